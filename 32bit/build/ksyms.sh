@@ -0,0 +1,46 @@
+#!/bin/sh
+# Write the kernel symbol table for ksyms.c as assembly: every function in
+# the ELF image given, sorted by address, with aliases at the same address
+# dropped. With no image the table is empty, for the first link.
+#
+# Usage: ksyms.sh <nm> [kernel.elf] > ksyms.S
+
+NM=$1
+ELF=$2
+
+if [ -n "$ELF" ]; then
+    "$NM" -n "$ELF"
+fi | awk '
+BEGIN {
+    n = 0
+}
+$2 ~ /^[tT]$/ && $3 !~ /^[$.]/ && $1 != last {
+    addr[n] = $1
+    name[n] = $3
+    last = $1
+    n++
+}
+END {
+    print "    .section .rodata"
+    print "    .balign 4"
+    print "    .global __ksym_count"
+    print "    .global __ksym_addrs"
+    print "    .global __ksym_name_offsets"
+    print "    .global __ksym_names"
+    print "__ksym_count:"
+    print "    .word " n
+    print "__ksym_addrs:"
+    for (i = 0; i < n; i++) {
+        print "    .word 0x" addr[i]
+    }
+    print "__ksym_name_offsets:"
+    offset = 0
+    for (i = 0; i < n; i++) {
+        print "    .word " offset
+        offset += length(name[i]) + 1
+    }
+    print "__ksym_names:"
+    for (i = 0; i < n; i++) {
+        print "    .asciz \"" name[i] "\""
+    }
+}'
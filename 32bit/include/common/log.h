@@ -0,0 +1,67 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+/**
+ * Kernel log. Every message goes into an in-memory ring together with its
+ * level and a microsecond timestamp, which works from the first
+ * instruction of kernel_main. Once log_console_start() has run, messages
+ * are also printed as they come in.
+ *
+ * Levels above LOG_LEVEL are compiled out: the call sits behind a constant
+ * false condition, so neither it nor the format string ends up in the
+ * image, while the format is still type checked and its arguments still
+ * count as used. Arguments of compiled out messages are not evaluated.
+ */
+#define LOG_ERROR 1
+#define LOG_WARNING 2
+#define LOG_INFO 3
+#define LOG_DEBUG 4
+
+#ifndef LOG_LEVEL
+    #define LOG_LEVEL LOG_INFO
+#endif
+
+#define LOG_RING_ENTRIES 128
+#define LOG_MSG_MAX 116
+
+typedef struct {
+    uint64_t timestamp_us;
+    uint8_t level;
+    uint8_t len;
+    uint16_t reserved;
+    char msg[LOG_MSG_MAX];
+} log_entry_t;
+
+#define LOG_DISABLED(level, ...) do { if (0) klog(level, __VA_ARGS__); } while (0)
+
+void klog(uint32_t level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_console_start(void);
+void log_dump(void);
+
+#if LOG_LEVEL >= LOG_ERROR
+    #define error(...) klog(LOG_ERROR, __VA_ARGS__)
+#else
+    #define error(...) LOG_DISABLED(LOG_ERROR, __VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_WARNING
+    #define warning(...) klog(LOG_WARNING, __VA_ARGS__)
+#else
+    #define warning(...) LOG_DISABLED(LOG_WARNING, __VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_INFO
+    #define info(...) klog(LOG_INFO, __VA_ARGS__)
+#else
+    #define info(...) LOG_DISABLED(LOG_INFO, __VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_DEBUG
+    #define debug(...) klog(LOG_DEBUG, __VA_ARGS__)
+#else
+    #define debug(...) LOG_DISABLED(LOG_DEBUG, __VA_ARGS__)
+#endif
+
+#endif
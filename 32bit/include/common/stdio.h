@@ -3,16 +3,25 @@
 
 #include <kernel/uart.h>
 #include <common/stdlib.h>
+#include <common/log.h>
+#include <stdarg.h>
 
+/* Longest line kprintf writes in one go, the rest is cut off */
+#define KPRINTF_BUF_SIZE 256
+
+typedef void (*idle_hook_t)(void);
+
+void set_idle_hook(idle_hook_t hook);
 char getc();
 void putc(char c);
 void puts(const char* str);
 void gets(char* buf, int buflen);
 void puthex(uint32_t val);
-void debug(const char* msg);
-void warning(const char* msg);
-void info(const char* msg);
-void error(const char* msg);
 void panic(const char* msg);
 
+int kprintf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+int kvprintf(const char* fmt, va_list args);
+int ksnprintf(char* buf, size_t size, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list args);
+
 #endif
@@ -1,9 +1,32 @@
 #ifndef STDLIB_H
 #define STDLIB_H
 
-void memcpy(void* dest, void* src, int bytes);
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The memory routines copy and fill a word at a time once the destination
+ * is aligned, and hand the bulk of large aligned buffers to the block
+ * routines in memops.S: NEON on the Cortex-A7, LDM/STM on the ARM1176 (or
+ * when built with NEON=0). MEMOPS_BLOCK is the chunk size those routines
+ * move per iteration.
+ */
+#if defined(MODEL_1) || defined(NO_NEON)
+    #define MEMOPS_BLOCK 32
+#else
+    #define MEMOPS_BLOCK 64
+#endif
+
+void* memcpy(void* dest, const void* src, size_t bytes);
+void* memmove(void* dest, const void* src, size_t bytes);
+void* memset(void* dest, int c, size_t bytes);
 void bzero(void* dest, int bytes);
 char* itoa(int i);
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t* remainder);
 int strcmp(const char *s1, const char *s2);
 
+/* Block routines from memops.S, bytes must be a non-zero multiple of MEMOPS_BLOCK and pointers word aligned */
+void __memcpy_blocks(void* dest, const void* src, size_t bytes);
+void __memset_blocks(void* dest, uint32_t pattern, size_t bytes);
+
 #endif
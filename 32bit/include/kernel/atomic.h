@@ -0,0 +1,102 @@
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+#include <kernel/barrier.h>
+#include <kernel/irq.h>
+#include <stdint.h>
+
+/**
+ * Atomic read-modify-write on a 32 bit word, built on LDREX/STREX (ARMv6
+ * and up). None of these imply a memory barrier, callers that publish or
+ * consume other data around them add dmb() themselves.
+ *
+ * Exclusive accesses need the MMU on: with it off all memory is strongly
+ * ordered and the Pi has no global exclusive monitor for that, so STREX
+ * never succeeds. Until mmu_init() sets exclusives_ok only the boot core
+ * runs, and masking IRQs around a plain read-modify-write is enough.
+ */
+extern volatile int exclusives_ok;
+
+static inline uint32_t atomic_xchg(volatile uint32_t* ptr, uint32_t val) {
+    uint32_t old, fail;
+
+    if (!exclusives_ok) {
+        fail = irq_save();
+        old = *ptr;
+        *ptr = val;
+        irq_restore(fail);
+        return old;
+    }
+
+    asm volatile(
+        "1: ldrex   %0, [%2]\n"
+        "   strex   %1, %3, [%2]\n"
+        "   teq     %1, #0\n"
+        "   bne     1b"
+        : "=&r"(old), "=&r"(fail)
+        : "r"(ptr), "r"(val)
+        : "cc", "memory");
+    return old;
+}
+
+/* Store val if *ptr holds expected, returns what *ptr held */
+static inline uint32_t atomic_cmpxchg(volatile uint32_t* ptr, uint32_t expected, uint32_t val) {
+    uint32_t old, fail;
+
+    if (!exclusives_ok) {
+        fail = irq_save();
+        old = *ptr;
+        if (old == expected) {
+            *ptr = val;
+        }
+        irq_restore(fail);
+        return old;
+    }
+
+    asm volatile(
+        "1: ldrex   %0, [%2]\n"
+        "   mov     %1, #0\n"
+        "   teq     %0, %3\n"
+        "   strexeq %1, %4, [%2]\n"
+        "   teq     %1, #0\n"
+        "   bne     1b"
+        : "=&r"(old), "=&r"(fail)
+        : "r"(ptr), "r"(expected), "r"(val)
+        : "cc", "memory");
+    return old;
+}
+
+static inline uint32_t atomic_add_return(volatile uint32_t* ptr, uint32_t val) {
+    uint32_t result, fail;
+
+    if (!exclusives_ok) {
+        fail = irq_save();
+        result = *ptr + val;
+        *ptr = result;
+        irq_restore(fail);
+        return result;
+    }
+
+    asm volatile(
+        "1: ldrex   %0, [%2]\n"
+        "   add     %0, %0, %3\n"
+        "   strex   %1, %0, [%2]\n"
+        "   teq     %1, #0\n"
+        "   bne     1b"
+        : "=&r"(result), "=&r"(fail)
+        : "r"(ptr), "r"(val)
+        : "cc", "memory");
+    return result;
+}
+
+static inline void wfe(void) {
+    asm volatile("wfe" ::: "memory");
+}
+
+/* Wake cores waiting in wfe(), after the store they wait for is visible */
+static inline void sev(void) {
+    dsb();
+    asm volatile("sev" ::: "memory");
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef BARRIER_H
+#define BARRIER_H
+
+/**
+ * Memory barriers. ARMv7 has dedicated instructions, the ARM1176 reaches
+ * the same operations through the c7 cache maintenance registers.
+ * barrier() only stops the compiler from reordering memory accesses, which
+ * is all that is needed between a thread and an interrupt handler on the
+ * same core.
+ */
+
+#define barrier() asm volatile("" ::: "memory")
+
+#ifdef MODEL_1
+    #define dmb() asm volatile("mcr p15, 0, %0, c7, c10, 5" :: "r"(0) : "memory")
+    #define dsb() asm volatile("mcr p15, 0, %0, c7, c10, 4" :: "r"(0) : "memory")
+    #define isb() asm volatile("mcr p15, 0, %0, c7, c5, 4" :: "r"(0) : "memory")
+#else
+    #define dmb() asm volatile("dmb" ::: "memory")
+    #define dsb() asm volatile("dsb" ::: "memory")
+    #define isb() asm volatile("isb" ::: "memory")
+#endif
+
+#endif
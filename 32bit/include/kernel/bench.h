@@ -0,0 +1,10 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+void memops_bench(void);
+void cache_bench(const char* label);
+void alloc_bench(void);
+void sched_bench(void);
+void pmu_bench(void);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <kernel/barrier.h>
+#include <stdint.h>
+
+/* Size of an L1 data cache line: 32 bytes on the ARM1176, 64 on the Cortex-A7 */
+#ifdef MODEL_1
+    #define L1_CACHE_BYTES 32
+#else
+    #define L1_CACHE_BYTES 64
+#endif
+
+/**
+ * Cache and TLB maintenance. The range operations work by virtual address
+ * one line at a time and cover every line the range touches. Cleaning
+ * writes dirty lines back to memory (before a device reads it),
+ * invalidating drops lines (before the CPU reads what a device wrote).
+ * Both cores share the ARMv7 encodings for these, only the whole-cache and
+ * TLB broadcast forms differ.
+ */
+
+#define CACHE_RANGE_OP(name, crm) \
+static inline void name(const void* start, uint32_t len) { \
+    uintptr_t line = (uintptr_t)start & ~(uintptr_t)(L1_CACHE_BYTES - 1); \
+    uintptr_t end = (uintptr_t)start + len; \
+    for (; line < end; line += L1_CACHE_BYTES) { \
+        asm volatile("mcr p15, 0, %0, c7, " #crm ", 1" :: "r"(line) : "memory"); \
+    } \
+    dsb(); \
+}
+
+CACHE_RANGE_OP(dcache_clean_range, c10)
+CACHE_RANGE_OP(dcache_invalidate_range, c6)
+CACHE_RANGE_OP(dcache_clean_invalidate_range, c14)
+
+/* Invalidate the whole instruction cache and the branch predictor, after writing code */
+static inline void icache_invalidate_all(void) {
+    asm volatile("mcr p15, 0, %0, c7, c5, 0" :: "r"(0) : "memory");
+    asm volatile("mcr p15, 0, %0, c7, c5, 6" :: "r"(0) : "memory");
+    dsb();
+    isb();
+}
+
+/* Drop every TLB entry, on ARMv7 on every core in the inner shareable domain */
+static inline void tlb_invalidate_all(void) {
+    dsb();
+#ifdef MODEL_1
+    asm volatile("mcr p15, 0, %0, c8, c7, 0" :: "r"(0) : "memory");
+#else
+    asm volatile("mcr p15, 0, %0, c8, c3, 0" :: "r"(0) : "memory");
+#endif
+    dsb();
+    isb();
+}
+
+/* Drop the TLB entries for one virtual address */
+static inline void tlb_invalidate_addr(const void* addr) {
+    uintptr_t mva = (uintptr_t)addr & ~(uintptr_t)0xFFF;
+
+    dsb();
+#ifdef MODEL_1
+    asm volatile("mcr p15, 0, %0, c8, c7, 1" :: "r"(mva) : "memory");
+#else
+    asm volatile("mcr p15, 0, %0, c8, c3, 1" :: "r"(mva) : "memory");
+#endif
+    dsb();
+    isb();
+}
+
+#endif
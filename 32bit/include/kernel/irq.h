@@ -0,0 +1,121 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <kernel/peripheral.h>
+#include <kernel/trap.h>
+#include <stdint.h>
+
+/**
+ * BCM2835 interrupt controller. GPU interrupts 0-63 are enabled through
+ * two 32 bit banks, the ARM specific ones through the basic bank.
+ */
+#define IRQ_CONTROLLER_BASE (PERIPHERAL_BASE + 0xB200)
+
+enum {
+    IRQ_BASIC_PENDING = (IRQ_CONTROLLER_BASE + 0x00),
+    IRQ_PENDING_1     = (IRQ_CONTROLLER_BASE + 0x04),
+    IRQ_PENDING_2     = (IRQ_CONTROLLER_BASE + 0x08),
+    IRQ_FIQ_CONTROL   = (IRQ_CONTROLLER_BASE + 0x0C),
+    IRQ_ENABLE_1      = (IRQ_CONTROLLER_BASE + 0x10),
+    IRQ_ENABLE_2      = (IRQ_CONTROLLER_BASE + 0x14),
+    IRQ_ENABLE_BASIC  = (IRQ_CONTROLLER_BASE + 0x18),
+    IRQ_DISABLE_1     = (IRQ_CONTROLLER_BASE + 0x1C),
+    IRQ_DISABLE_2     = (IRQ_CONTROLLER_BASE + 0x20),
+    IRQ_DISABLE_BASIC = (IRQ_CONTROLLER_BASE + 0x24),
+};
+
+/* IRQ_FIQ_CONTROL takes one source, numbered as for irq_register(), plus this enable bit */
+#define IRQ_FIQ_ENABLE (1 << 7)
+
+/* Basic pending bits that say a bank has pending sources, including the ones the basic register shortcuts */
+#define IRQ_BASIC_BANK_1 ((1 << 8) | (0x1F << 10))
+#define IRQ_BASIC_BANK_2 ((1 << 9) | (0x3F << 15))
+#define IRQ_BASIC_ARM_MASK 0xFF
+
+/* GPU interrupt numbers */
+#define IRQ_UART0 57
+
+/**
+ * On the Pi 2 every core has a local interrupt source register. GPU
+ * interrupts all go to core 0 and show up there as one bit, the per-core
+ * timers each have their own, at the same bit as their CORE_TIMER_IRQCNTL
+ * routing enable.
+ */
+#ifndef MODEL_1
+    #define CORE_IRQ_SOURCE(cpu) (LOCAL_PERIPHERAL_BASE + 0x60 + (cpu) * 4)
+    #define CORE_IRQ_MAILBOX0 4
+    #define CORE_IRQ_GPU (1 << 8)
+    #define CORE_IRQ_SOURCE_MASK 0xFFF
+#endif
+
+/**
+ * IRQ numbers handed to irq_register(): GPU interrupts are 0-63, the ARM
+ * sources in the basic bank 64-71 and, on the Pi 2, each core's local
+ * sources follow from 72 in CORE_IRQ_SOURCE bit order. Local sources are
+ * routed per core by their drivers, irq_enable() only covers the others.
+ */
+#define IRQ_BASIC_BASE 64
+#define IRQ_BASIC(n) (IRQ_BASIC_BASE + (n))
+#ifndef MODEL_1
+    #define IRQ_LOCAL_BASE 72
+    #define IRQ_LOCAL(bit) (IRQ_LOCAL_BASE + (bit))
+    #define NR_IRQS (IRQ_LOCAL_BASE + 12)
+#else
+    #define NR_IRQS 72
+#endif
+
+typedef void (*irq_handler_t)(void* arg);
+
+/**
+ * The handler runs with IRQs unmasked and its own source masked, so other
+ * interrupts can nest inside it. Only for handlers that are slow and take
+ * their locks with the irqsave variants, and not for local sources, which
+ * can't be masked individually.
+ */
+#define IRQF_NESTED (1 << 0)
+
+/* CPSR interrupt mask and state bits */
+#define CPSR_IRQ_MASK (1 << 7)
+#define CPSR_FIQ_MASK (1 << 6)
+#define CPSR_THUMB (1 << 5)
+
+static inline void enable_interrupts(void) {
+    asm volatile("cpsie i" ::: "memory");
+}
+
+static inline void disable_interrupts(void) {
+    asm volatile("cpsid i" ::: "memory");
+}
+
+/* FIQs are left unmasked by irq_save(), the FIQ handler takes no locks */
+static inline void enable_fiq(void) {
+    asm volatile("cpsie f" ::: "memory");
+}
+
+static inline void disable_fiq(void) {
+    asm volatile("cpsid f" ::: "memory");
+}
+
+/* Mask IRQs and return the previous CPSR, for irq_restore() */
+static inline uint32_t irq_save(void) {
+    uint32_t cpsr;
+    asm volatile("mrs %0, cpsr\n\tcpsid i" : "=r"(cpsr) :: "memory");
+    return cpsr;
+}
+
+static inline void irq_restore(uint32_t cpsr) {
+    if (!(cpsr & CPSR_IRQ_MASK)) {
+        asm volatile("cpsie i" ::: "memory");
+    }
+}
+
+void interrupts_init(void);
+int irq_register(uint32_t irq, irq_handler_t handler, void* arg, uint32_t flags, const char* name);
+void irq_unregister(uint32_t irq);
+void irq_enable(uint32_t irq);
+void irq_disable(uint32_t irq);
+const char* irq_name(uint32_t irq);
+void irq_dispatch(uint32_t entry_cycles, irq_frame_t* frame);
+void irq_info(void);
+
+#endif
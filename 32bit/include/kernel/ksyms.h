@@ -0,0 +1,21 @@
+#ifndef KSYMS_H
+#define KSYMS_H
+
+#include <stdint.h>
+
+/**
+ * Kernel symbol table, for naming code addresses. The makefile links the
+ * kernel once with an empty table, has build/ksyms.sh list the functions
+ * in that image, and links again with the list. The table lives at the
+ * end of .rodata, behind all the code, so no function moves between the
+ * two links.
+ */
+#define KSYM_NONE 0xFFFFFFFF
+
+uint32_t ksym_count(void);
+uint32_t ksym_find(uint32_t addr);
+const char* ksym_name(uint32_t index);
+uint32_t ksym_addr(uint32_t index);
+int kernel_text(uint32_t addr);
+
+#endif
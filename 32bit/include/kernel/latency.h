@@ -0,0 +1,42 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+/**
+ * Timer and wakeup latency, after cyclictest. Every online core runs a
+ * pinned realtime thread that arms a one-shot timer for the next multiple
+ * of LATENCY_PERIOD_US and blocks. The timer's handler records how late
+ * it ran against the deadline and wakes the thread, which records how
+ * late it got back on the core, through the IRQ exit and the switch.
+ *
+ * The Pi 2 uses each core's generic timer that the clock event leaves
+ * free and measures in system counter ticks, the Pi 1 uses system timer
+ * channel 3 (shared with the profiler) and measures in microseconds.
+ *
+ * Latencies go into 1 us histogram buckets, from which the percentiles
+ * are read, and the exact minimum, average and maximum are kept next to
+ * them. A run lasts LATENCY_SECONDS, set with LATENCY_SECONDS= on the
+ * make command line for long runs, and reports the worst case so far
+ * once a second while it goes.
+ *
+ * Optional background load runs at low priority on every core while it
+ * measures: allocator threads keeping LATENCY_ALLOC_HELD random page and
+ * kmalloc blocks and replacing one at a time, and a thread writing lines
+ * to the UART as fast as it drains.
+ */
+#ifndef LATENCY_SECONDS
+    #define LATENCY_SECONDS 10
+#endif
+#define LATENCY_PERIOD_US 1000
+#define LATENCY_BUCKETS 1000            // 1 us each, anything later is counted as an overflow
+#define LATENCY_ALLOC_HELD 32
+#define LATENCY_ALLOC_MAX_ORDER 3
+#define LATENCY_ALLOC_MAX_BYTES 2048
+
+#define LATENCY_LOAD_ALLOC (1 << 0)
+#define LATENCY_LOAD_UART (1 << 1)
+
+void latency_test(uint32_t loads);
+
+#endif
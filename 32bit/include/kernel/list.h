@@ -9,6 +9,15 @@
  * 3. In one .c file: IMPLEMENT_LIST(mytype)
  *    - Defines all the list functions for mytype
  * 4. To initialize: INITIALIZE_LIST(mylist);
+ *
+ * For large arrays of small nodes there is an index linked variant with the
+ * same operations. Links are array indices stored in the node as
+ * next##mytype / prev##mytype (bitfields work), saving the two pointers:
+ * 1. DEFINE_INDEX_LIST(mytype)
+ * 2. Declare the index fields in the struct yourself
+ * 3. IMPLEMENT_INDEX_LIST(mytype, array, none), where array is the base of
+ *    the node array and none is the index value that means "no node"
+ * 4. To initialize: INITIALIZE_INDEX_LIST(mylist, none);
  */
 
 #include <stddef.h>
@@ -59,6 +68,10 @@ void append_##nodeType##_list(nodeType##_list_t *list, struct nodeType *node) {
 void push_##nodeType##_list(nodeType##_list_t *list, struct nodeType *node) { \
     node->next##nodeType = list->head; \
     node->prev##nodeType = NULL; \
+    \
+    if (list->head != NULL) { \
+        list->head->prev##nodeType = node; \
+    } \
     list->head = node; \
     list->size += 1; \
     \
@@ -94,6 +107,25 @@ struct nodeType *pop_##nodeType##_list(nodeType##_list_t *list) { \
     return res; \
 } \
 \
+/* Unlink a node from anywhere in the list in O(1) */ \
+void remove_##nodeType##_list(nodeType##_list_t *list, struct nodeType *node) { \
+    if (node->prev##nodeType != NULL) { \
+        node->prev##nodeType->next##nodeType = node->next##nodeType; \
+    } else { \
+        list->head = node->next##nodeType; \
+    } \
+    \
+    if (node->next##nodeType != NULL) { \
+        node->next##nodeType->prev##nodeType = node->prev##nodeType; \
+    } else { \
+        list->tail = node->prev##nodeType; \
+    } \
+    \
+    list->size -= 1; \
+    node->next##nodeType = NULL; \
+    node->prev##nodeType = NULL; \
+} \
+\
 uint32_t size_##nodeType##_list(nodeType##_list_t *list) { \
     return list->size; \
 } \
@@ -102,4 +134,94 @@ struct nodeType *next_##nodeType##_list(struct nodeType *node) { \
     return node->next##nodeType; \
 }
 
+/* Index linked list container, head and tail are indices into the node array */
+#define DEFINE_INDEX_LIST(nodeType) \
+    typedef struct nodeType##_list { \
+        uint32_t head; \
+        uint32_t tail; \
+        uint32_t size; \
+    } nodeType##_list_t;
+
+#define INITIALIZE_INDEX_LIST(list, none) \
+    do { \
+        (list).head = (none); \
+        (list).tail = (none); \
+        (list).size = 0; \
+    } while (0)
+
+/* Implement the list operations for nodes stored in array[], linked by index */
+#define IMPLEMENT_INDEX_LIST(nodeType, array, none) \
+\
+void append_##nodeType##_list(nodeType##_list_t *list, struct nodeType *node) { \
+    uint32_t index = node - (array); \
+    \
+    node->next##nodeType = (none); \
+    node->prev##nodeType = list->tail; \
+    \
+    if (list->tail == (none)) { \
+        list->head = index; \
+    } else { \
+        (array)[list->tail].next##nodeType = index; \
+    } \
+    list->tail = index; \
+    list->size += 1; \
+} \
+\
+void push_##nodeType##_list(nodeType##_list_t *list, struct nodeType *node) { \
+    uint32_t index = node - (array); \
+    \
+    node->next##nodeType = list->head; \
+    node->prev##nodeType = (none); \
+    \
+    if (list->head != (none)) { \
+        (array)[list->head].prev##nodeType = index; \
+    } else { \
+        list->tail = index; \
+    } \
+    list->head = index; \
+    list->size += 1; \
+} \
+\
+struct nodeType *peek_##nodeType##_list(nodeType##_list_t *list) { \
+    return list->head == (none) ? NULL : &(array)[list->head]; \
+} \
+\
+void remove_##nodeType##_list(nodeType##_list_t *list, struct nodeType *node) { \
+    if (node->prev##nodeType != (none)) { \
+        (array)[node->prev##nodeType].next##nodeType = node->next##nodeType; \
+    } else { \
+        list->head = node->next##nodeType; \
+    } \
+    \
+    if (node->next##nodeType != (none)) { \
+        (array)[node->next##nodeType].prev##nodeType = node->prev##nodeType; \
+    } else { \
+        list->tail = node->prev##nodeType; \
+    } \
+    \
+    list->size -= 1; \
+    node->next##nodeType = (none); \
+    node->prev##nodeType = (none); \
+} \
+\
+struct nodeType *pop_##nodeType##_list(nodeType##_list_t *list) { \
+    struct nodeType *res; \
+    \
+    if (list->head == (none)) { \
+        return NULL; \
+    } \
+    \
+    res = &(array)[list->head]; \
+    remove_##nodeType##_list(list, res); \
+    return res; \
+} \
+\
+uint32_t size_##nodeType##_list(nodeType##_list_t *list) { \
+    return list->size; \
+} \
+\
+struct nodeType *next_##nodeType##_list(struct nodeType *node) { \
+    return node->next##nodeType == (none) ? NULL : &(array)[node->next##nodeType]; \
+}
+
 #endif
\ No newline at end of file
@@ -10,42 +10,153 @@
 #define PAGE_SIZE 4096
 #define KERNEL_HEAP_SIZE (1024 * 1024)
 
+/**
+ * The physical page allocator is a binary buddy system. A block of order n
+ * is 2^n physically contiguous pages aligned to its own size, so orders
+ * 0 .. MAX_ORDER - 1 hand out 4 KiB up to 4 MiB.
+ */
+#define MAX_ORDER 11
+
+/* Used when neither the ATAGs nor a device tree say how much RAM there is */
+#define MEM_DEFAULT_SIZE (1UL << 30)
+
+/**
+ * Single page pools. ZERO_POOL_TARGET pages are kept scrubbed ahead of time,
+ * and up to DIRTY_POOL_MAX freed pages wait to be reused or scrubbed.
+ */
+#define ZERO_POOL_TARGET 64
+#define DIRTY_POOL_MAX 256
+
+/**
+ * Per-CPU magazines. Every core keeps a stack of up to MAG_DEPTH free pages,
+ * and of free objects in every slab cache, that it allocates from and frees
+ * to with IRQs masked and no lock taken. An empty magazine is refilled and
+ * a full one flushed MAG_DEPTH / 2 entries at a time under the global lock.
+ * Build with MAG_DEPTH=n to size them, mem_set_magazine_depth() lowers the
+ * depth at run time and 0 turns them off.
+ */
+#ifndef MAG_DEPTH
+#define MAG_DEPTH 16
+#endif
+
+/* alloc_page_flags() flags */
+#define ALLOC_ZERO 0x1          // The caller needs the page zeroed
+
 typedef struct {
 	uint8_t allocated: 1;			// This page is allocated to something
 	uint8_t kernel_page: 1;			// This page is a part of the kernel
 	uint8_t kernel_heap_page: 1;	// This page is a part of the kernel heap
-	uint32_t reserved: 29;
+	uint8_t buddy_free: 1;			// This page heads a block on a buddy free list
+	uint8_t reserved: 4;
 } page_flags_t;
 
+/**
+ * Page frame descriptor, one per physical page, packed into 8 bytes.
+ * List links are 20 bit indices into the descriptor array rather than
+ * pointers, which covers 4 GiB of 4 KiB frames. A descriptor is only
+ * written once its page is handed to the buddy allocator, so the array is
+ * never cleared up front.
+ */
+#define PAGE_NONE 0xFFFFF			// Index value for "no page"
+#define PAGE_REF_MAX 0xFFF
+
 typedef struct page {
-	uint32_t vaddr_mapped;	// The virtual address that maps to this page
+	uint32_t nextpage: 20;			// Index of the next page on the same list
+	uint32_t order: 4;				// Order of the block this page heads
 	page_flags_t flags;
-	DEFINE_LINK(page);
+	uint32_t prevpage: 20;			// Index of the previous page on the same list
+	uint32_t refcount: 12;			// Mappings sharing an allocated page, see page_get()
 } page_t;
 
+typedef struct {
+    uint32_t zero_hits;         // ALLOC_ZERO requests served from the zeroed pool
+    uint32_t zero_misses;       // ALLOC_ZERO requests that had to zero on the spot
+    uint32_t dirty_reuses;      // Non-zeroing requests served from the dirty pool
+    uint32_t scrubbed;          // Pages zeroed by the idle loop
+    uint32_t zeroed_pages;      // Current size of the zeroed pool
+    uint32_t dirty_pages;       // Current size of the dirty pool
+    uint32_t mag_hits;          // Single page requests served from a per-CPU magazine
+    uint32_t mag_refills;       // Batches moved from the pools into a magazine
+    uint32_t mag_flushes;       // Batches moved from a magazine back to the pools
+    uint32_t mag_pages;         // Pages currently held in magazines
+} page_pool_stats_t;
+
 /**
  * Heap Stuff
  */
 
 /**
- * kmalloc is implemented as a linked list of allocated segments.
+ * kmalloc is a two-level segregated fit (TLSF) allocator.
+ * Free segments are kept on lists indexed by a first level (power of two
+ * size class) and a second level (linear split of that class). Bitmaps of
+ * the non-empty lists let a CLZ find a fitting list in constant time, and
+ * the prev_phys boundary tag lets kfree coalesce with both neighbours
+ * without walking the heap.
  * Segments are 16-byte aligned (for potential future use).
- * Best-fit algorithm is used.
+ * Requests up to KMALLOC_SLAB_MAX bytes are served by power of two slab
+ * caches instead, which puts the per-CPU magazines in front of them, and
+ * kfree tells the two apart by address.
  */
+#define KMALLOC_SLAB_MAX 256
+
 typedef struct heap_segment {
-    struct heap_segment* next;
-    struct heap_segment* prev;
-    uint32_t is_allocated;
-    uint32_t segment_size;  // Includes this header
+    struct heap_segment* next;      // Next free segment of the same size class
+    struct heap_segment* prev;      // Previous free segment of the same size class
+    struct heap_segment* prev_phys; // Physically preceding segment, NULL for the first
+    uint32_t segment_size;          // Includes this header, low bit set while free
 } heap_segment_t;
 
 /**
  * End Heap Stuff
  */
 
+/**
+ * Consistency checks, for the self tests and the host build's fuzzer.
+ * mem_check_pages() walks every page the allocator holds on to: the free
+ * areas (block alignment, flags and list sizes, and no two free buddies
+ * left unmerged), the page pools and the per-CPU magazines.
+ * mem_check_heap() walks the kmalloc heap segment by segment (boundary
+ * tags, no two free neighbours) and checks the TLSF lists and bitmaps
+ * against what it found. Both log every problem with error() and return
+ * how many there were, and pass every range they walk to fn unless it is
+ * NULL. Other cores' magazines are read without a lock, so run the check
+ * while they are quiet.
+ */
+typedef enum {
+    MEM_RANGE_RESERVED,         // Kernel image, page descriptors and heap
+    MEM_RANGE_DEFERRED,         // Not handed to the buddy allocator yet
+    MEM_RANGE_BUDDY,            // A block on a buddy free list
+    MEM_RANGE_ZEROED,           // A page in the zeroed pool
+    MEM_RANGE_DIRTY,            // A page in the dirty pool
+    MEM_RANGE_MAGAZINE,         // A page in a per-CPU magazine
+    MEM_RANGE_HEAP_FREE,        // A free heap segment, header included
+    MEM_RANGE_HEAP_USED,        // An allocated heap segment, header included
+} mem_range_t;
+
+typedef void (*mem_walk_fn_t)(void* addr, uint32_t bytes, mem_range_t kind, void* arg);
+
 void mem_init(atag_t* atags);
+#ifdef HOST_BUILD
+void mem_init_arena(void* arena, uint32_t size);
+#endif
 void* alloc_page(void);
 void free_page(void* ptr);
+void* alloc_page_flags(uint32_t flags);
+void* alloc_pages(uint32_t order);
+void free_pages(void* ptr, uint32_t order);
+int page_get(void* ptr);
+void page_put(void* ptr);
+uint32_t page_refcount(void* ptr);
+uint32_t mem_free_blocks(uint32_t order);
+uint32_t mem_free_page_count(void);
+int mem_idle_scrub(void);
+void mem_pool_stats(page_pool_stats_t* stats);
+void mem_set_magazine_depth(uint32_t depth);
+uint32_t mem_magazine_depth(void);
+uint32_t mem_check_pages(mem_walk_fn_t fn, void* arg);
+uint32_t mem_check_heap(mem_walk_fn_t fn, void* arg);
+int buddy_stress_test(void);
+int slab_test(void);
 void* kmalloc(uint32_t bytes);
 void kfree(void* ptr);
 
@@ -0,0 +1,41 @@
+#ifndef MMU_H
+#define MMU_H
+
+#include <stdint.h>
+
+/**
+ * Flat identity mapping built from 1 MiB sections in a single level 1
+ * table: RAM below the peripheral window is normal write-back cacheable
+ * memory, the peripherals are device memory and never executable, and
+ * everything else faults. Building with MMU=0 leaves the MMU and caches
+ * off, as a baseline to measure against.
+ */
+#define SECTION_SIZE (1024 * 1024)
+#define L1_TABLE_ENTRIES 4096
+
+/* Short descriptor section entry bits */
+#define SECTION_TYPE (2 << 0)
+#define SECTION_B (1 << 2)
+#define SECTION_C (1 << 3)
+#define SECTION_XN (1 << 4)
+#define SECTION_AP_RW (3 << 10)     // Full access
+#define SECTION_TEX(x) ((x) << 12)
+#define SECTION_S (1 << 16)
+
+/* Normal memory, inner and outer write-back write-allocate */
+#ifdef MODEL_1
+    #define SECTION_NORMAL (SECTION_TYPE | SECTION_AP_RW | SECTION_TEX(1) | SECTION_C | SECTION_B)
+#else
+    #define SECTION_NORMAL (SECTION_TYPE | SECTION_AP_RW | SECTION_TEX(1) | SECTION_C | SECTION_B | SECTION_S)
+#endif
+
+/* Shareable device memory */
+#define SECTION_DEVICE (SECTION_TYPE | SECTION_AP_RW | SECTION_B | SECTION_XN)
+
+void mmu_init(void);
+void mmu_init_secondary(void);
+int mmu_enabled(void);
+uint32_t* mmu_kernel_table(void);
+void mmu_switch_table(uint32_t* l1);
+
+#endif
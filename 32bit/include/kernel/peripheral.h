@@ -0,0 +1,18 @@
+#ifndef PERIPHERAL_H
+#define PERIPHERAL_H
+
+/**
+ * Physical base of the BCM283x peripheral window. On the Pi 2/3 the ARM
+ * local peripherals (per-core timers, mailboxes, interrupt routing) sit
+ * right above it.
+ */
+#ifdef MODEL_1
+    #define PERIPHERAL_BASE 0x20000000
+#else
+    #define PERIPHERAL_BASE 0x3F000000
+    #define LOCAL_PERIPHERAL_BASE 0x40000000
+#endif
+
+#define PERIPHERAL_SIZE 0x01000000
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef PMU_H
+#define PMU_H
+
+#include <stdint.h>
+
+/**
+ * Performance monitoring unit.
+ * The cycle counter runs at the CPU clock and wraps every 2^32 cycles, so
+ * it is only good for timing spans well under a few seconds. The ARM1176
+ * keeps it in its system control coprocessor (c15), ARMv7 cores in the
+ * architected PMU (c9).
+ *
+ * pmu_init() also points the first two event counters at L1 data cache
+ * refills and mispredicted branches, which both PMUs can count. The event
+ * numbers differ between the two, the counter numbers below don't.
+ */
+#define PMU_EVENT_DCACHE_MISS 0
+#define PMU_EVENT_BRANCH_MISS 1
+#define PMU_EVENTS 2
+
+#ifdef MODEL_1
+    #define PMU_EVTYPE_DCACHE_MISS 0x0B
+    #define PMU_EVTYPE_BRANCH_MISS 0x06
+#else
+    #define PMU_EVTYPE_DCACHE_MISS 0x03     // L1D_CACHE_REFILL
+    #define PMU_EVTYPE_BRANCH_MISS 0x10     // BR_MIS_PRED
+#endif
+
+/**
+ * The Cortex-A7 PMU can also interrupt when an event counter overflows,
+ * through the local interrupt controller, which routes each core's PMU to
+ * that core. The profiler counts CPU cycles on the counter after the ones
+ * above and starts it period cycles short of overflowing.
+ */
+#ifndef MODEL_1
+    #include <kernel/peripheral.h>
+
+    #define PMU_EVTYPE_CPU_CYCLES 0x11
+    #define PMU_OVERFLOW_COUNTER PMU_EVENTS
+    #define PMU_IRQ_ROUTING_SET (LOCAL_PERIPHERAL_BASE + 0x10)
+    #define PMU_IRQ_ROUTING_CLR (LOCAL_PERIPHERAL_BASE + 0x14)
+    #define CORE_IRQ_PMU 9      // Bit in CORE_IRQ_SOURCE
+#endif
+
+typedef struct pmu_sample {
+    uint32_t cycles;
+    uint32_t events[PMU_EVENTS];
+} pmu_sample_t;
+
+void pmu_init(void);
+#ifndef MODEL_1
+void pmu_overflow_start(uint32_t period);
+int pmu_overflow_rearm(uint32_t period);
+void pmu_overflow_stop(void);
+#endif
+
+static inline uint32_t pmu_cycles(void) {
+    uint32_t cycles;
+#ifdef MODEL_1
+    asm volatile("mrc p15, 0, %0, c15, c12, 1" : "=r"(cycles));
+#else
+    asm volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(cycles));
+#endif
+    return cycles;
+}
+
+static inline uint32_t pmu_event(uint32_t counter) {
+    uint32_t count;
+#ifdef MODEL_1
+    if (counter == 0) {
+        asm volatile("mrc p15, 0, %0, c15, c12, 2" : "=r"(count));
+    } else {
+        asm volatile("mrc p15, 0, %0, c15, c12, 3" : "=r"(count));
+    }
+#else
+    // PMSELR picks the counter PMXEVCNTR reads
+    asm volatile("mcr p15, 0, %0, c9, c12, 5\n\tisb" :: "r"(counter) : "memory");
+    asm volatile("mrc p15, 0, %0, c9, c13, 2" : "=r"(count));
+#endif
+    return count;
+}
+
+/* All counters at once, the cycle count last so the event reads aren't in it */
+static inline void pmu_read(pmu_sample_t* sample) {
+    uint32_t i;
+
+    for (i = 0; i < PMU_EVENTS; i++) {
+        sample->events[i] = pmu_event(i);
+    }
+    sample->cycles = pmu_cycles();
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+/**
+ * Sampling profiler. While it runs, every core is interrupted about once
+ * per PROFILE_PERIOD_CYCLES of its own cycles by a PMU counter overflow,
+ * and records the interrupted PC and up to PROFILE_DEPTH return addresses
+ * from the frame pointer chain into a buffer of its own. The Pi 1 can't
+ * route its PMU interrupt, it samples off system timer channel 3 every
+ * PROFILE_PERIOD_US instead.
+ *
+ * The cycle counter stops in wfi, so on the Pi 2 idle time doesn't show.
+ * Code running with IRQs masked is charged to wherever they are unmasked,
+ * as the sample can't be taken before. Call chains need the frame
+ * pointers the build keeps unless CALLCHAIN=0.
+ */
+#define PROFILE_PERIOD_CYCLES 899981    // About 1 kHz at 900 MHz, prime so it doesn't beat with the tick
+#define PROFILE_PERIOD_US 997
+#define PROFILE_DEPTH 4
+#define PROFILE_BUF_ORDER 4             // 64 KiB of samples per core, a bit over 3 s worth
+#define PROFILE_REPORT_LINES 20
+
+typedef struct profile_sample {
+    uint32_t pc;
+    uint32_t callers[PROFILE_DEPTH];    // Return addresses, innermost first, 0 past the end of the chain
+} profile_sample_t;
+
+int profile_start(void);
+void profile_stop(void);
+void profile_report(void);
+
+#endif
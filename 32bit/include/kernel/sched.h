@@ -0,0 +1,104 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/smp.h>
+#include <kernel/timer.h>
+#include <stdint.h>
+
+/**
+ * Preemptive kernel thread scheduler.
+ *
+ * Every core has its own run queue: one FIFO list per priority level and a
+ * bitmap of the non-empty ones, so picking the next thread is a CLZ. The
+ * per-core tick preempts the running thread when its time slice is used
+ * up and another thread of the same or a higher priority is waiting, or at
+ * once when a higher priority thread wakes up. New threads go on the
+ * creating core's queue and a core with nothing to run steals the oldest
+ * waiting thread from the busiest other core.
+ *
+ * The tick is a timer on the core's wheel that only runs while a thread
+ * other than idle does, and sleepers are woken by their own timers, so an
+ * idle core takes no interrupts until something is due.
+ *
+ * A thread switches by calling context_switch() with its run queue locked
+ * and IRQs masked, and whichever thread runs next unlocks it. Preemption
+ * goes through the same path from the IRQ exit, with the interrupted
+ * registers already saved on the thread's stack by irq_entry.
+ */
+
+#define SCHED_PRIORITIES 4
+#define SCHED_PRIO_LOW 0
+#define SCHED_PRIO_NORMAL 1
+#define SCHED_PRIO_HIGH 2
+#define SCHED_PRIO_REALTIME 3
+
+#define SCHED_TICK_US 10000     // Tick period while a thread is running, 100 Hz
+#define SCHED_SLICE_TICKS 2     // Ticks a thread runs before others of its priority get a turn
+
+#define THREAD_STACK_ORDER 1    // 8 KiB kernel stacks
+#define THREAD_ANY_CPU 0xFFFFFFFF
+
+typedef enum {
+    THREAD_RUNNING,             // Running or on a run queue
+    THREAD_SLEEPING,            // In thread_sleep_us()
+    THREAD_BLOCKED,             // Waiting for thread_wake()
+    THREAD_DEAD,
+} thread_state_t;
+
+typedef void (*thread_fn_t)(void* arg);
+
+typedef struct thread {
+    uint32_t* sp;               // Saved stack pointer while switched out, see switch.S
+    void* stack;                // Base of the stack pages, NULL for boot stacks
+    const char* name;
+    uint32_t id;
+    thread_state_t state;
+    uint32_t priority;
+    uint32_t cpu;               // Core whose run queue holds the thread, or that it sleeps on
+    uint32_t pinned;            // Never stolen by another core
+    uint32_t slice;             // Ticks left in the current time slice
+    ktimer_t sleep_timer;       // Wakes the thread from thread_sleep_us()
+    uint32_t switches;          // Times the thread was switched in
+    thread_fn_t entry;
+    void* arg;
+    DEFINE_LINK(thread);
+} thread_t;
+
+DEFINE_LIST(thread);
+
+typedef struct runqueue {
+    spinlock_t lock;
+    thread_list_t queues[SCHED_PRIORITIES];
+    uint32_t bitmap;            // Bit p set while queues[p] is not empty
+    uint32_t nr_queued;
+    uint32_t nr_sleeping;       // Sleeping or blocked
+    thread_t* current;
+    thread_t* idle;
+    thread_t* dead;             // Exited thread whose stack is freed after the switch away from it
+    volatile uint32_t need_resched;
+    ktimer_t tick_timer;
+    uint32_t tick_active;       // tick_timer is armed, only while a thread other than idle runs
+    uint32_t switches;
+    uint32_t steals;
+    uint64_t ticks;
+} __attribute__((aligned(64))) runqueue_t;
+
+void sched_init(void);
+void sched_start(void);
+void sched_start_secondary(void);
+thread_t* thread_create(const char* name, thread_fn_t fn, void* arg, uint32_t priority);
+thread_t* thread_create_on(const char* name, thread_fn_t fn, void* arg, uint32_t priority, uint32_t cpu);
+thread_t* thread_current(void);
+void thread_yield(void);
+void thread_sleep_us(uint64_t us);
+void thread_prepare_block(void);
+void thread_block(void);
+int thread_wake(thread_t* thread);
+void thread_exit(void);
+void schedule(void);
+void sched_irq_exit(void);
+void sched_info(void);
+
+#endif
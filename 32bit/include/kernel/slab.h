@@ -0,0 +1,83 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <kernel/list.h>
+#include <kernel/cache.h>
+#include <kernel/mem.h>
+#include <kernel/smp.h>
+#include <kernel/spinlock.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Slab object caches.
+ *
+ * Each cache carves whole pages from alloc_page() into objects of a single
+ * size. The slab descriptor lives at the start of its page, so freeing an
+ * object finds its slab by rounding the pointer down to a page boundary.
+ * Free objects are threaded through a per-slab free list, which makes
+ * alloc and free O(1) with no per-object header.
+ *
+ * Slabs in the same cache start their first object at different cache line
+ * offsets (colors) so hot objects from different slabs don't all compete
+ * for the same cache sets.
+ *
+ * If a constructor is given it runs once when a slab is populated, and
+ * objects must be returned to the cache in their constructed state.
+ *
+ * Every core keeps a magazine of free objects in front of each cache (see
+ * MAG_DEPTH in mem.h), so most allocs and frees take no lock. The slab
+ * lists behind it are covered by the cache's lock. active_objs counts
+ * objects sitting in magazines as in use, kmem_cache_drain() gives this
+ * core's back to the slabs.
+ */
+
+typedef void (*kmem_ctor_t)(void* obj);
+
+typedef struct slab {
+    struct kmem_cache* cache;
+    void* free_list;            // First free object in this slab
+    uint32_t inuse;             // Objects currently handed out
+    uint32_t color;             // Byte offset of the first object from the objects area
+    DEFINE_LINK(slab);
+} slab_t;
+
+DEFINE_LIST(slab);
+
+typedef struct kmem_magazine {
+    uint32_t count;
+    void* objs[MAG_DEPTH];
+} kmem_magazine_t;
+
+typedef struct kmem_cache {
+    const char* name;
+    uint32_t object_size;       // Size requested by the creator
+    uint32_t stride;            // Distance between objects, includes alignment padding
+    uint32_t align;
+    uint32_t free_offset;       // Where the free list link lives inside a free object
+    uint32_t objs_per_slab;
+    uint32_t objs_offset;       // Offset of the objects area from the start of the page
+    uint32_t color_count;       // Number of distinct colors that fit in the slack
+    uint32_t color_step;
+    uint32_t color_next;
+    kmem_ctor_t ctor;
+    slab_list_t slabs_partial;
+    slab_list_t slabs_full;
+    slab_list_t slabs_free;
+    uint32_t active_objs;
+    uint32_t total_objs;
+    spinlock_t lock;
+    uint32_t mag_depth;
+    kmem_magazine_t mags[NR_CPUS];
+    DEFINE_LINK(kmem_cache);
+} kmem_cache_t;
+
+kmem_cache_t* kmem_cache_create(const char* name, uint32_t size, uint32_t align, kmem_ctor_t ctor);
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+void kmem_free(void* obj);
+void kmem_cache_drain(kmem_cache_t* cache);
+void kmem_set_magazine_depth(uint32_t depth);
+void kmem_cache_info(void);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <kernel/peripheral.h>
+
+/**
+ * Multi-core support. The Pi 2 has four Cortex-A7 cores and the firmware
+ * parks cores 1-3 in a loop that waits for an entry address to show up in
+ * their local mailbox 3. The Pi 1 has a single core, so there is nothing to
+ * wake on it. This header is shared with boot.S, which lays out the stacks.
+ */
+#ifdef MODEL_1
+    #define NR_CPUS 1
+#else
+    #define NR_CPUS 4
+#endif
+
+/**
+ * Every core gets one stack area: the exception mode stacks at the bottom,
+ * then the SVC stack a secondary core runs on. The boot core keeps its SVC
+ * stack below the kernel image.
+ */
+#define CPU_STACK_SIZE 32768
+#define CPU_IRQ_STACK_TOP 4096
+#define CPU_FIQ_STACK_TOP 5120
+#define CPU_ABT_STACK_TOP 9216
+#define CPU_UND_STACK_TOP 10240
+#define CPU_SVC_STACK_TOP CPU_STACK_SIZE
+
+/**
+ * Each core has four mailboxes: writing bits to a set register ORs them in
+ * and raises the core's mailbox interrupt if enabled, writing them to the
+ * clear register takes them out again. Mailbox 3 is how the firmware stub
+ * is told where to release a parked core.
+ */
+#ifndef MODEL_1
+    #define CORE_MAILBOX_INT_CNTL(cpu) (LOCAL_PERIPHERAL_BASE + 0x50 + (cpu) * 4)
+    #define CORE_MAILBOX_SET(cpu, n) (LOCAL_PERIPHERAL_BASE + 0x80 + (cpu) * 0x10 + (n) * 4)
+    #define CORE_MAILBOX_CLR(cpu, n) (LOCAL_PERIPHERAL_BASE + 0xC0 + (cpu) * 0x10 + (n) * 4)
+    #define CORE_MAILBOX3_SET(cpu) CORE_MAILBOX_SET(cpu, 3)
+#endif
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+/* Data private to one core, padded to a cache line so cores don't share lines */
+typedef struct cpu_data {
+    uint32_t cpu;
+    uint32_t mpidr;
+    volatile uint32_t online;
+    uint64_t online_us;     // System timer when the core came up
+    void (*volatile call_fn)(void* arg);    // Work posted by smp_call_others(), NULL when idle
+    void* call_arg;
+    uint32_t irq_depth;     // IRQ handlers this core is inside of, more than one when nested
+    struct irq_frame* irq_frame;        // What the innermost IRQ interrupted, for the profiler
+    volatile uint32_t softirq_pending;  // Bit per softirq raised on this core, see softirq.h
+    uint32_t in_softirq;    // softirq_run() is active
+} __attribute__((aligned(64))) cpu_data_t;
+
+extern cpu_data_t cpu_data[NR_CPUS];
+
+/* TPIDRPRW holds the running core's cpu_data, it is only accessible from privileged modes */
+static inline cpu_data_t* this_cpu(void) {
+    cpu_data_t* data;
+    asm volatile("mrc p15, 0, %0, c13, c0, 4" : "=r"(data));
+    return data;
+}
+
+static inline uint32_t smp_processor_id(void) {
+    return this_cpu()->cpu;
+}
+
+void percpu_init(uint32_t cpu);
+void smp_init(void);
+uint32_t smp_online_cpus(void);
+void smp_info(void);
+uint32_t smp_call_others(void (*fn)(void* arg), void* arg);
+void smp_call_wait(void);
+void smp_run_call(void);
+void kernel_main_secondary(uint32_t cpu);
+
+#endif
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <kernel/irq.h>
+#include <kernel/smp.h>
+#include <stdint.h>
+
+/**
+ * Software interrupts, the bottom half of interrupt handling.
+ *
+ * A hard IRQ handler does what can't wait, acknowledges the device and
+ * raises a softirq, which sets a bit in the core's pending word. When the
+ * outermost IRQ returns, irq_dispatch() runs the pending softirqs with IRQs
+ * unmasked, lowest number first, so the next interrupt isn't held up by the
+ * processing the last one asked for. Softirqs run on the core that raised
+ * them, never nest, and the interrupted thread is not preempted until they
+ * are done. Raising one that is already pending is free.
+ *
+ * A softirq that keeps being raised while the others run is given
+ * SOFTIRQ_MAX_RESTART rounds, what is left over waits for the next IRQ
+ * exit or the idle loop. Anything that has to sleep belongs on a work
+ * queue instead, see workqueue.h.
+ */
+
+typedef enum {
+    SOFTIRQ_TIMER,              // Timer wheel expiry, raised by the clock event
+    NR_SOFTIRQS,
+} softirq_t;
+
+#define SOFTIRQ_MAX_RESTART 10
+
+typedef void (*softirq_fn_t)(void);
+
+void open_softirq(softirq_t nr, softirq_fn_t fn, const char* name);
+void softirq_run(void);
+void softirq_info(void);
+
+/* Mark a softirq pending on this core, from any context */
+static inline void raise_softirq(softirq_t nr) {
+    uint32_t flags = irq_save();
+
+    this_cpu()->softirq_pending |= 1U << nr;
+    irq_restore(flags);
+}
+
+/* Whether this core is running softirqs, including from an IRQ that interrupted them */
+static inline int in_softirq(void) {
+    return this_cpu()->in_softirq;
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <kernel/irq.h>
+#include <stdint.h>
+
+/**
+ * Spinlocks for data shared between cores.
+ *
+ * spinlock_t is a ticket lock: one word holding the ticket being served
+ * and the next ticket to hand out. Cores take tickets in arrival order, so
+ * the lock is fair, and waiters sleep in wfe until the owner's unlock does
+ * a sev.
+ *
+ * mcs_lock_t is an MCS queue lock. Every waiter brings its own queue node
+ * (usually on its stack) and spins on that, so under contention each core
+ * only watches its own cache line and a release touches just the next
+ * waiter's. Use it where many cores contend, the ticket lock is cheaper
+ * otherwise.
+ *
+ * Both are unlocked when zeroed, so a lock in .bss works before its init
+ * function runs. The init functions name the lock and register its
+ * statistics for lock_stats_dump(). Neither lock masks interrupts, use the
+ * _irqsave variants for data an interrupt handler also touches. Building
+ * with LOCKSTAT=0 drops the statistics.
+ */
+
+typedef struct lock_stats {
+    const char* name;
+    uint32_t acquisitions;
+    uint32_t contended;         // Acquisitions that had to wait
+    uint32_t spins;             // Times a waiter woke up and found the lock still held
+    uint32_t max_hold;          // Longest hold, in CPU cycles
+    uint32_t hold_start;
+    struct lock_stats* next;
+} lock_stats_t;
+
+typedef struct spinlock {
+    union {
+        volatile uint32_t slock;
+        struct {
+            volatile uint16_t owner;
+            volatile uint16_t next;
+        } tickets;
+    };
+#ifndef NO_LOCKSTAT
+    lock_stats_t stats;
+#endif
+} spinlock_t;
+
+typedef struct mcs_node {
+    struct mcs_node* volatile next;
+    volatile uint32_t locked;
+} mcs_node_t;
+
+typedef struct mcs_lock {
+    mcs_node_t* volatile tail;
+#ifndef NO_LOCKSTAT
+    lock_stats_t stats;
+#endif
+} mcs_lock_t;
+
+void spin_lock_init(spinlock_t* lock, const char* name);
+void spin_lock(spinlock_t* lock);
+int spin_trylock(spinlock_t* lock);
+void spin_unlock(spinlock_t* lock);
+
+void mcs_lock_init(mcs_lock_t* lock, const char* name);
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node);
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node);
+
+static inline uint32_t spin_lock_irqsave(spinlock_t* lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+static inline uint32_t mcs_lock_irqsave(mcs_lock_t* lock, mcs_node_t* node) {
+    uint32_t flags = irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t* lock, mcs_node_t* node, uint32_t flags) {
+    mcs_unlock(lock, node);
+    irq_restore(flags);
+}
+
+void lock_stats_dump(void);
+void lock_stats_reset(void);
+int lock_test(void);
+
+#endif
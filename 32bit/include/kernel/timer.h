@@ -0,0 +1,130 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <kernel/peripheral.h>
+#include <kernel/irq.h>
+#include <kernel/list.h>
+#include <stdint.h>
+
+/**
+ * BCM2835 system timer, a free running 64 bit counter at 1 MHz that is
+ * running from power on, so it can timestamp the earliest boot messages.
+ * It has four 32 bit compare channels that raise GPU interrupts 0-3 when
+ * the low word matches, 0 and 2 are taken by the GPU firmware.
+ */
+#define SYSTEM_TIMER_BASE (PERIPHERAL_BASE + 0x3000)
+
+enum {
+    SYSTEM_TIMER_CS  = (SYSTEM_TIMER_BASE + 0x00),
+    SYSTEM_TIMER_CLO = (SYSTEM_TIMER_BASE + 0x04),
+    SYSTEM_TIMER_CHI = (SYSTEM_TIMER_BASE + 0x08),
+};
+
+#define SYSTEM_TIMER_C(channel) (SYSTEM_TIMER_BASE + 0x0C + (channel) * 4)
+#define SYSTEM_TIMER_MATCH(channel) (1 << (channel))
+#define IRQ_SYSTEM_TIMER(channel) (channel)
+
+/**
+ * ARM generic timer (Cortex-A7 only). Every core has a physical (CNTP) and
+ * a virtual (CNTV) down counting timer, both running off the same system
+ * counter, and the local interrupt controller routes each to the core it
+ * belongs to. boot.S lets SVC use the physical one and zeroes the virtual
+ * offset, so the two read the same time.
+ */
+#ifndef MODEL_1
+    #define CORE_TIMER_IRQCNTL(cpu) (LOCAL_PERIPHERAL_BASE + 0x40 + (cpu) * 4)
+    #define CORE_TIMER_CNTPNS_IRQ (1 << 1)
+    #define CORE_TIMER_CNTV_IRQ (1 << 3)
+
+    typedef enum {
+        GENTIMER_PHYS,
+        GENTIMER_VIRT,
+    } gentimer_t;
+#endif
+
+/**
+ * The clock event device, a one-shot interrupt per core that the timer
+ * wheel programs for its next deadline. The Pi 1 uses system timer compare
+ * channel 1. The Pi 2 uses each core's virtual generic timer, or the
+ * physical one when built with GENTIMER=phys.
+ */
+#ifdef MODEL_1
+    #define CLOCKEVENT_CHANNEL 1
+    #define CLOCKEVENT_IRQ IRQ_SYSTEM_TIMER(CLOCKEVENT_CHANNEL)
+#elif defined(GENTIMER_PHYS_EVENT)
+    #define CLOCKEVENT_GENTIMER GENTIMER_PHYS
+    #define CLOCKEVENT_IRQ_ROUTE CORE_TIMER_CNTPNS_IRQ
+    #define CLOCKEVENT_IRQ IRQ_LOCAL(1)
+#else
+    #define CLOCKEVENT_GENTIMER GENTIMER_VIRT
+    #define CLOCKEVENT_IRQ_ROUTE CORE_TIMER_CNTV_IRQ
+    #define CLOCKEVENT_IRQ IRQ_LOCAL(3)
+#endif
+
+/* Deadlines closer than this are pushed out to it, so the compare can't be missed */
+#define CLOCKEVENT_MIN_DELTA_US 2
+
+/**
+ * Software timers.
+ *
+ * Each core has a hierarchical timing wheel: TIMER_WHEEL_LEVELS levels of
+ * 64 slots, where every level is 8 times coarser than the one below and
+ * level 0 ticks every TIMER_RES_US. A timer goes into the level whose
+ * granularity fits the distance to its deadline and never moves after
+ * that, so adding and cancelling are O(1) list operations plus a bitmap
+ * bit. The price is that a timer far out fires up to one slot of its level
+ * late (1/8 to 1/64 of its distance), never early.
+ *
+ * There is no periodic tick: the clock event is programmed for the
+ * earliest non-empty slot, and the wheel catches up to the present in one
+ * step when it fires, however long the core was idle. Timers fire on the
+ * core that added them, from the timer softirq with IRQs unmasked, and
+ * may re-add themselves.
+ */
+#define TIMER_RES_SHIFT 4
+#define TIMER_RES_US (1 << TIMER_RES_SHIFT)
+#define TIMER_WHEEL_LEVELS 7
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_CLK_SHIFT 3
+
+typedef void (*timer_fn_t)(void* arg);
+
+typedef struct ktimer {
+    uint64_t deadline_us;
+    timer_fn_t fn;
+    void* arg;
+    struct timer_base* volatile base;   // Wheel holding the timer, NULL when not pending
+    uint32_t slot;
+    DEFINE_LINK(ktimer);
+} ktimer_t;
+
+DEFINE_LIST(ktimer);
+
+uint64_t timer_now_us(void);
+void udelay(uint32_t us);
+
+void systimer_set_compare(uint32_t channel, uint32_t deadline);
+void systimer_ack(uint32_t channel);
+#ifndef MODEL_1
+uint32_t gentimer_freq(void);
+void gentimer_start(gentimer_t timer, uint32_t counts);
+void gentimer_start_at(gentimer_t timer, uint64_t count);
+void gentimer_stop(gentimer_t timer);
+uint64_t gentimer_count(void);
+#endif
+
+void clockevent_init(void);
+void clockevent_program(uint64_t deadline_us);
+void clockevent_stop(void);
+void clockevent_handler(void* arg);
+
+void timer_wheel_init(void);
+void timer_add(ktimer_t* timer, uint64_t deadline_us, timer_fn_t fn, void* arg);
+int timer_cancel(ktimer_t* timer);
+int timer_pending(ktimer_t* timer);
+void timer_run(void);
+void timer_info(void);
+int timer_test(void);
+
+#endif
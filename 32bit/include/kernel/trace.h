@@ -0,0 +1,86 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/**
+ * Binary event tracing.
+ *
+ * Tracepoints write fixed size records into a ring of their own core,
+ * with IRQs masked for the few stores it takes and no lock, so tracing
+ * barely moves the timing it is there to show. Each event is switched on
+ * at runtime through its bit in trace_mask, which is all a disabled
+ * tracepoint costs. When a ring is full the oldest records are
+ * overwritten. Built with TRACE=0 the tracepoints compile to nothing.
+ *
+ * The trace clock is the generic timer's counter on the Pi 2, the same on
+ * every core, and the 1 MHz system timer on the Pi 1. A record keeps only
+ * its low word. The decoder gets the high word back by going backwards
+ * from the full clock value at the time tracing stopped, which only goes
+ * wrong across a gap of 2^32 ticks without records on a core (over a
+ * minute even at QEMU's 62.5 MHz).
+ *
+ * trace_dump() stops tracing and writes every ring to the console as text,
+ * so it survives the terminal and the '\n' translation:
+ *
+ *   TRACE BEGIN <format version> <trace clock Hz> <clock at stop, 16 hex digits>
+ *   TRACE IRQ <number> <name>              every registered IRQ
+ *   TRACE CPU <cpu> <records> <overwritten>
+ *   <32 hex digits>                        one per record, oldest first
+ *   TRACE END
+ *
+ * A record line is the record's 16 bytes in memory order, a little endian
+ * trace_record_t. 32bit/tools/trace_decode.py turns a console log holding
+ * a dump into a timeline.
+ */
+#define TRACE_FORMAT_VERSION 1
+#define TRACE_RECORDS 1024      // Per core, a power of two
+
+typedef enum {
+    TRACE_IRQ_ENTRY,            // data: IRQ number
+    TRACE_IRQ_EXIT,             // data: IRQ number
+    TRACE_SWITCH,               // data: state of the thread switched out, arg: ids of the previous and next thread
+    TRACE_PAGE_ALLOC,           // data: order, arg[0]: address
+    TRACE_PAGE_FREE,            // data: order, arg[0]: address
+    TRACE_KMALLOC,              // arg[0]: address, arg[1]: bytes asked for
+    TRACE_KFREE,                // arg[0]: address
+    TRACE_UART_TX,              // data: bytes moved into the TX FIFO, arg[0]: bytes still queued
+    TRACE_UART_RX,              // data: bytes waiting in the RX ring, arg[0]: overruns so far
+    NR_TRACE_EVENTS,
+} trace_event_t;
+
+#define TRACE_ALL ((1U << NR_TRACE_EVENTS) - 1)
+
+typedef struct trace_record {
+    uint32_t time;              // Low word of the trace clock
+    uint16_t event;
+    uint16_t data;              // Small event specific value
+    uint32_t arg[2];
+} trace_record_t;
+
+extern volatile uint32_t trace_mask;
+
+void __trace(uint32_t event, uint32_t data, uint32_t arg0, uint32_t arg1);
+
+#ifdef NO_TRACE
+    // Still type checked, and whatever only feeds a tracepoint doesn't show up as unused
+    #define trace(event, data, arg0, arg1) \
+        do { \
+            if (0) { \
+                __trace((event), (data), (arg0), (arg1)); \
+            } \
+        } while (0)
+#else
+    #define trace(event, data, arg0, arg1) \
+        do { \
+            if (trace_mask & (1U << (event))) { \
+                __trace((event), (data), (arg0), (arg1)); \
+            } \
+        } while (0)
+#endif
+
+void trace_start(uint32_t mask);
+void trace_stop(void);
+void trace_dump(void);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef TRAP_H
+#define TRAP_H
+
+/**
+ * Register state the exception entry stubs in vectors.S save on the stack
+ * of the mode the exception is taken to. sp and lr are the interrupted
+ * mode's banked ones, pc is where it resumes and cpsr its saved status.
+ * Handlers may change r0-r12, pc and cpsr before returning, sp and lr are
+ * not written back. This header is shared with vectors.S.
+ */
+#define TRAP_FRAME_SP 52
+#define TRAP_FRAME_PC 60
+#define TRAP_FRAME_CPSR 64
+#define TRAP_FRAME_SIZE 72      // Padded to keep the stack 8 byte aligned
+
+/* SVC numbers svc_handler() returns from, any other one is fatal */
+#define SVC_NULL 0              // Does nothing, times the exception round trip
+
+#ifndef __ASSEMBLER__
+
+#include <stdint.h>
+
+typedef struct trap_frame {
+    uint32_t r[13];
+    uint32_t sp;
+    uint32_t lr;                // Only meaningful if the exception came from another mode
+    uint32_t pc;
+    uint32_t cpsr;
+    uint32_t pad;
+} trap_frame_t;
+
+/**
+ * What irq_entry saves of the interrupted code, on its SVC stack: the
+ * caller saved registers, the frame pointer for the profiler's call chains,
+ * and the return address and status srs pushed. IRQs are only taken from
+ * SVC mode, so lr is the interrupted code's own.
+ */
+typedef struct irq_frame {
+    uint32_t r[4];
+    uint32_t fp;
+    uint32_t r12;
+    uint32_t lr;
+    uint32_t pc;
+    uint32_t cpsr;
+} irq_frame_t;
+
+void trap_dump(const trap_frame_t* frame);
+
+#endif
+
+#endif
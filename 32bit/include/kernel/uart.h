@@ -86,12 +86,53 @@ enum {
     UART0_TDR    = (UART0_BASE + 0x8C),
 };
 
+/* UART0_IMSC / UART0_MIS / UART0_ICR interrupt bits */
+enum {
+    UART_INT_RX = (1 << 4),     // RX FIFO reached its trigger level
+    UART_INT_TX = (1 << 5),     // TX FIFO dropped to its trigger level
+    UART_INT_RT = (1 << 6),     // RX FIFO has data but went quiet
+};
+
+/**
+ * Interrupt driven console. Output is queued on a ring that the TX FIFO
+ * interrupt drains, input is collected into a ring by the RX interrupts.
+ * Each ring has exactly one producer and one consumer, either of which may
+ * be the interrupt handler, so they need no lock. Sizes must be powers of
+ * two, head and tail are free running and only masked on access. A
+ * reader blocks in uart_rx_wait() and is woken by a system_wq item, so the
+ * interrupt side never touches the scheduler.
+ *
+ * On the Pi 2 the UART interrupt is the FIQ and uart_fiq_entry in
+ * vectors.S fills the RX ring, which relies on the field layout below.
+ * Build with FIQ=0 to keep it on the IRQ path.
+ */
+#if !defined(MODEL_1) && !defined(NO_UART_FIQ)
+    #define UART_FIQ
+#endif
+
+#define UART_TX_RING_SIZE 4096
+#define UART_RX_RING_SIZE 256
+
+typedef struct {
+    volatile uint32_t head;     // Next byte to consume
+    volatile uint32_t tail;     // Next free slot, owned by the producer
+    uint8_t* buf;
+    uint32_t mask;
+    uint32_t overruns;          // Bytes dropped because the ring was full
+} uart_ring_t;
+
 //declarative signatures
 uart_flags_t read_flags();
 void uart_init();
 void uart_putc(unsigned char c);
 void uart_puts(const char* s);
+void uart_write(const char* buf, uint32_t len);
 unsigned char uart_getc();
+int uart_rx_ready();
+void uart_enable_interrupts(void);
+void uart_set_polled(void);
+int uart_rx_wait(void);
+uint32_t uart_rx_overruns(void);
 void mmio_write(uint32_t reg, uint32_t data);
 uint32_t mmio_read(uint32_t reg);
 void delay(int32_t count);
@@ -0,0 +1,68 @@
+#ifndef VM_H
+#define VM_H
+
+#include <kernel/list.h>
+#include <stdint.h>
+
+/**
+ * Virtual memory.
+ *
+ * An address space is a level 1 table of its own that shares the kernel's
+ * identity sections and adds 4 KiB page mappings in the window
+ * [VM_USER_START, VM_USER_END). The window is described by areas (VMAs)
+ * with a protection each; vm_map() only records the area and pages are
+ * filled in by the data abort handler on first touch:
+ *  - a read of an untouched page maps the shared zero page read-only,
+ *  - a write gets a freshly zeroed page,
+ *  - a write to a page that is shared after vm_clone() copies it, unless
+ *    this mapping is the last one left, which just makes it writable.
+ *
+ * Level 2 tables come from alloc_page(), one page serves four consecutive
+ * megabytes (four 1 KiB tables).
+ */
+#define VM_USER_START 0x80000000
+#define VM_USER_END 0xC0000000
+
+/* Area protections */
+#define VM_READ 0x1
+#define VM_WRITE 0x2
+#define VM_EXEC 0x4
+
+typedef struct vm_area {
+    uint32_t start;
+    uint32_t end;               // Exclusive
+    uint32_t prot;
+    DEFINE_LINK(vm_area);
+} vm_area_t;
+
+DEFINE_LIST(vm_area);
+
+typedef struct addr_space {
+    uint32_t* l1;               // 16 KiB level 1 table, doubles as its physical address
+    vm_area_list_t areas;
+} addr_space_t;
+
+typedef struct {
+    uint32_t faults;            // Faults resolved
+    uint32_t zero_maps;         // Reads satisfied with the shared zero page
+    uint32_t demand_zero;       // Fresh zeroed pages for writes
+    uint32_t cow_copies;        // Shared pages copied on write
+    uint32_t cow_reuses;        // Writes to a page nobody else shared any more
+} vm_stats_t;
+
+void vm_init(void);
+addr_space_t* vm_create(void);
+addr_space_t* vm_clone(addr_space_t* src);
+void vm_destroy(addr_space_t* as);
+void vm_switch(addr_space_t* as);
+addr_space_t* vm_current(void);
+
+int vm_map(addr_space_t* as, uint32_t addr, uint32_t len, uint32_t prot);
+int vm_unmap(addr_space_t* as, uint32_t addr, uint32_t len);
+int vm_protect(addr_space_t* as, uint32_t addr, uint32_t len, uint32_t prot);
+
+int vm_handle_fault(uint32_t addr, uint32_t status);
+void vm_get_stats(vm_stats_t* stats);
+int vm_test(void);
+
+#endif
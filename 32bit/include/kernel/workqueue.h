@@ -0,0 +1,63 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+#include <kernel/sched.h>
+#include <stdint.h>
+
+/**
+ * Work queues, deferred work that runs in a kernel thread.
+ *
+ * Where a softirq still runs in interrupt context and may not sleep, a
+ * work item's function runs in one of the queue's worker threads, one per
+ * core, so it can sleep, block and take as long as it needs while the
+ * scheduler keeps everything else going. Interrupt handlers queue the
+ * work and return.
+ *
+ * An item is queued on the calling core's worker unless a core is given,
+ * and at most once: queueing an item that is still waiting does nothing.
+ * It may be queued again from its own function. system_wq runs at
+ * SCHED_PRIO_HIGH, so its items go ahead of normal threads but should keep
+ * short.
+ */
+
+typedef void (*work_fn_t)(void* arg);
+
+typedef struct work {
+    work_fn_t fn;
+    void* arg;
+    volatile uint32_t pending;              // Queued and not started yet
+    struct worker_pool* volatile pool;      // Pool it is queued on, NULL once started or cancelled
+    uint64_t queued_us;
+    DEFINE_LINK(work);
+} work_t;
+
+DEFINE_LIST(work);
+
+typedef struct worker_pool {
+    spinlock_t lock;
+    work_list_t queue;
+    thread_t* worker;
+    uint32_t stop;              // WORKER_STOP/WORKER_EXIT while workqueue_create() unwinds
+    uint32_t done;
+    uint32_t max_wait_us;       // Longest an item waited between queueing and starting
+} __attribute__((aligned(64))) worker_pool_t;
+
+typedef struct workqueue {
+    const char* name;
+    worker_pool_t pools[NR_CPUS];
+} workqueue_t;
+
+extern workqueue_t* system_wq;
+
+void workqueue_init(void);
+workqueue_t* workqueue_create(const char* name, uint32_t priority);
+void work_init(work_t* work, work_fn_t fn, void* arg);
+int queue_work(workqueue_t* wq, work_t* work);
+int queue_work_on(workqueue_t* wq, uint32_t cpu, work_t* work);
+int cancel_work(work_t* work);
+void workqueue_info(void);
+int workqueue_test(void);
+
+#endif
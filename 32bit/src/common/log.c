@@ -0,0 +1,86 @@
+#include <common/log.h>
+#include <common/stdio.h>
+#include <kernel/spinlock.h>
+#include <kernel/timer.h>
+
+_Static_assert(sizeof(log_entry_t) == 128, "log entries are sized to fill 128 bytes");
+
+static const char* level_names[] = { "", "ERROR", "WARNING", "INFO", "DEBUG" };
+
+/* The newest LOG_RING_ENTRIES messages, log_seq counts every message ever logged */
+static log_entry_t log_ring[LOG_RING_ENTRIES];
+static uint32_t log_seq;
+
+/* Messages before this sequence number have been printed, or will never be */
+static uint32_t log_console_seq;
+static int log_console_on;
+
+/* Taken with IRQs masked so a handler on the same core can't claim the same slot */
+static spinlock_t log_lock;
+
+static void log_print(log_entry_t* entry) {
+    kprintf("[%s] %s\n", level_names[entry->level], entry->msg);
+}
+
+void klog(uint32_t level, const char* fmt, ...) {
+    log_entry_t* entry;
+    va_list args;
+    uint32_t flags, seq;
+    int len;
+
+    flags = spin_lock_irqsave(&log_lock);
+    seq = log_seq++;
+    entry = &log_ring[seq % LOG_RING_ENTRIES];
+
+    va_start(args, fmt);
+    len = kvsnprintf(entry->msg, LOG_MSG_MAX, fmt, args);
+    va_end(args);
+
+    if (len >= LOG_MSG_MAX) {
+        len = LOG_MSG_MAX - 1;
+    }
+    // One line per entry, the trailing newline is added on output
+    if (len > 0 && entry->msg[len - 1] == '\n') {
+        entry->msg[--len] = '\0';
+    }
+    entry->len = len;
+    entry->level = level;
+    entry->timestamp_us = timer_now_us();
+
+    if (log_console_on) {
+        log_print(entry);
+        log_console_seq = log_seq;
+    }
+    spin_unlock_irqrestore(&log_lock, flags);
+}
+
+/* The console is up, print what was logged so far and echo from now on */
+void log_console_start(void) {
+    uint32_t flags;
+
+    spin_lock_init(&log_lock, "log");
+    flags = spin_lock_irqsave(&log_lock);
+
+    if (log_seq - log_console_seq > LOG_RING_ENTRIES) {
+        kprintf("[WARNING] %u early log messages lost\n", log_seq - log_console_seq - LOG_RING_ENTRIES);
+        log_console_seq = log_seq - LOG_RING_ENTRIES;
+    }
+    for (; log_console_seq != log_seq; log_console_seq++) {
+        log_print(&log_ring[log_console_seq % LOG_RING_ENTRIES]);
+    }
+    log_console_on = 1;
+    spin_unlock_irqrestore(&log_lock, flags);
+}
+
+/* Replay the ring with timestamps, oldest first */
+void log_dump(void) {
+    uint32_t seq, first, sec, usec;
+    log_entry_t* entry;
+
+    first = log_seq > LOG_RING_ENTRIES ? log_seq - LOG_RING_ENTRIES : 0;
+    for (seq = first; seq != log_seq; seq++) {
+        entry = &log_ring[seq % LOG_RING_ENTRIES];
+        sec = div_u64_rem(entry->timestamp_us, 1000000, &usec);
+        kprintf("[%5u.%06u] [%s] %s\n", sec, usec, level_names[entry->level], entry->msg);
+    }
+}
@@ -0,0 +1,200 @@
+#include <common/stdio.h>
+#include <common/stdlib.h>
+
+/**
+ * kprintf formats into a buffer on the caller's stack and hands the
+ * finished line to the console with a single write, so a message is never
+ * interleaved with output from an interrupt handler and nothing here keeps
+ * state between calls.
+ *
+ * Supported: %d %i %u %x %X %p %s %c %%, the l (32 bit) and ll (64 bit)
+ * length modifiers, a field width, and the '0' and '-' flags.
+ */
+
+typedef struct {
+    char* buf;
+    size_t size;
+    size_t len;     // Length the output would have, may exceed size
+} fmt_out_t;
+
+static void fmt_putc(fmt_out_t* out, char c) {
+    if (out->len + 1 < out->size) {
+        out->buf[out->len] = c;
+    }
+    out->len++;
+}
+
+static void fmt_pad(fmt_out_t* out, char c, int count) {
+    while (count-- > 0) {
+        fmt_putc(out, c);
+    }
+}
+
+static void fmt_string(fmt_out_t* out, const char* str, int width, int left) {
+    int len = 0;
+
+    if (str == NULL) {
+        str = "(null)";
+    }
+    while (str[len] != '\0') {
+        len++;
+    }
+
+    if (!left) {
+        fmt_pad(out, ' ', width - len);
+    }
+    while (*str) {
+        fmt_putc(out, *str++);
+    }
+    if (left) {
+        fmt_pad(out, ' ', width - len);
+    }
+}
+
+static void fmt_number(fmt_out_t* out, uint64_t val, uint32_t base, int upper, int negative,
+                       int width, int zero_pad, int left) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[24];
+    uint32_t rem;
+    int len = 0;
+
+    do {
+        if (base == 16) {
+            // No division needed for hex, which is also the common case for addresses
+            rem = val & 0xF;
+            val >>= 4;
+        } else {
+            val = div_u64_rem(val, base, &rem);
+        }
+        tmp[len++] = digits[rem];
+    } while (val != 0);
+
+    width -= len + negative;
+    if (left) {
+        zero_pad = 0;
+    }
+
+    if (!left && !zero_pad) {
+        fmt_pad(out, ' ', width);
+    }
+    if (negative) {
+        fmt_putc(out, '-');
+    }
+    if (zero_pad) {
+        fmt_pad(out, '0', width);
+    }
+    while (len > 0) {
+        fmt_putc(out, tmp[--len]);
+    }
+    if (left) {
+        fmt_pad(out, ' ', width);
+    }
+}
+
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list args) {
+    fmt_out_t out = { buf, size, 0 };
+    int width, zero_pad, left, longs;
+    uint64_t uval;
+    int64_t sval;
+
+    for (; *fmt != '\0'; fmt++) {
+        if (*fmt != '%') {
+            fmt_putc(&out, *fmt);
+            continue;
+        }
+
+        fmt++;
+        zero_pad = left = 0;
+        for (;; fmt++) {
+            if (*fmt == '0') {
+                zero_pad = 1;
+            } else if (*fmt == '-') {
+                left = 1;
+            } else {
+                break;
+            }
+        }
+
+        width = 0;
+        while (*fmt >= '0' && *fmt <= '9') {
+            width = width * 10 + (*fmt++ - '0');
+        }
+
+        longs = 0;
+        while (*fmt == 'l') {
+            longs++;
+            fmt++;
+        }
+
+        switch (*fmt) {
+        case 'd':
+        case 'i':
+            sval = longs >= 2 ? va_arg(args, int64_t) : va_arg(args, int32_t);
+            uval = sval < 0 ? -(uint64_t)sval : (uint64_t)sval;
+            fmt_number(&out, uval, 10, 0, sval < 0, width, zero_pad, left);
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+            uval = longs >= 2 ? va_arg(args, uint64_t) : va_arg(args, uint32_t);
+            fmt_number(&out, uval, *fmt == 'u' ? 10 : 16, *fmt == 'X', 0, width, zero_pad, left);
+            break;
+        case 'p':
+            fmt_putc(&out, '0');
+            fmt_putc(&out, 'x');
+            fmt_number(&out, (uintptr_t)va_arg(args, void*), 16, 0, 0, 2 * sizeof(void*), 1, 0);
+            break;
+        case 's':
+            fmt_string(&out, va_arg(args, const char*), width, left);
+            break;
+        case 'c':
+            fmt_putc(&out, (char)va_arg(args, int));
+            break;
+        case '%':
+            fmt_putc(&out, '%');
+            break;
+        case '\0':
+            fmt--;
+            break;
+        default:
+            // Unknown conversion, show it as is
+            fmt_putc(&out, '%');
+            fmt_putc(&out, *fmt);
+            break;
+        }
+    }
+
+    if (size > 0) {
+        buf[out.len < size ? out.len : size - 1] = '\0';
+    }
+    return out.len;
+}
+
+int ksnprintf(char* buf, size_t size, const char* fmt, ...) {
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = kvsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return len;
+}
+
+int kvprintf(const char* fmt, va_list args) {
+    char buf[KPRINTF_BUF_SIZE];
+    int len;
+
+    len = kvsnprintf(buf, sizeof(buf), fmt, args);
+    uart_write(buf, (uint32_t)len < sizeof(buf) ? (uint32_t)len : sizeof(buf) - 1);
+    return len;
+}
+
+int kprintf(const char* fmt, ...) {
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = kvprintf(fmt, args);
+    va_end(args);
+    return len;
+}
@@ -1,6 +1,16 @@
 #include <common/stdio.h>
 
+/* Work to do while waiting for console input */
+static idle_hook_t idle_hook;
+
+void set_idle_hook(idle_hook_t hook) {
+    idle_hook = hook;
+}
+
 char getc() {
+    while (idle_hook != NULL && !uart_rx_ready()) {
+        idle_hook();
+    }
     return uart_getc();
 }
 
@@ -9,10 +19,12 @@ void putc(char c) {
 }
 
 void puts(const char* str) {
-    int i;
-    for (i = 0; str[i] != '\0'; i++) {
-        putc(str[i]);
+    uint32_t len = 0;
+
+    while (str[len] != '\0') {
+        len++;
     }
+    uart_write(str, len);
 }
 
 void gets(char* buf, int buflen) {
@@ -41,31 +53,9 @@ void puthex(uint32_t val) {
     }
 }
 
-void debug(const char* msg) {
-    puts("[DEBUG] ");
-    puts(msg);
-    puts("\n");
-}
-
-void info(const char* msg) {
-    puts("[INFO] ");
-    puts(msg);
-    puts("\n");
-}
-
-void warning(const char* msg) {
-    puts("[WARNING] ");
-    puts(msg);
-    puts("\n");
-}
-
-void error(const char* msg) {
-    puts("[ERROR] ");
-    puts(msg);
-    puts("\n");
-}
-
 void panic(const char* msg) {
+    asm volatile("cpsid if" ::: "memory");
+    uart_set_polled();
     puts("\n=== KERNEL PANIC ===\n");
     puts(msg);
     puts("\nSystem halted.\n");
@@ -1,17 +1,171 @@
 #include <common/stdlib.h>
 
-void memcpy(void* dest, void* src, int bytes) {
-    char *d = dest, *s = src;
+/* Below this size the setup for the block routines costs more than it saves */
+#define MEMOPS_BULK_MIN (2 * MEMOPS_BLOCK)
+
+#define WORD_MASK (sizeof(uint32_t) - 1)
+
+/*
+ * Copy words from a source that is not word aligned to an aligned
+ * destination. Every source word is read aligned and the output is stitched
+ * together from two neighbouring words, so no unaligned access is ever
+ * made. Reads never leave the aligned words that hold source bytes.
+ */
+static void copy_words_shifted(uint32_t* d, const uint8_t* s, size_t words) {
+    uint32_t offset = (uintptr_t)s & WORD_MASK;
+    const uint32_t* ws = (const uint32_t*)(s - offset);
+    uint32_t shift = offset * 8;
+    uint32_t lo = *ws++, hi;
+
+    while (words--) {
+        hi = *ws++;
+        *d++ = (lo >> shift) | (hi << (32 - shift));
+        lo = hi;
+    }
+}
+
+void* memcpy(void* dest, const void* src, size_t bytes) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    size_t chunk;
+
+    if (bytes >= sizeof(uint32_t)) {
+        // Byte copy until the destination is word aligned
+        while ((uintptr_t)d & WORD_MASK) {
+            *d++ = *s++;
+            bytes--;
+        }
+
+        if (((uintptr_t)s & WORD_MASK) == 0) {
+            if (bytes >= MEMOPS_BULK_MIN) {
+                chunk = bytes & ~(size_t)(MEMOPS_BLOCK - 1);
+                __memcpy_blocks(d, s, chunk);
+                d += chunk;
+                s += chunk;
+                bytes -= chunk;
+            }
+
+            while (bytes >= sizeof(uint32_t)) {
+                *(uint32_t*)d = *(const uint32_t*)s;
+                d += sizeof(uint32_t);
+                s += sizeof(uint32_t);
+                bytes -= sizeof(uint32_t);
+            }
+        } else {
+            // Leave at least one word so the last shifted read stays inside the source
+            chunk = bytes / sizeof(uint32_t);
+            if (chunk > 1) {
+                chunk--;
+                copy_words_shifted((uint32_t*)d, s, chunk);
+                d += chunk * sizeof(uint32_t);
+                s += chunk * sizeof(uint32_t);
+                bytes -= chunk * sizeof(uint32_t);
+            }
+        }
+    }
+
     while (bytes--) {
         *d++ = *s++;
     }
+    return dest;
 }
 
-void bzero(void* dest, int bytes) {
-    char* d = dest;
+void* memmove(void* dest, const void* src, size_t bytes) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    // A forward copy never reads a byte it has already overwritten unless dest starts inside src
+    if (d <= s || d >= s + bytes) {
+        return memcpy(dest, src, bytes);
+    }
+
+    // Overlapping with dest above src, copy backwards
+    d += bytes;
+    s += bytes;
+    if ((((uintptr_t)d ^ (uintptr_t)s) & WORD_MASK) == 0) {
+        while (bytes && ((uintptr_t)d & WORD_MASK)) {
+            *--d = *--s;
+            bytes--;
+        }
+        while (bytes >= sizeof(uint32_t)) {
+            d -= sizeof(uint32_t);
+            s -= sizeof(uint32_t);
+            *(uint32_t*)d = *(const uint32_t*)s;
+            bytes -= sizeof(uint32_t);
+        }
+    }
     while (bytes--) {
-        *d++ = 0;
+        *--d = *--s;
     }
+    return dest;
+}
+
+void* memset(void* dest, int c, size_t bytes) {
+    uint8_t* d = dest;
+    uint32_t pattern = (uint8_t)c * 0x01010101U;
+    size_t chunk;
+
+    if (bytes >= sizeof(uint32_t)) {
+        while ((uintptr_t)d & WORD_MASK) {
+            *d++ = (uint8_t)c;
+            bytes--;
+        }
+
+        if (bytes >= MEMOPS_BULK_MIN) {
+            chunk = bytes & ~(size_t)(MEMOPS_BLOCK - 1);
+            __memset_blocks(d, pattern, chunk);
+            d += chunk;
+            bytes -= chunk;
+        }
+
+        while (bytes >= sizeof(uint32_t)) {
+            *(uint32_t*)d = pattern;
+            d += sizeof(uint32_t);
+            bytes -= sizeof(uint32_t);
+        }
+    }
+
+    while (bytes--) {
+        *d++ = (uint8_t)c;
+    }
+    return dest;
+}
+
+void bzero(void* dest, int bytes) {
+    memset(dest, 0, bytes);
+}
+
+/**
+ * 64 by 32 bit unsigned division. There is no libgcc to provide
+ * __aeabi_uldivmod, so the high word is divided with the 32 bit divider and
+ * the low word is shifted in one bit at a time.
+ */
+uint64_t div_u64_rem(uint64_t dividend, uint32_t divisor, uint32_t* remainder) {
+    uint32_t high = dividend >> 32, low = (uint32_t)dividend;
+    uint32_t quot_high, quot_low = 0, rem, carry;
+    int bit;
+
+    if (high == 0) {
+        *remainder = low % divisor;
+        return low / divisor;
+    }
+
+    quot_high = high / divisor;
+    rem = high % divisor;
+
+    for (bit = 31; bit >= 0; bit--) {
+        // rem < divisor, so if the shift carries out the result is past divisor anyway
+        carry = rem >> 31;
+        rem = (rem << 1) | ((low >> bit) & 1);
+        quot_low <<= 1;
+        if (carry || rem >= divisor) {
+            rem -= divisor;
+            quot_low |= 1;
+        }
+    }
+
+    *remainder = rem;
+    return ((uint64_t)quot_high << 32) | quot_low;
 }
 
 char* itoa(int i) {
@@ -54,6 +208,19 @@ char* itoa(int i) {
 int strcmp(const char *s1, const char *s2) {
     const unsigned char *p1 = (const unsigned char *)s1;
     const unsigned char *p2 = (const unsigned char *)s2;
+    const uint32_t *w1, *w2;
+
+    // Compare a word at a time while neither word holds the terminating zero byte
+    if ((((uintptr_t)p1 | (uintptr_t)p2) & WORD_MASK) == 0) {
+        w1 = (const uint32_t *)p1;
+        w2 = (const uint32_t *)p2;
+        while (*w1 == *w2 && ((*w1 - 0x01010101U) & ~*w1 & 0x80808080U) == 0) {
+            w1++;
+            w2++;
+        }
+        p1 = (const unsigned char *)w1;
+        p2 = (const unsigned char *)w2;
+    }
 
     while (*p1 && (*p1 == *p2)) {
         p1++;
@@ -61,4 +228,4 @@ int strcmp(const char *s1, const char *s2) {
     }
 
     return (*p1 > *p2) ? 1 : (*p1 < *p2) ? -1 : 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,103 @@
 #include <kernel/atag.h>
+#include <stddef.h>
 
+/* Flattened device tree header magic and structure block tokens, all big endian */
+#define FDT_MAGIC 0xD00DFEED
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE 2
+#define FDT_PROP 3
+#define FDT_NOP 4
+#define FDT_END 9
+
+/* Boot info is only trusted if it sits in the low RAM the firmware and QEMU use for it */
+#define BOOT_INFO_LIMIT 0x20000000
+
+static uint32_t be32(const void* ptr) {
+    const uint8_t* b = ptr;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+/* Does a node name match "memory" or "memory@<unit address>" */
+static int fdt_is_memory_node(const char* name) {
+    const char* want = "memory";
+
+    while (*want && *name == *want) {
+        name++;
+        want++;
+    }
+    return *want == '\0' && (*name == '\0' || *name == '@');
+}
+
+static int fdt_is_reg(const char* name) {
+    return name[0] == 'r' && name[1] == 'e' && name[2] == 'g' && name[3] == '\0';
+}
+
+/**
+ * Walk the structure block for the top level memory node and return the
+ * size cell of its first reg entry. The Pi device trees use one address
+ * and one size cell at the root.
+ */
+static uint32_t fdt_get_mem_size(const uint8_t* fdt) {
+    const uint8_t* p = fdt + be32(fdt + 8);         // off_dt_struct
+    const char* strings = (const char*)fdt + be32(fdt + 12); // off_dt_strings
+    const uint8_t* end = fdt + be32(fdt + 4);       // totalsize
+    uint32_t token, len, depth = 0, in_memory = 0;
+    const char* name;
+
+    while (p < end) {
+        token = be32(p);
+        p += 4;
+
+        switch (token) {
+        case FDT_BEGIN_NODE:
+            name = (const char*)p;
+            depth++;
+            in_memory = depth == 2 && fdt_is_memory_node(name);
+            while (*p++ != '\0') {
+            }
+            p = (const uint8_t*)(((uintptr_t)p + 3) & ~(uintptr_t)3);
+            break;
+        case FDT_END_NODE:
+            depth--;
+            in_memory = 0;
+            break;
+        case FDT_PROP:
+            len = be32(p);
+            name = strings + be32(p + 4);
+            p += 8;
+            if (in_memory && fdt_is_reg(name) && len >= 8) {
+                return be32(p + 4);
+            }
+            p += (len + 3) & ~3U;
+            break;
+        case FDT_NOP:
+            break;
+        default:
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find the amount of RAM from the boot information the firmware left in r2,
+ * which is either an ATAG list or a flattened device tree. Returns 0 if the
+ * pointer doesn't look like either, so the caller can fall back to a default.
+ */
 uint32_t get_mem_size(atag_t * tag) {
+    if (tag == NULL || (uintptr_t)tag >= BOOT_INFO_LIMIT || ((uintptr_t)tag & 3)) {
+        return 0;
+    }
+
+    if (be32(tag) == FDT_MAGIC) {
+        return fdt_get_mem_size((const uint8_t*)tag);
+    }
+
+    // An ATAG list always starts with ATAG_CORE
+    if (tag->tag != CORE) {
+        return 0;
+    }
+
     while (tag->tag != NONE) {
         if (tag->tag == MEM) {
             return tag->mem.size;
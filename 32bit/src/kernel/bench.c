@@ -0,0 +1,454 @@
+#include <kernel/bench.h>
+#include <kernel/pmu.h>
+#include <kernel/mem.h>
+#include <kernel/mmu.h>
+#include <kernel/smp.h>
+#include <kernel/sched.h>
+#include <kernel/atomic.h>
+#include <kernel/irq.h>
+#include <kernel/trap.h>
+#include <kernel/uart.h>
+#include <common/stdio.h>
+#include <common/stdlib.h>
+
+/**
+ * In-kernel benchmarks. Everything is timed with the PMU cycle counter, so
+ * results are in CPU cycles and comparable between builds on the same
+ * machine (or the same QEMU host).
+ */
+
+#define MEMOPS_BUF_ORDER 5      // 128 KiB buffers
+#define MEMOPS_WORK (256 * 1024) // Bytes moved per measurement
+
+static const uint32_t memops_sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+
+/* Destination and source offsets from a cache line boundary */
+static const uint32_t memops_offsets[][2] = { { 0, 0 }, { 3, 3 }, { 0, 1 }, { 2, 7 } };
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+/* The byte at a time loop the memory routines used to be, as a baseline */
+static void bytewise_copy(uint8_t* d, const uint8_t* s, uint32_t bytes) {
+    while (bytes--) {
+        *d++ = *s++;
+    }
+}
+
+/* Print bytes per cycle with two decimals */
+static void print_rate(uint32_t bytes, uint32_t cycles) {
+    uint32_t hundredths;
+
+    if (cycles == 0) {
+        cycles = 1;
+    }
+    hundredths = bytes * 100 / cycles;
+    kprintf("%u.%02u  ", hundredths / 100, hundredths % 100);
+}
+
+static uint32_t time_memcpy(uint8_t* d, const uint8_t* s, uint32_t size, uint32_t reps) {
+    uint32_t start = pmu_cycles();
+    while (reps--) {
+        memcpy(d, s, size);
+    }
+    return pmu_cycles() - start;
+}
+
+static uint32_t time_memset(uint8_t* d, uint32_t size, uint32_t reps) {
+    uint32_t start = pmu_cycles();
+    while (reps--) {
+        memset(d, 0x5A, size);
+    }
+    return pmu_cycles() - start;
+}
+
+static uint32_t time_bytewise(uint8_t* d, const uint8_t* s, uint32_t size, uint32_t reps) {
+    uint32_t start = pmu_cycles();
+    while (reps--) {
+        bytewise_copy(d, s, size);
+    }
+    return pmu_cycles() - start;
+}
+
+/**
+ * Report bytes per cycle for memcpy and memset across sizes and
+ * destination/source alignments, next to the old byte loop.
+ */
+void memops_bench(void) {
+    uint8_t *dst, *src;
+    uint32_t i, j, size, reps, work;
+
+    dst = alloc_pages(MEMOPS_BUF_ORDER);
+    src = alloc_pages(MEMOPS_BUF_ORDER);
+    if (dst == NULL || src == NULL) {
+        error("memperf: out of memory");
+        free_pages(dst, MEMOPS_BUF_ORDER);
+        free_pages(src, MEMOPS_BUF_ORDER);
+        return;
+    }
+
+    for (j = 0; j < ARRAY_LEN(memops_offsets); j++) {
+        kprintf("\ndst+%u src+%u (bytes/cycle)\nsize     memcpy  memset  bytewise\n",
+                memops_offsets[j][0], memops_offsets[j][1]);
+
+        for (i = 0; i < ARRAY_LEN(memops_sizes); i++) {
+            size = memops_sizes[i];
+            reps = MEMOPS_WORK / size;
+            work = reps * size;
+
+            kprintf("%-8u ", size);
+            print_rate(work, time_memcpy(dst + memops_offsets[j][0], src + memops_offsets[j][1], size, reps));
+            print_rate(work, time_memset(dst + memops_offsets[j][0], size, reps));
+            print_rate(work, time_bytewise(dst + memops_offsets[j][0], src + memops_offsets[j][1], size, reps));
+            puts("\n");
+        }
+    }
+
+    free_pages(dst, MEMOPS_BUF_ORDER);
+    free_pages(src, MEMOPS_BUF_ORDER);
+}
+
+#define CACHE_BENCH_BYTES 8192
+#define CACHE_BENCH_REPS 16
+
+/* Static so this can run before mem_init, and before the MMU is on */
+static uint8_t cache_bench_src[CACHE_BENCH_BYTES] __attribute__((aligned(64)));
+static uint8_t cache_bench_dst[CACHE_BENCH_BYTES] __attribute__((aligned(64)));
+
+/**
+ * Log what memcpy and a page style bzero cost per KiB in the current cache
+ * and MMU state. Boot runs it once before and once after mmu_init().
+ */
+void cache_bench(const char* label) {
+    uint32_t start, copy_cycles, zero_cycles, i;
+
+    start = pmu_cycles();
+    for (i = 0; i < CACHE_BENCH_REPS; i++) {
+        memcpy(cache_bench_dst, cache_bench_src, CACHE_BENCH_BYTES);
+    }
+    copy_cycles = pmu_cycles() - start;
+
+    start = pmu_cycles();
+    for (i = 0; i < CACHE_BENCH_REPS; i++) {
+        bzero(cache_bench_dst, CACHE_BENCH_BYTES);
+    }
+    zero_cycles = pmu_cycles() - start;
+
+    info("%s: memcpy %u cycles/KiB, bzero %u cycles/KiB (MMU %s)", label,
+         copy_cycles / (CACHE_BENCH_REPS * CACHE_BENCH_BYTES / 1024),
+         zero_cycles / (CACHE_BENCH_REPS * CACHE_BENCH_BYTES / 1024), mmu_enabled() ? "on" : "off");
+}
+
+#define ALLOC_BENCH_ROUNDS 2000
+#define ALLOC_BENCH_BATCH 8     // Blocks held at once, so frees don't just undo the last alloc
+#define ALLOC_BENCH_OBJ_SIZE 64
+
+/* What each phase allocates, alloc_page() is the ALLOC_ZERO path most callers take */
+enum { ALLOC_BENCH_PAGE, ALLOC_BENCH_ZEROED_PAGE, ALLOC_BENCH_KMALLOC, ALLOC_BENCH_PHASES };
+
+static const char* const alloc_bench_names[ALLOC_BENCH_PHASES] = { "page", "zeroed", "kmalloc" };
+
+static uint32_t alloc_bench_cpus;
+static uint32_t alloc_bench_phase;
+static volatile uint32_t alloc_bench_failed;
+
+static void* alloc_bench_alloc(void) {
+    switch (alloc_bench_phase) {
+    case ALLOC_BENCH_PAGE:
+        return alloc_page_flags(0);
+    case ALLOC_BENCH_ZEROED_PAGE:
+        return alloc_page();
+    default:
+        return kmalloc(ALLOC_BENCH_OBJ_SIZE);
+    }
+}
+
+/* One core's share: batches of the current phase's blocks */
+static void alloc_bench_worker(void* arg) {
+    void* blocks[ALLOC_BENCH_BATCH];
+    uint32_t round, i;
+
+    (void)arg;
+    if (smp_processor_id() >= alloc_bench_cpus) {
+        return;
+    }
+
+    for (round = 0; round < ALLOC_BENCH_ROUNDS; round++) {
+        for (i = 0; i < ALLOC_BENCH_BATCH; i++) {
+            blocks[i] = alloc_bench_alloc();
+        }
+        for (i = 0; i < ALLOC_BENCH_BATCH; i++) {
+            if (blocks[i] == NULL) {
+                alloc_bench_failed = 1;
+            } else if (alloc_bench_phase == ALLOC_BENCH_KMALLOC) {
+                kfree(blocks[i]);
+            } else {
+                free_page(blocks[i]);
+            }
+        }
+    }
+}
+
+/**
+ * Allocation throughput on 1 up to every online core, with the per-CPU
+ * magazines off and at their build depth, for single pages with and
+ * without ALLOC_ZERO and for small kmalloc objects. Every core does the
+ * same amount of work, so perfect scaling keeps the cycle count flat as
+ * cores are added. Reported as alloc/free pairs per thousand cycles on the
+ * boot core.
+ */
+void alloc_bench(void) {
+    uint32_t depths[2] = { 0, MAG_DEPTH };
+    uint32_t old_depth, online, phase, d, ncpus, start, cycles, pairs, base = 0, rate;
+
+    old_depth = mem_magazine_depth();
+    online = smp_online_cpus();
+
+    puts("alloc    depth  cpus       cycles  pairs/kcycle  scaling\n");
+    for (phase = 0; phase < ALLOC_BENCH_PHASES; phase++) {
+        alloc_bench_phase = phase;
+        for (d = 0; d < ARRAY_LEN(depths); d++) {
+            mem_set_magazine_depth(depths[d]);
+            for (ncpus = 1; ncpus <= online; ncpus++) {
+                alloc_bench_cpus = ncpus;
+                alloc_bench_failed = 0;
+
+                start = pmu_cycles();
+                smp_call_others(alloc_bench_worker, NULL);
+                alloc_bench_worker(NULL);
+                smp_call_wait();
+                cycles = pmu_cycles() - start;
+
+                if (alloc_bench_failed) {
+                    error("allocbench: out of memory");
+                    mem_set_magazine_depth(old_depth);
+                    return;
+                }
+
+                pairs = ncpus * ALLOC_BENCH_ROUNDS * ALLOC_BENCH_BATCH;
+                rate = pairs * 1000 / (cycles / 100 ? cycles / 100 : 1);
+                if (ncpus == 1) {
+                    base = rate ? rate : 1;
+                }
+                kprintf("%-7s  %5u  %4u  %11u  %9u.%02u  %4u.%02ux\n", alloc_bench_names[phase], depths[d], ncpus,
+                        cycles, rate / 100, rate % 100, rate / base, rate * 100 / base % 100);
+            }
+        }
+    }
+    mem_set_magazine_depth(old_depth);
+}
+
+#define SCHED_BENCH_YIELDS 10000
+
+static volatile uint32_t sched_bench_start;
+static volatile uint32_t sched_bench_end;
+static volatile uint32_t sched_bench_done;
+
+/* Two of these on one core take turns, so every yield is a switch to the other one */
+static void sched_bench_worker(void* arg) {
+    uint32_t i;
+
+    if (arg == NULL) {
+        sched_bench_start = pmu_cycles();
+    }
+    for (i = 0; i < SCHED_BENCH_YIELDS; i++) {
+        thread_yield();
+    }
+    sched_bench_end = pmu_cycles();
+    atomic_add_return(&sched_bench_done, 1);
+}
+
+/**
+ * Context switch latency: two threads pinned to this core ping-pong with
+ * thread_yield(), next to the cost of a yield that finds nothing else to
+ * run. The shell sleeps meanwhile, its rare wakeups add a few switches.
+ */
+void sched_bench(void) {
+    uint32_t i, start, yield_cycles, switch_cycles, cpu = smp_processor_id();
+
+    start = pmu_cycles();
+    for (i = 0; i < SCHED_BENCH_YIELDS; i++) {
+        thread_yield();
+    }
+    yield_cycles = pmu_cycles() - start;
+
+    sched_bench_done = 0;
+    if (thread_create_on("bench0", sched_bench_worker, NULL, SCHED_PRIO_NORMAL, cpu) == NULL ||
+            thread_create_on("bench1", sched_bench_worker, (void*)1, SCHED_PRIO_NORMAL, cpu) == NULL) {
+        error("schedbench: could not create the threads");
+        return;
+    }
+    while (sched_bench_done != 2) {
+        thread_sleep_us(10000);
+    }
+    switch_cycles = sched_bench_end - sched_bench_start;
+
+    kprintf("yield without a switch: %u cycles\n", yield_cycles / SCHED_BENCH_YIELDS);
+    kprintf("yield with a switch:    %u cycles (%u switches)\n", switch_cycles / (2 * SCHED_BENCH_YIELDS),
+            2 * SCHED_BENCH_YIELDS);
+}
+
+/**
+ * The hot path suite behind the 'bench' command. Each case runs one
+ * operation per sample with IRQs masked, reading the cycle counter and the
+ * two event counters around it, and the distribution of each is reported
+ * as min, median and 99th percentile. The cost of reading the counters is
+ * measured first and taken off the cycle counts.
+ */
+
+#define BENCH_SAMPLES 200
+#define BENCH_UART_SAMPLES 32   // Each one prints a line
+#define BENCH_COPY_BYTES 4096
+
+typedef void (*bench_fn_t)(void* arg);
+
+typedef struct bench_case {
+    const char* name;
+    bench_fn_t fn;
+    void* arg;
+    uint32_t samples;
+} bench_case_t;
+
+static uint32_t bench_values[1 + PMU_EVENTS][BENCH_SAMPLES];
+static uint8_t* bench_dst;
+static uint8_t* bench_src;
+
+static const char bench_line[] = "bench: uart_write of one 64 byte line, newline included ......\n";
+
+static void bench_nop(void* arg) {
+    (void)arg;
+}
+
+static void bench_page(void* arg) {
+    (void)arg;
+    free_page(alloc_page());
+}
+
+static void bench_kmalloc(void* arg) {
+    kfree(kmalloc((uint32_t)arg));
+}
+
+static void bench_memcpy(void* arg) {
+    (void)arg;
+    memcpy(bench_dst, bench_src, BENCH_COPY_BYTES);
+}
+
+static void bench_bzero(void* arg) {
+    (void)arg;
+    bzero(bench_dst, BENCH_COPY_BYTES);
+}
+
+static void bench_uart(void* arg) {
+    (void)arg;
+    uart_write(bench_line, sizeof(bench_line) - 1);
+}
+
+/* Into svc_handler() and straight back out, lr_svc is lost to the exception */
+static void bench_svc(void* arg) {
+    (void)arg;
+    asm volatile("svc %0" :: "i"(SVC_NULL) : "lr", "memory");
+}
+
+static const bench_case_t bench_cases[] = {
+    { "alloc+free_page", bench_page, NULL, BENCH_SAMPLES },
+    { "kmalloc+kfree 16", bench_kmalloc, (void*)16, BENCH_SAMPLES },
+    { "kmalloc+kfree 64", bench_kmalloc, (void*)64, BENCH_SAMPLES },
+    { "kmalloc+kfree 256", bench_kmalloc, (void*)256, BENCH_SAMPLES },
+    { "kmalloc+kfree 1K", bench_kmalloc, (void*)1024, BENCH_SAMPLES },
+    { "kmalloc+kfree 4K", bench_kmalloc, (void*)4096, BENCH_SAMPLES },
+    { "memcpy 4K", bench_memcpy, NULL, BENCH_SAMPLES },
+    { "bzero 4K", bench_bzero, NULL, BENCH_SAMPLES },
+    { "uart_write 64B", bench_uart, NULL, BENCH_UART_SAMPLES },
+    { "svc round trip", bench_svc, NULL, BENCH_SAMPLES },
+};
+
+/* Fill bench_values with one column per sample, cycles minus overhead */
+static void bench_measure(const bench_case_t* bc, uint32_t overhead) {
+    pmu_sample_t before, after;
+    uint32_t i, e, flags, cycles;
+
+    // Once untimed, so the first sample doesn't pay for cold caches alone
+    bc->fn(bc->arg);
+
+    for (i = 0; i < bc->samples; i++) {
+        flags = irq_save();
+        pmu_read(&before);
+        bc->fn(bc->arg);
+        pmu_read(&after);
+        irq_restore(flags);
+
+        cycles = after.cycles - before.cycles;
+        bench_values[0][i] = cycles > overhead ? cycles - overhead : 0;
+        for (e = 0; e < PMU_EVENTS; e++) {
+            bench_values[1 + e][i] = after.events[e] - before.events[e];
+        }
+    }
+}
+
+static void sort_u32(uint32_t* values, uint32_t count) {
+    uint32_t i, j, v;
+
+    for (i = 1; i < count; i++) {
+        v = values[i];
+        for (j = i; j > 0 && values[j - 1] > v; j--) {
+            values[j] = values[j - 1];
+        }
+        values[j] = v;
+    }
+}
+
+/* Min, median and 99th percentile of each counter, for one case */
+typedef struct bench_result {
+    uint32_t stats[1 + PMU_EVENTS][3];
+} bench_result_t;
+
+static bench_result_t bench_results[ARRAY_LEN(bench_cases)];
+
+static void bench_summarize(bench_result_t* result, uint32_t samples) {
+    uint32_t m;
+
+    for (m = 0; m < 1 + PMU_EVENTS; m++) {
+        sort_u32(bench_values[m], samples);
+        result->stats[m][0] = bench_values[m][0];
+        result->stats[m][1] = bench_values[m][samples / 2];
+        result->stats[m][2] = bench_values[m][samples * 99 / 100];
+    }
+}
+
+/* Run every case, then print the table, so the UART case's lines don't end up in the middle of it */
+void pmu_bench(void) {
+    bench_case_t calibrate = { "counter overhead", bench_nop, NULL, BENCH_SAMPLES };
+    uint32_t overhead, i, m;
+
+    bench_dst = alloc_pages(1);
+    bench_src = alloc_pages(1);
+    if (bench_dst == NULL || bench_src == NULL) {
+        error("bench: out of memory");
+        free_pages(bench_dst, 1);
+        free_pages(bench_src, 1);
+        return;
+    }
+
+    bench_measure(&calibrate, 0);
+    sort_u32(bench_values[0], BENCH_SAMPLES);
+    overhead = bench_values[0][0];
+
+    for (i = 0; i < ARRAY_LEN(bench_cases); i++) {
+        bench_measure(&bench_cases[i], overhead);
+        bench_summarize(&bench_results[i], bench_cases[i].samples);
+    }
+
+    puts("\n                    cycles                   dcache misses            branch misses\n");
+    puts("benchmark               min  median     p99      min  median     p99      min  median     p99\n");
+    for (i = 0; i < ARRAY_LEN(bench_cases); i++) {
+        kprintf("%-18s", bench_cases[i].name);
+        for (m = 0; m < 1 + PMU_EVENTS; m++) {
+            kprintf("  %7u %7u %7u", bench_results[i].stats[m][0], bench_results[i].stats[m][1],
+                    bench_results[i].stats[m][2]);
+        }
+        puts("\n");
+    }
+    kprintf("(%u cycles of counter reads taken off)\n", overhead);
+
+    free_pages(bench_dst, 1);
+    free_pages(bench_src, 1);
+}
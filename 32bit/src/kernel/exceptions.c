@@ -1,25 +1,82 @@
 #include <common/stdio.h>
+#include <kernel/irq.h>
+#include <kernel/trap.h>
+#include <kernel/ksyms.h>
+#include <kernel/vm.h>
 
-void __attribute__((interrupt("UNDEF"))) undefined_handler(void) {
+static const char* const mode_names[] = {
+    [0x10] = "usr", [0x11] = "fiq", [0x12] = "irq", [0x13] = "svc",
+    [0x17] = "abt", [0x1A] = "hyp", [0x1B] = "und", [0x1F] = "sys",
+};
+
+/* Print the interrupted state, for the handlers that are about to panic */
+void trap_dump(const trap_frame_t* frame) {
+    const char* mode = mode_names[frame->cpsr & 0x1F];
+    uint32_t i, sym;
+
+    for (i = 0; i < 12; i += 4) {
+        kprintf("r%-2u %08x  r%-2u %08x  r%-2u %08x  r%-2u %08x\n", i, frame->r[i], i + 1, frame->r[i + 1],
+                i + 2, frame->r[i + 2], i + 3, frame->r[i + 3]);
+    }
+    kprintf("r12 %08x  sp  %08x  lr  %08x  pc  %08x\n", frame->r[12], frame->sp, frame->lr, frame->pc);
+    kprintf("cpsr %08x (%s mode, IRQs %s)\n", frame->cpsr, mode != NULL ? mode : "bad",
+            frame->cpsr & CPSR_IRQ_MASK ? "masked" : "on");
+    if ((sym = ksym_find(frame->pc)) != KSYM_NONE) {
+        kprintf("pc is at %s+0x%x\n", ksym_name(sym), frame->pc - ksym_addr(sym));
+    }
+}
+
+void undefined_handler(trap_frame_t* frame) {
+    trap_dump(frame);
     panic("Undefined Instruction exception");
 }
 
-void __attribute__((interrupt("SWI"))) svc_handler(void) {
+/* The SVC number is in the instruction before the return address, ARM or Thumb */
+void svc_handler(trap_frame_t* frame) {
+    uint32_t nr;
+
+    if (frame->cpsr & CPSR_THUMB) {
+        nr = *(const uint16_t*)(frame->pc - 2) & 0xFF;
+    } else {
+        nr = *(const uint32_t*)(frame->pc - 4) & 0xFFFFFF;
+    }
+    if (nr == SVC_NULL) {
+        return;
+    }
+
+    trap_dump(frame);
+    kprintf("SVC #%u\n", nr);
     panic("Supervisor Call (SVC) exception");
 }
 
-void __attribute__((interrupt("ABRT"))) prefetch_abort_handler(void) {
+void prefetch_abort_handler(trap_frame_t* frame) {
+    uint32_t ifsr;
+
+    asm volatile("mrc p15, 0, %0, c5, c0, 1" : "=r"(ifsr));
+    trap_dump(frame);
+    kprintf("IFSR %x\n", ifsr);
     panic("Prefetch Abort exception");
 }
 
-void __attribute__((interrupt("ABRT"))) data_abort_handler(void) {
-    panic("Data Abort exception");
-}
+/* Returns only if the access can be retried */
+void data_abort_handler(trap_frame_t* frame) {
+    uint32_t addr, status;
+    char msg[96];
 
-void __attribute__((interrupt("IRQ"))) irq_handler(void) {
-    panic("Unexpected IRQ");
+    asm volatile("mrc p15, 0, %0, c6, c0, 0" : "=r"(addr));
+    asm volatile("mrc p15, 0, %0, c5, c0, 0" : "=r"(status));
+    if (vm_handle_fault(addr, status) == 0) {
+        return;
+    }
+
+    trap_dump(frame);
+    ksnprintf(msg, sizeof(msg), "Data Abort exception at %p accessing %p (DFSR %x)", (void*)frame->pc,
+              (void*)addr, status);
+    panic(msg);
 }
 
-void __attribute__((interrupt("FIQ"))) fiq_handler(void) {
+/* Only reached without the UART FIQ fast path, where nothing routes a FIQ here */
+void fiq_handler(trap_frame_t* frame) {
+    trap_dump(frame);
     panic("Unexpected FIQ");
-}
\ No newline at end of file
+}
@@ -0,0 +1,295 @@
+#include <kernel/irq.h>
+#include <kernel/spinlock.h>
+#include <kernel/smp.h>
+#include <kernel/softirq.h>
+#include <kernel/pmu.h>
+#include <kernel/trace.h>
+#include <kernel/barrier.h>
+#include <common/stdio.h>
+#include <common/stdlib.h>
+
+/**
+ * Per core handling statistics, in cycles. Entry is the time from irq_entry
+ * reading the cycle counter to the handler being called, which covers the
+ * register save, reading the pending registers and any sources handled
+ * before this one in the same exception.
+ */
+typedef struct irq_stat {
+    uint32_t count;
+    uint32_t max_cycles;
+    uint64_t entry_cycles;
+    uint64_t handler_cycles;
+} irq_stat_t;
+
+typedef struct irq_desc {
+    irq_handler_t handler;
+    void* arg;
+    uint32_t flags;
+    const char* name;
+#ifndef NO_IRQSTAT
+    irq_stat_t stats[NR_CPUS];
+#endif
+} irq_desc_t;
+
+static irq_desc_t irq_descs[NR_IRQS];
+
+/* Copy of the enable registers, so the pending banks can be masked to the sources we asked for */
+static uint32_t irq_enabled[3];
+static spinlock_t irq_lock;
+
+static inline uint32_t highest_bit(uint32_t word) {
+    return 31 - __builtin_clz(word);
+}
+
+void interrupts_init(void) {
+    spin_lock_init(&irq_lock, "irq");
+
+    // Start with every source masked, drivers enable what they handle
+    mmio_write(IRQ_DISABLE_1, 0xFFFFFFFF);
+    mmio_write(IRQ_DISABLE_2, 0xFFFFFFFF);
+    mmio_write(IRQ_DISABLE_BASIC, 0xFFFFFFFF);
+}
+
+/* Install the handler for an IRQ, it still has to be enabled. irq_flags takes IRQF_NESTED */
+int irq_register(uint32_t irq, irq_handler_t handler, void* arg, uint32_t irq_flags, const char* name) {
+    irq_desc_t* desc;
+    uint32_t flags;
+
+    if (irq >= NR_IRQS || handler == NULL) {
+        error("irq_register: bad IRQ %u", irq);
+        return -1;
+    }
+    if ((irq_flags & IRQF_NESTED) && irq >= IRQ_BASIC_BASE + 8) {
+        error("irq_register: IRQ %u can't be masked on its own, so it can't nest", irq);
+        return -1;
+    }
+
+    desc = &irq_descs[irq];
+    flags = spin_lock_irqsave(&irq_lock);
+    if (desc->handler != NULL) {
+        spin_unlock_irqrestore(&irq_lock, flags);
+        error("irq_register: IRQ %u is taken by %s", irq, desc->name);
+        return -1;
+    }
+    desc->arg = arg;
+    desc->flags = irq_flags;
+    desc->name = name;
+    barrier();
+    desc->handler = handler;
+    spin_unlock_irqrestore(&irq_lock, flags);
+    return 0;
+}
+
+/* Disables the IRQ first, so the handler isn't called afterwards */
+void irq_unregister(uint32_t irq) {
+    uint32_t flags;
+
+    if (irq >= NR_IRQS) {
+        return;
+    }
+    irq_disable(irq);
+
+    flags = spin_lock_irqsave(&irq_lock);
+    irq_descs[irq].handler = NULL;
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+void irq_enable(uint32_t irq) {
+    uint32_t flags;
+
+    if (irq >= IRQ_BASIC_BASE + 8) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&irq_lock);
+    irq_enabled[irq >> 5] |= 1U << (irq & 31);
+    if (irq >= IRQ_BASIC_BASE) {
+        mmio_write(IRQ_ENABLE_BASIC, 1U << (irq - IRQ_BASIC_BASE));
+    } else {
+        mmio_write(irq < 32 ? IRQ_ENABLE_1 : IRQ_ENABLE_2, 1U << (irq & 31));
+    }
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+void irq_disable(uint32_t irq) {
+    uint32_t flags;
+
+    if (irq >= IRQ_BASIC_BASE + 8) {
+        return;
+    }
+
+    flags = spin_lock_irqsave(&irq_lock);
+    irq_enabled[irq >> 5] &= ~(1U << (irq & 31));
+    if (irq >= IRQ_BASIC_BASE) {
+        mmio_write(IRQ_DISABLE_BASIC, 1U << (irq - IRQ_BASIC_BASE));
+    } else {
+        mmio_write(irq < 32 ? IRQ_DISABLE_1 : IRQ_DISABLE_2, 1U << (irq & 31));
+    }
+    spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+/* Name the handler was registered under, NULL for a free IRQ */
+const char* irq_name(uint32_t irq) {
+    if (irq >= NR_IRQS || irq_descs[irq].handler == NULL) {
+        return NULL;
+    }
+    return irq_descs[irq].name;
+}
+
+static void irq_handle(uint32_t irq, uint32_t start) {
+    irq_desc_t* desc = &irq_descs[irq];
+#ifndef NO_IRQSTAT
+    irq_stat_t* stat = &desc->stats[smp_processor_id()];
+    uint32_t entry, cycles;
+#else
+    (void)start;
+#endif
+
+    if (desc->handler == NULL) {
+#ifndef MODEL_1
+        // Local sources can't be masked from here
+        if (irq >= IRQ_LOCAL_BASE) {
+            error("Local IRQ source %u has no handler", irq - IRQ_LOCAL_BASE);
+            panic("Unexpected local IRQ");
+        }
+#endif
+        irq_disable(irq);
+        error("IRQ %u has no handler, disabled", irq);
+        return;
+    }
+
+#ifndef NO_IRQSTAT
+    entry = pmu_cycles();
+#endif
+    trace(TRACE_IRQ_ENTRY, irq, 0, 0);
+    if (desc->flags & IRQF_NESTED) {
+        irq_disable(irq);
+        enable_interrupts();
+        desc->handler(desc->arg);
+        disable_interrupts();
+        irq_enable(irq);
+    } else {
+        desc->handler(desc->arg);
+    }
+    trace(TRACE_IRQ_EXIT, irq, 0, 0);
+#ifndef NO_IRQSTAT
+    cycles = pmu_cycles() - entry;
+    stat->count++;
+    stat->entry_cycles += entry - start;
+    stat->handler_cycles += cycles;
+    if (cycles > stat->max_cycles) {
+        stat->max_cycles = cycles;
+    }
+#endif
+}
+
+/* Handle every source pending in one 32 bit bank, highest number first */
+static void irq_handle_bank(uint32_t pending, uint32_t base, uint32_t start) {
+    uint32_t bit;
+
+    while (pending != 0) {
+        bit = highest_bit(pending);
+        pending &= ~(1U << bit);
+        irq_handle(base + bit, start);
+    }
+}
+
+/**
+ * The basic pending register says which banks have anything pending, so
+ * at most three reads find every source. Some GPU sources only show up as
+ * shortcut bits in the basic register and not in the bank summary bits,
+ * which is why the bank masks include them.
+ */
+static void irq_dispatch_gpu(uint32_t start) {
+    uint32_t basic = mmio_read(IRQ_BASIC_PENDING);
+
+    if (basic & IRQ_BASIC_BANK_1) {
+        irq_handle_bank(mmio_read(IRQ_PENDING_1) & irq_enabled[0], 0, start);
+    }
+    if (basic & IRQ_BASIC_BANK_2) {
+        irq_handle_bank(mmio_read(IRQ_PENDING_2) & irq_enabled[1], 32, start);
+    }
+    irq_handle_bank(basic & IRQ_BASIC_ARM_MASK & irq_enabled[2], IRQ_BASIC_BASE, start);
+}
+
+/**
+ * Called from irq_entry with interrupts masked, the cycle count at entry
+ * and the interrupted registers, which handlers find in this_cpu(). The
+ * nesting depth keeps sched_irq_exit() from switching threads under a
+ * handler that an inner IRQ interrupted. The outermost level runs whatever
+ * softirqs the handlers raised on the way out.
+ */
+void irq_dispatch(uint32_t start, irq_frame_t* frame) {
+    cpu_data_t* cpu = this_cpu();
+    irq_frame_t* outer = cpu->irq_frame;
+#ifndef MODEL_1
+    uint32_t source;
+#endif
+
+    cpu->irq_depth++;
+    cpu->irq_frame = frame;
+#ifndef MODEL_1
+    source = mmio_read(CORE_IRQ_SOURCE(smp_processor_id())) & CORE_IRQ_SOURCE_MASK;
+
+    // The local timers are the most latency sensitive, they go before the GPU
+    if (source & ~CORE_IRQ_GPU) {
+        irq_handle_bank(source & ~CORE_IRQ_GPU, IRQ_LOCAL_BASE, start);
+    }
+    if (source & CORE_IRQ_GPU) {
+        irq_dispatch_gpu(start);
+    }
+#else
+    irq_dispatch_gpu(start);
+#endif
+    cpu->irq_frame = outer;
+    if (--cpu->irq_depth == 0 && cpu->softirq_pending) {
+        softirq_run();
+    }
+}
+
+void irq_info(void) {
+#ifdef NO_IRQSTAT
+    puts("IRQ statistics are compiled out, rebuild without IRQSTAT=0\n");
+#else
+    irq_desc_t* desc;
+    irq_stat_t total;
+    uint32_t irq, cpu, rem;
+
+    puts("irq  name          ");
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (cpu_data[cpu].online) {
+            kprintf("      cpu%u", cpu);
+        }
+    }
+    puts("     entry   handler       max  (cycles)\n");
+
+    for (irq = 0; irq < NR_IRQS; irq++) {
+        desc = &irq_descs[irq];
+        if (desc->handler == NULL) {
+            continue;
+        }
+
+        kprintf("%3u  %-12s  ", irq, desc->name);
+        bzero(&total, sizeof(total));
+        for (cpu = 0; cpu < NR_CPUS; cpu++) {
+            if (cpu_data[cpu].online) {
+                kprintf("%10u", desc->stats[cpu].count);
+            }
+            total.count += desc->stats[cpu].count;
+            total.entry_cycles += desc->stats[cpu].entry_cycles;
+            total.handler_cycles += desc->stats[cpu].handler_cycles;
+            if (desc->stats[cpu].max_cycles > total.max_cycles) {
+                total.max_cycles = desc->stats[cpu].max_cycles;
+            }
+        }
+
+        if (total.count == 0) {
+            puts("         -         -         -\n");
+            continue;
+        }
+        kprintf("%10llu", div_u64_rem(total.entry_cycles, total.count, &rem));
+        kprintf("%10llu", div_u64_rem(total.handler_cycles, total.count, &rem));
+        kprintf("%10u\n", total.max_cycles);
+    }
+#endif
+}
@@ -12,21 +12,90 @@
  #include <kernel/uart.h>
  #include <kernel/atag.h>
  #include <kernel/mem.h>
+ #include <kernel/slab.h>
+ #include <kernel/pmu.h>
+ #include <kernel/bench.h>
+ #include <kernel/irq.h>
+ #include <kernel/mmu.h>
+ #include <kernel/vm.h>
+ #include <kernel/smp.h>
+ #include <kernel/spinlock.h>
+ #include <kernel/sched.h>
+ #include <kernel/timer.h>
+ #include <kernel/softirq.h>
+ #include <kernel/workqueue.h>
+ #include <kernel/profile.h>
+ #include <kernel/trace.h>
+ #include <kernel/latency.h>
  #include <common/stdio.h>
  #include <common/stdlib.h>
 
+/* How long the shell sleeps between looks at the UART if it can't block for input yet */
+#define SHELL_POLL_US 2000
+
+/* Runs whenever the shell is waiting for input: scrub pages, then block until a key comes in */
+static void kernel_idle(void) {
+    if (!mem_idle_scrub() && !uart_rx_wait()) {
+        thread_sleep_us(SHELL_POLL_US);
+    }
+}
+
+static void print_pool_stats(void) {
+    page_pool_stats_t stats;
+    uint32_t requests;
+
+    mem_pool_stats(&stats);
+    requests = stats.zero_hits + stats.zero_misses;
+
+    kprintf("Zeroed pool: %u pages, dirty pool: %u pages\n", stats.zeroed_pages, stats.dirty_pages);
+    kprintf("Zeroed allocs: %u hits, %u misses (%u%% hit rate)\n", stats.zero_hits, stats.zero_misses,
+            requests ? stats.zero_hits * 100 / requests : 0);
+    kprintf("Dirty reuses: %u, pages scrubbed while idle: %u\n", stats.dirty_reuses, stats.scrubbed);
+    kprintf("Magazines (depth %u): %u pages held, %u hits, %u refills, %u flushes\n", mem_magazine_depth(),
+            stats.mag_pages, stats.mag_hits, stats.mag_refills, stats.mag_flushes);
+}
+
 void kernel_main(uint32_t r0, uint32_t r1, uint32_t atags) {
     char buf[256];
+    uint32_t start;
     (void)buf;
     //init registers as empty
     (void) r0;
     (void) r1;
     (void) atags;
 
+    percpu_init(0);
+
+    // Logged before the console exists, printed once it does
+    info("SimpleOS booting, boot info at %p", (void*)atags);
+
+    // Turn on the MMU and caches first, the before/after numbers go to the log
+    pmu_init();
+    cache_bench("boot, caches off");
+    mmu_init();
+    cache_bench("boot, caches on");
+
     uart_init();
     puts("\nSimpleOS v0.01-alpha\n\n\n");
+    log_console_start();
     info("Initializing Memory Module\n");
+    start = pmu_cycles();
     mem_init((atag_t*)atags);
+    info("mem_init took %u cycles", pmu_cycles() - start);
+    vm_init();
+    sched_init();
+    smp_init();
+    set_idle_hook(kernel_idle);
+
+    // Console output is queued from here on, the UART interrupts drain it
+    interrupts_init();
+    uart_enable_interrupts();
+    enable_interrupts();
+    sched_start();
+    workqueue_init();
+#ifdef BOOT_BENCH
+    pmu_bench();
+#endif
 
 
 
@@ -35,8 +104,8 @@ void kernel_main(uint32_t r0, uint32_t r1, uint32_t atags) {
     info("Testing memory allocation...");
     void* p1 = alloc_page();
     void* h1 = kmalloc(128);
-    puts("Page allocated at 0x"); puts(itoa((uint32_t)p1)); puts("\n");
-    puts("Heap allocated at 0x"); puts(itoa((uint32_t)h1)); puts("\n");
+    kprintf("Page allocated at %p\n", p1);
+    kprintf("Heap allocated at %p\n", h1);
     free_page(p1);
     kfree(h1);
     info("Memory test complete\n");
@@ -45,6 +114,31 @@ void kernel_main(uint32_t r0, uint32_t r1, uint32_t atags) {
     puts("\nType 'test_undef' to trigger Undefined Instruction exception\n");
     puts("Type 'q' to abort SimpleOS and quit HW emulation\n");
     puts("Type 'test_abort' to trigger Data Abort exception\n");
+    puts("Type 'test_buddy' to stress test the page allocator\n");
+    puts("Type 'test_slab' to test the slab object caches\n");
+    puts("Type 'slabinfo' to show slab cache utilization\n");
+    puts("Type 'poolstat' to show zeroed page pool statistics\n");
+    puts("Type 'memperf' to benchmark memcpy/memset\n");
+    puts("Type 'bench' to run the hot path benchmarks with the PMU counters\n");
+    puts("Type 'dmesg' to show the kernel log\n");
+    puts("Type 'test_vm' to test demand paging and copy-on-write\n");
+    puts("Type 'cpus' to list the processor cores\n");
+    puts("Type 'test_locks' to test the spinlocks on every core\n");
+    puts("Type 'lockstat' to show lock contention statistics\n");
+    puts("Type 'allocbench' to measure allocator scaling across cores\n");
+    puts("Type 'threads' to show the run queues\n");
+    puts("Type 'schedbench' to measure context switch latency\n");
+    puts("Type 'timers' to show the timer wheels\n");
+    puts("Type 'test_timers' to test timer expiry and cancellation\n");
+    puts("Type 'irqs' to show interrupt counts and handling cost\n");
+    puts("Type 'softirqs' to show softirq and work queue activity\n");
+    puts("Type 'test_work' to test the work queues\n");
+    puts("Type 'prof_start' and 'prof_stop' to start and stop the sampling profiler\n");
+    puts("Type 'profile' to show where the profiler found the cores busy\n");
+    puts("Type 'trace_on' and 'trace_off' to start and stop event tracing\n");
+    puts("Type 'trace_dump' to write the trace buffers out for 32bit/tools/trace_decode.py\n");
+    puts("Type 'latency' to measure timer interrupt and thread wakeup latency\n");
+    puts("Type 'latency_alloc', 'latency_uart' or 'latency_load' to measure it under allocator, UART or both loads\n");
     puts("Type anything else to echo\n");
 
     while (1) {
@@ -60,10 +154,93 @@ void kernel_main(uint32_t r0, uint32_t r1, uint32_t atags) {
         } else if (strcmp(buf, "test_abort") == 0) {
             puts("Triggering Data Abort...\n");
             *(volatile uint32_t*)0xDEADBEEF = 0xBAD;
+        } else if (strcmp(buf, "test_buddy") == 0) {
+            if (buddy_stress_test()) {
+                info("Buddy allocator test passed");
+            } else {
+                error("Buddy allocator test failed");
+            }
+        } else if (strcmp(buf, "test_slab") == 0) {
+            if (slab_test()) {
+                info("Slab cache test passed");
+            } else {
+                error("Slab cache test failed");
+            }
+        } else if (strcmp(buf, "slabinfo") == 0) {
+            kmem_cache_info();
+        } else if (strcmp(buf, "poolstat") == 0) {
+            print_pool_stats();
+        } else if (strcmp(buf, "memperf") == 0) {
+            memops_bench();
+        } else if (strcmp(buf, "bench") == 0) {
+            pmu_bench();
+        } else if (strcmp(buf, "dmesg") == 0) {
+            log_dump();
+        } else if (strcmp(buf, "test_vm") == 0) {
+            if (vm_test()) {
+                info("Virtual memory test passed");
+            } else {
+                error("Virtual memory test failed");
+            }
+        } else if (strcmp(buf, "cpus") == 0) {
+            smp_info();
+        } else if (strcmp(buf, "test_locks") == 0) {
+            if (lock_test()) {
+                info("Lock test passed");
+            } else {
+                error("Lock test failed");
+            }
+        } else if (strcmp(buf, "lockstat") == 0) {
+            lock_stats_dump();
+        } else if (strcmp(buf, "allocbench") == 0) {
+            alloc_bench();
+        } else if (strcmp(buf, "threads") == 0) {
+            sched_info();
+        } else if (strcmp(buf, "schedbench") == 0) {
+            sched_bench();
+        } else if (strcmp(buf, "timers") == 0) {
+            timer_info();
+        } else if (strcmp(buf, "irqs") == 0) {
+            irq_info();
+        } else if (strcmp(buf, "softirqs") == 0) {
+            softirq_info();
+            workqueue_info();
+        } else if (strcmp(buf, "test_work") == 0) {
+            if (workqueue_test()) {
+                info("Work queue test passed");
+            } else {
+                error("Work queue test failed");
+            }
+        } else if (strcmp(buf, "prof_start") == 0) {
+            if (profile_start() == 0) {
+                info("Profiler started");
+            }
+        } else if (strcmp(buf, "prof_stop") == 0) {
+            profile_stop();
+        } else if (strcmp(buf, "profile") == 0) {
+            profile_report();
+        } else if (strcmp(buf, "trace_on") == 0) {
+            trace_start(TRACE_ALL);
+        } else if (strcmp(buf, "trace_off") == 0) {
+            trace_stop();
+        } else if (strcmp(buf, "trace_dump") == 0) {
+            trace_dump();
+        } else if (strcmp(buf, "latency") == 0) {
+            latency_test(0);
+        } else if (strcmp(buf, "latency_alloc") == 0) {
+            latency_test(LATENCY_LOAD_ALLOC);
+        } else if (strcmp(buf, "latency_uart") == 0) {
+            latency_test(LATENCY_LOAD_UART);
+        } else if (strcmp(buf, "latency_load") == 0) {
+            latency_test(LATENCY_LOAD_ALLOC | LATENCY_LOAD_UART);
+        } else if (strcmp(buf, "test_timers") == 0) {
+            if (timer_test()) {
+                info("Timer test passed");
+            } else {
+                error("Timer test failed");
+            }
         } else {
-            puts("Echo: ");
-            puts(buf);
-            puts("\n");
+            kprintf("Echo: %s\n", buf);
         }
     }
 }
@@ -0,0 +1,378 @@
+#include <kernel/timer.h>
+#include <kernel/spinlock.h>
+#include <kernel/smp.h>
+#include <kernel/irq.h>
+#include <kernel/softirq.h>
+#include <common/stdio.h>
+
+IMPLEMENT_LIST(ktimer);
+
+/* Wheel geometry, in TIMER_RES_US ticks of the wheel clock */
+#define LVL_SHIFT(lvl) ((lvl) * TIMER_WHEEL_CLK_SHIFT)
+#define LVL_GRAN(lvl) (1U << LVL_SHIFT(lvl))
+#define LVL_OFFS(lvl) ((lvl) * TIMER_WHEEL_SIZE)
+#define LVL_MASK (TIMER_WHEEL_SIZE - 1)
+#define LVL_CLK_MASK ((1U << TIMER_WHEEL_CLK_SHIFT) - 1)
+
+/* Smallest distance that goes into level lvl (lvl >= 1) */
+#define LVL_START(lvl) ((TIMER_WHEEL_SIZE - 1U) << (((lvl) - 1) * TIMER_WHEEL_CLK_SHIFT))
+
+/* Distances past the last level are clamped to this, and requeued when they come up early */
+#define WHEEL_TIMEOUT_CUTOFF LVL_START(TIMER_WHEEL_LEVELS)
+#define WHEEL_TIMEOUT_MAX (WHEEL_TIMEOUT_CUTOFF - LVL_GRAN(TIMER_WHEEL_LEVELS - 1))
+
+#define WHEEL_SLOTS (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SIZE)
+#define SLOT_EXPIRED WHEEL_SLOTS
+
+typedef struct timer_base {
+    spinlock_t lock;
+    uint32_t clk;               // Next wheel tick to process
+    uint32_t pending[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE / 32];   // Non-empty slots
+    ktimer_list_t slots[WHEEL_SLOTS];
+    ktimer_list_t expired;      // Collected by timer_run(), callbacks not run yet
+    uint32_t count;             // Timers in the slots and on expired
+    uint64_t next_event_us;     // What the clock event is programmed for, 0 when stopped
+    uint32_t fired;
+    uint32_t events;            // Clock event interrupts taken
+} __attribute__((aligned(64))) timer_base_t;
+
+static timer_base_t timer_bases[NR_CPUS];
+
+static const char* const timer_lock_names[] = { "timers0", "timers1", "timers2", "timers3" };
+
+/* Wheel clock comparisons that survive the 32 bit tick count wrapping */
+static inline int clk_after(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) > 0;
+}
+
+static inline int clk_after_eq(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) >= 0;
+}
+
+/* The first tick at or after a deadline, so a timer is never early */
+static inline uint32_t us_to_clk_up(uint64_t us) {
+    return (uint32_t)((us + TIMER_RES_US - 1) >> TIMER_RES_SHIFT);
+}
+
+/* Widen a wheel tick back to microseconds, taking the high bits from the present */
+static inline uint64_t clk_to_us(uint32_t clk, uint64_t now_us) {
+    uint64_t now_clk = now_us >> TIMER_RES_SHIFT;
+
+    return (now_clk + (int32_t)(clk - (uint32_t)now_clk)) << TIMER_RES_SHIFT;
+}
+
+static inline void slot_mark(timer_base_t* base, uint32_t slot) {
+    base->pending[slot / TIMER_WHEEL_SIZE][(slot & LVL_MASK) >> 5] |= 1U << (slot & 31);
+}
+
+static inline void slot_clear(timer_base_t* base, uint32_t slot) {
+    base->pending[slot / TIMER_WHEEL_SIZE][(slot & LVL_MASK) >> 5] &= ~(1U << (slot & 31));
+}
+
+static inline uint32_t lowest_bit(uint32_t word) {
+    return 31 - __builtin_clz(word & -word);
+}
+
+/**
+ * Slot for a timer due at wheel tick expires, given the wheel is at clk,
+ * and the tick that slot gets processed at. Above level 0 the slot is
+ * rounded up to the level granularity so the timer can't fire early.
+ */
+static uint32_t wheel_slot(uint32_t expires, uint32_t clk, uint32_t* bucket_expiry) {
+    uint32_t delta = expires - clk, lvl;
+
+    if ((int32_t)delta < 0) {
+        *bucket_expiry = clk;
+        return clk & LVL_MASK;
+    }
+    if (delta < LVL_START(1)) {
+        *bucket_expiry = expires;
+        return expires & LVL_MASK;
+    }
+    if (delta >= WHEEL_TIMEOUT_CUTOFF) {
+        expires = clk + WHEEL_TIMEOUT_MAX;
+        delta = WHEEL_TIMEOUT_MAX;
+    }
+
+    for (lvl = 1; lvl < TIMER_WHEEL_LEVELS - 1 && delta >= LVL_START(lvl + 1); lvl++) {
+    }
+    expires = (expires >> LVL_SHIFT(lvl)) + 1;
+    *bucket_expiry = expires << LVL_SHIFT(lvl);
+    return LVL_OFFS(lvl) + (expires & LVL_MASK);
+}
+
+/**
+ * Distance from slot start of level lvl to the next non-empty slot of that
+ * level, wrapping around, or -1 if the level is empty. Each level's bitmap
+ * is two words: look at the bits from start up, then the other word, then
+ * the bits below start.
+ */
+static int level_next_pending(timer_base_t* base, uint32_t lvl, uint32_t start) {
+    uint32_t* map = base->pending[lvl];
+    uint32_t word = start >> 5, upper = ~0U << (start & 31), bits;
+
+    if ((bits = map[word] & upper) != 0) {
+        return ((word << 5) + lowest_bit(bits) - start) & LVL_MASK;
+    }
+    if ((bits = map[word ^ 1]) != 0) {
+        return (((word ^ 1) << 5) + lowest_bit(bits) - start) & LVL_MASK;
+    }
+    if ((bits = map[word] & ~upper) != 0) {
+        return ((word << 5) + lowest_bit(bits) - start) & LVL_MASK;
+    }
+    return -1;
+}
+
+/**
+ * Tick at which the earliest non-empty slot gets processed. A level's
+ * clock moves on to its next slot as soon as the level below has left
+ * slot 0, hence the adjustment when stepping up a level.
+ */
+static uint32_t wheel_next_expiry(timer_base_t* base) {
+    uint32_t clk = base->clk, next = base->clk + WHEEL_TIMEOUT_CUTOFF, lvl, tmp, adj;
+    int pos;
+
+    for (lvl = 0; lvl < TIMER_WHEEL_LEVELS; lvl++) {
+        pos = level_next_pending(base, lvl, clk & LVL_MASK);
+        if (pos >= 0) {
+            tmp = (clk + pos) << LVL_SHIFT(lvl);
+            if (clk_after(next, tmp)) {
+                next = tmp;
+            }
+        }
+        adj = clk & LVL_CLK_MASK ? 1 : 0;
+        clk >>= TIMER_WHEEL_CLK_SHIFT;
+        clk += adj;
+    }
+    return next;
+}
+
+/**
+ * Bring an idle wheel's clock up to now before adding a timer, otherwise
+ * the distance would be measured from a stale clock and put the timer in a
+ * coarser level than it needs.
+ */
+static void wheel_forward(timer_base_t* base, uint32_t now) {
+    uint32_t next;
+
+    if (!clk_after(now, base->clk)) {
+        return;
+    }
+    next = base->count ? wheel_next_expiry(base) : now;
+    if (clk_after_eq(next, now)) {
+        base->clk = now;
+    } else if (clk_after(next, base->clk)) {
+        base->clk = next;
+    }
+}
+
+static uint32_t wheel_enqueue(timer_base_t* base, ktimer_t* timer) {
+    uint32_t bucket_expiry;
+
+    timer->slot = wheel_slot(us_to_clk_up(timer->deadline_us), base->clk, &bucket_expiry);
+    append_ktimer_list(&base->slots[timer->slot], timer);
+    slot_mark(base, timer->slot);
+    base->count++;
+    timer->base = base;
+    return bucket_expiry;
+}
+
+static void wheel_dequeue(timer_base_t* base, ktimer_t* timer) {
+    if (timer->slot == SLOT_EXPIRED) {
+        remove_ktimer_list(&base->expired, timer);
+    } else {
+        remove_ktimer_list(&base->slots[timer->slot], timer);
+        if (size_ktimer_list(&base->slots[timer->slot]) == 0) {
+            slot_clear(base, timer->slot);
+        }
+    }
+    base->count--;
+    timer->base = NULL;
+}
+
+/* Move the slots due at base->clk, one per level at most, to the expired list */
+static void wheel_collect(timer_base_t* base) {
+    uint32_t clk = base->clk, lvl, slot;
+    ktimer_t* timer;
+
+    for (lvl = 0; lvl < TIMER_WHEEL_LEVELS; lvl++) {
+        slot = LVL_OFFS(lvl) + (clk & LVL_MASK);
+        if (base->pending[lvl][(slot & LVL_MASK) >> 5] & (1U << (slot & 31))) {
+            while ((timer = pop_ktimer_list(&base->slots[slot])) != NULL) {
+                timer->slot = SLOT_EXPIRED;
+                append_ktimer_list(&base->expired, timer);
+            }
+            slot_clear(base, slot);
+        }
+        // The next level only moves when this one wraps back to slot 0
+        if (clk & LVL_CLK_MASK) {
+            break;
+        }
+        clk >>= TIMER_WHEEL_CLK_SHIFT;
+    }
+}
+
+/* Program the clock event for the earliest slot, or stop it, base->lock must be held */
+static void wheel_program(timer_base_t* base, uint64_t now_us) {
+    if (base->count == 0) {
+        base->next_event_us = 0;
+        clockevent_stop();
+        return;
+    }
+    base->next_event_us = clk_to_us(wheel_next_expiry(base), now_us);
+    clockevent_program(base->next_event_us);
+}
+
+void timer_wheel_init(void) {
+    uint32_t cpu, slot, now = timer_now_us() >> TIMER_RES_SHIFT;
+    timer_base_t* base;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        base = &timer_bases[cpu];
+        spin_lock_init(&base->lock, timer_lock_names[cpu]);
+        for (slot = 0; slot < WHEEL_SLOTS; slot++) {
+            INITIALIZE_LIST(base->slots[slot]);
+        }
+        INITIALIZE_LIST(base->expired);
+        base->clk = now;
+    }
+    open_softirq(SOFTIRQ_TIMER, timer_run, "timer");
+}
+
+/**
+ * Call fn(arg) from the timer softirq on this core once deadline_us has
+ * passed. A timer that is already pending is moved to the new deadline.
+ */
+void timer_add(ktimer_t* timer, uint64_t deadline_us, timer_fn_t fn, void* arg) {
+    timer_base_t* base;
+    uint64_t now_us, expiry_us;
+    uint32_t flags;
+
+    timer_cancel(timer);
+
+    flags = irq_save();
+    base = &timer_bases[smp_processor_id()];
+    timer->deadline_us = deadline_us;
+    timer->fn = fn;
+    timer->arg = arg;
+
+    spin_lock(&base->lock);
+    now_us = timer_now_us();
+    wheel_forward(base, now_us >> TIMER_RES_SHIFT);
+    expiry_us = clk_to_us(wheel_enqueue(base, timer), now_us);
+
+    // Only an earlier deadline needs the hardware touched
+    if (base->next_event_us == 0 || expiry_us < base->next_event_us) {
+        base->next_event_us = expiry_us;
+        clockevent_program(expiry_us);
+    }
+    spin_unlock(&base->lock);
+    irq_restore(flags);
+}
+
+/**
+ * Take a timer off its wheel, returns 1 if it was pending. A timer whose
+ * callback is already running on another core is not waited for.
+ */
+int timer_cancel(ktimer_t* timer) {
+    timer_base_t* base = timer->base;
+    uint32_t flags;
+    int ret = 0;
+
+    if (base == NULL) {
+        return 0;
+    }
+
+    flags = spin_lock_irqsave(&base->lock);
+    // It may have fired or moved while the lock was being taken
+    if (timer->base == base) {
+        wheel_dequeue(base, timer);
+        ret = 1;
+    }
+    spin_unlock_irqrestore(&base->lock, flags);
+    return ret;
+}
+
+int timer_pending(ktimer_t* timer) {
+    return timer->base != NULL;
+}
+
+/**
+ * Run everything that is due on this core, the SOFTIRQ_TIMER handler the
+ * clock event interrupt raises. Callbacks run with IRQs unmasked, so the
+ * lock is taken with them masked, as a hard IRQ handler may add a timer.
+ * A wheel that slept through a long idle stretch jumps straight to its
+ * next non-empty slot instead of stepping through every tick in between.
+ */
+void timer_run(void) {
+    timer_base_t* base = &timer_bases[smp_processor_id()];
+    uint64_t now_us;
+    uint32_t now, next, flags;
+    ktimer_t* timer;
+
+    flags = spin_lock_irqsave(&base->lock);
+    base->events++;
+    now_us = timer_now_us();
+    now = now_us >> TIMER_RES_SHIFT;
+
+    while (clk_after_eq(now, base->clk)) {
+        if (clk_after(now, base->clk)) {
+            next = base->count ? wheel_next_expiry(base) : now + 1;
+            if (clk_after(next, now)) {
+                base->clk = now + 1;
+                break;
+            }
+            if (clk_after(next, base->clk)) {
+                base->clk = next;
+            }
+        }
+
+        wheel_collect(base);
+        base->clk++;
+
+        while ((timer = peek_ktimer_list(&base->expired)) != NULL) {
+            wheel_dequeue(base, timer);
+
+            // Clamped timers from past the last level come round early, put them back
+            if (timer->deadline_us > now_us) {
+                wheel_enqueue(base, timer);
+                continue;
+            }
+
+            base->fired++;
+            spin_unlock_irqrestore(&base->lock, flags);
+            timer->fn(timer->arg);
+            flags = spin_lock_irqsave(&base->lock);
+        }
+    }
+
+    wheel_program(base, now_us);
+    spin_unlock_irqrestore(&base->lock, flags);
+}
+
+void timer_info(void) {
+    timer_base_t* base;
+    uint64_t now = timer_now_us(), next;
+    uint32_t cpu, flags, count, fired, events;
+
+    puts("cpu  pending       fired      events  next event in (us)\n");
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (!cpu_data[cpu].online) {
+            continue;
+        }
+
+        base = &timer_bases[cpu];
+        flags = spin_lock_irqsave(&base->lock);
+        count = base->count;
+        fired = base->fired;
+        events = base->events;
+        next = base->next_event_us;
+        spin_unlock_irqrestore(&base->lock, flags);
+
+        if (next == 0) {
+            kprintf("%3u  %7u  %10u  %10u  stopped\n", cpu, count, fired, events);
+        } else {
+            kprintf("%3u  %7u  %10u  %10u  %lld\n", cpu, count, fired, events, (int64_t)(next - now));
+        }
+    }
+}
@@ -0,0 +1,413 @@
+#include <kernel/latency.h>
+#include <kernel/timer.h>
+#include <kernel/sched.h>
+#include <kernel/irq.h>
+#include <kernel/mem.h>
+#include <kernel/smp.h>
+#include <kernel/uart.h>
+#include <kernel/atomic.h>
+#include <kernel/barrier.h>
+#include <common/stdio.h>
+#include <common/stdlib.h>
+
+#ifdef MODEL_1
+    #define LATENCY_CHANNEL 3
+    #define LATENCY_IRQ IRQ_SYSTEM_TIMER(LATENCY_CHANNEL)
+#elif defined(GENTIMER_PHYS_EVENT)
+    #define LATENCY_GENTIMER GENTIMER_VIRT
+    #define LATENCY_IRQ_ROUTE CORE_TIMER_CNTV_IRQ
+    #define LATENCY_IRQ IRQ_LOCAL(3)
+#else
+    #define LATENCY_GENTIMER GENTIMER_PHYS
+    #define LATENCY_IRQ_ROUTE CORE_TIMER_CNTPNS_IRQ
+    #define LATENCY_IRQ IRQ_LOCAL(1)
+#endif
+
+/* Deadlines closer than this when the thread gets round to arming the timer count as missed */
+#define LATENCY_MIN_AHEAD_US 20
+
+typedef struct latency_hist {
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint32_t overflows;
+    uint32_t count;
+    uint32_t min_ns;
+    uint32_t max_ns;
+    uint64_t total_ns;
+} latency_hist_t;
+
+/* Written by its own core's thread and timer IRQ, the shell only reads it */
+typedef struct latency_cpu {
+    thread_t* thread;
+    uint64_t deadline;          // Clock ticks
+    volatile uint32_t armed;
+    uint32_t irq_ticks;         // How late the handler ran
+    uint32_t missed;            // Periods skipped because the thread was still busy when they came
+    latency_hist_t irq;
+    latency_hist_t wake;
+} __attribute__((aligned(64))) latency_cpu_t;
+
+static latency_cpu_t latency_cpus[NR_CPUS];
+static latency_hist_t latency_all_irq, latency_all_wake;
+static volatile uint32_t latency_running;
+static volatile uint32_t latency_loading;
+static volatile uint32_t latency_exited;
+static uint32_t latency_clock_hz;
+static uint32_t latency_period_ticks;
+static uint32_t latency_min_ahead_ticks;
+
+static inline uint64_t latency_clock(void) {
+#ifdef MODEL_1
+    return timer_now_us();
+#else
+    return gentimer_count();
+#endif
+}
+
+/* Interrupt this core at deadline, with IRQs masked and the deadline at least LATENCY_MIN_AHEAD_US out */
+static void latency_arm(uint64_t deadline) {
+#ifdef MODEL_1
+    systimer_set_compare(LATENCY_CHANNEL, (uint32_t)deadline);
+#else
+    gentimer_start_at(LATENCY_GENTIMER, deadline);
+#endif
+}
+
+static void latency_disarm(void) {
+#ifdef MODEL_1
+    systimer_set_compare(LATENCY_CHANNEL, mmio_read(SYSTEM_TIMER_CLO) - 1);
+    systimer_ack(LATENCY_CHANNEL);
+#else
+    gentimer_stop(LATENCY_GENTIMER);
+#endif
+}
+
+/* The timer interrupt, with IRQs masked: how late it is, then hand over to the thread */
+static void latency_handler(void* arg) {
+    uint64_t now = latency_clock();
+    latency_cpu_t* cpu = &latency_cpus[smp_processor_id()];
+    (void)arg;
+
+#ifdef MODEL_1
+    systimer_ack(LATENCY_CHANNEL);
+#else
+    gentimer_stop(LATENCY_GENTIMER);
+#endif
+    if (cpu->armed) {
+        cpu->armed = 0;
+        cpu->irq_ticks = now > cpu->deadline ? now - cpu->deadline : 0;
+        thread_wake(cpu->thread);
+    }
+}
+
+static uint32_t ticks_to_ns(uint64_t ticks) {
+#ifdef MODEL_1
+    uint64_t ns = ticks * 1000;
+#else
+    uint32_t rem;
+    uint64_t ns = div_u64_rem(ticks * 1000000000, latency_clock_hz, &rem);
+#endif
+
+    return ns > 0xFFFFFFFF ? 0xFFFFFFFF : ns;
+}
+
+static void latency_record(latency_hist_t* hist, uint64_t ticks) {
+    uint32_t ns = ticks_to_ns(ticks), us = ns / 1000;
+
+    if (us < LATENCY_BUCKETS) {
+        hist->buckets[us]++;
+    } else {
+        hist->overflows++;
+    }
+    if (hist->count == 0 || ns < hist->min_ns) {
+        hist->min_ns = ns;
+    }
+    if (ns > hist->max_ns) {
+        hist->max_ns = ns;
+    }
+    hist->total_ns += ns;
+    hist->count++;
+}
+
+/**
+ * The measuring thread, pinned to its core at realtime priority. It marks
+ * itself blocked before arming the timer, so an interrupt that comes
+ * before thread_block() can't be lost.
+ */
+static void latency_thread(void* arg) {
+    latency_cpu_t* cpu = arg;
+    uint64_t now;
+    uint32_t flags;
+
+    cpu->thread = thread_current();
+#ifndef MODEL_1
+    flags = irq_save();
+    mmio_write(CORE_TIMER_IRQCNTL(smp_processor_id()),
+               mmio_read(CORE_TIMER_IRQCNTL(smp_processor_id())) | LATENCY_IRQ_ROUTE);
+    irq_restore(flags);
+#endif
+
+    cpu->deadline = latency_clock() + latency_period_ticks;
+    while (latency_running) {
+        thread_prepare_block();
+        flags = irq_save();
+        now = latency_clock();
+        while (cpu->deadline < now + latency_min_ahead_ticks) {
+            cpu->deadline += latency_period_ticks;
+            cpu->missed++;
+        }
+        cpu->armed = 1;
+        latency_arm(cpu->deadline);
+        irq_restore(flags);
+        thread_block();
+
+        now = latency_clock();
+        latency_record(&cpu->irq, cpu->irq_ticks);
+        latency_record(&cpu->wake, now - cpu->deadline);
+        cpu->deadline += latency_period_ticks;
+    }
+
+    flags = irq_save();
+    latency_disarm();
+#ifndef MODEL_1
+    mmio_write(CORE_TIMER_IRQCNTL(smp_processor_id()),
+               mmio_read(CORE_TIMER_IRQCNTL(smp_processor_id())) & ~LATENCY_IRQ_ROUTE);
+#endif
+    irq_restore(flags);
+    atomic_add_return(&latency_exited, 1);
+}
+
+static uint32_t latency_rand(uint32_t* seed) {
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+#define LATENCY_KMALLOC 0xFF
+
+/* Allocator load: hold LATENCY_ALLOC_HELD random blocks and keep replacing a random one */
+static void latency_alloc_load(void* arg) {
+    void* blocks[LATENCY_ALLOC_HELD] = { NULL };
+    uint8_t kinds[LATENCY_ALLOC_HELD] = { 0 };
+    uint32_t seed = 0xA110C + (uint32_t)arg, i, r;
+
+    while (latency_loading) {
+        i = latency_rand(&seed) % LATENCY_ALLOC_HELD;
+        if (kinds[i] == LATENCY_KMALLOC) {
+            kfree(blocks[i]);
+        } else {
+            free_pages(blocks[i], kinds[i]);
+        }
+
+        r = latency_rand(&seed);
+        if (r & 1) {
+            kinds[i] = (r >> 1) % (LATENCY_ALLOC_MAX_ORDER + 1);
+            blocks[i] = alloc_pages(kinds[i]);
+        } else {
+            kinds[i] = LATENCY_KMALLOC;
+            blocks[i] = kmalloc(16 + (r >> 1) % LATENCY_ALLOC_MAX_BYTES);
+        }
+    }
+
+    for (i = 0; i < LATENCY_ALLOC_HELD; i++) {
+        if (kinds[i] == LATENCY_KMALLOC) {
+            kfree(blocks[i]);
+        } else {
+            free_pages(blocks[i], kinds[i]);
+        }
+    }
+    atomic_add_return(&latency_exited, 1);
+}
+
+static const char latency_uart_line[] = "latency: UART load, one line after another as fast as they drain ....\n";
+
+/* UART load: keep the TX ring full */
+static void latency_uart_load(void* arg) {
+    (void)arg;
+    while (latency_loading) {
+        uart_write(latency_uart_line, sizeof(latency_uart_line) - 1);
+    }
+    atomic_add_return(&latency_exited, 1);
+}
+
+static void latency_merge(latency_hist_t* total, const latency_hist_t* hist) {
+    uint32_t i;
+
+    if (hist->count == 0) {
+        return;
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        total->buckets[i] += hist->buckets[i];
+    }
+    total->overflows += hist->overflows;
+    if (total->count == 0 || hist->min_ns < total->min_ns) {
+        total->min_ns = hist->min_ns;
+    }
+    if (hist->max_ns > total->max_ns) {
+        total->max_ns = hist->max_ns;
+    }
+    total->total_ns += hist->total_ns;
+    total->count += hist->count;
+}
+
+/* Upper edge in us of the bucket holding the given per mille rank, LATENCY_BUCKETS if it overflowed */
+static uint32_t latency_percentile(const latency_hist_t* hist, uint32_t permille) {
+    uint32_t rank, rem, seen = 0, i;
+
+    rank = div_u64_rem((uint64_t)hist->count * permille + 999, 1000, &rem);
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            return i + 1;
+        }
+    }
+    return LATENCY_BUCKETS;
+}
+
+static void print_us(uint32_t ns) {
+    kprintf("  %5u.%02u", ns / 1000, ns % 1000 / 10);
+}
+
+static void latency_print(const char* label, const char* kind, const latency_hist_t* hist) {
+    uint32_t rem;
+
+    if (hist->count == 0) {
+        return;
+    }
+    kprintf("%-4s %-5s %9u", label, kind, hist->count);
+    print_us(hist->min_ns);
+    print_us(div_u64_rem(hist->total_ns, hist->count, &rem));
+    kprintf("  %6u  %6u  %6u", latency_percentile(hist, 500), latency_percentile(hist, 990),
+            latency_percentile(hist, 999));
+    print_us(hist->max_ns);
+    puts("\n");
+}
+
+/* Both histograms over every core, in power of two ranges */
+static void latency_print_hist(void) {
+    uint32_t lo, hi, i, irq, wake;
+
+    puts("\n      range (us)        irq       wake\n");
+    for (lo = 0, hi = 1; lo < LATENCY_BUCKETS; lo = hi, hi *= 2) {
+        if (hi > LATENCY_BUCKETS) {
+            hi = LATENCY_BUCKETS;
+        }
+        irq = wake = 0;
+        for (i = lo; i < hi; i++) {
+            irq += latency_all_irq.buckets[i];
+            wake += latency_all_wake.buckets[i];
+        }
+        if (irq != 0 || wake != 0) {
+            kprintf("  %5u - %-5u  %10u %10u\n", lo, hi, irq, wake);
+        }
+    }
+    if (latency_all_irq.overflows != 0 || latency_all_wake.overflows != 0) {
+        kprintf("  %5u or more  %10u %10u\n", LATENCY_BUCKETS, latency_all_irq.overflows,
+                latency_all_wake.overflows);
+    }
+}
+
+static void latency_report(void) {
+    char label[8];
+    uint32_t cpu, missed = 0;
+
+    bzero(&latency_all_irq, sizeof(latency_all_irq));
+    bzero(&latency_all_wake, sizeof(latency_all_wake));
+
+    puts("\ncpu  what    samples      min      avg     p50     p99   p99.9      max  (us)\n");
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        ksnprintf(label, sizeof(label), "%u", cpu);
+        latency_print(label, "irq", &latency_cpus[cpu].irq);
+        latency_print(label, "wake", &latency_cpus[cpu].wake);
+        latency_merge(&latency_all_irq, &latency_cpus[cpu].irq);
+        latency_merge(&latency_all_wake, &latency_cpus[cpu].wake);
+        missed += latency_cpus[cpu].missed;
+    }
+    latency_print("all", "irq", &latency_all_irq);
+    latency_print("all", "wake", &latency_all_wake);
+    kprintf("(irq is the timer handler against the deadline, wake the thread back on its core, %u periods missed)\n",
+            missed);
+    latency_print_hist();
+}
+
+/* Worst case on any core so far, for the progress lines */
+static void latency_worst(uint32_t* irq_ns, uint32_t* wake_ns) {
+    uint32_t cpu;
+
+    *irq_ns = *wake_ns = 0;
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (latency_cpus[cpu].irq.max_ns > *irq_ns) {
+            *irq_ns = latency_cpus[cpu].irq.max_ns;
+        }
+        if (latency_cpus[cpu].wake.max_ns > *wake_ns) {
+            *wake_ns = latency_cpus[cpu].wake.max_ns;
+        }
+    }
+}
+
+/**
+ * Run the measurement for LATENCY_SECONDS with the given LATENCY_LOAD_*
+ * background load, printing the worst case so far every second, then the
+ * per-core statistics and the histograms.
+ */
+void latency_test(uint32_t loads) {
+    uint32_t cpu, threads = 0, second, irq_ns, wake_ns, rem;
+
+    if (irq_register(LATENCY_IRQ, latency_handler, NULL, 0, "latency") != 0) {
+        return;
+    }
+#ifdef MODEL_1
+    latency_clock_hz = 1000000;
+#else
+    latency_clock_hz = gentimer_freq();
+#endif
+    latency_period_ticks = div_u64_rem((uint64_t)latency_clock_hz * LATENCY_PERIOD_US, 1000000, &rem);
+    latency_min_ahead_ticks = div_u64_rem((uint64_t)latency_clock_hz * LATENCY_MIN_AHEAD_US, 1000000, &rem);
+
+    bzero(latency_cpus, sizeof(latency_cpus));
+    latency_exited = 0;
+    latency_running = 1;
+    latency_loading = 1;
+    dmb();
+#ifdef MODEL_1
+    latency_disarm();
+    irq_enable(LATENCY_IRQ);
+#endif
+
+    kprintf("latency: %u s of %u us periods on %u cores, load:%s%s%s\n", LATENCY_SECONDS, LATENCY_PERIOD_US,
+            smp_online_cpus(), loads & LATENCY_LOAD_ALLOC ? " allocator" : "",
+            loads & LATENCY_LOAD_UART ? " UART" : "", loads == 0 ? " none" : "");
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (!cpu_data[cpu].online) {
+            continue;
+        }
+        if ((loads & LATENCY_LOAD_ALLOC) &&
+                thread_create_on("alloc_load", latency_alloc_load, (void*)cpu, SCHED_PRIO_LOW, cpu) != NULL) {
+            threads++;
+        }
+        if (thread_create_on("latency", latency_thread, &latency_cpus[cpu], SCHED_PRIO_REALTIME, cpu) != NULL) {
+            threads++;
+        } else {
+            error("latency: could not start the thread on cpu %u", cpu);
+        }
+    }
+    if ((loads & LATENCY_LOAD_UART) && thread_create("uart_load", latency_uart_load, NULL, SCHED_PRIO_LOW) != NULL) {
+        threads++;
+    }
+
+    for (second = 1; second <= LATENCY_SECONDS; second++) {
+        thread_sleep_us(1000000);
+        latency_worst(&irq_ns, &wake_ns);
+        kprintf("latency: %u s, max irq %u.%02u us, wake %u.%02u us\n", second, irq_ns / 1000,
+                irq_ns % 1000 / 10, wake_ns / 1000, wake_ns % 1000 / 10);
+    }
+
+    // The measuring threads see this at their next period
+    latency_running = 0;
+    latency_loading = 0;
+    while (latency_exited != threads) {
+        thread_sleep_us(10000);
+    }
+    irq_unregister(LATENCY_IRQ);
+
+    latency_report();
+}
@@ -0,0 +1,70 @@
+#include <kernel/spinlock.h>
+#include <kernel/smp.h>
+#include <kernel/pmu.h>
+#include <common/stdio.h>
+
+/**
+ * Lock self test: every online core increments a shared counter under the
+ * lock. Any lost update means the lock let two cores in at once.
+ */
+
+#define LOCK_TEST_ITERATIONS 20000
+
+static spinlock_t test_ticket_lock;
+static mcs_lock_t test_mcs_lock;
+static volatile uint32_t test_counter;
+
+static void ticket_worker(void* arg) {
+    uint32_t i;
+
+    (void)arg;
+    for (i = 0; i < LOCK_TEST_ITERATIONS; i++) {
+        spin_lock(&test_ticket_lock);
+        test_counter++;
+        spin_unlock(&test_ticket_lock);
+    }
+}
+
+static void mcs_worker(void* arg) {
+    mcs_node_t node;
+    uint32_t i;
+
+    (void)arg;
+    for (i = 0; i < LOCK_TEST_ITERATIONS; i++) {
+        mcs_lock(&test_mcs_lock, &node);
+        test_counter++;
+        mcs_unlock(&test_mcs_lock, &node);
+    }
+}
+
+static int lock_test_run(const char* name, void (*worker)(void* arg)) {
+    uint32_t cpus, start, cycles, expected;
+
+    test_counter = 0;
+    start = pmu_cycles();
+    cpus = smp_call_others(worker, NULL) + 1;
+    worker(NULL);
+    smp_call_wait();
+    cycles = pmu_cycles() - start;
+
+    expected = cpus * LOCK_TEST_ITERATIONS;
+    kprintf("%s: %u cpus, %u increments in %u cycles (%u per increment)\n", name, cpus, test_counter, cycles,
+            cycles / expected);
+    if (test_counter != expected) {
+        error("%s lock lost updates: counter is %u, expected %u", name, test_counter, expected);
+        return 0;
+    }
+    return 1;
+}
+
+int lock_test(void) {
+    int ok;
+
+    spin_lock_init(&test_ticket_lock, "test_ticket");
+    mcs_lock_init(&test_mcs_lock, "test_mcs");
+
+    ok = lock_test_run("ticket", ticket_worker);
+    ok &= lock_test_run("mcs", mcs_worker);
+    lock_stats_dump();
+    return ok;
+}
@@ -1,178 +1,1254 @@
 #include <kernel/mem.h>
+#include <kernel/peripheral.h>
+#include <kernel/spinlock.h>
+#include <kernel/slab.h>
+#include <kernel/smp.h>
+#include <kernel/trace.h>
 #include <common/stdio.h>
 
-extern uint8_t __end;
 static uint32_t num_pages;
 
-DEFINE_LIST(page);
-IMPLEMENT_LIST(page);
+/**
+ * Page frame n is at ram_base + n * PAGE_SIZE. RAM starts at physical
+ * address 0 and is identity mapped, the host build puts an arena in its
+ * place.
+ */
+#ifdef HOST_BUILD
+static uintptr_t ram_base;
+#else
+    #define ram_base 0
+#endif
 
 static page_t* all_pages_array;
-page_list_t free_pages;
 
-static heap_segment_t *heap_segment_list_head;
-static void heap_init(uint32_t heap_start);
+_Static_assert(sizeof(page_t) == 8, "page_t must stay 8 bytes");
 
-void mem_init(atag_t* atags) {
-    uint32_t mem_size = 1UL << 30;  // Fixed 1 GiB - exact match for Raspberry Pi 2B and qemu -m 1024
-    uint32_t page_array_len, kernel_pages, page_array_end, i;
+DEFINE_INDEX_LIST(page);
+IMPLEMENT_INDEX_LIST(page, all_pages_array, PAGE_NONE);
 
-    /* Silence unused parameter warning and print the (likely garbage) ATAG pointer for debug */
-    (void)atags;
+/* One free list per block order, each holding the head page of every free block */
+static page_list_t free_area[MAX_ORDER];
 
-    puts("[DEBUG] mem_init: raw ATAGs pointer from r2 = ");
-    puthex((uint32_t)atags);
-    puts("\n");
+/**
+ * Single pages go through two pools in front of the buddy allocator.
+ * zeroed_pages holds frames that were scrubbed ahead of time by the idle
+ * loop, so alloc_page() normally hands out a zeroed frame without touching
+ * it. free_page() puts frames on dirty_pages, and they are either reused by
+ * callers that don't need zeroed memory or scrubbed lazily later on.
+ * Pool pages are neither allocated nor on a buddy free list, so the buddy
+ * allocator never merges them.
+ */
+static page_list_t zeroed_pages;
+static page_list_t dirty_pages;
+static page_pool_stats_t pool_stats;
 
-    puts("[DEBUG] Using fixed 1 GiB physical memory size (safe for QEMU and real Pi 2B)\n");
+/**
+ * Free RAM is handed to the buddy allocator lazily. At boot only the
+ * unaligned pages at either end of [first_free_pfn, num_pages) become free
+ * blocks; the max order aligned middle [lazy_next_pfn, lazy_end_pfn) is
+ * released one max order block at a time when the free areas run dry.
+ * Descriptors are only ever read for pages that have been released, so
+ * nothing has to be cleared up front.
+ */
+static uint32_t first_free_pfn;
+static uint32_t lazy_next_pfn;
+static uint32_t lazy_end_pfn;
 
-    puts("[DEBUG] Total memory = ");
-    puthex(mem_size);
-    puts(" bytes\n");
+/**
+ * zone_lock covers the free areas, the page pools, the lazy range and the
+ * page descriptors of everything above first_free_pfn. Every core
+ * allocates pages, so it is a queue lock. Zeroing happens outside it.
+ * heap_lock covers the kmalloc heap. A slab cache's lock is taken before
+ * zone_lock, the per-CPU magazines need no lock at all.
+ */
+static mcs_lock_t zone_lock;
+static spinlock_t heap_lock;
 
-    num_pages = mem_size / PAGE_SIZE;
+/**
+ * A core's page magazine, two stacks kept apart so ALLOC_ZERO requests get
+ * pre-zeroed pages whenever there are any. The zeroed stack only holds
+ * pages from the zeroed pool, the dirty stack pages freed on this core or
+ * taken from the dirty pool. Once a stack and its pool are both empty the
+ * request takes from the other stack, zeroing outside any lock if it has
+ * to, and only goes to the buddy allocator when both stacks are empty.
+ * Magazine pages are neither allocated nor on a buddy free list, like
+ * pool pages. Only the owning core touches its magazine, always with IRQs
+ * masked.
+ */
+typedef struct {
+    uint32_t count;
+    void* pages[MAG_DEPTH];
+} page_stack_t;
 
-    puts("[DEBUG] Total pages = ");
-    puthex(num_pages);
-    puts("\n");
+typedef struct {
+    page_stack_t zeroed;
+    page_stack_t dirty;
+    uint32_t zero_hits;
+    uint32_t zero_misses;
+    uint32_t dirty_reuses;
+    uint32_t hits;
+    uint32_t refills;
+    uint32_t flushes;
+} page_magazine_t;
 
-    page_array_len = sizeof(page_t) * num_pages;
-    all_pages_array = (page_t*)&__end;
+static page_magazine_t page_mags[NR_CPUS];
+static volatile uint32_t mag_depth = MAG_DEPTH;
 
-    /* Zero the entire page metadata array */
-    bzero(all_pages_array, page_array_len);
+/* kmalloc size classes 32, 64, 128 and 256 bytes */
+#define KMALLOC_MIN_SHIFT 5
+#define KMALLOC_CACHES 4
 
-    INITIALIZE_LIST(free_pages);
+static kmem_cache_t* kmalloc_caches[KMALLOC_CACHES];
+static const char* const kmalloc_cache_names[KMALLOC_CACHES] = {
+    "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256"
+};
+static uintptr_t heap_base;
 
-    /* Mark kernel image pages */
-    kernel_pages = ((uint32_t)&__end) / PAGE_SIZE;
-    for (i = 0; i < kernel_pages; i++) {
-        all_pages_array[i].vaddr_mapped = i * PAGE_SIZE;
-        all_pages_array[i].flags.allocated = 1;
-        all_pages_array[i].flags.kernel_page = 1;
-    }
+#define MAX_BLOCK_PAGES (1U << (MAX_ORDER - 1))
+
+static void heap_init(uintptr_t heap_start);
+static void kmalloc_caches_init(void);
+static void buddy_add_range(uint32_t start_pfn, uint32_t end_pfn);
+static void buddy_free_block(uint32_t pfn, uint32_t order);
+
+static inline void* page_to_addr(page_t* page) {
+    return (void*)(ram_base + (uintptr_t)(page - all_pages_array) * PAGE_SIZE);
+}
+
+static inline uint32_t addr_to_pfn(void* ptr) {
+    return ((uintptr_t)ptr - ram_base) / PAGE_SIZE;
+}
+
+/* Has this pfn been given to the buddy allocator at some point */
+static inline int pfn_released(uint32_t pfn) {
+    return pfn >= first_free_pfn && pfn < num_pages && (pfn < lazy_next_pfn || pfn >= lazy_end_pfn);
+}
 
-    /* Reserve kernel heap pages */
-    for (; i < kernel_pages + (KERNEL_HEAP_SIZE / PAGE_SIZE); i++) {
-        all_pages_array[i].vaddr_mapped = i * PAGE_SIZE;
-        all_pages_array[i].flags.allocated = 1;
-        all_pages_array[i].flags.kernel_heap_page = 1;
+/* Set up the allocators over mem_size bytes of RAM, with the page descriptors going at image_end */
+static void mem_layout(uint32_t mem_size, uintptr_t image_end) {
+    uintptr_t page_array_end;
+    uint32_t page_array_len, i;
+
+    num_pages = mem_size / PAGE_SIZE;
+    page_array_len = sizeof(page_t) * num_pages;
+    all_pages_array = (page_t*)image_end;
+
+    mcs_lock_init(&zone_lock, "zone");
+    spin_lock_init(&heap_lock, "heap");
+
+    for (i = 0; i < MAX_ORDER; i++) {
+        INITIALIZE_INDEX_LIST(free_area[i], PAGE_NONE);
     }
+    INITIALIZE_INDEX_LIST(zeroed_pages, PAGE_NONE);
+    INITIALIZE_INDEX_LIST(dirty_pages, PAGE_NONE);
+
+    /*
+     * The kernel image, the page metadata array and the kernel heap that
+     * follows it are never handed to the page allocator, so their
+     * descriptors are never looked at either.
+     */
+    page_array_end = image_end + page_array_len;
+    first_free_pfn = (page_array_end - ram_base + KERNEL_HEAP_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    /* Add remaining pages to free list */
-    for (; i < num_pages; i++) {
-        all_pages_array[i].flags.allocated = 0;
-        all_pages_array[i].vaddr_mapped = i * PAGE_SIZE;  // Optional but consistent
-        append_page_list(&free_pages, &all_pages_array[i]);
+    lazy_next_pfn = (first_free_pfn + MAX_BLOCK_PAGES - 1) & ~(MAX_BLOCK_PAGES - 1);
+    lazy_end_pfn = num_pages & ~(MAX_BLOCK_PAGES - 1);
+    if (lazy_next_pfn > lazy_end_pfn) {
+        lazy_next_pfn = lazy_end_pfn = num_pages;
     }
 
-    page_array_end = (uint32_t)&__end + page_array_len;
+    buddy_add_range(first_free_pfn, lazy_next_pfn);
+    buddy_add_range(lazy_end_pfn, num_pages);
+
     heap_init(page_array_end);
+    kmalloc_caches_init();
 
-    puts("[DEBUG] Memory initialization complete. Free pages = ");
-    puthex(size_page_list(&free_pages));
-    puts("\n");
+    info("mem: %u MiB, %u free pages, %u max order blocks deferred", mem_size >> 20,
+            mem_free_page_count(), (lazy_end_pfn - lazy_next_pfn) / MAX_BLOCK_PAGES);
 }
 
-void* alloc_page(void) {
+#ifndef HOST_BUILD
+extern uint8_t __end;
+
+void mem_init(atag_t* atags) {
+    uint32_t mem_size;
+
+    mem_size = get_mem_size(atags);
+    if (mem_size == 0) {
+        mem_size = MEM_DEFAULT_SIZE;
+    }
+
+    // The peripheral window is not RAM even when the reported size runs into it
+    if (mem_size > PERIPHERAL_BASE) {
+        mem_size = PERIPHERAL_BASE;
+    }
+
+    mem_layout(mem_size, (uintptr_t)&__end);
+}
+#else
+/* The arena plays RAM, with the page descriptors at its start where the kernel image would end */
+void mem_init_arena(void* arena, uint32_t size) {
+    ram_base = (uintptr_t)arena;
+    mem_layout(size, ram_base);
+}
+#endif
+
+/**
+ * Seed the free areas with the pages in [start_pfn, end_pfn), carving the
+ * range into the largest naturally aligned blocks that fit.
+ */
+static void buddy_add_range(uint32_t start_pfn, uint32_t end_pfn) {
+    uint32_t order;
     page_t* page;
-    void* page_mem;
 
-    if (size_page_list(&free_pages) == 0) {
-        return 0; //if there is no more allocatable space remaining
+    while (start_pfn < end_pfn) {
+        order = MAX_ORDER - 1;
+        while (order > 0 && ((start_pfn & ((1U << order) - 1)) || start_pfn + (1U << order) > end_pfn)) {
+            order--;
+        }
+
+        // First time this descriptor is used, so set every field
+        page = &all_pages_array[start_pfn];
+        bzero(page, sizeof(page_t));
+        page->flags.buddy_free = 1;
+        page->order = order;
+        append_page_list(&free_area[order], page);
+
+        start_pfn += 1U << order;
+    }
+}
+
+/* Release the next deferred max order block, returns 0 once there are none left */
+static int buddy_release_lazy(void) {
+    if (lazy_next_pfn >= lazy_end_pfn) {
+        return 0;
+    }
+
+    buddy_add_range(lazy_next_pfn, lazy_next_pfn + MAX_BLOCK_PAGES);
+    lazy_next_pfn += MAX_BLOCK_PAGES;
+    return 1;
+}
+
+/**
+ * Return a block to its free area, merging it with its buddy for as long as
+ * the buddy is free and of the same order. Each step is O(1) thanks to the
+ * O(1) list removal, so a free costs at most MAX_ORDER merges. A buddy below
+ * MAX_ORDER - 1 shares its max order block, so it can only fall outside the
+ * released pages at the reserved start of RAM or past its end.
+ */
+static void buddy_free_block(uint32_t pfn, uint32_t order) {
+    uint32_t buddy_pfn;
+    page_t *page, *buddy;
+
+    while (order < MAX_ORDER - 1) {
+        buddy_pfn = pfn ^ (1U << order);
+        if (buddy_pfn < first_free_pfn || buddy_pfn + (1U << order) > num_pages) {
+            break;
+        }
+
+        buddy = &all_pages_array[buddy_pfn];
+        if (!buddy->flags.buddy_free || buddy->order != order) {
+            break;
+        }
+
+        // The buddy is free, take it off its list and absorb it
+        remove_page_list(&free_area[order], buddy);
+        buddy->flags.buddy_free = 0;
+        pfn &= ~(1U << order);
+        order++;
+    }
+
+    page = &all_pages_array[pfn];
+    page->flags.allocated = 0;
+    page->flags.kernel_page = 0;
+    page->flags.buddy_free = 1;
+    page->order = order;
+    push_page_list(&free_area[order], page);
+}
+
+/* Take a block of the given order off the free areas, splitting larger blocks as needed */
+static page_t* buddy_alloc_block(uint32_t order) {
+    page_t *page, *buddy;
+    uint32_t current;
+
+    // Find the smallest free block that can satisfy the request
+    for (current = order; current < MAX_ORDER; current++) {
+        if (size_page_list(&free_area[current]) != 0) {
+            break;
+        }
+    }
+
+    if (current == MAX_ORDER) {
+        if (!buddy_release_lazy()) {
+            return NULL; //if there is no more allocatable space remaining
+        }
+        current = MAX_ORDER - 1;
+    }
+
+    page = pop_page_list(&free_area[current]);
+    page->flags.buddy_free = 0;
+
+    // Split the block in half until it is the requested size, freeing the upper halves
+    while (current > order) {
+        current--;
+        buddy = page + (1U << current);
+        buddy->flags.allocated = 0;
+        buddy->flags.kernel_page = 0;
+        buddy->flags.kernel_heap_page = 0;
+        buddy->flags.buddy_free = 1;
+        buddy->order = current;
+        push_page_list(&free_area[current], buddy);
     }
 
-    // Get a free page
-    page = pop_page_list(&free_pages);
     page->flags.kernel_page = 1;
     page->flags.allocated = 1;
+    page->order = order;
+    page->refcount = 1;
+    return page;
+}
+
+/* Look up the metadata of an allocated block, or report why ptr is not one */
+static page_t* mem_check_block(void* ptr, uint32_t order) {
+    uint32_t pfn;
+    page_t* page;
+
+    // Get page metadata from the physical address
+    pfn = addr_to_pfn(ptr);
+    if (!pfn_released(pfn) || (pfn & ((1U << order) - 1))) {
+        error("free_pages: bad page address");
+        return NULL;
+    }
+
+    page = &all_pages_array[pfn];
+    if (!page->flags.allocated || page->flags.kernel_heap_page || page->order != order) {
+        error("free_pages: page is not an allocated block of this order");
+        return NULL;
+    }
+    return page;
+}
+
+void* alloc_pages(uint32_t order) {
+    page_t* page;
+    void* page_mem;
+    mcs_node_t node;
+    uint32_t flags;
+
+    if (order >= MAX_ORDER) {
+        return 0;
+    }
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    page = buddy_alloc_block(order);
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+    if (page == NULL) {
+        return 0;
+    }
 
     // Get the address the physical page metadata refers to
-    page_mem = (void*)((page - all_pages_array) * PAGE_SIZE);
+    page_mem = page_to_addr(page);
+
+    // Zero out the pages, big security flaw to not do this :)
+    bzero(page_mem, PAGE_SIZE << order);
+
+    trace(TRACE_PAGE_ALLOC, order, (uintptr_t)page_mem, 0);
+    return page_mem;
+}
+
+void free_pages(void* ptr, uint32_t order) {
+    mcs_node_t node;
+    uint32_t flags;
+
+    if (ptr == NULL || order >= MAX_ORDER) {
+        return;
+    }
+    trace(TRACE_PAGE_FREE, order, (uintptr_t)ptr, 0);
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    if (mem_check_block(ptr, order) != NULL) {
+        buddy_free_block(addr_to_pfn(ptr), order);
+    }
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+}
 
-    // Zero out the page, big security flaw to not do this :)
-    bzero(page_mem, PAGE_SIZE);
+static void pool_release(page_t* page) {
+    buddy_free_block(page - all_pages_array, 0);
+}
+
+static void pool_add(page_list_t* pool, page_t* page) {
+    page->flags.allocated = 0;
+    page->flags.kernel_page = 0;
+    push_page_list(pool, page);
+}
+
+static page_t* pool_take(page_list_t* pool) {
+    page_t* page;
+
+    page = pop_page_list(pool);
+    if (page != NULL) {
+        page->flags.allocated = 1;
+        page->flags.kernel_page = 1;
+        page->order = 0;
+        page->refcount = 1;
+    }
+    return page;
+}
+
+/**
+ * Pick the page for a single page request from the pools and the buddy
+ * allocator, zone_lock must be held. *scrub is set when the page still has
+ * to be zeroed.
+ */
+static page_t* page_take_locked(uint32_t flags, uint32_t* scrub) {
+    page_t* page;
+
+    *scrub = 0;
+    if (flags & ALLOC_ZERO) {
+        page = pool_take(&zeroed_pages);
+        if (page != NULL) {
+            pool_stats.zero_hits++;
+            return page;
+        }
+
+        page = buddy_alloc_block(0);
+        if (page == NULL) {
+            // Last resort, scrub a dirty page on the spot
+            page = pool_take(&dirty_pages);
+        }
+        if (page != NULL) {
+            pool_stats.zero_misses++;
+            *scrub = 1;
+        }
+        return page;
+    }
+
+    // The caller overwrites the whole page, recycle dirty pages first and save zeroed ones
+    page = pool_take(&dirty_pages);
+    if (page != NULL) {
+        pool_stats.dirty_reuses++;
+        return page;
+    }
+    page = buddy_alloc_block(0);
+    if (page == NULL) {
+        page = pool_take(&zeroed_pages);
+    }
+    return page;
+}
+
+/* Single page allocation straight from the pools and the buddy allocator */
+static void* alloc_page_global(uint32_t flags) {
+    page_t* page;
+    mcs_node_t node;
+    uint32_t irq_flags, scrub;
 
+    irq_flags = mcs_lock_irqsave(&zone_lock, &node);
+    page = page_take_locked(flags, &scrub);
+    mcs_unlock_irqrestore(&zone_lock, &node, irq_flags);
+
+    if (page == NULL) {
+        return 0;
+    }
+    if (scrub) {
+        bzero(page_to_addr(page), PAGE_SIZE);
+    }
+    return page_to_addr(page);
+}
+
+/* Give an allocated single page back, zone_lock must be held */
+static void free_page_locked(page_t* page) {
+    if (size_page_list(&dirty_pages) < DIRTY_POOL_MAX) {
+        pool_add(&dirty_pages, page);
+    } else {
+        pool_release(page);
+    }
+}
+
+static inline uint32_t mag_batch(uint32_t depth) {
+    return depth > 1 ? depth / 2 : 1;
+}
+
+/* Fill an empty stack with up to half the magazine depth of pages from its pool, IRQs must be masked */
+static void page_mag_refill(page_magazine_t* mag, page_stack_t* stack, page_list_t* pool) {
+    uint32_t batch = mag_batch(mag_depth);
+    mcs_node_t node;
+    page_t* page;
+
+    mcs_lock(&zone_lock, &node);
+    while (stack->count < batch && (page = pool_take(pool)) != NULL) {
+        page->flags.allocated = 0;
+        page->flags.kernel_page = 0;
+        stack->pages[stack->count++] = page_to_addr(page);
+    }
+    mcs_unlock(&zone_lock, &node);
+    if (stack->count != 0) {
+        mag->refills++;
+    }
+}
+
+/* Hand a stack's oldest pages back until no more than target are left, IRQs must be masked */
+static void page_mag_flush(page_magazine_t* mag, page_stack_t* stack, uint32_t target) {
+    uint32_t i, n;
+    mcs_node_t node;
+    page_t* page;
+
+    if (stack->count <= target) {
+        return;
+    }
+    n = stack->count - target;
+
+    mcs_lock(&zone_lock, &node);
+    for (i = 0; i < n; i++) {
+        page = &all_pages_array[addr_to_pfn(stack->pages[i])];
+        if (stack == &mag->zeroed) {
+            pool_add(&zeroed_pages, page);
+        } else {
+            free_page_locked(page);
+        }
+    }
+    mcs_unlock(&zone_lock, &node);
+
+    for (i = n; i < stack->count; i++) {
+        stack->pages[i - n] = stack->pages[i];
+    }
+    stack->count = target;
+    mag->flushes++;
+}
+
+/* Bring a magazine down to the current depth after it was lowered, IRQs must be masked */
+static inline void page_mag_trim(page_magazine_t* mag, uint32_t depth) {
+    if (mag->zeroed.count > depth || mag->dirty.count > depth) {
+        page_mag_flush(mag, &mag->zeroed, depth);
+        page_mag_flush(mag, &mag->dirty, depth);
+    }
+}
+
+void* alloc_page_flags(uint32_t flags) {
+    page_magazine_t* mag;
+    page_stack_t *stack, *other;
+    page_list_t* pool;
+    mcs_node_t node;
+    uint32_t irq_flags, depth, scrub = 0;
+    page_t* page = NULL;
+    void* page_mem;
+
+    irq_flags = irq_save();
+    depth = mag_depth;
+    mag = &page_mags[smp_processor_id()];
+    page_mag_trim(mag, depth);
+    if (depth == 0) {
+        irq_restore(irq_flags);
+        page_mem = alloc_page_global(flags);
+        trace(TRACE_PAGE_ALLOC, 0, (uintptr_t)page_mem, 0);
+        return page_mem;
+    }
+
+    if (flags & ALLOC_ZERO) {
+        stack = &mag->zeroed;
+        other = &mag->dirty;
+        pool = &zeroed_pages;
+    } else {
+        stack = &mag->dirty;
+        other = &mag->zeroed;
+        pool = &dirty_pages;
+    }
+
+    // The pool size is only a hint here, page_mag_refill() takes what is really there
+    if (stack->count == 0 && size_page_list(pool) != 0) {
+        page_mag_refill(mag, stack, pool);
+    }
+    if (stack->count == 0 && other->count != 0) {
+        // Rather the other stack than the lock, even if its page has to be zeroed
+        stack = other;
+    }
+    if (stack->count == 0) {
+        mcs_lock(&zone_lock, &node);
+        page = page_take_locked(flags, &scrub);
+        mcs_unlock(&zone_lock, &node);
+    }
+    if (page == NULL && stack->count != 0) {
+        page_mem = stack->pages[--stack->count];
+        mag->hits++;
+        if (stack == &mag->dirty && (flags & ALLOC_ZERO)) {
+            mag->zero_misses++;
+            scrub = 1;
+        } else if (stack == &mag->dirty) {
+            mag->dirty_reuses++;
+        } else if (flags & ALLOC_ZERO) {
+            mag->zero_hits++;
+        }
+
+        page = &all_pages_array[addr_to_pfn(page_mem)];
+        page->flags.allocated = 1;
+        page->flags.kernel_page = 1;
+        page->order = 0;
+        page->refcount = 1;
+    }
+    irq_restore(irq_flags);
+
+    if (page == NULL) {
+        return 0;
+    }
+    page_mem = page_to_addr(page);
+    if (scrub) {
+        bzero(page_mem, PAGE_SIZE);
+    }
+    trace(TRACE_PAGE_ALLOC, 0, (uintptr_t)page_mem, 0);
     return page_mem;
 }
 
+void* alloc_page(void) {
+    return alloc_page_flags(ALLOC_ZERO);
+}
+
 void free_page(void* ptr) {
+    page_magazine_t* mag;
     page_t* page;
+    mcs_node_t node;
+    uint32_t flags, depth;
 
-    // Get page metadata from the physical address
-    page = all_pages_array + ((uint32_t)ptr / PAGE_SIZE);
+    if (ptr == NULL) {
+        return;
+    }
+    trace(TRACE_PAGE_FREE, 0, (uintptr_t)ptr, 0);
 
-    // Mark the page as free
-    page->flags.allocated = 0;
-    append_page_list(&free_pages, page);
+    // Only the owner of an allocated page changes its descriptor, so checking it needs no lock
+    flags = irq_save();
+    depth = mag_depth;
+    mag = &page_mags[smp_processor_id()];
+    page_mag_trim(mag, depth);
+    if (depth != 0 && (page = mem_check_block(ptr, 0)) != NULL) {
+        if (mag->dirty.count >= depth) {
+            page_mag_flush(mag, &mag->dirty, depth - mag_batch(depth));
+        }
+        page->flags.allocated = 0;
+        page->flags.kernel_page = 0;
+        mag->dirty.pages[mag->dirty.count++] = ptr;
+        irq_restore(flags);
+        return;
+    }
+    irq_restore(flags);
+    if (depth != 0) {
+        return;
+    }
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    if ((page = mem_check_block(ptr, 0)) != NULL) {
+        free_page_locked(page);
+    }
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+}
+
+/**
+ * Change the magazine depth, up to MAG_DEPTH. This core's page magazine is
+ * trimmed right away, other cores trim theirs on their next single page
+ * alloc or free.
+ */
+void mem_set_magazine_depth(uint32_t depth) {
+    uint32_t flags;
+
+    if (depth > MAG_DEPTH) {
+        depth = MAG_DEPTH;
+    }
+    mag_depth = depth;
+    kmem_set_magazine_depth(depth);
+
+    flags = irq_save();
+    page_mag_trim(&page_mags[smp_processor_id()], depth);
+    irq_restore(flags);
+}
+
+uint32_t mem_magazine_depth(void) {
+    return mag_depth;
 }
 
+/**
+ * Page reference counts. Every page comes out of the allocator with one
+ * reference. Sharing a page (copy-on-write mappings) takes another with
+ * page_get(), and page_put() frees it once the last one is dropped.
+ * free_page() ignores the count and frees right away.
+ */
+int page_get(void* ptr) {
+    page_t* page;
+    mcs_node_t node;
+    uint32_t flags;
+    int ret = -1;
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    if ((page = mem_check_block(ptr, 0)) != NULL) {
+        if (page->refcount == PAGE_REF_MAX) {
+            error("page_get: reference count overflow");
+        } else {
+            page->refcount++;
+            ret = 0;
+        }
+    }
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+    return ret;
+}
+
+void page_put(void* ptr) {
+    page_t* page;
+    mcs_node_t node;
+    uint32_t flags;
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    if ((page = mem_check_block(ptr, 0)) != NULL && --page->refcount == 0) {
+        free_page_locked(page);
+    }
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+}
+
+uint32_t page_refcount(void* ptr) {
+    uint32_t pfn = addr_to_pfn(ptr), count = 0;
+    page_t* page;
+    mcs_node_t node;
+    uint32_t flags;
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    if (pfn_released(pfn)) {
+        page = &all_pages_array[pfn];
+        count = page->flags.allocated ? page->refcount : 0;
+    }
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+    return count;
+}
+
+/**
+ * Idle time page scrubbing. Zeroes at most one page per call so the idle
+ * loop stays responsive: a dirty page if there is one, otherwise a fresh
+ * page from the buddy allocator while the zeroed pool is below its target.
+ * Returns 1 if a page was scrubbed.
+ */
+int mem_idle_scrub(void) {
+    page_t* page;
+    mcs_node_t node;
+    uint32_t flags;
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    if (size_page_list(&zeroed_pages) >= ZERO_POOL_TARGET) {
+        // Nothing to refill, dirty pages go back to the buddy allocator so they can merge
+        page = pop_page_list(&dirty_pages);
+        if (page != NULL) {
+            pool_release(page);
+        }
+        mcs_unlock_irqrestore(&zone_lock, &node, flags);
+        return 0;
+    }
+
+    // The page is on no list while it is scrubbed, so nobody else can hand it out
+    page = pop_page_list(&dirty_pages);
+    if (page == NULL) {
+        page = buddy_alloc_block(0);
+    }
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+    if (page == NULL) {
+        return 0;
+    }
+
+    bzero(page_to_addr(page), PAGE_SIZE);
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    pool_add(&zeroed_pages, page);
+    pool_stats.scrubbed++;
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+    return 1;
+}
+
+void mem_pool_stats(page_pool_stats_t* stats) {
+    mcs_node_t node;
+    uint32_t flags, cpu;
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    *stats = pool_stats;
+    stats->zeroed_pages = size_page_list(&zeroed_pages);
+    stats->dirty_pages = size_page_list(&dirty_pages);
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+
+    // Other cores keep going while these are summed, the totals are a snapshot at best
+    stats->mag_hits = stats->mag_refills = stats->mag_flushes = stats->mag_pages = 0;
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        stats->mag_hits += page_mags[cpu].hits;
+        stats->mag_refills += page_mags[cpu].refills;
+        stats->mag_flushes += page_mags[cpu].flushes;
+        stats->mag_pages += page_mags[cpu].zeroed.count + page_mags[cpu].dirty.count;
+        stats->zero_hits += page_mags[cpu].zero_hits;
+        stats->zero_misses += page_mags[cpu].zero_misses;
+        stats->dirty_reuses += page_mags[cpu].dirty_reuses;
+    }
+}
+
+uint32_t mem_free_blocks(uint32_t order) {
+    if (order >= MAX_ORDER) {
+        return 0;
+    }
+    return size_page_list(&free_area[order]);
+}
+
+uint32_t mem_free_page_count(void) {
+    uint32_t order, count = 0, flags, cpu;
+    mcs_node_t node;
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    for (order = 0; order < MAX_ORDER; order++) {
+        count += size_page_list(&free_area[order]) << order;
+    }
+    count += size_page_list(&zeroed_pages) + size_page_list(&dirty_pages);
+
+    // Deferred blocks count as free, they are released on first use
+    count += lazy_end_pfn - lazy_next_pfn;
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        count += page_mags[cpu].zeroed.count + page_mags[cpu].dirty.count;
+    }
+    return count;
+}
+
+/* Check one order's free area, returns the number of problems found */
+static uint32_t mem_check_free_area(uint32_t order, mem_walk_fn_t fn, void* arg) {
+    uint32_t pfn, buddy_pfn, count = 0, problems = 0;
+    page_t *page, *buddy;
+
+    for (page = peek_page_list(&free_area[order]); page != NULL; page = next_page_list(page)) {
+        pfn = page - all_pages_array;
+        if (!pfn_released(pfn) || count++ == size_page_list(&free_area[order])) {
+            error("mem_check: order %u free list is corrupt at pfn %u", order, pfn);
+            return problems + 1;
+        }
+
+        if ((pfn & ((1U << order) - 1)) || pfn + (1U << order) > num_pages) {
+            error("mem_check: order %u free block at pfn %u is misaligned or runs past RAM", order, pfn);
+            problems++;
+        }
+        if (!page->flags.buddy_free || page->flags.allocated || page->order != order) {
+            error("mem_check: order %u free block at pfn %u has the wrong flags or order", order, pfn);
+            problems++;
+        }
+
+        // Same test as buddy_free_block(), a free buddy here means a merge was missed
+        buddy_pfn = pfn ^ (1U << order);
+        if (order < MAX_ORDER - 1 && buddy_pfn >= first_free_pfn && buddy_pfn + (1U << order) <= num_pages) {
+            buddy = &all_pages_array[buddy_pfn];
+            if (buddy->flags.buddy_free && buddy->order == order) {
+                error("mem_check: order %u free blocks at pfn %u and %u were not merged", order, pfn, buddy_pfn);
+                problems++;
+            }
+        }
+
+        if (fn != NULL) {
+            fn(page_to_addr(page), PAGE_SIZE << order, MEM_RANGE_BUDDY, arg);
+        }
+    }
+
+    if (count != size_page_list(&free_area[order])) {
+        error("mem_check: order %u free list holds %u blocks but counts %u", order, count,
+                size_page_list(&free_area[order]));
+        problems++;
+    }
+    return problems;
+}
+
+/* Check a page pool, returns the number of problems found */
+static uint32_t mem_check_pool(page_list_t* pool, const char* name, mem_range_t kind, mem_walk_fn_t fn, void* arg) {
+    uint32_t pfn, count = 0, problems = 0;
+    page_t* page;
+
+    for (page = peek_page_list(pool); page != NULL; page = next_page_list(page)) {
+        pfn = page - all_pages_array;
+        if (!pfn_released(pfn) || count++ == size_page_list(pool)) {
+            error("mem_check: %s pool is corrupt at pfn %u", name, pfn);
+            return problems + 1;
+        }
+
+        if (page->flags.allocated || page->flags.buddy_free) {
+            error("mem_check: %s pool page %u is allocated or on a free list", name, pfn);
+            problems++;
+        }
+        if (fn != NULL) {
+            fn(page_to_addr(page), PAGE_SIZE, kind, arg);
+        }
+    }
+
+    if (count != size_page_list(pool)) {
+        error("mem_check: %s pool holds %u pages but counts %u", name, count, size_page_list(pool));
+        problems++;
+    }
+    return problems;
+}
+
+/* Check one stack of a core's page magazine, returns the number of problems found */
+static uint32_t mem_check_stack(uint32_t cpu, page_stack_t* stack, const char* name, mem_walk_fn_t fn, void* arg) {
+    uint32_t i, pfn, problems = 0;
+    page_t* page;
+    void* addr;
+
+    if (stack->count > MAG_DEPTH) {
+        error("mem_check: cpu %u %s page stack holds %u pages", cpu, name, stack->count);
+        return 1;
+    }
+
+    for (i = 0; i < stack->count; i++) {
+        addr = stack->pages[i];
+        pfn = addr_to_pfn(addr);
+        if (!pfn_released(pfn) || page_to_addr(&all_pages_array[pfn]) != addr) {
+            error("mem_check: cpu %u %s page stack holds a bad address %p", cpu, name, addr);
+            problems++;
+            continue;
+        }
+
+        page = &all_pages_array[pfn];
+        if (page->flags.allocated || page->flags.buddy_free) {
+            error("mem_check: cpu %u magazine page %u is allocated or on a free list", cpu, pfn);
+            problems++;
+        }
+        if (fn != NULL) {
+            fn(addr, PAGE_SIZE, MEM_RANGE_MAGAZINE, arg);
+        }
+    }
+    return problems;
+}
+
+uint32_t mem_check_pages(mem_walk_fn_t fn, void* arg) {
+    uint32_t order, cpu, flags, problems = 0;
+    mcs_node_t node;
+
+    flags = mcs_lock_irqsave(&zone_lock, &node);
+    if (fn != NULL) {
+        fn((void*)ram_base, first_free_pfn * PAGE_SIZE, MEM_RANGE_RESERVED, arg);
+        if (lazy_next_pfn < lazy_end_pfn) {
+            fn(page_to_addr(&all_pages_array[lazy_next_pfn]), (lazy_end_pfn - lazy_next_pfn) * PAGE_SIZE,
+                    MEM_RANGE_DEFERRED, arg);
+        }
+    }
+
+    for (order = 0; order < MAX_ORDER; order++) {
+        problems += mem_check_free_area(order, fn, arg);
+    }
+    problems += mem_check_pool(&zeroed_pages, "zeroed", MEM_RANGE_ZEROED, fn, arg);
+    problems += mem_check_pool(&dirty_pages, "dirty", MEM_RANGE_DIRTY, fn, arg);
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        problems += mem_check_stack(cpu, &page_mags[cpu].zeroed, "zeroed", fn, arg);
+        problems += mem_check_stack(cpu, &page_mags[cpu].dirty, "dirty", fn, arg);
+    }
+    mcs_unlock_irqrestore(&zone_lock, &node, flags);
+    return problems;
+}
+
+
+/**
+ * TLSF parameters. Sizes below TLSF_SMALL_SIZE all share first level 0 and
+ * are split linearly in 16 byte steps, larger sizes get one first level per
+ * power of two, each divided into TLSF_SL_COUNT second level lists.
+ */
+#define TLSF_ALIGN_LOG2 4
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1U << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_SMALL_SIZE (1U << TLSF_FL_SHIFT)
+#define TLSF_FL_MAX 21  // Segments up to 2 MiB, comfortably above KERNEL_HEAP_SIZE
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+
+#define HEAP_SEGMENT_FREE 1U
+#define HEAP_MIN_SEGMENT (2 * sizeof(heap_segment_t))
 
-static void heap_init(uint32_t heap_start) {
-    heap_segment_list_head = (heap_segment_t*)heap_start;
-    bzero(heap_segment_list_head, sizeof(heap_segment_t));
-    heap_segment_list_head->segment_size = KERNEL_HEAP_SIZE;
+static uint32_t tlsf_fl_bitmap;
+static uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT];
+static heap_segment_t* tlsf_free[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+/* Index of the most significant set bit */
+static inline uint32_t tlsf_fls(uint32_t word) {
+    return 31 - __builtin_clz(word);
+}
+
+/* Index of the least significant set bit, isolated first so a single CLZ finds it */
+static inline uint32_t tlsf_ffs(uint32_t word) {
+    return 31 - __builtin_clz(word & -word);
+}
+
+static inline uint32_t heap_segment_size(heap_segment_t* seg) {
+    return seg->segment_size & ~HEAP_SEGMENT_FREE;
+}
+
+static inline heap_segment_t* heap_next_phys(heap_segment_t* seg) {
+    return (heap_segment_t*)((uint8_t*)seg + heap_segment_size(seg));
+}
+
+static void tlsf_mapping_insert(uint32_t size, uint32_t* fl, uint32_t* sl) {
+    uint32_t bit;
+
+    if (size < TLSF_SMALL_SIZE) {
+        *fl = 0;
+        *sl = size >> TLSF_ALIGN_LOG2;
+    } else {
+        bit = tlsf_fls(size);
+        *sl = (size >> (bit - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = bit - TLSF_FL_SHIFT + 1;
+    }
+}
+
+/* Like tlsf_mapping_insert, but rounds up so every segment on the resulting list is big enough */
+static void tlsf_mapping_search(uint32_t size, uint32_t* fl, uint32_t* sl) {
+    if (size >= TLSF_SMALL_SIZE) {
+        size += (1U << (tlsf_fls(size) - TLSF_SL_LOG2)) - 1;
+    }
+    tlsf_mapping_insert(size, fl, sl);
+}
+
+static heap_segment_t* tlsf_find_suitable(uint32_t* fl, uint32_t* sl) {
+    uint32_t sl_map, fl_map;
+
+    // First look for a free list in this size class that is at least as large
+    sl_map = tlsf_sl_bitmap[*fl] & (~0U << *sl);
+    if (sl_map == 0) {
+        // Otherwise take the smallest non-empty larger size class
+        fl_map = tlsf_fl_bitmap & (~0U << (*fl + 1));
+        if (fl_map == 0) {
+            return NULL;
+        }
+        *fl = tlsf_ffs(fl_map);
+        sl_map = tlsf_sl_bitmap[*fl];
+    }
+
+    *sl = tlsf_ffs(sl_map);
+    return tlsf_free[*fl][*sl];
+}
+
+static void tlsf_insert(heap_segment_t* seg) {
+    uint32_t fl, sl;
+
+    tlsf_mapping_insert(heap_segment_size(seg), &fl, &sl);
+    seg->segment_size |= HEAP_SEGMENT_FREE;
+    seg->prev = NULL;
+    seg->next = tlsf_free[fl][sl];
+    if (seg->next != NULL) {
+        seg->next->prev = seg;
+    }
+    tlsf_free[fl][sl] = seg;
+
+    tlsf_fl_bitmap |= 1U << fl;
+    tlsf_sl_bitmap[fl] |= 1U << sl;
+}
+
+static void tlsf_remove(heap_segment_t* seg) {
+    uint32_t fl, sl;
+
+    tlsf_mapping_insert(heap_segment_size(seg), &fl, &sl);
+    if (seg->prev != NULL) {
+        seg->prev->next = seg->next;
+    } else {
+        tlsf_free[fl][sl] = seg->next;
+    }
+    if (seg->next != NULL) {
+        seg->next->prev = seg->prev;
+    }
+    seg->segment_size &= ~HEAP_SEGMENT_FREE;
+
+    if (tlsf_free[fl][sl] == NULL) {
+        tlsf_sl_bitmap[fl] &= ~(1U << sl);
+        if (tlsf_sl_bitmap[fl] == 0) {
+            tlsf_fl_bitmap &= ~(1U << fl);
+        }
+    }
+}
+
+static void heap_init(uintptr_t heap_start) {
+    heap_segment_t *first, *sentinel;
+
+    heap_base = heap_start;
+    first = (heap_segment_t*)heap_start;
+    bzero(first, sizeof(heap_segment_t));
+    first->segment_size = KERNEL_HEAP_SIZE - sizeof(heap_segment_t);
+
+    // A zero sized, always allocated segment at the end stops right coalescing
+    sentinel = heap_next_phys(first);
+    bzero(sentinel, sizeof(heap_segment_t));
+    sentinel->prev_phys = first;
+
+    tlsf_insert(first);
+}
+
+static void kmalloc_caches_init(void) {
+    uint32_t i;
+
+    for (i = 0; i < KMALLOC_CACHES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_cache_names[i], 1U << (KMALLOC_MIN_SHIFT + i), 16, NULL);
+    }
+}
+
+static inline int heap_owns(void* ptr) {
+    return (uintptr_t)ptr >= heap_base && (uintptr_t)ptr < heap_base + KERNEL_HEAP_SIZE;
 }
 
 void* kmalloc(uint32_t bytes) {
-    heap_segment_t *curr, *best = NULL;
-    int diff, best_diff = 0x7fffffff; // Max signed int
+    heap_segment_t *seg, *rest;
+    uint32_t fl, sl, remaining, flags, i, requested = bytes;
+    void* obj;
+
+    if (bytes > KERNEL_HEAP_SIZE) {
+        return NULL;
+    }
 
-    // Add the header to the number of bytes we need and make the size 4 byte aligned
+    // Small sizes go to the smallest slab class that fits, the heap takes over if that runs dry
+    if (bytes <= KMALLOC_SLAB_MAX) {
+        for (i = 0; (1U << (KMALLOC_MIN_SHIFT + i)) < bytes; i++) {
+        }
+        if (kmalloc_caches[i] != NULL && (obj = kmem_cache_alloc(kmalloc_caches[i])) != NULL) {
+            trace(TRACE_KMALLOC, 0, (uintptr_t)obj, bytes);
+            return obj;
+        }
+    }
+
+    // Add the header to the number of bytes we need and make the size 16 byte aligned
     bytes += sizeof(heap_segment_t);
     bytes += bytes % 16 ? 16 - (bytes % 16) : 0;
+    if (bytes < HEAP_MIN_SEGMENT) {
+        bytes = HEAP_MIN_SEGMENT;
+    }
 
-    // Find the allocation that is closest in size to this request
-    for (curr = heap_segment_list_head; curr != NULL; curr = curr->next) {
-        diff = curr->segment_size - bytes;
-        if (!curr->is_allocated && diff < best_diff && diff >= 0) {
-            best = curr;
-            best_diff = diff;
-        }
+    tlsf_mapping_search(bytes, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) {
+        return NULL;
     }
 
+    flags = spin_lock_irqsave(&heap_lock);
+
     // There must be no free memory right now :(
-    if (best == NULL)
+    seg = tlsf_find_suitable(&fl, &sl);
+    if (seg == NULL) {
+        spin_unlock_irqrestore(&heap_lock, flags);
         return NULL;
-
-    // If the best difference we could come up with was large, split up this segment into two.
-    // Since our segment headers are rather large, the criterion for splitting the segment is that
-    // when split, the segment not being requested should be twice a header size
-    if (best_diff > (int)(2 * sizeof(heap_segment_t))) {
-        bzero(((void*)(best)) + bytes, sizeof(heap_segment_t));
-        curr = best->next;
-        best->next = ((void*)(best)) + bytes;
-        best->next->next = curr;
-        best->next->prev = best;
-        best->next->segment_size = best->segment_size - bytes;
-        best->segment_size = bytes;
     }
+    tlsf_remove(seg);
 
-    best->is_allocated = 1;
+    // Give the tail back to the free lists if it is big enough to be useful on its own
+    remaining = heap_segment_size(seg) - bytes;
+    if (remaining >= HEAP_MIN_SEGMENT) {
+        rest = (heap_segment_t*)((uint8_t*)seg + bytes);
+        rest->segment_size = remaining;
+        rest->prev_phys = seg;
+        heap_next_phys(rest)->prev_phys = rest;
+        seg->segment_size = bytes;
+        tlsf_insert(rest);
+    }
 
-    return best + 1;
+    spin_unlock_irqrestore(&heap_lock, flags);
+    trace(TRACE_KMALLOC, 0, (uintptr_t)(seg + 1), requested);
+    return seg + 1;
 }
 
 void kfree(void* ptr) {
-    heap_segment_t* seg;
+    heap_segment_t *seg, *neighbour;
+    uint32_t flags;
 
     if (!ptr)
         return;
+    trace(TRACE_KFREE, 0, (uintptr_t)ptr, 0);
 
-    seg = ptr - sizeof(heap_segment_t);
-    seg->is_allocated = 0;
+    if (!heap_owns(ptr)) {
+        kmem_free(ptr);
+        return;
+    }
 
-    // try to coalesce segements to the left
-    while(seg->prev != NULL && !seg->prev->is_allocated) {
-        seg->prev->next = seg->next;
-        seg->next->prev = seg->prev;
-        seg->prev->segment_size += seg->segment_size;
-        seg = seg->prev;
+    seg = (heap_segment_t*)ptr - 1;
+    flags = spin_lock_irqsave(&heap_lock);
+    if (seg->segment_size & HEAP_SEGMENT_FREE) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        error("kfree: double free");
+        return;
+    }
+
+    // Coalesce with the segment to the right, the sentinel guarantees there is one
+    neighbour = heap_next_phys(seg);
+    if (neighbour->segment_size & HEAP_SEGMENT_FREE) {
+        tlsf_remove(neighbour);
+        seg->segment_size += heap_segment_size(neighbour);
+    }
+
+    // Coalesce with the segment to the left
+    neighbour = seg->prev_phys;
+    if (neighbour != NULL && (neighbour->segment_size & HEAP_SEGMENT_FREE)) {
+        tlsf_remove(neighbour);
+        neighbour->segment_size += heap_segment_size(seg);
+        seg = neighbour;
+    }
+
+    heap_next_phys(seg)->prev_phys = seg;
+    tlsf_insert(seg);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+uint32_t mem_check_heap(mem_walk_fn_t fn, void* arg) {
+    heap_segment_t *seg, *prev = NULL, *sentinel;
+    uint32_t fl, sl, seg_fl, seg_sl, size, flags, free_segments = 0, listed = 0, problems = 0;
+    int is_free, has_bit;
+
+    sentinel = (heap_segment_t*)(heap_base + KERNEL_HEAP_SIZE) - 1;
+    flags = spin_lock_irqsave(&heap_lock);
+
+    // The segments must tile the heap exactly, each one tagged with its left neighbour
+    for (seg = (heap_segment_t*)heap_base; seg != sentinel; seg = heap_next_phys(seg)) {
+        size = heap_segment_size(seg);
+        if (size < HEAP_MIN_SEGMENT || size % 16 || (uintptr_t)seg + size > (uintptr_t)sentinel) {
+            error("mem_check: heap segment at %p has a bad size %u", (void*)seg, size);
+            problems++;
+            break;
+        }
+
+        is_free = seg->segment_size & HEAP_SEGMENT_FREE;
+        if (seg->prev_phys != prev) {
+            error("mem_check: heap segment at %p has a stale boundary tag", (void*)seg);
+            problems++;
+        }
+        if (is_free && prev != NULL && (prev->segment_size & HEAP_SEGMENT_FREE)) {
+            error("mem_check: free heap segments at %p and %p were not merged", (void*)prev, (void*)seg);
+            problems++;
+        }
+
+        free_segments += is_free ? 1 : 0;
+        if (fn != NULL) {
+            fn(seg, size, is_free ? MEM_RANGE_HEAP_FREE : MEM_RANGE_HEAP_USED, arg);
+        }
+        prev = seg;
     }
-    // try to coalesce segments to the right
-    while(seg->next != NULL && !seg->next->is_allocated) {
-        seg->next->next->prev = seg;
-        seg->next = seg->next->next;
-        seg->segment_size += seg->next->segment_size;
+    if (seg == sentinel && (sentinel->segment_size != 0 || sentinel->prev_phys != prev)) {
+        error("mem_check: heap sentinel was overwritten");
+        problems++;
     }
+
+    // Every free segment must be on the list its size maps to, and the bitmaps must match the lists
+    for (fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        for (sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            has_bit = (tlsf_sl_bitmap[fl] >> sl) & 1;
+            if (has_bit != (tlsf_free[fl][sl] != NULL)) {
+                error("mem_check: TLSF bitmap disagrees with free list %u/%u", fl, sl);
+                problems++;
+            }
+
+            prev = NULL;
+            for (seg = tlsf_free[fl][sl]; seg != NULL; prev = seg, seg = seg->next) {
+                if (!heap_owns(seg) || listed++ > free_segments) {
+                    error("mem_check: TLSF free list %u/%u is corrupt", fl, sl);
+                    problems++;
+                    break;
+                }
+
+                tlsf_mapping_insert(heap_segment_size(seg), &seg_fl, &seg_sl);
+                if (!(seg->segment_size & HEAP_SEGMENT_FREE) || seg_fl != fl || seg_sl != sl || seg->prev != prev) {
+                    error("mem_check: heap segment at %p is on the wrong free list", (void*)seg);
+                    problems++;
+                }
+            }
+        }
+
+        if (((tlsf_fl_bitmap >> fl) & 1) != (tlsf_sl_bitmap[fl] != 0)) {
+            error("mem_check: TLSF first level bitmap disagrees with level %u", fl);
+            problems++;
+        }
+    }
+    if (listed != free_segments) {
+        error("mem_check: %u free heap segments but %u on the free lists", free_segments, listed);
+        problems++;
+    }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return problems;
 }
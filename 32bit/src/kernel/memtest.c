@@ -0,0 +1,288 @@
+#include <kernel/mem.h>
+#include <kernel/slab.h>
+#include <kernel/vm.h>
+#include <kernel/mmu.h>
+#include <common/stdio.h>
+
+/**
+ * In-kernel self tests for the memory manager. These only use the public
+ * allocator API, so they can be run from the shell at any time.
+ */
+
+#define STRESS_SLOTS 128
+#define STRESS_ROUNDS 4096
+#define STRESS_MAX_ORDER 6
+
+typedef struct {
+    uint32_t* mem;
+    uint32_t order;
+} stress_block_t;
+
+static uint32_t stress_seed;
+
+static uint32_t stress_rand(void) {
+    stress_seed = stress_seed * 1103515245 + 12345;
+    return stress_seed >> 16;
+}
+
+/* Tag the first and last word of a block so that overlapping blocks are caught on free */
+static uint32_t stress_tag(stress_block_t* block) {
+    return (uint32_t)(uintptr_t)block->mem ^ 0xB0DDCAFE;
+}
+
+static uint32_t stress_last_word(uint32_t order) {
+    return ((PAGE_SIZE << order) / sizeof(uint32_t)) - 1;
+}
+
+static int stress_fail(const char* msg) {
+    error("%s", msg);
+    return 0;
+}
+
+/**
+ * Churn the buddy allocator with random alloc/free of mixed orders, checking
+ * alignment, zeroing and that no two live blocks overlap. Once everything is
+ * freed again every free area must be back to its starting size, which can
+ * only happen if all split blocks coalesced with their buddies.
+ * Returns 1 on success.
+ */
+int buddy_stress_test(void) {
+    static stress_block_t blocks[STRESS_SLOTS];
+    uint32_t before[MAX_ORDER];
+    uint32_t i, slot, last, free_before, allocs = 0, frees = 0;
+    stress_block_t* block;
+    void* big;
+
+    stress_seed = 0x5EED;
+    for (i = 0; i < MAX_ORDER; i++) {
+        before[i] = mem_free_blocks(i);
+    }
+    free_before = mem_free_page_count();
+
+    for (i = 0; i < STRESS_ROUNDS; i++) {
+        slot = stress_rand() % STRESS_SLOTS;
+        block = &blocks[slot];
+
+        if (block->mem != NULL) {
+            last = stress_last_word(block->order);
+            if (block->mem[0] != stress_tag(block) || block->mem[last] != stress_tag(block)) {
+                return stress_fail("buddy test: block was overwritten by an overlapping allocation");
+            }
+            free_pages(block->mem, block->order);
+            block->mem = NULL;
+            frees++;
+            continue;
+        }
+
+        block->order = stress_rand() % STRESS_MAX_ORDER;
+        block->mem = alloc_pages(block->order);
+        if (block->mem == NULL) {
+            return stress_fail("buddy test: out of memory");
+        }
+        allocs++;
+
+        if (((uintptr_t)block->mem / PAGE_SIZE) & ((1U << block->order) - 1)) {
+            return stress_fail("buddy test: block is not aligned to its order");
+        }
+
+        last = stress_last_word(block->order);
+        if (block->mem[0] != 0 || block->mem[last] != 0) {
+            return stress_fail("buddy test: block was not zeroed");
+        }
+        block->mem[0] = stress_tag(block);
+        block->mem[last] = stress_tag(block);
+    }
+
+    for (slot = 0; slot < STRESS_SLOTS; slot++) {
+        block = &blocks[slot];
+        if (block->mem != NULL) {
+            free_pages(block->mem, block->order);
+            block->mem = NULL;
+            frees++;
+        }
+    }
+
+    /*
+     * Max order blocks released lazily during the test stay in the free
+     * area, so that one may only grow. Everything below it must match.
+     */
+    for (i = 0; i < MAX_ORDER - 1; i++) {
+        if (mem_free_blocks(i) != before[i]) {
+            return stress_fail("buddy test: free areas did not coalesce back to their initial state");
+        }
+    }
+    if (mem_free_blocks(MAX_ORDER - 1) < before[MAX_ORDER - 1] || mem_free_page_count() != free_before) {
+        return stress_fail("buddy test: pages were lost");
+    }
+    if (mem_check_pages(NULL, NULL) != 0) {
+        return stress_fail("buddy test: page allocator is inconsistent");
+    }
+
+    // The largest order must still be available as one contiguous block
+    big = alloc_pages(MAX_ORDER - 1);
+    if (big == NULL) {
+        return stress_fail("buddy test: could not allocate a max order block");
+    }
+    free_pages(big, MAX_ORDER - 1);
+
+    kprintf("buddy test: %u allocs, %u frees, all blocks coalesced\n", allocs, frees);
+    return 1;
+}
+
+#define SLAB_TEST_OBJS 300
+#define SLAB_TEST_MAGIC 0x51AB51AB
+
+typedef struct {
+    uint32_t magic;
+    uint32_t payload[9];
+} slab_test_obj_t;
+
+static void slab_test_ctor(void* obj) {
+    ((slab_test_obj_t*)obj)->magic = SLAB_TEST_MAGIC;
+}
+
+/**
+ * Allocate enough objects from a constructed cache to span several slabs,
+ * checking alignment, that no object is handed out twice and that the
+ * constructed state survives a free/alloc round trip. Returns 1 on success.
+ */
+int slab_test(void) {
+    static slab_test_obj_t* objs[SLAB_TEST_OBJS];
+    static kmem_cache_t* cache;
+    uint32_t i;
+
+    if (cache == NULL) {
+        cache = kmem_cache_create("slab_test", sizeof(slab_test_obj_t), 16, slab_test_ctor);
+        if (cache == NULL) {
+            return stress_fail("slab test: could not create cache");
+        }
+    }
+
+    for (i = 0; i < SLAB_TEST_OBJS; i++) {
+        objs[i] = kmem_cache_alloc(cache);
+        if (objs[i] == NULL) {
+            return stress_fail("slab test: out of memory");
+        }
+        if ((uintptr_t)objs[i] & 15) {
+            return stress_fail("slab test: object is not aligned");
+        }
+        if (objs[i]->magic != SLAB_TEST_MAGIC) {
+            return stress_fail("slab test: object was handed out twice or not constructed");
+        }
+        objs[i]->magic = i;
+    }
+
+    for (i = 0; i < SLAB_TEST_OBJS; i++) {
+        if (objs[i]->magic != i) {
+            return stress_fail("slab test: objects overlap");
+        }
+        objs[i]->magic = SLAB_TEST_MAGIC;
+        kmem_cache_free(cache, objs[i]);
+    }
+
+    // Objects parked in this core's magazine still count as active
+    kmem_cache_drain(cache);
+    if (cache->active_objs != 0) {
+        return stress_fail("slab test: objects leaked");
+    }
+
+    kprintf("slab test: %u objects in %u per slab, all returned\n", SLAB_TEST_OBJS, cache->objs_per_slab);
+    return 1;
+}
+
+#define VM_TEST_BASE (VM_USER_START + SECTION_SIZE)
+#define VM_TEST_LEN (16 * SECTION_SIZE)
+#define VM_TEST_READS 64
+#define VM_TEST_WRITES 8
+
+static volatile uint32_t* vm_test_word(uint32_t page) {
+    return (volatile uint32_t*)(VM_TEST_BASE + page * PAGE_SIZE);
+}
+
+static int vm_fail(const char* msg) {
+    vm_switch(NULL);
+    return stress_fail(msg);
+}
+
+/**
+ * Walk an address space through demand-zero reads and writes, a clone, and
+ * copy-on-write from both sides, checking contents, reference counts and
+ * that tearing down the clone gives back every page it took.
+ * Returns 1 on success.
+ */
+int vm_test(void) {
+    addr_space_t *parent, *child;
+    vm_stats_t before, after;
+    uint32_t i, stride, free_before;
+
+    vm_get_stats(&before);
+    parent = vm_create();
+    if (parent == NULL || vm_map(parent, VM_TEST_BASE, VM_TEST_LEN, VM_READ | VM_WRITE) != 0) {
+        return stress_fail("vm test: could not set up an address space");
+    }
+    vm_switch(parent);
+
+    // Sparse reads all land on the zero page
+    stride = VM_TEST_LEN / PAGE_SIZE / VM_TEST_READS;
+    for (i = 0; i < VM_TEST_READS; i++) {
+        if (*vm_test_word(i * stride) != 0) {
+            return vm_fail("vm test: untouched page is not zero");
+        }
+    }
+
+    for (i = 0; i < VM_TEST_WRITES; i++) {
+        *vm_test_word(i) = 0xA000 + i;
+    }
+
+    free_before = mem_free_page_count();
+    child = vm_clone(parent);
+    if (child == NULL) {
+        return vm_fail("vm test: clone failed");
+    }
+
+    // The child sees the parent's data, and its first write makes it a private copy
+    vm_switch(child);
+    for (i = 0; i < VM_TEST_WRITES; i++) {
+        if (*vm_test_word(i) != 0xA000 + i) {
+            return vm_fail("vm test: clone does not see the parent's pages");
+        }
+    }
+    *vm_test_word(0) = 0xC0;
+
+    vm_switch(parent);
+    if (*vm_test_word(0) != 0xA000) {
+        return vm_fail("vm test: child write leaked into the parent");
+    }
+    *vm_test_word(1) = 0xB1;
+
+    vm_switch(child);
+    if (*vm_test_word(0) != 0xC0 || *vm_test_word(1) != 0xA001) {
+        return vm_fail("vm test: parent write leaked into the child");
+    }
+
+    vm_destroy(child);
+    if (mem_free_page_count() != free_before) {
+        return vm_fail("vm test: destroying the clone leaked pages");
+    }
+
+    // The parent is the only owner left, so this write keeps the page
+    vm_switch(parent);
+    *vm_test_word(2) = 0xB2;
+
+    if (vm_unmap(parent, VM_TEST_BASE, VM_TEST_LEN / 2) != 0) {
+        return vm_fail("vm test: unmap failed");
+    }
+    vm_switch(NULL);
+    vm_destroy(parent);
+
+    vm_get_stats(&after);
+    kprintf("vm test: %u faults, %u zero page maps, %u demand zero, %u cow copies, %u cow reuses\n",
+            after.faults - before.faults, after.zero_maps - before.zero_maps,
+            after.demand_zero - before.demand_zero, after.cow_copies - before.cow_copies,
+            after.cow_reuses - before.cow_reuses);
+
+    if (after.cow_copies - before.cow_copies != 2 || after.cow_reuses - before.cow_reuses != 1) {
+        return stress_fail("vm test: unexpected copy-on-write behaviour");
+    }
+    return 1;
+}
@@ -0,0 +1,104 @@
+#include <kernel/mmu.h>
+#include <kernel/cache.h>
+#include <kernel/peripheral.h>
+#include <kernel/atomic.h>
+
+/* SCTLR bits */
+#define SCTLR_M (1 << 0)    // MMU
+#define SCTLR_C (1 << 2)    // Data and unified caches
+#define SCTLR_Z (1 << 11)   // Branch prediction
+#define SCTLR_I (1 << 12)   // Instruction cache
+#define SCTLR_XP (1 << 23)  // ARMv6 page table format, subpages off
+
+/* Translation table walks are cacheable, write-back write-allocate (and shareable on ARMv7) */
+#ifdef MODEL_1
+    #define TTBR_WALK_FLAGS ((1 << 0) | (1 << 3))
+#else
+    #define TTBR_WALK_FLAGS ((1 << 6) | (1 << 3) | (1 << 1))
+#endif
+
+/* Set once LDREX/STREX work, see atomic.h */
+volatile int exclusives_ok;
+
+static uint32_t l1_table[L1_TABLE_ENTRIES] __attribute__((aligned(16384)));
+
+static void map_sections(uint32_t start, uint32_t end, uint32_t attrs) {
+    for (; start < end; start += SECTION_SIZE) {
+        l1_table[start / SECTION_SIZE] = start | attrs;
+    }
+}
+
+int mmu_enabled(void) {
+    uint32_t sctlr;
+
+    asm volatile("mrc p15, 0, %0, c1, c0, 0" : "=r"(sctlr));
+    return sctlr & SCTLR_M;
+}
+
+#ifndef NO_MMU
+/* Turn on this core's MMU and caches with the shared kernel table */
+static void mmu_enable(void) {
+    uint32_t reg;
+
+#ifndef MODEL_1
+    // The Cortex-A7 only takes part in cache coherency with ACTLR.SMP set, before caches go on
+    asm volatile("mrc p15, 0, %0, c1, c0, 1" : "=r"(reg));
+    reg |= 1 << 6;
+    asm volatile("mcr p15, 0, %0, c1, c0, 1" :: "r"(reg));
+#else
+    // The ARM1176 doesn't invalidate its caches at reset
+    asm volatile("mcr p15, 0, %0, c7, c7, 0" :: "r"(0));
+#endif
+    dsb();
+
+    asm volatile("mcr p15, 0, %0, c2, c0, 2" :: "r"(0));                        // TTBCR: TTBR0 only
+    asm volatile("mcr p15, 0, %0, c2, c0, 0" :: "r"((uint32_t)l1_table | TTBR_WALK_FLAGS));
+    asm volatile("mcr p15, 0, %0, c3, c0, 0" :: "r"(1));                        // DACR: domain 0 client
+    asm volatile("mcr p15, 0, %0, c8, c7, 0" :: "r"(0));                        // TLBIALL
+    icache_invalidate_all();
+
+    asm volatile("mrc p15, 0, %0, c1, c0, 0" : "=r"(reg));
+    reg |= SCTLR_M | SCTLR_C | SCTLR_Z | SCTLR_I;
+#ifdef MODEL_1
+    reg |= SCTLR_XP;
+#endif
+    asm volatile("mcr p15, 0, %0, c1, c0, 0" :: "r"(reg) : "memory");
+    isb();
+}
+#endif
+
+void mmu_init(void) {
+#ifndef NO_MMU
+    // The table is in .bss, so every other section is already a fault entry
+    map_sections(0, PERIPHERAL_BASE, SECTION_NORMAL);
+    map_sections(PERIPHERAL_BASE, PERIPHERAL_BASE + PERIPHERAL_SIZE, SECTION_DEVICE);
+#ifndef MODEL_1
+    map_sections(LOCAL_PERIPHERAL_BASE, LOCAL_PERIPHERAL_BASE + SECTION_SIZE, SECTION_DEVICE);
+#endif
+    mmu_enable();
+    exclusives_ok = 1;
+#endif
+}
+
+/* Secondary cores reuse the table the boot core built */
+void mmu_init_secondary(void) {
+#ifndef NO_MMU
+    mmu_enable();
+#endif
+}
+
+uint32_t* mmu_kernel_table(void) {
+    return l1_table;
+}
+
+/**
+ * Make l1 the active level 1 table. There are no ASIDs in use, so the whole
+ * TLB goes with the old table.
+ */
+void mmu_switch_table(uint32_t* l1) {
+    dsb();
+    asm volatile("mcr p15, 0, %0, c2, c0, 0" :: "r"((uint32_t)l1 | TTBR_WALK_FLAGS) : "memory");
+    isb();
+    tlb_invalidate_all();
+    icache_invalidate_all();
+}
@@ -0,0 +1,84 @@
+#include <kernel/pmu.h>
+#include <kernel/smp.h>
+#include <kernel/uart.h>
+
+void pmu_init(void) {
+#ifdef MODEL_1
+    // PMNC: enable the counters (bit 0), reset both event counters (bit 1) and the cycle counter (bit 2),
+    // with the events for count 0 in bits 20-27 and count 1 in bits 12-19
+    asm volatile("mcr p15, 0, %0, c15, c12, 0" :: "r"((1 << 0) | (1 << 1) | (1 << 2) |
+                 (PMU_EVTYPE_DCACHE_MISS << 20) | (PMU_EVTYPE_BRANCH_MISS << 12)));
+#else
+    static const uint32_t events[PMU_EVENTS] = { PMU_EVTYPE_DCACHE_MISS, PMU_EVTYPE_BRANCH_MISS };
+    uint32_t pmcr, i;
+
+    // PMXEVTYPER of the counter PMSELR selects
+    for (i = 0; i < PMU_EVENTS; i++) {
+        asm volatile("mcr p15, 0, %0, c9, c12, 5\n\tisb" :: "r"(i) : "memory");
+        asm volatile("mcr p15, 0, %0, c9, c13, 1" :: "r"(events[i]));
+    }
+
+    // PMCR: enable the counters (bit 0), reset the event counters (bit 1) and the cycle counter (bit 2)
+    asm volatile("mrc p15, 0, %0, c9, c12, 0" : "=r"(pmcr));
+    pmcr |= (1 << 0) | (1 << 1) | (1 << 2);
+    asm volatile("mcr p15, 0, %0, c9, c12, 0" :: "r"(pmcr));
+
+    // PMCNTENSET: switch on the cycle counter (bit 31) and the event counters
+    asm volatile("mcr p15, 0, %0, c9, c12, 1" :: "r"((1U << 31) | ((1U << PMU_EVENTS) - 1)));
+#endif
+}
+
+#ifndef MODEL_1
+/* Select a counter for PMXEVTYPER/PMXEVCNTR and return the previous selection */
+static uint32_t pmu_select(uint32_t counter) {
+    uint32_t old;
+
+    asm volatile("mrc p15, 0, %0, c9, c12, 5" : "=r"(old));
+    asm volatile("mcr p15, 0, %0, c9, c12, 5\n\tisb" :: "r"(counter) : "memory");
+    return old;
+}
+
+/**
+ * Count CPU cycles on PMU_OVERFLOW_COUNTER from period short of overflowing
+ * and route the overflow interrupt to this core. Called with IRQs masked,
+ * here and from the overflow IRQ the selection is put back afterwards, as
+ * an interrupted pmu_event() may be between selecting and reading.
+ */
+void pmu_overflow_start(uint32_t period) {
+    uint32_t old = pmu_select(PMU_OVERFLOW_COUNTER);
+
+    asm volatile("mcr p15, 0, %0, c9, c13, 1" :: "r"(PMU_EVTYPE_CPU_CYCLES));
+    asm volatile("mcr p15, 0, %0, c9, c13, 2" :: "r"(-period));
+    pmu_select(old);
+
+    // PMOVSR clear, PMINTENSET and PMCNTENSET
+    asm volatile("mcr p15, 0, %0, c9, c12, 3" :: "r"(1U << PMU_OVERFLOW_COUNTER));
+    asm volatile("mcr p15, 0, %0, c9, c14, 1" :: "r"(1U << PMU_OVERFLOW_COUNTER));
+    asm volatile("mcr p15, 0, %0, c9, c12, 1" :: "r"(1U << PMU_OVERFLOW_COUNTER));
+    mmio_write(PMU_IRQ_ROUTING_SET, 1U << smp_processor_id());
+}
+
+/* From the overflow IRQ: start the next period and drop the interrupt, returns 0 if the counter hadn't overflowed */
+int pmu_overflow_rearm(uint32_t period) {
+    uint32_t overflow, old;
+
+    asm volatile("mrc p15, 0, %0, c9, c12, 3" : "=r"(overflow));
+    if (!(overflow & (1U << PMU_OVERFLOW_COUNTER))) {
+        return 0;
+    }
+
+    old = pmu_select(PMU_OVERFLOW_COUNTER);
+    asm volatile("mcr p15, 0, %0, c9, c13, 2" :: "r"(-period));
+    pmu_select(old);
+    asm volatile("mcr p15, 0, %0, c9, c12, 3" :: "r"(1U << PMU_OVERFLOW_COUNTER));
+    return 1;
+}
+
+void pmu_overflow_stop(void) {
+    // PMCNTENCLR, PMINTENCLR and PMOVSR clear
+    asm volatile("mcr p15, 0, %0, c9, c12, 2" :: "r"(1U << PMU_OVERFLOW_COUNTER));
+    asm volatile("mcr p15, 0, %0, c9, c14, 2" :: "r"(1U << PMU_OVERFLOW_COUNTER));
+    asm volatile("mcr p15, 0, %0, c9, c12, 3" :: "r"(1U << PMU_OVERFLOW_COUNTER));
+    mmio_write(PMU_IRQ_ROUTING_CLR, 1U << smp_processor_id());
+}
+#endif
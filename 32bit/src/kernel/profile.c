@@ -0,0 +1,288 @@
+#include <kernel/profile.h>
+#include <kernel/ksyms.h>
+#include <kernel/pmu.h>
+#include <kernel/irq.h>
+#include <kernel/trap.h>
+#include <kernel/timer.h>
+#include <kernel/sched.h>
+#include <kernel/workqueue.h>
+#include <kernel/barrier.h>
+#include <kernel/mem.h>
+#include <common/stdio.h>
+#include <common/stdlib.h>
+
+#ifdef MODEL_1
+    #define PROFILE_CHANNEL 3
+    #define PROFILE_IRQ IRQ_SYSTEM_TIMER(PROFILE_CHANNEL)
+#else
+    #define PROFILE_IRQ IRQ_LOCAL(CORE_IRQ_PMU)
+#endif
+
+#define PROFILE_BUF_SAMPLES ((PAGE_SIZE << PROFILE_BUF_ORDER) / sizeof(profile_sample_t))
+
+/* Only written by its own core's profile_handler(), apart from the reset before a run */
+typedef struct profile_buf {
+    profile_sample_t* samples;
+    volatile uint32_t count;
+    uint32_t dropped;           // Samples lost to a full buffer
+} __attribute__((aligned(64))) profile_buf_t;
+
+static profile_buf_t profile_bufs[NR_CPUS];
+static work_t profile_arm_work[NR_CPUS];
+static volatile uint32_t profile_running;
+static uint32_t profile_registered;
+
+/* From the linker script and boot.S */
+extern uint8_t __start;
+extern uint8_t __cpu_stacks[];
+
+/* Top of the stack sp is on, or sp itself if it isn't one we know */
+static uint32_t stack_top(uint32_t sp) {
+    thread_t* thread = thread_current();
+    uint32_t base, size = PAGE_SIZE << THREAD_STACK_ORDER;
+
+    if (thread != NULL && thread->stack != NULL) {
+        base = (uint32_t)thread->stack;
+        return sp - base < size ? base + size : sp;
+    }
+
+    // Core 0's boot stack is right below the image, the others have their stack areas
+    if (sp < (uint32_t)&__start) {
+        return (uint32_t)&__start;
+    }
+    base = (uint32_t)__cpu_stacks + smp_processor_id() * CPU_STACK_SIZE;
+    return sp - base < CPU_STACK_SIZE ? base + CPU_STACK_SIZE : sp;
+}
+
+/**
+ * Follow the frame pointer chain of the interrupted code. gcc's ARM
+ * prologues push fp and lr next to each other and point fp at the saved
+ * lr, with the caller's fp the word below. Leaf functions only push fp
+ * and point fp at that, which shows as a first frame that holds no code
+ * address, and the return address is still in lr. Frames have to go up
+ * the interrupted stack and return into the kernel text, otherwise the
+ * walk stops, as code built without frame pointers uses r11 for anything.
+ */
+static void profile_unwind(const irq_frame_t* frame, uint32_t* callers) {
+    uint32_t n = 0;
+#ifndef NO_CALLCHAIN
+    uint32_t low = (uint32_t)(frame + 1), high = stack_top(low);
+    uint32_t fp = frame->fp, next, ret;
+
+    if (fp >= low && fp + 4 <= high && !(fp & 3) && !kernel_text(*(uint32_t*)fp)) {
+        if (kernel_text(frame->lr)) {
+            callers[n++] = frame->lr;
+        }
+        next = *(uint32_t*)fp;
+        fp = next > fp ? next : 0;
+    }
+
+    while (n < PROFILE_DEPTH && fp >= low + 4 && fp + 4 <= high && !(fp & 3)) {
+        ret = *(uint32_t*)fp;
+        if (!kernel_text(ret)) {
+            break;
+        }
+        callers[n++] = ret;
+        next = *(uint32_t*)(fp - 4);
+        if (next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+#else
+    (void)frame;
+#endif
+
+    while (n < PROFILE_DEPTH) {
+        callers[n++] = 0;
+    }
+}
+
+/* The sample interrupt, with IRQs masked */
+static void profile_handler(void* arg) {
+    cpu_data_t* cpu = this_cpu();
+    profile_buf_t* buf = &profile_bufs[cpu->cpu];
+    profile_sample_t* sample;
+    (void)arg;
+
+#ifdef MODEL_1
+    systimer_ack(PROFILE_CHANNEL);
+    if (!profile_running) {
+        irq_disable(PROFILE_IRQ);
+        return;
+    }
+    systimer_set_compare(PROFILE_CHANNEL, mmio_read(SYSTEM_TIMER_CLO) + PROFILE_PERIOD_US);
+#else
+    if (!profile_running) {
+        pmu_overflow_stop();
+        return;
+    }
+    if (!pmu_overflow_rearm(PROFILE_PERIOD_CYCLES)) {
+        return;
+    }
+#endif
+
+    if (buf->count == PROFILE_BUF_SAMPLES) {
+        buf->dropped++;
+        return;
+    }
+    sample = &buf->samples[buf->count];
+    sample->pc = cpu->irq_frame->pc;
+    profile_unwind(cpu->irq_frame, sample->callers);
+    dmb();
+    buf->count++;
+}
+
+/* Run by each core's worker, the sample source has to be started on the core it interrupts */
+static void profile_arm(void* arg) {
+    uint32_t flags = irq_save();
+    (void)arg;
+
+    if (profile_running) {
+#ifdef MODEL_1
+        systimer_ack(PROFILE_CHANNEL);
+        systimer_set_compare(PROFILE_CHANNEL, mmio_read(SYSTEM_TIMER_CLO) + PROFILE_PERIOD_US);
+        irq_enable(PROFILE_IRQ);
+#else
+        pmu_overflow_start(PROFILE_PERIOD_CYCLES);
+#endif
+    }
+    irq_restore(flags);
+}
+
+/* Start sampling on every online core, with empty buffers */
+int profile_start(void) {
+    profile_buf_t* buf;
+    uint32_t cpu;
+
+    if (profile_running) {
+        error("profile_start: the profiler is already running");
+        return -1;
+    }
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        buf = &profile_bufs[cpu];
+        if (!cpu_data[cpu].online) {
+            continue;
+        }
+        if (buf->samples == NULL && (buf->samples = alloc_pages(PROFILE_BUF_ORDER)) == NULL) {
+            error("profile_start: out of memory");
+            return -1;
+        }
+        buf->count = 0;
+        buf->dropped = 0;
+    }
+
+    if (!profile_registered) {
+        if (irq_register(PROFILE_IRQ, profile_handler, NULL, 0, "profile") != 0) {
+            return -1;
+        }
+        profile_registered = 1;
+    }
+
+    dmb();
+    profile_running = 1;
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (cpu_data[cpu].online) {
+            work_init(&profile_arm_work[cpu], profile_arm, NULL);
+            queue_work_on(system_wq, cpu, &profile_arm_work[cpu]);
+        }
+    }
+    return 0;
+}
+
+/* Each core's sample source switches itself off at its next interrupt */
+void profile_stop(void) {
+    profile_running = 0;
+    dmb();
+}
+
+/* Bucket for a code address, the last one is for addresses without a symbol */
+static uint32_t profile_bucket(uint32_t addr) {
+    uint32_t index = ksym_find(addr);
+
+    return index == KSYM_NONE ? ksym_count() : index;
+}
+
+/* Count one sample, each function once however often it is in the chain */
+static void profile_count(const profile_sample_t* sample, uint32_t* self, uint32_t* total) {
+    uint32_t buckets[1 + PROFILE_DEPTH];
+    uint32_t i, j, n = 0;
+
+    buckets[n++] = profile_bucket(sample->pc);
+    self[buckets[0]]++;
+    // A return address is past its call, which may be the last instruction of the caller
+    for (i = 0; i < PROFILE_DEPTH && sample->callers[i] != 0; i++) {
+        buckets[n++] = profile_bucket(sample->callers[i] - 4);
+    }
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < i && buckets[j] != buckets[i]; j++) {
+        }
+        if (j == i) {
+            total[buckets[i]]++;
+        }
+    }
+}
+
+/**
+ * Print the functions with the most samples. Self is where the samples
+ * hit, total also counts the samples taken in the functions they called,
+ * as far as the call chains go.
+ */
+void profile_report(void) {
+    uint32_t nr_buckets = ksym_count() + 1, samples = 0, dropped = 0;
+    uint32_t *self, *total, cpu, count, i, line, best;
+
+    self = kmalloc(nr_buckets * sizeof(uint32_t));
+    total = kmalloc(nr_buckets * sizeof(uint32_t));
+    if (self == NULL || total == NULL) {
+        error("profile_report: out of memory");
+        kfree(self);
+        kfree(total);
+        return;
+    }
+    bzero(self, nr_buckets * sizeof(uint32_t));
+    bzero(total, nr_buckets * sizeof(uint32_t));
+
+    puts("profile:");
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (profile_bufs[cpu].samples == NULL) {
+            continue;
+        }
+        count = profile_bufs[cpu].count;
+        dmb();
+        for (i = 0; i < count; i++) {
+            profile_count(&profile_bufs[cpu].samples[i], self, total);
+        }
+        kprintf(" cpu%u %u", cpu, count);
+        samples += count;
+        dropped += profile_bufs[cpu].dropped;
+    }
+    kprintf(" samples, %u dropped to full buffers%s\n", dropped, profile_running ? ", still running" : "");
+
+    if (samples == 0) {
+        puts("Nothing sampled, start the profiler with 'prof_start'\n");
+    } else {
+        puts(" self%  total%   samples  function\n");
+        // Selection of the largest remaining self count, the table is short
+        for (line = 0; line < PROFILE_REPORT_LINES; line++) {
+            best = 0;
+            for (i = 1; i < nr_buckets; i++) {
+                if (self[i] > self[best]) {
+                    best = i;
+                }
+            }
+            if (self[best] == 0) {
+                break;
+            }
+            kprintf("%3u.%u%%  %3u.%u%%  %8u  %s\n", self[best] * 100 / samples, self[best] * 1000 / samples % 10,
+                    total[best] * 100 / samples, total[best] * 1000 / samples % 10, self[best],
+                    best < nr_buckets - 1 ? ksym_name(best) : "[no symbol]");
+            self[best] = 0;
+        }
+    }
+
+    kfree(self);
+    kfree(total);
+}
@@ -0,0 +1,590 @@
+#include <kernel/sched.h>
+#include <kernel/slab.h>
+#include <kernel/mem.h>
+#include <kernel/timer.h>
+#include <kernel/atomic.h>
+#include <kernel/irq.h>
+#include <kernel/softirq.h>
+#include <kernel/trace.h>
+#include <common/stdio.h>
+#include <common/stdlib.h>
+
+IMPLEMENT_LIST(thread);
+
+static runqueue_t runqueues[NR_CPUS];
+static kmem_cache_t* thread_cache;
+static volatile uint32_t next_thread_id;
+
+/* The contexts the cores booted on: kernel_main on core 0, the idle loops on the others */
+static thread_t boot_threads[NR_CPUS];
+
+static const char* const rq_lock_names[] = { "runqueue0", "runqueue1", "runqueue2", "runqueue3" };
+static const char* const idle_names[] = { "idle0", "idle1", "idle2", "idle3" };
+
+/* Defined in switch.S */
+extern void context_switch(uint32_t** prev_sp, uint32_t* next_sp);
+extern void thread_trampoline(void);
+
+static void sched_tick(void* arg);
+
+/* Words context_switch() keeps on a switched out stack: r4-r11, r12 and lr */
+#define SWITCH_FRAME_WORDS 10
+
+static inline runqueue_t* this_rq(void) {
+    return &runqueues[smp_processor_id()];
+}
+
+static void enqueue(runqueue_t* rq, thread_t* thread) {
+    append_thread_list(&rq->queues[thread->priority], thread);
+    rq->bitmap |= 1U << thread->priority;
+    rq->nr_queued++;
+}
+
+static void dequeue(runqueue_t* rq, thread_t* thread) {
+    remove_thread_list(&rq->queues[thread->priority], thread);
+    if (size_thread_list(&rq->queues[thread->priority]) == 0) {
+        rq->bitmap &= ~(1U << thread->priority);
+    }
+    rq->nr_queued--;
+}
+
+/* Oldest thread of the highest waiting priority */
+static thread_t* pick_next(runqueue_t* rq) {
+    thread_t* thread;
+
+    if (rq->bitmap == 0) {
+        return NULL;
+    }
+    thread = peek_thread_list(&rq->queues[31 - __builtin_clz(rq->bitmap)]);
+    dequeue(rq, thread);
+    return thread;
+}
+
+/**
+ * The second half of every switch, run by the thread switched to: drop the
+ * run queue lock the previous thread took, and free it if it exited.
+ */
+static void sched_finish_switch(void) {
+    runqueue_t* rq = this_rq();
+    thread_t* dead = rq->dead;
+
+    rq->dead = NULL;
+    spin_unlock(&rq->lock);
+
+    if (dead != NULL && dead->stack != NULL) {
+        free_pages(dead->stack, THREAD_STACK_ORDER);
+        kmem_cache_free(thread_cache, dead);
+    }
+}
+
+/**
+ * Switch to the next thread. Called with IRQs masked and rq locked, returns
+ * with the lock dropped once this thread is switched back in, which may be
+ * on another core if it was stolen meanwhile.
+ */
+static void __schedule(runqueue_t* rq) {
+    thread_t *prev = rq->current, *next;
+
+    if (prev->state == THREAD_RUNNING && prev != rq->idle) {
+        enqueue(rq, prev);
+    }
+
+    next = pick_next(rq);
+    if (next == NULL) {
+        next = rq->idle;
+    }
+    next->slice = SCHED_SLICE_TICKS;
+    rq->need_resched = 0;
+
+    // Tick only while there is something to preempt
+    if (next == rq->idle) {
+        if (rq->tick_active) {
+            timer_cancel(&rq->tick_timer);
+            rq->tick_active = 0;
+        }
+    } else if (!rq->tick_active) {
+        timer_add(&rq->tick_timer, timer_now_us() + SCHED_TICK_US, sched_tick, rq);
+        rq->tick_active = 1;
+    }
+
+    if (next != prev) {
+        rq->current = next;
+        rq->switches++;
+        next->switches++;
+        trace(TRACE_SWITCH, prev->state, prev->id, next->id);
+        context_switch(&prev->sp, next->sp);
+    }
+    sched_finish_switch();
+}
+
+void schedule(void) {
+    uint32_t flags = irq_save();
+    runqueue_t* rq = this_rq();
+
+    spin_lock(&rq->lock);
+    __schedule(rq);
+    irq_restore(flags);
+}
+
+/* Go to the back of this priority's queue */
+void thread_yield(void) {
+    schedule();
+}
+
+/**
+ * Make a sleeping or blocked thread runnable again, rq must be its run
+ * queue and locked. A thread that blocked but hasn't switched away yet is
+ * still rq->current and must not be queued as well.
+ */
+static void wake_locked(runqueue_t* rq, thread_t* thread) {
+    thread_t* current = rq->current;
+
+    thread->state = THREAD_RUNNING;
+    rq->nr_sleeping--;
+    if (thread == current) {
+        return;
+    }
+    enqueue(rq, thread);
+    if (current == rq->idle || thread->priority > current->priority) {
+        rq->need_resched = 1;
+    }
+}
+
+/* sleep_timer callback, on the core the thread went to sleep on */
+static void sched_wakeup(void* arg) {
+    thread_t* thread = arg;
+    runqueue_t* rq = &runqueues[thread->cpu];
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&rq->lock);
+    wake_locked(rq, thread);
+    spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+void thread_sleep_us(uint64_t us) {
+    uint32_t flags = irq_save();
+    runqueue_t* rq = this_rq();
+    thread_t* self;
+
+    spin_lock(&rq->lock);
+    self = rq->current;
+    if (self == rq->idle) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        error("thread_sleep_us: the idle thread can't sleep");
+        return;
+    }
+
+    self->state = THREAD_SLEEPING;
+    rq->nr_sleeping++;
+    timer_add(&self->sleep_timer, timer_now_us() + us, sched_wakeup, self);
+    __schedule(rq);
+    irq_restore(flags);
+}
+
+/**
+ * First half of blocking until thread_wake(): mark the calling thread
+ * blocked, then check whatever it waits for and call thread_block() if it
+ * still has to wait. A wakeup that comes in between makes thread_block()
+ * return at once, so it can't be lost.
+ */
+void thread_prepare_block(void) {
+    uint32_t flags = irq_save();
+    runqueue_t* rq = this_rq();
+
+    spin_lock(&rq->lock);
+    if (rq->current == rq->idle) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        panic("thread_prepare_block: the idle thread can't block");
+    }
+    rq->current->state = THREAD_BLOCKED;
+    rq->nr_sleeping++;
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+/* Switch away unless thread_wake() got here first since thread_prepare_block() */
+void thread_block(void) {
+    uint32_t flags = irq_save();
+    runqueue_t* rq = this_rq();
+
+    spin_lock(&rq->lock);
+    if (rq->current->state == THREAD_BLOCKED) {
+        __schedule(rq);
+    } else {
+        spin_unlock(&rq->lock);
+    }
+    irq_restore(flags);
+}
+
+/**
+ * Wake a thread that blocked with thread_prepare_block(), from any context
+ * and core. Returns 0 if it wasn't blocked. The woken thread preempts at
+ * the next IRQ exit or tick, not from in here, as callers may hold locks.
+ */
+int thread_wake(thread_t* thread) {
+    uint32_t flags = irq_save(), cpu;
+    runqueue_t* rq;
+
+    // A blocked thread stays on its core, a running one may move, look again under the lock
+    while (1) {
+        cpu = thread->cpu;
+        rq = &runqueues[cpu];
+        spin_lock(&rq->lock);
+        if (thread->cpu == cpu) {
+            break;
+        }
+        spin_unlock(&rq->lock);
+    }
+
+    if (thread->state != THREAD_BLOCKED) {
+        spin_unlock(&rq->lock);
+        irq_restore(flags);
+        return 0;
+    }
+    wake_locked(rq, thread);
+    spin_unlock(&rq->lock);
+
+    if (cpu != smp_processor_id()) {
+        sev();
+    }
+    irq_restore(flags);
+    return 1;
+}
+
+void thread_exit(void) {
+    runqueue_t* rq;
+
+    irq_save();
+    rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->current->state = THREAD_DEAD;
+    rq->dead = rq->current;
+    __schedule(rq);
+
+    panic("thread_exit: an exited thread was switched back in");
+}
+
+thread_t* thread_current(void) {
+    uint32_t flags = irq_save();
+    thread_t* thread = this_rq()->current;
+
+    irq_restore(flags);
+    return thread;
+}
+
+/* C side of thread_trampoline, the first thing a new thread runs */
+void sched_thread_start(thread_t* thread) {
+    sched_finish_switch();
+    enable_interrupts();
+
+    thread->entry(thread->arg);
+    thread_exit();
+}
+
+/* Allocate a thread with a stack set up so the first switch to it lands in thread_trampoline */
+static thread_t* thread_alloc(const char* name, thread_fn_t fn, void* arg, uint32_t priority) {
+    thread_t* thread;
+    uint32_t* sp;
+
+    if (priority >= SCHED_PRIORITIES) {
+        error("thread_create: bad priority %u", priority);
+        return NULL;
+    }
+
+    thread = kmem_cache_alloc(thread_cache);
+    if (thread == NULL) {
+        error("thread_create: out of memory");
+        return NULL;
+    }
+    bzero(thread, sizeof(thread_t));
+
+    thread->stack = alloc_pages(THREAD_STACK_ORDER);
+    if (thread->stack == NULL) {
+        kmem_cache_free(thread_cache, thread);
+        error("thread_create: out of memory for the stack");
+        return NULL;
+    }
+
+    // The stack comes zeroed, r4 carries the thread and lr the entry
+    sp = (uint32_t*)((uint8_t*)thread->stack + (PAGE_SIZE << THREAD_STACK_ORDER)) - SWITCH_FRAME_WORDS;
+    sp[0] = (uint32_t)thread;
+    sp[SWITCH_FRAME_WORDS - 1] = (uint32_t)thread_trampoline;
+    thread->sp = sp;
+
+    thread->name = name;
+    thread->id = atomic_add_return(&next_thread_id, 1);
+    thread->state = THREAD_RUNNING;
+    thread->priority = priority;
+    thread->entry = fn;
+    thread->arg = arg;
+    return thread;
+}
+
+/**
+ * Start a thread on the given core's run queue and keep it there, or with
+ * THREAD_ANY_CPU on this core's queue where idle cores may steal it.
+ */
+thread_t* thread_create_on(const char* name, thread_fn_t fn, void* arg, uint32_t priority, uint32_t cpu) {
+    thread_t *thread, *current;
+    runqueue_t* rq;
+    uint32_t flags;
+
+    if (cpu != THREAD_ANY_CPU && (cpu >= NR_CPUS || !cpu_data[cpu].online)) {
+        error("thread_create: cpu %u is not online", cpu);
+        return NULL;
+    }
+
+    thread = thread_alloc(name, fn, arg, priority);
+    if (thread == NULL) {
+        return NULL;
+    }
+
+    flags = irq_save();
+    if (cpu == THREAD_ANY_CPU) {
+        cpu = smp_processor_id();
+    } else {
+        thread->pinned = 1;
+    }
+    thread->cpu = cpu;
+
+    rq = &runqueues[cpu];
+    spin_lock(&rq->lock);
+    enqueue(rq, thread);
+    current = rq->current;
+    spin_unlock(&rq->lock);
+
+    // Run it now if it outranks us, otherwise let idle cores know there is something to steal
+    if (cpu == smp_processor_id() && (current == rq->idle || priority > current->priority)) {
+        schedule();
+    } else {
+        sev();
+    }
+    irq_restore(flags);
+    return thread;
+}
+
+thread_t* thread_create(const char* name, thread_fn_t fn, void* arg, uint32_t priority) {
+    return thread_create_on(name, fn, arg, priority, THREAD_ANY_CPU);
+}
+
+/**
+ * Per-core tick, a wheel timer armed while a thread other than idle runs:
+ * ask for a switch if the running thread should give way, and let idle
+ * cores know there are threads waiting here.
+ */
+static void sched_tick(void* arg) {
+    runqueue_t* rq = arg;
+    thread_t* current;
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&rq->lock);
+    rq->ticks++;
+
+    current = rq->current;
+    if (current == rq->idle) {
+        rq->tick_active = 0;
+        rq->need_resched = rq->bitmap != 0;
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+
+    if (current->slice > 0) {
+        current->slice--;
+    }
+    // Higher priorities preempt at once, equal ones once the slice is used up
+    if ((rq->bitmap >> (current->priority + 1)) != 0 ||
+            (current->slice == 0 && (rq->bitmap >> current->priority) != 0)) {
+        rq->need_resched = 1;
+    }
+    timer_add(&rq->tick_timer, timer_now_us() + SCHED_TICK_US, sched_tick, rq);
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    if (rq->nr_queued > 0) {
+        sev();
+    }
+}
+
+/**
+ * Called by irq_entry on the interrupted thread's stack, with IRQs still
+ * masked. Nested IRQs leave it to the outermost, and an IRQ that came in
+ * while softirqs ran leaves it to the one they ran from.
+ */
+void sched_irq_exit(void) {
+    if (this_cpu()->irq_depth == 0 && !in_softirq() && this_rq()->need_resched) {
+        schedule();
+    }
+}
+
+/**
+ * Move one waiting thread from the core with the longest queue to this
+ * one. The victim is picked from an unlocked look at the queue lengths and
+ * only one run queue lock is held at a time, so two cores stealing from
+ * each other can't deadlock. IRQs must be masked.
+ */
+static int sched_steal(runqueue_t* rq) {
+    uint32_t cpu, self = rq - runqueues, victim_cpu = NR_CPUS, most = 0;
+    thread_t* thread = NULL;
+    runqueue_t* victim;
+    int prio;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (cpu != self && runqueues[cpu].nr_queued > most) {
+            most = runqueues[cpu].nr_queued;
+            victim_cpu = cpu;
+        }
+    }
+    if (victim_cpu == NR_CPUS) {
+        return 0;
+    }
+
+    victim = &runqueues[victim_cpu];
+    spin_lock(&victim->lock);
+    for (prio = SCHED_PRIORITIES - 1; prio >= 0 && thread == NULL; prio--) {
+        for (thread = victim->queues[prio].head; thread != NULL && thread->pinned; thread = next_thread_list(thread)) {
+        }
+    }
+    if (thread != NULL) {
+        dequeue(victim, thread);
+    }
+    spin_unlock(&victim->lock);
+
+    if (thread == NULL) {
+        return 0;
+    }
+
+    spin_lock(&rq->lock);
+    thread->cpu = self;
+    enqueue(rq, thread);
+    rq->steals++;
+    spin_unlock(&rq->lock);
+    return 1;
+}
+
+/**
+ * What a core runs when its queue is empty: cross-calls from
+ * smp_call_others(), softirqs the last IRQ exit left over, then stealing,
+ * then wfe until an interrupt or event. Never sleeps or exits.
+ */
+static void sched_idle(void* arg) {
+    runqueue_t* rq;
+    uint32_t flags;
+
+    (void)arg;
+    while (1) {
+        smp_run_call();
+
+        flags = irq_save();
+        if (this_cpu()->softirq_pending) {
+            softirq_run();
+        }
+        rq = this_rq();
+        if (rq->nr_queued == 0 && !sched_steal(rq)) {
+            irq_restore(flags);
+            wfe();
+            continue;
+        }
+        irq_restore(flags);
+        schedule();
+    }
+}
+
+/* Turn the code this core is running into a thread, it keeps its boot stack */
+static thread_t* sched_adopt_boot(uint32_t cpu, const char* name, uint32_t priority) {
+    thread_t* thread = &boot_threads[cpu];
+
+    thread->name = name;
+    thread->id = atomic_add_return(&next_thread_id, 1);
+    thread->state = THREAD_RUNNING;
+    thread->priority = priority;
+    thread->cpu = cpu;
+    thread->pinned = 1;
+    thread->slice = SCHED_SLICE_TICKS;
+    runqueues[cpu].current = thread;
+    return thread;
+}
+
+/**
+ * Set up the run queues and turn kernel_main into the "shell" thread,
+ * pinned to core 0 as smp_call_wait() needs the other cores' idle threads.
+ * Call before smp_init(), preemption starts with sched_start().
+ */
+void sched_init(void) {
+    runqueue_t* rq;
+    uint32_t cpu, prio;
+
+    thread_cache = kmem_cache_create("thread", sizeof(thread_t), 0, NULL);
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        rq = &runqueues[cpu];
+        spin_lock_init(&rq->lock, rq_lock_names[cpu]);
+        for (prio = 0; prio < SCHED_PRIORITIES; prio++) {
+            INITIALIZE_LIST(rq->queues[prio]);
+        }
+    }
+    timer_wheel_init();
+
+    sched_adopt_boot(0, "shell", SCHED_PRIO_NORMAL);
+    runqueues[0].idle = thread_alloc(idle_names[0], sched_idle, NULL, SCHED_PRIO_LOW);
+    if (runqueues[0].idle == NULL) {
+        panic("sched_init: could not create the idle thread");
+    }
+    runqueues[0].idle->pinned = 1;
+}
+
+/* Start core 0's clock event and the shell thread's tick, after interrupts_init() */
+void sched_start(void) {
+    runqueue_t* rq = this_rq();
+    uint32_t flags;
+
+    clockevent_init();
+
+    flags = spin_lock_irqsave(&rq->lock);
+    timer_add(&rq->tick_timer, timer_now_us() + SCHED_TICK_US, sched_tick, rq);
+    rq->tick_active = 1;
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    info("Scheduler running, %u Hz tick while busy", 1000000 / SCHED_TICK_US);
+}
+
+/* Where a secondary core ends up once it is online: it becomes its own idle thread */
+void sched_start_secondary(void) {
+    uint32_t cpu = smp_processor_id();
+    thread_t* idle;
+
+    idle = sched_adopt_boot(cpu, idle_names[cpu], SCHED_PRIO_LOW);
+    runqueues[cpu].idle = idle;
+
+    clockevent_init();
+    enable_interrupts();
+    sched_idle(NULL);
+}
+
+void sched_info(void) {
+    runqueue_t* rq;
+    const char* current;
+    uint32_t cpu, flags, queued, sleeping, switches, steals;
+    uint64_t ticks;
+
+    puts("cpu  current       queued  sleeping    switches    steals       ticks\n");
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (!cpu_data[cpu].online) {
+            continue;
+        }
+
+        // Copy under the lock, print outside it
+        rq = &runqueues[cpu];
+        flags = spin_lock_irqsave(&rq->lock);
+        current = rq->current != NULL ? rq->current->name : "-";
+        queued = rq->nr_queued;
+        sleeping = rq->nr_sleeping;
+        switches = rq->switches;
+        steals = rq->steals;
+        ticks = rq->ticks;
+        spin_unlock_irqrestore(&rq->lock, flags);
+
+        kprintf("%3u  %-12s  %6u  %8u  %10u  %8u  %10llu\n", cpu, current, queued, sleeping, switches, steals,
+                ticks);
+    }
+}
@@ -0,0 +1,357 @@
+#include <kernel/slab.h>
+#include <kernel/mem.h>
+#include <common/stdio.h>
+#include <common/stdlib.h>
+
+IMPLEMENT_LIST(slab);
+
+DEFINE_LIST(kmem_cache);
+IMPLEMENT_LIST(kmem_cache);
+
+/* Every cache, for reporting */
+static kmem_cache_list_t cache_list;
+
+static spinlock_t cache_list_lock;
+
+/* The cache that kmem_cache_t descriptors themselves are allocated from */
+static kmem_cache_t cache_cache;
+
+/* Magazine depth new caches start with */
+static uint32_t default_mag_depth = MAG_DEPTH;
+
+#define ROUND_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+static inline slab_t* obj_to_slab(void* obj) {
+    return (slab_t*)((uintptr_t)obj & ~(uintptr_t)(PAGE_SIZE - 1));
+}
+
+static inline void** obj_free_link(kmem_cache_t* cache, void* obj) {
+    return (void**)((uint8_t*)obj + cache->free_offset);
+}
+
+/**
+ * Work out the page layout for a cache: the object stride, how many objects
+ * fit after the slab descriptor, and how many cache line colors fit in the
+ * slack that is left over.
+ */
+static void kmem_cache_setup(kmem_cache_t* cache, const char* name, uint32_t size, uint32_t align, kmem_ctor_t ctor) {
+    uint32_t slack;
+
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+
+    bzero(cache, sizeof(kmem_cache_t));
+    cache->name = name;
+    cache->object_size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+
+    /*
+     * A free object stores its free list link in its first word, unless a
+     * constructor ran on it, in which case the link goes after the object so
+     * the constructed state survives a free.
+     */
+    if (ctor != NULL) {
+        cache->free_offset = ROUND_UP(size, sizeof(void*));
+        size = cache->free_offset + sizeof(void*);
+    } else {
+        cache->free_offset = 0;
+        if (size < sizeof(void*)) {
+            size = sizeof(void*);
+        }
+    }
+
+    cache->stride = ROUND_UP(size, align);
+    cache->objs_offset = ROUND_UP(sizeof(slab_t), align);
+    cache->objs_per_slab = (PAGE_SIZE - cache->objs_offset) / cache->stride;
+
+    slack = PAGE_SIZE - cache->objs_offset - cache->objs_per_slab * cache->stride;
+    cache->color_step = align > L1_CACHE_BYTES ? align : L1_CACHE_BYTES;
+    cache->color_count = slack / cache->color_step + 1;
+    cache->color_next = 0;
+
+    INITIALIZE_LIST(cache->slabs_partial);
+    INITIALIZE_LIST(cache->slabs_full);
+    INITIALIZE_LIST(cache->slabs_free);
+    cache->mag_depth = default_mag_depth;
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, uint32_t size, uint32_t align, kmem_ctor_t ctor) {
+    kmem_cache_t* cache;
+    uint32_t flags;
+
+    if (size == 0 || size > PAGE_SIZE || (align & (align - 1)) != 0 || align > PAGE_SIZE / 2) {
+        error("kmem_cache_create: bad object size or alignment");
+        return NULL;
+    }
+
+    // The first cache is created by mem_init() while only the boot core runs
+    if (cache_cache.name == NULL) {
+        INITIALIZE_LIST(cache_list);
+        spin_lock_init(&cache_list_lock, "kmem_cache_list");
+        kmem_cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0, NULL);
+        spin_lock_init(&cache_cache.lock, cache_cache.name);
+        append_kmem_cache_list(&cache_list, &cache_cache);
+    }
+
+    cache = kmem_cache_alloc(&cache_cache);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    // There has to be room for at least one object after the slab descriptor
+    kmem_cache_setup(cache, name, size, align, ctor);
+    if (cache->objs_per_slab == 0) {
+        kmem_cache_free(&cache_cache, cache);
+        error("kmem_cache_create: object does not fit in a slab");
+        return NULL;
+    }
+
+    spin_lock_init(&cache->lock, name);
+    flags = spin_lock_irqsave(&cache_list_lock);
+    append_kmem_cache_list(&cache_list, cache);
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+    return cache;
+}
+
+/* Populate a new slab from a fresh page and put it on the free slab list */
+static slab_t* kmem_cache_grow(kmem_cache_t* cache) {
+    slab_t* slab;
+    uint8_t* obj;
+    void* page;
+    uint32_t i;
+
+    // Every byte that matters is written below, so skip zeroing the page
+    page = alloc_page_flags(0);
+    if (page == NULL) {
+        return NULL;
+    }
+
+    slab = page;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->color = cache->color_next * cache->color_step;
+    cache->color_next = (cache->color_next + 1) % cache->color_count;
+
+    // Build the free list back to front so objects are handed out in address order
+    slab->free_list = NULL;
+    obj = (uint8_t*)page + cache->objs_offset + slab->color + (cache->objs_per_slab - 1) * cache->stride;
+    for (i = 0; i < cache->objs_per_slab; i++, obj -= cache->stride) {
+        if (cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+        *obj_free_link(cache, obj) = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    cache->total_objs += cache->objs_per_slab;
+    append_slab_list(&cache->slabs_free, slab);
+    return slab;
+}
+
+/* Take one object off the slabs, the cache lock must be held */
+static void* kmem_cache_alloc_locked(kmem_cache_t* cache) {
+    slab_t* slab;
+    void* obj;
+
+    slab = peek_slab_list(&cache->slabs_partial);
+    if (slab == NULL) {
+        slab = pop_slab_list(&cache->slabs_free);
+        if (slab == NULL) {
+            if (kmem_cache_grow(cache) == NULL) {
+                return NULL;
+            }
+            slab = pop_slab_list(&cache->slabs_free);
+        }
+        push_slab_list(&cache->slabs_partial, slab);
+    }
+
+    obj = slab->free_list;
+    slab->free_list = *obj_free_link(cache, obj);
+    slab->inuse++;
+    cache->active_objs++;
+
+    if (slab->inuse == cache->objs_per_slab) {
+        remove_slab_list(&cache->slabs_partial, slab);
+        push_slab_list(&cache->slabs_full, slab);
+    }
+
+    return obj;
+}
+
+/* Put one object back on its slab, the cache lock must be held */
+static void kmem_cache_free_locked(kmem_cache_t* cache, void* obj) {
+    slab_t* slab = obj_to_slab(obj);
+
+    *obj_free_link(cache, obj) = slab->free_list;
+    slab->free_list = obj;
+    cache->active_objs--;
+
+    if (slab->inuse-- == cache->objs_per_slab) {
+        remove_slab_list(&cache->slabs_full, slab);
+        push_slab_list(&cache->slabs_partial, slab);
+    }
+
+    if (slab->inuse == 0) {
+        remove_slab_list(&cache->slabs_partial, slab);
+
+        // Keep one empty slab around to absorb alloc/free flapping, give the rest back
+        if (size_slab_list(&cache->slabs_free) == 0) {
+            push_slab_list(&cache->slabs_free, slab);
+        } else {
+            cache->total_objs -= cache->objs_per_slab;
+            free_page(slab);
+        }
+    }
+}
+
+static inline uint32_t mag_batch(uint32_t depth) {
+    return depth > 1 ? depth / 2 : 1;
+}
+
+/* Hand the oldest objects in a magazine back to the slabs until target are left, IRQs must be masked */
+static void kmem_magazine_flush(kmem_cache_t* cache, kmem_magazine_t* mag, uint32_t target) {
+    uint32_t i, n;
+
+    if (mag->count <= target) {
+        return;
+    }
+    n = mag->count - target;
+
+    spin_lock(&cache->lock);
+    for (i = 0; i < n; i++) {
+        kmem_cache_free_locked(cache, mag->objs[i]);
+    }
+    spin_unlock(&cache->lock);
+
+    for (i = n; i < mag->count; i++) {
+        mag->objs[i - n] = mag->objs[i];
+    }
+    mag->count = target;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    kmem_magazine_t* mag;
+    uint32_t flags, batch;
+    void* obj;
+
+    flags = irq_save();
+    if (cache->mag_depth == 0) {
+        spin_lock(&cache->lock);
+        obj = kmem_cache_alloc_locked(cache);
+        spin_unlock(&cache->lock);
+        irq_restore(flags);
+        return obj;
+    }
+
+    // Refill an empty magazine with half its depth in one go
+    mag = &cache->mags[smp_processor_id()];
+    if (mag->count == 0) {
+        batch = mag_batch(cache->mag_depth);
+        spin_lock(&cache->lock);
+        while (mag->count < batch && (obj = kmem_cache_alloc_locked(cache)) != NULL) {
+            mag->objs[mag->count++] = obj;
+        }
+        spin_unlock(&cache->lock);
+    }
+    obj = mag->count ? mag->objs[--mag->count] : NULL;
+    irq_restore(flags);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    kmem_magazine_t* mag;
+    uint32_t flags, depth;
+
+    if (obj == NULL) {
+        return;
+    }
+
+    if (obj_to_slab(obj)->cache != cache) {
+        error("kmem_cache_free: object does not belong to this cache");
+        return;
+    }
+
+    flags = irq_save();
+    depth = cache->mag_depth;
+    if (depth == 0) {
+        mag = &cache->mags[smp_processor_id()];
+        kmem_magazine_flush(cache, mag, 0);
+        spin_lock(&cache->lock);
+        kmem_cache_free_locked(cache, obj);
+        spin_unlock(&cache->lock);
+        irq_restore(flags);
+        return;
+    }
+
+    // A full magazine keeps its newest, cache hot, objects and gives back the rest
+    mag = &cache->mags[smp_processor_id()];
+    if (mag->count >= depth) {
+        kmem_magazine_flush(cache, mag, depth - mag_batch(depth));
+    }
+    mag->objs[mag->count++] = obj;
+    irq_restore(flags);
+}
+
+/* Free an object without knowing its cache, the slab header names it */
+void kmem_free(void* obj) {
+    if (obj != NULL) {
+        kmem_cache_free(obj_to_slab(obj)->cache, obj);
+    }
+}
+
+/* Give every object in this core's magazine back to the slabs */
+void kmem_cache_drain(kmem_cache_t* cache) {
+    uint32_t flags = irq_save();
+
+    kmem_magazine_flush(cache, &cache->mags[smp_processor_id()], 0);
+    irq_restore(flags);
+}
+
+/**
+ * Set the magazine depth of every cache, and of caches created later.
+ * Magazines holding more than that shrink on their owner's next free.
+ */
+void kmem_set_magazine_depth(uint32_t depth) {
+    kmem_cache_t* cache;
+    uint32_t flags;
+
+    if (depth > MAG_DEPTH) {
+        depth = MAG_DEPTH;
+    }
+
+    flags = spin_lock_irqsave(&cache_list_lock);
+    default_mag_depth = depth;
+    for (cache = cache_list.head; cache != NULL; cache = next_kmem_cache_list(cache)) {
+        cache->mag_depth = depth;
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
+
+void kmem_cache_info(void) {
+    kmem_cache_t* cache;
+    uint32_t slabs, used, cached, cpu, flags, rem;
+
+    puts("name            objsize  active/total  cached  slabs  used%\n");
+    flags = spin_lock_irqsave(&cache_list_lock);
+    for (cache = cache_list.head; cache != NULL; cache = next_kmem_cache_list(cache)) {
+        slabs = size_slab_list(&cache->slabs_partial) + size_slab_list(&cache->slabs_full) +
+                size_slab_list(&cache->slabs_free);
+        cached = 0;
+        for (cpu = 0; cpu < NR_CPUS; cpu++) {
+            cached += cache->mags[cpu].count;
+        }
+        // Share of the slab pages that holds live object payload
+        used = 0;
+        if (slabs != 0) {
+            // The product needs 64 bits, in 32 it wraps at about 43 MB of live objects
+            used = div_u64_rem((uint64_t)(cache->active_objs - cached) * cache->object_size * 100, slabs * PAGE_SIZE,
+                    &rem);
+        }
+
+        kprintf("%-16s%7u  %6u/%-6u  %6u  %5u  %4u%%\n", cache->name, cache->object_size,
+                cache->active_objs - cached, cache->total_objs, cached, slabs, used);
+    }
+    spin_unlock_irqrestore(&cache_list_lock, flags);
+}
@@ -0,0 +1,173 @@
+#include <kernel/smp.h>
+#include <kernel/mmu.h>
+#include <kernel/cache.h>
+#include <kernel/timer.h>
+#include <kernel/uart.h>
+#include <kernel/atomic.h>
+#include <kernel/pmu.h>
+#include <kernel/sched.h>
+#include <common/stdio.h>
+
+/* How long the boot core waits for a woken core to report in */
+#define SECONDARY_BOOT_TIMEOUT_US 100000
+
+cpu_data_t cpu_data[NR_CPUS];
+
+/* Defined in boot.S */
+extern uint8_t __cpu_stacks[];
+extern void secondary_start(void);
+
+static inline uint32_t read_mpidr(void) {
+    uint32_t mpidr;
+    asm volatile("mrc p15, 0, %0, c0, c0, 5" : "=r"(mpidr));
+    return mpidr;
+}
+
+/* Point TPIDRPRW at this core's data, before anything calls this_cpu() */
+void percpu_init(uint32_t cpu) {
+    asm volatile("mcr p15, 0, %0, c13, c0, 4" :: "r"(&cpu_data[cpu]));
+}
+
+#ifndef MODEL_1
+/**
+ * Release a parked core and wait for it to come up. Until it turns its MMU
+ * on the core reads memory uncached, so everything it touches before then
+ * is cleaned out of this core's cache first, and it writes nothing shared
+ * until its cache is coherent with ours.
+ */
+static int smp_boot_cpu(uint32_t cpu) {
+    uint64_t start;
+
+    cpu_data[cpu].cpu = cpu;
+    cpu_data[cpu].online = 0;
+    dcache_clean_invalidate_range(&cpu_data[cpu], sizeof(cpu_data_t));
+    dcache_clean_invalidate_range(__cpu_stacks + cpu * CPU_STACK_SIZE, CPU_STACK_SIZE);
+
+    mmio_write(CORE_MAILBOX3_SET(cpu), (uint32_t)secondary_start);
+    dsb();
+    asm volatile("sev");
+
+    start = timer_now_us();
+    while (!cpu_data[cpu].online) {
+        if (timer_now_us() - start > SECONDARY_BOOT_TIMEOUT_US) {
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif
+
+void smp_init(void) {
+#ifndef MODEL_1
+    uint32_t cpu;
+#endif
+
+    cpu_data[0].mpidr = read_mpidr();
+    cpu_data[0].online_us = timer_now_us();
+    cpu_data[0].online = 1;
+
+#ifndef MODEL_1
+    // Without the MMU there are no working atomics (see atomic.h), so stay on one core
+    if (!exclusives_ok) {
+        warning("MMU is off, running on the boot CPU only");
+        return;
+    }
+
+    for (cpu = 1; cpu < NR_CPUS; cpu++) {
+        if (smp_boot_cpu(cpu) != 0) {
+            warning("CPU %u did not come online", cpu);
+        }
+    }
+#endif
+
+    info("%u of %u CPUs online", smp_online_cpus(), NR_CPUS);
+}
+
+uint32_t smp_online_cpus(void) {
+    uint32_t cpu, count = 0;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        count += cpu_data[cpu].online != 0;
+    }
+    return count;
+}
+
+void smp_info(void) {
+    uint32_t cpu;
+
+    puts("cpu  mpidr     online at (us)\n");
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (!cpu_data[cpu].online) {
+            kprintf("%3u  offline\n", cpu);
+            continue;
+        }
+        kprintf("%3u  %08x  %llu\n", cpu, cpu_data[cpu].mpidr, cpu_data[cpu].online_us);
+    }
+    kprintf("Running on cpu %u\n", smp_processor_id());
+}
+
+/**
+ * Run fn(arg) on every other online core, returns how many were started.
+ * The caller can do its own share of the work before smp_call_wait().
+ * A core picks the call up from its idle thread, so fn must not sleep,
+ * and the caller must stay on its core until the wait is over.
+ */
+uint32_t smp_call_others(void (*fn)(void* arg), void* arg) {
+    uint32_t cpu, self = smp_processor_id(), started = 0;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (cpu == self || !cpu_data[cpu].online) {
+            continue;
+        }
+        cpu_data[cpu].call_arg = arg;
+        dmb();
+        cpu_data[cpu].call_fn = fn;
+        started++;
+    }
+    sev();
+    return started;
+}
+
+/* Run the work posted to this core, if any. The idle threads call this. */
+void smp_run_call(void) {
+    cpu_data_t* data = this_cpu();
+    void (*fn)(void*) = data->call_fn;
+
+    if (fn == NULL) {
+        return;
+    }
+    dmb();
+    fn(data->call_arg);
+    dmb();
+    data->call_fn = NULL;
+    sev();
+}
+
+/* Wait until every core has finished the work smp_call_others() gave it */
+void smp_call_wait(void) {
+    uint32_t cpu;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        while (cpu_data[cpu].call_fn != NULL) {
+            wfe();
+        }
+    }
+    dmb();
+}
+
+/* C entry point of cores 1-3, on their own stacks with their own exception vectors */
+void kernel_main_secondary(uint32_t cpu) {
+    cpu_data_t* data;
+
+    percpu_init(cpu);
+    mmu_init_secondary();
+    pmu_init();
+
+    data = this_cpu();
+    data->mpidr = read_mpidr();
+    data->online_us = timer_now_us();
+    dmb();
+    data->online = 1;
+
+    sched_start_secondary();
+}
@@ -0,0 +1,99 @@
+#include <kernel/softirq.h>
+#include <kernel/pmu.h>
+#include <common/stdio.h>
+
+typedef struct softirq_action {
+    softirq_fn_t fn;
+    const char* name;
+} softirq_action_t;
+
+/* Per core counts, only touched by the core itself */
+typedef struct softirq_stat {
+    uint32_t runs[NR_SOFTIRQS];
+    uint32_t max_cycles[NR_SOFTIRQS];
+    uint32_t deferred;          // Times the restart limit left work pending
+} __attribute__((aligned(64))) softirq_stat_t;
+
+static softirq_action_t softirq_actions[NR_SOFTIRQS];
+static softirq_stat_t softirq_stats[NR_CPUS];
+
+void open_softirq(softirq_t nr, softirq_fn_t fn, const char* name) {
+    softirq_actions[nr].name = name;
+    softirq_actions[nr].fn = fn;
+}
+
+/**
+ * Run this core's pending softirqs. Called with IRQs masked, from the
+ * outermost irq_dispatch() and the idle loop, and returns with them masked.
+ * Each round takes the whole pending word at once, so anything raised
+ * while the handlers run is picked up by the next round.
+ */
+void softirq_run(void) {
+    cpu_data_t* cpu = this_cpu();
+    softirq_stat_t* stat = &softirq_stats[cpu->cpu];
+    uint32_t pending, nr, start, cycles, restart = SOFTIRQ_MAX_RESTART;
+
+    if (cpu->in_softirq) {
+        return;
+    }
+    cpu->in_softirq = 1;
+
+    while ((pending = cpu->softirq_pending) != 0) {
+        if (restart-- == 0) {
+            stat->deferred++;
+            break;
+        }
+        cpu->softirq_pending = 0;
+        enable_interrupts();
+
+        while (pending != 0) {
+            nr = __builtin_ctz(pending);
+            pending &= pending - 1;
+            if (softirq_actions[nr].fn == NULL) {
+                continue;
+            }
+
+            start = pmu_cycles();
+            softirq_actions[nr].fn();
+            cycles = pmu_cycles() - start;
+            stat->runs[nr]++;
+            if (cycles > stat->max_cycles[nr]) {
+                stat->max_cycles[nr] = cycles;
+            }
+        }
+
+        disable_interrupts();
+    }
+
+    cpu->in_softirq = 0;
+}
+
+void softirq_info(void) {
+    uint32_t nr, cpu;
+
+    puts("softirq     ");
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (cpu_data[cpu].online) {
+            kprintf("        cpu%u  max cycles", cpu);
+        }
+    }
+    puts("\n");
+
+    for (nr = 0; nr < NR_SOFTIRQS; nr++) {
+        kprintf("%-10s  ", softirq_actions[nr].name != NULL ? softirq_actions[nr].name : "-");
+        for (cpu = 0; cpu < NR_CPUS; cpu++) {
+            if (cpu_data[cpu].online) {
+                kprintf("  %10u  %10u", softirq_stats[cpu].runs[nr], softirq_stats[cpu].max_cycles[nr]);
+            }
+        }
+        puts("\n");
+    }
+
+    puts("deferred    ");
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (cpu_data[cpu].online) {
+            kprintf("  %10u            ", softirq_stats[cpu].deferred);
+        }
+    }
+    puts("\n");
+}
@@ -0,0 +1,175 @@
+#include <kernel/spinlock.h>
+#include <kernel/atomic.h>
+#include <kernel/pmu.h>
+#include <common/stdio.h>
+
+#define TICKET_ONE (1 << 16)
+
+#ifndef NO_LOCKSTAT
+/* Every named lock, newest first. The lock guarding the list is never registered itself. */
+static lock_stats_t* stats_list;
+static spinlock_t stats_list_lock;
+
+static void lock_stats_register(lock_stats_t* stats, const char* name) {
+    uint32_t flags = spin_lock_irqsave(&stats_list_lock);
+
+    if (stats->name == NULL) {
+        stats->next = stats_list;
+        stats_list = stats;
+    }
+    stats->name = name;
+    spin_unlock_irqrestore(&stats_list_lock, flags);
+}
+
+/* Both run with the lock held, so plain updates are safe */
+static inline void lock_acquired(lock_stats_t* stats, int contended, uint32_t spins) {
+    stats->acquisitions++;
+    if (contended) {
+        stats->contended++;
+        stats->spins += spins;
+    }
+    stats->hold_start = pmu_cycles();
+}
+
+static inline void lock_released(lock_stats_t* stats) {
+    uint32_t held = pmu_cycles() - stats->hold_start;
+
+    if (held > stats->max_hold) {
+        stats->max_hold = held;
+    }
+}
+
+#define LOCK_REGISTER(lock, name) lock_stats_register(&(lock)->stats, name)
+#define LOCK_ACQUIRED(lock, contended, spins) lock_acquired(&(lock)->stats, contended, spins)
+#define LOCK_RELEASED(lock) lock_released(&(lock)->stats)
+#else
+#define LOCK_REGISTER(lock, name) do { (void)(lock); (void)(name); } while (0)
+#define LOCK_ACQUIRED(lock, contended, spins) do { (void)(contended); (void)(spins); } while (0)
+#define LOCK_RELEASED(lock) do { } while (0)
+#endif
+
+void spin_lock_init(spinlock_t* lock, const char* name) {
+    LOCK_REGISTER(lock, name);
+}
+
+void spin_lock(spinlock_t* lock) {
+    uint32_t old, spins = 0;
+    uint16_t ticket;
+
+    old = atomic_add_return(&lock->slock, TICKET_ONE) - TICKET_ONE;
+    ticket = old >> 16;
+
+    // The owner's unlock does a sev, so sleep rather than hammer the line
+    while (lock->tickets.owner != ticket) {
+        wfe();
+        spins++;
+    }
+    dmb();
+
+    LOCK_ACQUIRED(lock, (uint16_t)old != ticket, spins);
+}
+
+int spin_trylock(spinlock_t* lock) {
+    uint32_t old = lock->slock;
+
+    if ((old >> 16) != (old & 0xFFFF)) {
+        return 0;
+    }
+    if (atomic_cmpxchg(&lock->slock, old, old + TICKET_ONE) != old) {
+        return 0;
+    }
+    dmb();
+
+    LOCK_ACQUIRED(lock, 0, 0);
+    return 1;
+}
+
+void spin_unlock(spinlock_t* lock) {
+    LOCK_RELEASED(lock);
+
+    // Only the holder writes the owner half, a waiter's ldrex/strex on the word fails and retries
+    dmb();
+    lock->tickets.owner++;
+    sev();
+}
+
+void mcs_lock_init(mcs_lock_t* lock, const char* name) {
+    LOCK_REGISTER(lock, name);
+}
+
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node) {
+    mcs_node_t* prev;
+    uint32_t spins = 0;
+
+    node->next = NULL;
+    node->locked = 1;
+    dmb();
+
+    prev = (mcs_node_t*)atomic_xchg((volatile uint32_t*)&lock->tail, (uint32_t)node);
+    if (prev != NULL) {
+        // Queue behind the previous tail, it hands the lock over by clearing our flag
+        prev->next = node;
+        while (node->locked) {
+            wfe();
+            spins++;
+        }
+    }
+    dmb();
+
+    LOCK_ACQUIRED(lock, prev != NULL, spins);
+}
+
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node) {
+    mcs_node_t* next;
+
+    LOCK_RELEASED(lock);
+    dmb();
+
+    next = node->next;
+    if (next == NULL) {
+        // Nobody queued: empty the lock, unless someone swapped themselves in meanwhile
+        if (atomic_cmpxchg((volatile uint32_t*)&lock->tail, (uint32_t)node, 0) == (uint32_t)node) {
+            return;
+        }
+        // They have the tail but haven't linked themselves to us yet
+        while ((next = node->next) == NULL) {
+        }
+    }
+
+    next->locked = 0;
+    sev();
+}
+
+void lock_stats_dump(void) {
+#ifndef NO_LOCKSTAT
+    lock_stats_t* stats;
+    uint32_t flags;
+
+    puts("lock                  acquired  contended       spins  max hold (cycles)\n");
+    flags = spin_lock_irqsave(&stats_list_lock);
+    for (stats = stats_list; stats != NULL; stats = stats->next) {
+        kprintf("%-20s %9u  %9u  %10u  %u\n", stats->name, stats->acquisitions, stats->contended,
+                stats->spins, stats->max_hold);
+    }
+    spin_unlock_irqrestore(&stats_list_lock, flags);
+#else
+    puts("Lock statistics were compiled out (LOCKSTAT=0)\n");
+#endif
+}
+
+/* Start counting from zero, racing acquisitions may still land in the old totals */
+void lock_stats_reset(void) {
+#ifndef NO_LOCKSTAT
+    lock_stats_t* stats;
+    uint32_t flags;
+
+    flags = spin_lock_irqsave(&stats_list_lock);
+    for (stats = stats_list; stats != NULL; stats = stats->next) {
+        stats->acquisitions = 0;
+        stats->contended = 0;
+        stats->spins = 0;
+        stats->max_hold = 0;
+    }
+    spin_unlock_irqrestore(&stats_list_lock, flags);
+#endif
+}
@@ -0,0 +1,158 @@
+#include <kernel/timer.h>
+#include <kernel/uart.h>
+#include <kernel/irq.h>
+#include <kernel/barrier.h>
+#include <kernel/smp.h>
+#include <kernel/softirq.h>
+
+uint64_t timer_now_us(void) {
+    uint32_t hi, lo;
+
+    // Re-read if the low word wrapped between the two reads
+    do {
+        hi = mmio_read(SYSTEM_TIMER_CHI);
+        lo = mmio_read(SYSTEM_TIMER_CLO);
+    } while (hi != mmio_read(SYSTEM_TIMER_CHI));
+
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Busy wait, for hardware that needs a settle time rather than for waiting on events */
+void udelay(uint32_t us) {
+    uint64_t end = timer_now_us() + us;
+
+    while (timer_now_us() < end) {
+    }
+}
+
+/* Compare channels match the low word of the counter only, so deadlines must be under 71 minutes away */
+void systimer_set_compare(uint32_t channel, uint32_t deadline) {
+    mmio_write(SYSTEM_TIMER_C(channel), deadline);
+}
+
+void systimer_ack(uint32_t channel) {
+    mmio_write(SYSTEM_TIMER_CS, SYSTEM_TIMER_MATCH(channel));
+}
+
+#ifndef MODEL_1
+uint32_t gentimer_freq(void) {
+    uint32_t freq;
+
+    asm volatile("mrc p15, 0, %0, c14, c0, 0" : "=r"(freq));
+    return freq;
+}
+
+/* Fire once, counts ticks of the system counter from now */
+void gentimer_start(gentimer_t timer, uint32_t counts) {
+    if (timer == GENTIMER_PHYS) {
+        asm volatile("mcr p15, 0, %0, c14, c2, 0" :: "r"(counts));
+        asm volatile("mcr p15, 0, %0, c14, c2, 1" :: "r"(1));
+    } else {
+        asm volatile("mcr p15, 0, %0, c14, c3, 0" :: "r"(counts));
+        asm volatile("mcr p15, 0, %0, c14, c3, 1" :: "r"(1));
+    }
+    isb();
+}
+
+/* Fire once when the system counter reaches count, straight away if it already has */
+void gentimer_start_at(gentimer_t timer, uint64_t count) {
+    if (timer == GENTIMER_PHYS) {
+        asm volatile("mcrr p15, 2, %0, %1, c14" :: "r"((uint32_t)count), "r"((uint32_t)(count >> 32)));
+        asm volatile("mcr p15, 0, %0, c14, c2, 1" :: "r"(1));
+    } else {
+        asm volatile("mcrr p15, 3, %0, %1, c14" :: "r"((uint32_t)count), "r"((uint32_t)(count >> 32)));
+        asm volatile("mcr p15, 0, %0, c14, c3, 1" :: "r"(1));
+    }
+    isb();
+}
+
+/* The system counter the generic timers compare against, CNTPCT */
+uint64_t gentimer_count(void) {
+    uint32_t lo, hi;
+
+    isb();
+    asm volatile("mrrc p15, 0, %0, %1, c14" : "=r"(lo), "=r"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Disabling also drops the interrupt, which stays asserted while the timer is enabled and expired */
+void gentimer_stop(gentimer_t timer) {
+    if (timer == GENTIMER_PHYS) {
+        asm volatile("mcr p15, 0, %0, c14, c2, 1" :: "r"(0));
+    } else {
+        asm volatile("mcr p15, 0, %0, c14, c3, 1" :: "r"(0));
+    }
+    isb();
+}
+
+/* Generic timer counts per microsecond in 16.16 fixed point, the same on every core */
+static uint32_t counts_per_us;
+#endif
+
+/* Set up the calling core's clock event, disarmed. Core 0 goes first and installs the shared handler */
+void clockevent_init(void) {
+    if (smp_processor_id() == 0) {
+        irq_register(CLOCKEVENT_IRQ, clockevent_handler, NULL, 0, "clockevent");
+    }
+#ifdef MODEL_1
+    systimer_ack(CLOCKEVENT_CHANNEL);
+    irq_enable(CLOCKEVENT_IRQ);
+#else
+    // freq * 65536 / 10^6 without a 64 bit division
+    counts_per_us = ((gentimer_freq() / 100) << 12) / 625;
+    gentimer_stop(CLOCKEVENT_GENTIMER);
+    mmio_write(CORE_TIMER_IRQCNTL(smp_processor_id()), CLOCKEVENT_IRQ_ROUTE);
+#endif
+}
+
+/* Interrupt the calling core at deadline_us, replacing whatever it was programmed for */
+void clockevent_program(uint64_t deadline_us) {
+    uint64_t now = timer_now_us();
+    uint32_t delta;
+#ifdef MODEL_1
+    uint32_t target;
+#else
+    uint32_t counts;
+#endif
+
+    if (deadline_us < now + CLOCKEVENT_MIN_DELTA_US) {
+        delta = CLOCKEVENT_MIN_DELTA_US;
+    } else if (deadline_us - now > 0x7FFFFFFF) {
+        delta = 0x7FFFFFFF;
+    } else {
+        delta = deadline_us - now;
+    }
+
+#ifdef MODEL_1
+    // A compare value the counter has already passed only matches 71 minutes later, so check and retry
+    do {
+        target = mmio_read(SYSTEM_TIMER_CLO) + delta;
+        systimer_set_compare(CLOCKEVENT_CHANNEL, target);
+        delta *= 2;
+    } while ((int32_t)(mmio_read(SYSTEM_TIMER_CLO) - target) >= 0);
+#else
+    // Round up, firing before the system timer reaches the deadline would only mean another round
+    counts = (((uint64_t)delta * counts_per_us) >> 16) + 1;
+    gentimer_start(CLOCKEVENT_GENTIMER, counts > 0x7FFFFFFF ? 0x7FFFFFFF : counts);
+#endif
+}
+
+void clockevent_stop(void) {
+#ifdef MODEL_1
+    // The channel can't be disabled, park it as far out as it goes
+    systimer_set_compare(CLOCKEVENT_CHANNEL, mmio_read(SYSTEM_TIMER_CLO) - 1);
+#else
+    gentimer_stop(CLOCKEVENT_GENTIMER);
+#endif
+}
+
+/* IRQ handler, with IRQs masked: silence the event and leave the wheel to the timer softirq */
+void clockevent_handler(void* arg) {
+    (void)arg;
+#ifdef MODEL_1
+    systimer_ack(CLOCKEVENT_CHANNEL);
+#else
+    gentimer_stop(CLOCKEVENT_GENTIMER);
+#endif
+    raise_softirq(SOFTIRQ_TIMER);
+}
@@ -0,0 +1,118 @@
+#include <kernel/timer.h>
+#include <kernel/sched.h>
+#include <kernel/pmu.h>
+#include <common/stdio.h>
+
+/**
+ * Timer wheel self test: add timers spread over the first few wheel
+ * levels, cancel every fourth, then sleep until the rest have fired. A
+ * timer may be late by up to a slot of its level, but never early, and a
+ * cancelled one must never run.
+ */
+
+#define TIMER_TEST_COUNT 64
+#define TIMER_TEST_SPREAD_US 200000
+#define TIMER_TEST_TIMEOUT_US 500000
+#define TIMER_TEST_OPS 1000
+
+static ktimer_t test_timers[TIMER_TEST_COUNT];
+static volatile uint64_t test_fired_at[TIMER_TEST_COUNT];
+static volatile uint32_t test_fired;
+static uint32_t test_seed;
+
+static uint32_t test_rand(void) {
+    test_seed = test_seed * 1103515245 + 12345;
+    return test_seed >> 16;
+}
+
+static void test_timer_fn(void* arg) {
+    test_fired_at[(uint32_t)arg] = timer_now_us();
+    test_fired++;
+}
+
+/* Cycles for an add and a cancel, with the wheel holding TIMER_TEST_OPS timers */
+static void timer_test_cost(void) {
+    uint32_t i, start, add_cycles, cancel_cycles;
+    uint64_t now = timer_now_us();
+
+    start = pmu_cycles();
+    for (i = 0; i < TIMER_TEST_OPS; i++) {
+        timer_add(&test_timers[i % TIMER_TEST_COUNT], now + 1000000 + i * 97, test_timer_fn, (void*)0);
+    }
+    add_cycles = pmu_cycles() - start;
+
+    start = pmu_cycles();
+    for (i = 0; i < TIMER_TEST_COUNT; i++) {
+        timer_cancel(&test_timers[i]);
+    }
+    cancel_cycles = pmu_cycles() - start;
+
+    // The adds past the first TIMER_TEST_COUNT were re-adds, which cancel first
+    kprintf("timer_add: %u cycles, timer_cancel: %u cycles\n", add_cycles / TIMER_TEST_OPS,
+            cancel_cycles / TIMER_TEST_COUNT);
+}
+
+int timer_test(void) {
+    uint64_t start, deadline[TIMER_TEST_COUNT], late, max_late = 0, total_late = 0;
+    uint32_t i, expected = 0, early = 0, stray = 0;
+    uint8_t cancelled[TIMER_TEST_COUNT];
+
+    timer_test_cost();
+
+    test_seed = 0x7117E5;
+    test_fired = 0;
+    start = timer_now_us();
+    for (i = 0; i < TIMER_TEST_COUNT; i++) {
+        test_fired_at[i] = 0;
+        deadline[i] = start + 50 + test_rand() % TIMER_TEST_SPREAD_US;
+        timer_add(&test_timers[i], deadline[i], test_timer_fn, (void*)i);
+    }
+
+    for (i = 0; i < TIMER_TEST_COUNT; i++) {
+        cancelled[i] = i % 4 == 0 && timer_cancel(&test_timers[i]);
+        // Only the very nearest deadlines may have gone already
+        if (i % 4 == 0 && !cancelled[i] && test_fired_at[i] == 0) {
+            error("timer %u was neither pending nor fired", i);
+            return 0;
+        }
+        if (!cancelled[i]) {
+            expected++;
+        }
+    }
+
+    while (timer_now_us() < start + TIMER_TEST_TIMEOUT_US) {
+        thread_sleep_us(5000);
+    }
+
+    for (i = 0; i < TIMER_TEST_COUNT; i++) {
+        if (test_fired_at[i] == 0) {
+            if (!cancelled[i]) {
+                error("timer %u never fired", i);
+                return 0;
+            }
+            continue;
+        }
+        if (cancelled[i]) {
+            stray++;
+            continue;
+        }
+        if (test_fired_at[i] < deadline[i]) {
+            early++;
+            continue;
+        }
+        late = test_fired_at[i] - deadline[i];
+        total_late += late;
+        if (late > max_late) {
+            max_late = late;
+        }
+    }
+
+    if (early != 0 || stray != 0) {
+        error("%u timers fired early, %u after being cancelled", early, stray);
+        return 0;
+    }
+
+    kprintf("%u timers fired, lateness max %llu us, average %u us\n", expected, max_late,
+            (uint32_t)total_late / expected);
+    return 1;
+}
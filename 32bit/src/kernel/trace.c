@@ -0,0 +1,141 @@
+#include <kernel/trace.h>
+#include <kernel/timer.h>
+#include <kernel/irq.h>
+#include <kernel/smp.h>
+#include <kernel/uart.h>
+#include <kernel/barrier.h>
+#include <common/stdio.h>
+
+/* Only written by its own core, records up to head are complete */
+typedef struct trace_buf {
+    trace_record_t records[TRACE_RECORDS];
+    volatile uint32_t head;
+} __attribute__((aligned(64))) trace_buf_t;
+
+volatile uint32_t trace_mask;
+
+/* Trace clock when tracing last stopped, where the decoder starts from */
+static uint64_t trace_stopped_at;
+
+static trace_buf_t trace_bufs[NR_CPUS];
+
+#ifdef MODEL_1
+    #define TRACE_CLOCK_HZ 1000000
+#endif
+
+static inline uint64_t trace_clock(void) {
+#ifdef MODEL_1
+    return timer_now_us();
+#else
+    uint32_t lo, hi;
+
+    asm volatile("mrrc p15, 0, %0, %1, c14" : "=r"(lo), "=r"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+/* The low word alone, a single register read on either board */
+static inline uint32_t trace_clock_low(void) {
+#ifdef MODEL_1
+    return mmio_read(SYSTEM_TIMER_CLO);
+#else
+    return trace_clock();
+#endif
+}
+
+/**
+ * Called through trace() once the event's bit is set. The record is filled
+ * in before head moves past it, so a dump running on another core never
+ * sees it half written.
+ */
+void __trace(uint32_t event, uint32_t data, uint32_t arg0, uint32_t arg1) {
+    uint32_t flags = irq_save();
+    trace_buf_t* buf = &trace_bufs[smp_processor_id()];
+    trace_record_t* rec = &buf->records[buf->head & (TRACE_RECORDS - 1)];
+
+    rec->time = trace_clock_low();
+    rec->event = event;
+    rec->data = data;
+    rec->arg[0] = arg0;
+    rec->arg[1] = arg1;
+    dmb();
+    buf->head++;
+    irq_restore(flags);
+}
+
+/* Clear every ring and trace the events in mask */
+void trace_start(uint32_t mask) {
+    uint32_t cpu;
+
+    trace_mask = 0;
+    dmb();
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        trace_bufs[cpu].head = 0;
+    }
+    dmb();
+    trace_mask = mask & TRACE_ALL;
+}
+
+void trace_stop(void) {
+    if (trace_mask != 0) {
+        trace_mask = 0;
+        dmb();
+        trace_stopped_at = trace_clock();
+    }
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void trace_dump_record(const trace_record_t* rec) {
+    const uint8_t* bytes = (const uint8_t*)rec;
+    char line[sizeof(trace_record_t) * 2 + 1];
+    uint32_t i;
+
+    for (i = 0; i < sizeof(trace_record_t); i++) {
+        line[i * 2] = hex_digits[bytes[i] >> 4];
+        line[i * 2 + 1] = hex_digits[bytes[i] & 0xF];
+    }
+    line[sizeof(line) - 1] = '\n';
+    uart_write(line, sizeof(line));
+}
+
+/**
+ * Stop tracing and write the rings out in the format trace.h describes. A
+ * core may still be in __trace() from before the stop, writing the slot
+ * after its newest record, which is the oldest one once the ring has
+ * wrapped, so that slot is left out.
+ */
+void trace_dump(void) {
+    trace_buf_t* buf;
+    uint32_t cpu, irq, head, count, i;
+    const char* name;
+
+    trace_stop();
+
+#ifdef MODEL_1
+    kprintf("TRACE BEGIN %u %u ", TRACE_FORMAT_VERSION, TRACE_CLOCK_HZ);
+#else
+    kprintf("TRACE BEGIN %u %u ", TRACE_FORMAT_VERSION, gentimer_freq());
+#endif
+    kprintf("%08x%08x\n", (uint32_t)(trace_stopped_at >> 32), (uint32_t)trace_stopped_at);
+    for (irq = 0; irq < NR_IRQS; irq++) {
+        if ((name = irq_name(irq)) != NULL) {
+            kprintf("TRACE IRQ %u %s\n", irq, name);
+        }
+    }
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (!cpu_data[cpu].online) {
+            continue;
+        }
+        buf = &trace_bufs[cpu];
+        head = buf->head;
+        dmb();
+        count = head < TRACE_RECORDS ? head : TRACE_RECORDS - 1;
+        kprintf("TRACE CPU %u %u %u\n", cpu, count, head - count);
+        for (i = head - count; i != head; i++) {
+            trace_dump_record(&buf->records[i & (TRACE_RECORDS - 1)]);
+        }
+    }
+    puts("TRACE END\n");
+}
@@ -1,4 +1,11 @@
 #include <kernel/uart.h>
+#include <kernel/irq.h>
+#include <kernel/barrier.h>
+#include <kernel/spinlock.h>
+#include <kernel/smp.h>
+#include <kernel/workqueue.h>
+#include <kernel/trace.h>
+#include <common/stdlib.h>
 
 uart_flags_t read_flags() {
     uart_flags_t flags;
@@ -6,7 +13,39 @@ uart_flags_t read_flags() {
     return flags;
 }
 
-void uart_putc(unsigned char c) {
+static uint8_t tx_buf[UART_TX_RING_SIZE];
+static uint8_t rx_buf[UART_RX_RING_SIZE];
+static uart_ring_t tx_ring = { 0, 0, tx_buf, UART_TX_RING_SIZE - 1, 0 };
+static uart_ring_t rx_ring = { 0, 0, rx_buf, UART_RX_RING_SIZE - 1, 0 };
+
+/* Polled until the interrupt controller and vectors are ready, and again after a panic */
+static volatile int uart_polled = 1;
+
+/* Whether the TX interrupt is unmasked, only changed with IRQs masked */
+static volatile int tx_irq_enabled;
+
+/* Serializes output between cores and the UART interrupt, and keeps lines whole */
+static spinlock_t uart_lock;
+
+/* Thread blocked in uart_rx_wait(), woken from rx_work once input arrives */
+static thread_t* volatile rx_waiter;
+static work_t rx_work;
+
+#ifdef UART_FIQ
+/* Bits uart_fiq_entry sets in core 0's mailbox 0, as in vectors.S */
+#define UART_DOORBELL_TX (1 << 0)
+#define UART_DOORBELL_RX (1 << 1)
+#endif
+
+static inline int ring_empty(uart_ring_t* ring) {
+    return ring->head == ring->tail;
+}
+
+static inline int ring_full(uart_ring_t* ring) {
+    return ring->tail - ring->head > ring->mask;
+}
+
+static void uart_putc_polled(unsigned char c) {
     uart_flags_t flags;
     // Wait for UART to become ready to transmit.
 
@@ -17,14 +56,311 @@ void uart_putc(unsigned char c) {
     mmio_write(UART0_DR, c);
 }
 
+/* Move queued output into the TX FIFO until one of them runs out, IRQs must be masked */
+static void uart_tx_fill(void) {
+    uint32_t start = tx_ring.head;
+
+    while (!ring_empty(&tx_ring) && !read_flags().transmit_queue_full) {
+        mmio_write(UART0_DR, tx_ring.buf[tx_ring.head & tx_ring.mask]);
+        tx_ring.head++;
+    }
+    trace(TRACE_UART_TX, tx_ring.head - start, tx_ring.tail - tx_ring.head, 0);
+}
+
+static void uart_set_imsc(uint32_t set, uint32_t clear) {
+    mmio_write(UART0_IMSC, (mmio_read(UART0_IMSC) | set) & ~clear);
+}
+
+/**
+ * Start draining the TX ring outside the interrupt handler, IRQs must be
+ * masked. The PL011 only raises the TX interrupt when the FIFO level
+ * crosses its trigger level, so the FIFO is filled by hand first and the
+ * interrupt takes over from there.
+ */
+static void uart_tx_kick(void) {
+    uart_tx_fill();
+    if (!ring_empty(&tx_ring) && !tx_irq_enabled) {
+        tx_irq_enabled = 1;
+        uart_set_imsc(UART_INT_TX, 0);
+    }
+}
+
+/**
+ * Queue len bytes for output. The ring is filled under uart_lock with IRQs
+ * masked, which makes the thread side a single producer even when other
+ * cores and exception handlers print too, and a whole kprintf line lands
+ * in one go. If the ring is full the FIFO is fed by hand, opening the IRQ
+ * window between attempts.
+ */
+void uart_write(const char* buf, uint32_t len) {
+    uint32_t flags, space, chunk;
+
+    flags = spin_lock_irqsave(&uart_lock);
+    if (uart_polled) {
+        while (len--) {
+            uart_putc_polled(*buf++);
+        }
+        spin_unlock_irqrestore(&uart_lock, flags);
+        return;
+    }
+
+    while (len) {
+        space = tx_ring.mask + 1 - (tx_ring.tail - tx_ring.head);
+        if (space == 0) {
+            spin_unlock_irqrestore(&uart_lock, flags);
+            flags = spin_lock_irqsave(&uart_lock);
+            uart_tx_fill();
+            continue;
+        }
+
+        // Stop at the end of the buffer, the next round continues from the start
+        chunk = tx_ring.mask + 1 - (tx_ring.tail & tx_ring.mask);
+        if (chunk > space) {
+            chunk = space;
+        }
+        if (chunk > len) {
+            chunk = len;
+        }
+
+        memcpy(&tx_ring.buf[tx_ring.tail & tx_ring.mask], buf, chunk);
+        barrier();
+        tx_ring.tail += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+
+    if (!tx_irq_enabled) {
+        uart_tx_kick();
+    }
+    spin_unlock_irqrestore(&uart_lock, flags);
+}
+
+void uart_putc(unsigned char c) {
+    uart_write((const char*)&c, 1);
+}
+
+int uart_rx_ready() {
+    if (uart_polled) {
+        return !read_flags().recieve_queue_empty;
+    }
+    return !ring_empty(&rx_ring);
+}
+
 unsigned char uart_getc() {
-    // Wait for UART to have received something.
-    uart_flags_t flags;
-    do {
-        flags = read_flags();
+    unsigned char c;
+
+    if (uart_polled) {
+        // Wait for UART to have received something.
+        uart_flags_t flags;
+        do {
+            flags = read_flags();
+        }
+        while ( flags.recieve_queue_empty );
+        return mmio_read(UART0_DR);
+    }
+
+    while (ring_empty(&rx_ring)) {
     }
-    while ( flags.recieve_queue_empty );
-    return mmio_read(UART0_DR);
+
+    c = rx_ring.buf[rx_ring.head & rx_ring.mask];
+    barrier();
+    rx_ring.head++;
+    return c;
+}
+
+/**
+ * Input processing deferred out of the interrupt handlers, on the system
+ * work queue: wake the thread waiting for input, if any.
+ */
+static void uart_rx_process(void* arg) {
+    thread_t* waiter = rx_waiter;
+
+    (void)arg;
+    if (waiter != NULL) {
+        thread_wake(waiter);
+    }
+}
+
+/* From the UART interrupt once the RX ring has input, the work queue may not be up yet */
+static void uart_rx_notify(void) {
+    trace(TRACE_UART_RX, rx_ring.tail - rx_ring.head, rx_ring.overruns, 0);
+    if (system_wq != NULL && rx_waiter != NULL) {
+        queue_work(system_wq, &rx_work);
+    }
+}
+
+/**
+ * Block the calling thread until there is input, instead of polling the
+ * ring. Returns 0 straight away if nothing would wake it up.
+ */
+int uart_rx_wait(void) {
+    thread_t* self;
+
+    if (uart_polled || system_wq == NULL) {
+        return 0;
+    }
+
+    // Published before the ring is checked, so input that arrives in between still wakes us
+    self = thread_current();
+    rx_waiter = self;
+    thread_prepare_block();
+    if (ring_empty(&rx_ring)) {
+        thread_block();
+    } else {
+        thread_wake(self);
+    }
+    rx_waiter = NULL;
+    return 1;
+}
+
+#ifdef UART_FIQ
+/**
+ * Work that uart_fiq_entry passed on through core 0's mailbox 0. For TX
+ * it masked the TX interrupt, which is unmasked again while there is more
+ * to send.
+ */
+static void uart_doorbell(void* arg) {
+    uint32_t pending = mmio_read(CORE_MAILBOX_CLR(0, 0));
+
+    (void)arg;
+    mmio_write(CORE_MAILBOX_CLR(0, 0), pending);
+
+    if (pending & UART_DOORBELL_RX) {
+        uart_rx_notify();
+    }
+    if (!(pending & UART_DOORBELL_TX)) {
+        return;
+    }
+
+    spin_lock(&uart_lock);
+    if (tx_irq_enabled) {
+        uart_tx_fill();
+        if (ring_empty(&tx_ring)) {
+            tx_irq_enabled = 0;
+        } else {
+            uart_set_imsc(UART_INT_TX, 0);
+        }
+    }
+    spin_unlock(&uart_lock);
+}
+
+/**
+ * Preload the banked FIQ registers uart_fiq_entry works from. Only r0-r2
+ * carry values across the mode switch, r8 and r9 name different registers
+ * on either side of it. FIQs must still be masked.
+ */
+static void uart_fiq_setup(void) {
+    asm volatile(
+        "mov r0, %0\n\t"
+        "mov r1, %1\n\t"
+        "mrs r2, cpsr\n\t"
+        "cps #0x11\n\t"
+        "mov r8, r0\n\t"
+        "mov r9, r1\n\t"
+        "msr cpsr_c, r2"
+        :: "r"(UART0_BASE), "r"(&rx_ring) : "r0", "r1", "r2", "memory");
+}
+#else
+/**
+ * The IRQ path. Registered with IRQF_NESTED, so the RX drain runs with
+ * IRQs unmasked and doesn't hold up the timers; it is the ring's only
+ * producer and needs no lock. Only the TX refill takes uart_lock, and
+ * waking the reader is left to rx_work.
+ */
+static void uart_irq_handler(void* arg) {
+    uint32_t status = mmio_read(UART0_MIS), flags;
+    uint8_t c;
+
+    (void)arg;
+    if (status & (UART_INT_RX | UART_INT_RT)) {
+        while (!read_flags().recieve_queue_empty) {
+            c = mmio_read(UART0_DR);
+            if (ring_full(&rx_ring)) {
+                rx_ring.overruns++;
+                continue;
+            }
+            rx_ring.buf[rx_ring.tail & rx_ring.mask] = c;
+            barrier();
+            rx_ring.tail++;
+        }
+        mmio_write(UART0_ICR, UART_INT_RX | UART_INT_RT);
+        uart_rx_notify();
+    }
+
+    if (status & UART_INT_TX) {
+        flags = spin_lock_irqsave(&uart_lock);
+        uart_tx_fill();
+        if (ring_empty(&tx_ring)) {
+            tx_irq_enabled = 0;
+            uart_set_imsc(0, UART_INT_TX);
+        }
+        mmio_write(UART0_ICR, UART_INT_TX);
+        spin_unlock_irqrestore(&uart_lock, flags);
+    }
+}
+#endif
+
+/* Switch from polling to the interrupt driven rings, interrupts_init() must have run */
+void uart_enable_interrupts(void) {
+    uint32_t flags;
+
+    work_init(&rx_work, uart_rx_process, NULL);
+#ifdef UART_FIQ
+    if (irq_register(IRQ_LOCAL(CORE_IRQ_MAILBOX0), uart_doorbell, NULL, 0, "uart") != 0) {
+        return;
+    }
+    mmio_write(CORE_MAILBOX_INT_CNTL(0), mmio_read(CORE_MAILBOX_INT_CNTL(0)) | 1);
+#else
+    if (irq_register(IRQ_UART0, uart_irq_handler, NULL, IRQF_NESTED, "uart") != 0) {
+        return;
+    }
+#endif
+
+    flags = spin_lock_irqsave(&uart_lock);
+    // TX interrupt when the FIFO drains to 1/4, RX interrupt when it fills to 1/2
+    mmio_write(UART0_IFLS, (1 << 0) | (2 << 3));
+    mmio_write(UART0_ICR, 0x7FF);
+    mmio_write(UART0_IMSC, UART_INT_RX | UART_INT_RT);
+    tx_irq_enabled = 0;
+    uart_polled = 0;
+#ifdef UART_FIQ
+    uart_fiq_setup();
+    mmio_write(IRQ_FIQ_CONTROL, IRQ_FIQ_ENABLE | IRQ_UART0);
+    enable_fiq();
+#else
+    irq_enable(IRQ_UART0);
+#endif
+
+    spin_unlock_irqrestore(&uart_lock, flags);
+}
+
+/**
+ * Go back to polling, for panics and anything else that can't rely on
+ * interrupts. Output that is still queued is flushed first so it comes out
+ * in order. A panic can happen with uart_lock held, so the lock is only
+ * taken if it is free.
+ */
+void uart_set_polled(void) {
+    uint32_t cpsr = irq_save();
+    int locked = spin_trylock(&uart_lock);
+
+    if (!uart_polled) {
+        mmio_write(UART0_IMSC, 0);
+        tx_irq_enabled = 0;
+        uart_polled = 1;
+        while (!ring_empty(&tx_ring)) {
+            uart_putc_polled(tx_ring.buf[tx_ring.head & tx_ring.mask]);
+            tx_ring.head++;
+        }
+    }
+    if (locked) {
+        spin_unlock(&uart_lock);
+    }
+    irq_restore(cpsr);
+}
+
+uint32_t uart_rx_overruns(void) {
+    return rx_ring.overruns;
 }
 
 /************************************************************
@@ -77,6 +413,8 @@ void delay(int32_t count) {
 
 
 void uart_init() {
+    spin_lock_init(&uart_lock, "uart");
+
     uart_control_t control;
     // Disable UART0.
     bzero(&control, 4);
@@ -116,9 +454,8 @@ void uart_init() {
     // Enable FIFO & 8 bit data transmissio (1 stop bit, no parity).
     mmio_write(UART0_LCRH, (1 << 4) | (1 << 5) | (1 << 6));
 
-    // Mask all interrupts.
-    mmio_write(UART0_IMSC, (1 << 1) | (1 << 4) | (1 << 5) | (1 << 6) |
-            (1 << 7) | (1 << 8) | (1 << 9) | (1 << 10));
+    // Mask all interrupts, a set IMSC bit enables its interrupt.
+    mmio_write(UART0_IMSC, 0);
 
     // Enable UART0, receive & transfer part of UART.
     control.uart_enabled = 1;
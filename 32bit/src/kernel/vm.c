@@ -0,0 +1,459 @@
+#include <kernel/vm.h>
+#include <kernel/mem.h>
+#include <kernel/mmu.h>
+#include <kernel/slab.h>
+#include <kernel/cache.h>
+#include <common/stdio.h>
+
+IMPLEMENT_LIST(vm_area);
+
+#define L1_ORDER 2                  // 16 KiB level 1 table, aligned to its size by the buddy allocator
+#define L1_COARSE 0x1               // Level 1 entry pointing at a level 2 table, domain 0
+#define L1_TYPE_MASK 0x3
+#define L2_ENTRIES 256
+#define L2_TABLE_BYTES 1024
+#define L2_PER_PAGE (PAGE_SIZE / L2_TABLE_BYTES)
+
+/* Small page descriptor bits */
+#define PTE_XN (1 << 0)
+#define PTE_SMALL (1 << 1)
+#define PTE_B (1 << 2)
+#define PTE_C (1 << 3)
+#define PTE_AP_RW (3 << 4)
+#define PTE_TEX(x) ((x) << 6)
+#define PTE_APX (1 << 9)            // With AP = 11, read-only
+#define PTE_S (1 << 10)
+#define PTE_FRAME_MASK 0xFFFFF000
+
+/* Normal write-back write-allocate memory, like the kernel's sections */
+#ifdef MODEL_1
+    #define PTE_NORMAL (PTE_SMALL | PTE_TEX(1) | PTE_C | PTE_B)
+#else
+    #define PTE_NORMAL (PTE_SMALL | PTE_TEX(1) | PTE_C | PTE_B | PTE_S)
+#endif
+
+/* DFSR decoding */
+#define DFSR_WNR (1 << 11)
+#define DFSR_FS(status) ((((status) >> 6) & 0x10) | ((status) & 0xF))
+#define FS_TRANSLATION_SECTION 0x05
+#define FS_TRANSLATION_PAGE 0x07
+#define FS_PERMISSION_PAGE 0x0F
+
+#define PAGE_MASK (~(uint32_t)(PAGE_SIZE - 1))
+
+static kmem_cache_t* as_cache;
+static kmem_cache_t* area_cache;
+static addr_space_t* current_as;
+static vm_stats_t vm_stats;
+
+/* Read-only stand in for every untouched page, it is never reference counted */
+static void* zero_page;
+
+void vm_init(void) {
+    as_cache = kmem_cache_create("addr_space", sizeof(addr_space_t), 0, NULL);
+    area_cache = kmem_cache_create("vm_area", sizeof(vm_area_t), 0, NULL);
+    zero_page = alloc_page();
+    if (as_cache == NULL || area_cache == NULL || zero_page == NULL) {
+        error("vm_init: out of memory");
+    }
+}
+
+/* Table walks may not snoop the data cache, so every table write is cleaned to memory */
+static inline void pte_write(uint32_t* pte, uint32_t val) {
+    *pte = val;
+    dcache_clean_range(pte, sizeof(*pte));
+}
+
+static uint32_t pte_bits(uint32_t prot, int writable) {
+    uint32_t bits = PTE_NORMAL;
+
+    // AP = 00 is no access at all, so any touch faults
+    if (!(prot & (VM_READ | VM_WRITE | VM_EXEC))) {
+        return bits | PTE_XN;
+    }
+
+    bits |= PTE_AP_RW;
+    if (!writable) {
+        bits |= PTE_APX;
+    }
+    if (!(prot & VM_EXEC)) {
+        bits |= PTE_XN;
+    }
+    return bits;
+}
+
+/* Find the level 2 entry for addr, allocating the level 2 tables if asked to */
+static uint32_t* vm_pte(addr_space_t* as, uint32_t addr, int alloc) {
+    uint32_t index = addr >> 20, group, i;
+    uint8_t* tables;
+
+    if ((as->l1[index] & L1_TYPE_MASK) != L1_COARSE) {
+        if (!alloc) {
+            return NULL;
+        }
+
+        // One zeroed page holds the tables for four neighbouring megabytes, all entries fault
+        tables = alloc_page();
+        if (tables == NULL) {
+            return NULL;
+        }
+        dcache_clean_range(tables, PAGE_SIZE);
+
+        group = index & ~(L2_PER_PAGE - 1);
+        for (i = 0; i < L2_PER_PAGE; i++) {
+            as->l1[group + i] = ((uint32_t)tables + i * L2_TABLE_BYTES) | L1_COARSE;
+        }
+        dcache_clean_range(&as->l1[group], L2_PER_PAGE * sizeof(uint32_t));
+    }
+
+    return (uint32_t*)(as->l1[index] & ~(L2_TABLE_BYTES - 1)) + ((addr >> 12) & (L2_ENTRIES - 1));
+}
+
+static vm_area_t* vm_find_area(addr_space_t* as, uint32_t addr) {
+    vm_area_t* area;
+
+    for (area = as->areas.head; area != NULL; area = next_vm_area_list(area)) {
+        if (addr >= area->start && addr < area->end) {
+            return area;
+        }
+    }
+    return NULL;
+}
+
+static int vm_check_range(uint32_t addr, uint32_t len) {
+    if ((addr | len) & (PAGE_SIZE - 1) || len == 0 || addr < VM_USER_START ||
+        addr > VM_USER_END || len > VM_USER_END - addr) {
+        error("vm: bad address range");
+        return -1;
+    }
+    return 0;
+}
+
+/* Drop the pages mapped in [start, end) */
+static void vm_release_range(addr_space_t* as, uint32_t start, uint32_t end) {
+    uint32_t addr, frame;
+    uint32_t* pte;
+
+    for (addr = start; addr < end; addr += PAGE_SIZE) {
+        pte = vm_pte(as, addr, 0);
+        if (pte == NULL) {
+            // Nothing in this megabyte
+            addr = (addr | (SECTION_SIZE - 1)) + 1 - PAGE_SIZE;
+            continue;
+        }
+        if (!(*pte & PTE_SMALL)) {
+            continue;
+        }
+
+        frame = *pte & PTE_FRAME_MASK;
+        pte_write(pte, 0);
+        if ((void*)frame != zero_page) {
+            page_put((void*)frame);
+        }
+        if (as == current_as) {
+            tlb_invalidate_addr((void*)addr);
+        }
+    }
+}
+
+addr_space_t* vm_create(void) {
+    addr_space_t* as;
+
+    if (!mmu_enabled() || as_cache == NULL) {
+        error("vm_create: virtual memory needs the MMU");
+        return NULL;
+    }
+
+    as = kmem_cache_alloc(as_cache);
+    if (as == NULL) {
+        return NULL;
+    }
+
+    // Start from the kernel's sections, the user window is never mapped there
+    as->l1 = alloc_pages(L1_ORDER);
+    if (as->l1 == NULL) {
+        kmem_cache_free(as_cache, as);
+        return NULL;
+    }
+    memcpy(as->l1, mmu_kernel_table(), L1_TABLE_ENTRIES * sizeof(uint32_t));
+    dcache_clean_range(as->l1, L1_TABLE_ENTRIES * sizeof(uint32_t));
+
+    INITIALIZE_LIST(as->areas);
+    return as;
+}
+
+void vm_destroy(addr_space_t* as) {
+    vm_area_t* area;
+    uint32_t index;
+
+    if (as == current_as) {
+        vm_switch(NULL);
+    }
+
+    vm_release_range(as, VM_USER_START, VM_USER_END);
+    for (index = VM_USER_START >> 20; index < VM_USER_END >> 20; index += L2_PER_PAGE) {
+        if ((as->l1[index] & L1_TYPE_MASK) == L1_COARSE) {
+            free_page((void*)(as->l1[index] & PAGE_MASK));
+        }
+    }
+
+    while ((area = pop_vm_area_list(&as->areas)) != NULL) {
+        kmem_cache_free(area_cache, area);
+    }
+    free_pages(as->l1, L1_ORDER);
+    kmem_cache_free(as_cache, as);
+}
+
+void vm_switch(addr_space_t* as) {
+    current_as = as;
+    mmu_switch_table(as != NULL ? as->l1 : mmu_kernel_table());
+}
+
+addr_space_t* vm_current(void) {
+    return current_as;
+}
+
+/* Create an area for [addr, addr + len), pages are filled in on demand */
+int vm_map(addr_space_t* as, uint32_t addr, uint32_t len, uint32_t prot) {
+    vm_area_t* area;
+
+    if (vm_check_range(addr, len) != 0) {
+        return -1;
+    }
+
+    for (area = as->areas.head; area != NULL; area = next_vm_area_list(area)) {
+        if (addr < area->end && addr + len > area->start) {
+            error("vm_map: range overlaps an existing mapping");
+            return -1;
+        }
+    }
+
+    area = kmem_cache_alloc(area_cache);
+    if (area == NULL) {
+        return -1;
+    }
+    area->start = addr;
+    area->end = addr + len;
+    area->prot = prot;
+    append_vm_area_list(&as->areas, area);
+    return 0;
+}
+
+/* Cut an area in two at addr, the upper half becomes a new area */
+static int vm_split(addr_space_t* as, vm_area_t* area, uint32_t addr) {
+    vm_area_t* upper = kmem_cache_alloc(area_cache);
+
+    if (upper == NULL) {
+        return -1;
+    }
+    upper->start = addr;
+    upper->end = area->end;
+    upper->prot = area->prot;
+    area->end = addr;
+    append_vm_area_list(&as->areas, upper);
+    return 0;
+}
+
+/* Split areas so that each one is either entirely inside [start, end) or entirely outside */
+static int vm_isolate(addr_space_t* as, uint32_t start, uint32_t end) {
+    vm_area_t* area;
+
+    // Split off halves are appended, so the walk gets to them as well
+    for (area = as->areas.head; area != NULL; area = next_vm_area_list(area)) {
+        if (area->start < start && area->end > start && vm_split(as, area, start) != 0) {
+            return -1;
+        }
+        if (area->start < end && area->end > end && vm_split(as, area, end) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int vm_unmap(addr_space_t* as, uint32_t addr, uint32_t len) {
+    vm_area_t *area, *next;
+
+    if (vm_check_range(addr, len) != 0 || vm_isolate(as, addr, addr + len) != 0) {
+        return -1;
+    }
+
+    for (area = as->areas.head; area != NULL; area = next) {
+        next = next_vm_area_list(area);
+        if (area->start >= addr && area->end <= addr + len) {
+            remove_vm_area_list(&as->areas, area);
+            kmem_cache_free(area_cache, area);
+        }
+    }
+
+    vm_release_range(as, addr, addr + len);
+    return 0;
+}
+
+/**
+ * Change the protection of the areas in [addr, addr + len). Mapped pages
+ * drop to read-only (or no access), write access comes back through the
+ * fault handler so shared pages still get copied.
+ */
+int vm_protect(addr_space_t* as, uint32_t addr, uint32_t len, uint32_t prot) {
+    vm_area_t* area;
+    uint32_t page;
+    uint32_t* pte;
+
+    if (vm_check_range(addr, len) != 0 || vm_isolate(as, addr, addr + len) != 0) {
+        return -1;
+    }
+
+    for (area = as->areas.head; area != NULL; area = next_vm_area_list(area)) {
+        if (area->start < addr || area->end > addr + len) {
+            continue;
+        }
+
+        area->prot = prot;
+        for (page = area->start; page < area->end; page += PAGE_SIZE) {
+            pte = vm_pte(as, page, 0);
+            if (pte != NULL && (*pte & PTE_SMALL)) {
+                pte_write(pte, (*pte & PTE_FRAME_MASK) | pte_bits(prot, 0));
+                if (as == current_as) {
+                    tlb_invalidate_addr((void*)page);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copy an address space. Areas are duplicated, pages are shared: both sides
+ * map them read-only and take a reference, and the first write on either
+ * side gets its own copy.
+ */
+addr_space_t* vm_clone(addr_space_t* src) {
+    addr_space_t* dst;
+    vm_area_t *area, *copy;
+    uint32_t addr, frame;
+    uint32_t *spte, *dpte;
+
+    dst = vm_create();
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    for (area = src->areas.head; area != NULL; area = next_vm_area_list(area)) {
+        copy = kmem_cache_alloc(area_cache);
+        if (copy == NULL) {
+            vm_destroy(dst);
+            return NULL;
+        }
+        copy->start = area->start;
+        copy->end = area->end;
+        copy->prot = area->prot;
+        append_vm_area_list(&dst->areas, copy);
+    }
+
+    for (addr = VM_USER_START; addr < VM_USER_END; addr += PAGE_SIZE) {
+        spte = vm_pte(src, addr, 0);
+        if (spte == NULL) {
+            addr = (addr | (SECTION_SIZE - 1)) + 1 - PAGE_SIZE;
+            continue;
+        }
+        if (!(*spte & PTE_SMALL)) {
+            continue;
+        }
+
+        frame = *spte & PTE_FRAME_MASK;
+        if ((void*)frame != zero_page && page_get((void*)frame) != 0) {
+            vm_destroy(dst);
+            return NULL;
+        }
+
+        dpte = vm_pte(dst, addr, 1);
+        if (dpte == NULL) {
+            if ((void*)frame != zero_page) {
+                page_put((void*)frame);
+            }
+            vm_destroy(dst);
+            return NULL;
+        }
+
+        if ((*spte & (PTE_AP_RW | PTE_APX)) == PTE_AP_RW) {
+            pte_write(spte, *spte | PTE_APX);
+        }
+        pte_write(dpte, *spte);
+    }
+
+    if (src == current_as) {
+        tlb_invalidate_all();
+    }
+    return dst;
+}
+
+/**
+ * Resolve a data abort in the current address space. Returns 0 if the
+ * access can be retried, -1 if it is a real fault.
+ */
+int vm_handle_fault(uint32_t addr, uint32_t status) {
+    addr_space_t* as = current_as;
+    uint32_t fs = DFSR_FS(status), page, frame, mapping;
+    int write = (status & DFSR_WNR) != 0, writable;
+    vm_area_t* area;
+    uint32_t* pte;
+
+    if (as == NULL || (fs != FS_TRANSLATION_SECTION && fs != FS_TRANSLATION_PAGE && fs != FS_PERMISSION_PAGE)) {
+        return -1;
+    }
+
+    // Nothing can be write-only, any accessible area is readable
+    area = vm_find_area(as, addr);
+    if (area == NULL || !(area->prot & (write ? VM_WRITE : VM_READ | VM_WRITE))) {
+        return -1;
+    }
+
+    page = addr & PAGE_MASK;
+    pte = vm_pte(as, page, 1);
+    if (pte == NULL) {
+        return -1;
+    }
+    frame = *pte & PTE_FRAME_MASK;
+
+    if (!(*pte & PTE_SMALL) || (write && (void*)frame == zero_page)) {
+        if (write) {
+            mapping = (uint32_t)alloc_page();
+            if (mapping == 0) {
+                return -1;
+            }
+            writable = 1;
+            vm_stats.demand_zero++;
+        } else {
+            mapping = (uint32_t)zero_page;
+            writable = 0;
+            vm_stats.zero_maps++;
+        }
+    } else if (!write) {
+        // Mapped but without access, the area's protection was raised since
+        mapping = frame;
+        writable = 0;
+    } else if (page_refcount((void*)frame) == 1) {
+        mapping = frame;
+        writable = 1;
+        vm_stats.cow_reuses++;
+    } else {
+        // The exception entry saved the NEON registers, so memcpy is fine here
+        mapping = (uint32_t)alloc_page_flags(0);
+        if (mapping == 0) {
+            return -1;
+        }
+        memcpy((void*)mapping, (void*)frame, PAGE_SIZE);
+        page_put((void*)frame);
+        writable = 1;
+        vm_stats.cow_copies++;
+    }
+
+    pte_write(pte, mapping | pte_bits(area->prot, writable));
+    tlb_invalidate_addr((void*)page);
+    vm_stats.faults++;
+    return 0;
+}
+
+void vm_get_stats(vm_stats_t* stats) {
+    *stats = vm_stats;
+}
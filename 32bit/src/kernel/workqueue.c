@@ -0,0 +1,268 @@
+#include <kernel/workqueue.h>
+#include <kernel/timer.h>
+#include <kernel/atomic.h>
+#include <kernel/barrier.h>
+#include <kernel/mem.h>
+#include <common/stdio.h>
+
+IMPLEMENT_LIST(work);
+
+#define MAX_WORKQUEUES 8
+#define WORKER_NAME_LEN 16
+
+/**
+ * Stopping a worker takes two steps. WORKER_STOP keeps it from blocking
+ * while it is woken, and only at WORKER_EXIT, once the waker is done with
+ * the thread, may it exit and have its thread freed.
+ */
+#define WORKER_STOP 1
+#define WORKER_EXIT 2
+#define WORKER_STOP_POLL_US 1000
+
+workqueue_t* system_wq;
+
+static workqueue_t* workqueues[MAX_WORKQUEUES];
+static uint32_t nr_workqueues;
+
+/**
+ * Take items off the pool's queue one at a time and run them with the
+ * lock dropped. With nothing queued the worker blocks, having marked
+ * itself blocked before dropping the lock, so an item queued right after
+ * still wakes it.
+ */
+static void worker_thread(void* arg) {
+    worker_pool_t* pool = arg;
+    uint32_t flags, wait;
+    work_t* work;
+
+    while (1) {
+        flags = spin_lock_irqsave(&pool->lock);
+        if (pool->stop == WORKER_EXIT) {
+            // The pool isn't touched again once the lock is dropped, see worker_stop()
+            pool->worker = NULL;
+            spin_unlock_irqrestore(&pool->lock, flags);
+            return;
+        }
+        if (pool->stop != 0) {
+            spin_unlock_irqrestore(&pool->lock, flags);
+            thread_sleep_us(WORKER_STOP_POLL_US);
+            continue;
+        }
+
+        work = pop_work_list(&pool->queue);
+        if (work == NULL) {
+            thread_prepare_block();
+            spin_unlock_irqrestore(&pool->lock, flags);
+            thread_block();
+            continue;
+        }
+
+        work->pool = NULL;
+        wait = timer_now_us() - work->queued_us;
+        if (wait > pool->max_wait_us) {
+            pool->max_wait_us = wait;
+        }
+        pool->done++;
+        dmb();
+        work->pending = 0;
+        spin_unlock_irqrestore(&pool->lock, flags);
+
+        // The item may be queued again or freed from here on
+        work->fn(work->arg);
+    }
+}
+
+/* Make a pool's worker exit and wait until it has let go of the pool */
+static void worker_stop(worker_pool_t* pool) {
+    thread_t* worker;
+    uint32_t flags, running;
+
+    flags = spin_lock_irqsave(&pool->lock);
+    pool->stop = WORKER_STOP;
+    worker = pool->worker;
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    // It can't exit before WORKER_EXIT, so the wake never reaches a freed thread
+    thread_wake(worker);
+    flags = spin_lock_irqsave(&pool->lock);
+    pool->stop = WORKER_EXIT;
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    do {
+        thread_sleep_us(WORKER_STOP_POLL_US);
+        flags = spin_lock_irqsave(&pool->lock);
+        running = pool->worker != NULL;
+        spin_unlock_irqrestore(&pool->lock, flags);
+    } while (running);
+}
+
+/* Undo a workqueue_create() that failed part way: stop the workers started so far and free everything */
+static void workqueue_unwind(workqueue_t* wq, char** names) {
+    uint32_t cpu;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (wq->pools[cpu].worker != NULL) {
+            worker_stop(&wq->pools[cpu]);
+        }
+        kfree(names[cpu]);
+    }
+    kfree(wq);
+}
+
+/**
+ * Create a work queue with a worker thread of the given priority on every
+ * online core. Everything is allocated before the first worker starts, and
+ * if a worker can't be created the ones already running are stopped again.
+ */
+workqueue_t* workqueue_create(const char* name, uint32_t priority) {
+    char* names[NR_CPUS] = { NULL };
+    workqueue_t* wq;
+    worker_pool_t* pool;
+    uint32_t cpu;
+
+    if (nr_workqueues == MAX_WORKQUEUES) {
+        error("workqueue_create: too many work queues for %s", name);
+        return NULL;
+    }
+
+    wq = kmalloc(sizeof(workqueue_t));
+    if (wq == NULL) {
+        error("workqueue_create: out of memory");
+        return NULL;
+    }
+    bzero(wq, sizeof(workqueue_t));
+    wq->name = name;
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        pool = &wq->pools[cpu];
+        spin_lock_init(&pool->lock, name);
+        INITIALIZE_LIST(pool->queue);
+        if (!cpu_data[cpu].online) {
+            continue;
+        }
+
+        names[cpu] = kmalloc(WORKER_NAME_LEN);
+        if (names[cpu] == NULL) {
+            error("workqueue_create: out of memory");
+            workqueue_unwind(wq, names);
+            return NULL;
+        }
+        ksnprintf(names[cpu], WORKER_NAME_LEN, "%s/%u", name, cpu);
+    }
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (names[cpu] == NULL) {
+            continue;
+        }
+        pool = &wq->pools[cpu];
+        pool->worker = thread_create_on(names[cpu], worker_thread, pool, priority, cpu);
+        if (pool->worker == NULL) {
+            error("workqueue_create: no worker for %s on cpu %u", name, cpu);
+            workqueue_unwind(wq, names);
+            return NULL;
+        }
+    }
+
+    workqueues[nr_workqueues++] = wq;
+    return wq;
+}
+
+/* Start system_wq, once the scheduler runs on every core */
+void workqueue_init(void) {
+    system_wq = workqueue_create("events", SCHED_PRIO_HIGH);
+    if (system_wq == NULL) {
+        panic("workqueue_init: could not create the system work queue");
+    }
+}
+
+void work_init(work_t* work, work_fn_t fn, void* arg) {
+    bzero(work, sizeof(work_t));
+    work->fn = fn;
+    work->arg = arg;
+}
+
+/**
+ * Queue an item on a core's worker, from any context. Returns 1 if it was
+ * queued and 0 if it was still waiting from an earlier call.
+ */
+int queue_work_on(workqueue_t* wq, uint32_t cpu, work_t* work) {
+    worker_pool_t* pool;
+    uint32_t flags;
+    thread_t* worker;
+
+    if (cpu >= NR_CPUS || !cpu_data[cpu].online) {
+        error("queue_work: cpu %u is not online", cpu);
+        return 0;
+    }
+    if (atomic_xchg(&work->pending, 1) != 0) {
+        return 0;
+    }
+
+    pool = &wq->pools[cpu];
+    flags = spin_lock_irqsave(&pool->lock);
+    work->queued_us = timer_now_us();
+    work->pool = pool;
+    append_work_list(&pool->queue, work);
+    worker = pool->worker;
+    spin_unlock_irqrestore(&pool->lock, flags);
+
+    // The run queue lock is taken after the pool lock is dropped, the worker takes them the other way round
+    if (worker != NULL) {
+        thread_wake(worker);
+    }
+    return 1;
+}
+
+int queue_work(workqueue_t* wq, work_t* work) {
+    uint32_t flags = irq_save();
+    int ret = queue_work_on(wq, smp_processor_id(), work);
+
+    irq_restore(flags);
+    return ret;
+}
+
+/* Take an item off its queue if it hasn't started, returns 1 if it was removed. A running one isn't waited for */
+int cancel_work(work_t* work) {
+    worker_pool_t* pool = work->pool;
+    uint32_t flags;
+    int ret = 0;
+
+    if (pool == NULL) {
+        return 0;
+    }
+
+    flags = spin_lock_irqsave(&pool->lock);
+    // It may have started or been cancelled while the lock was being taken
+    if (work->pool == pool) {
+        remove_work_list(&pool->queue, work);
+        work->pool = NULL;
+        dmb();
+        work->pending = 0;
+        ret = 1;
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+    return ret;
+}
+
+void workqueue_info(void) {
+    worker_pool_t* pool;
+    uint32_t i, cpu, flags, queued, done, max_wait;
+
+    puts("queue       cpu  queued        done  max wait (us)\n");
+    for (i = 0; i < nr_workqueues; i++) {
+        for (cpu = 0; cpu < NR_CPUS; cpu++) {
+            pool = &workqueues[i]->pools[cpu];
+            if (pool->worker == NULL) {
+                continue;
+            }
+
+            flags = spin_lock_irqsave(&pool->lock);
+            queued = size_work_list(&pool->queue);
+            done = pool->done;
+            max_wait = pool->max_wait_us;
+            spin_unlock_irqrestore(&pool->lock, flags);
+
+            kprintf("%-10s  %3u  %6u  %10u  %13u\n", workqueues[i]->name, cpu, queued, done, max_wait);
+        }
+    }
+}
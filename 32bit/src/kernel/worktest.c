@@ -0,0 +1,119 @@
+#include <kernel/workqueue.h>
+#include <kernel/timer.h>
+#include <kernel/atomic.h>
+#include <common/stdio.h>
+
+/**
+ * Work queue self test: every online core's worker runs a batch of items
+ * on that core, including ones that sleep, an item still waiting can't be
+ * queued twice, and one cancelled before its worker got to it never runs.
+ * The queue-to-start delay is reported, and on an idle system it is
+ * roughly the cost of waking the worker.
+ */
+
+#define WORK_TEST_ITEMS 8
+#define WORK_TEST_SLEEP_US 2000
+#define WORK_TEST_TIMEOUT_US 1000000
+
+typedef struct work_test_item {
+    work_t work;
+    uint32_t cpu;               // Core it was queued on
+    volatile uint32_t ran_on;   // Core it ran on plus one, 0 until it ran
+    uint64_t queued_us;
+    uint64_t started_us;
+} work_test_item_t;
+
+static work_test_item_t test_items[NR_CPUS][WORK_TEST_ITEMS];
+static volatile uint32_t test_done;
+
+static void work_test_fn(void* arg) {
+    work_test_item_t* item = arg;
+
+    item->started_us = timer_now_us();
+    // Odd items sleep, which only a worker thread can do
+    if ((item - &test_items[item->cpu][0]) & 1) {
+        thread_sleep_us(WORK_TEST_SLEEP_US);
+    }
+    item->ran_on = smp_processor_id() + 1;
+    atomic_add_return(&test_done, 1);
+}
+
+static void work_test_never(void* arg) {
+    *(volatile uint32_t*)arg = 1;
+}
+
+int workqueue_test(void) {
+    work_test_item_t* item;
+    work_t cancelled;
+    volatile uint32_t cancelled_ran = 0;
+    uint32_t cpu, i, flags, expected = 0, wait, max_wait = 0, total_wait = 0;
+    uint64_t start;
+    int removed;
+
+    // With IRQs masked the local worker can't get in between queueing and cancelling
+    work_init(&cancelled, work_test_never, (void*)&cancelled_ran);
+    flags = irq_save();
+    if (queue_work(system_wq, &cancelled) != 1 || queue_work(system_wq, &cancelled) != 0) {
+        irq_restore(flags);
+        error("queueing an item twice didn't return 1 then 0");
+        return 0;
+    }
+    removed = cancel_work(&cancelled);
+    irq_restore(flags);
+    if (!removed) {
+        error("cancel_work didn't remove a waiting item");
+        return 0;
+    }
+
+    test_done = 0;
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (!cpu_data[cpu].online) {
+            continue;
+        }
+        for (i = 0; i < WORK_TEST_ITEMS; i++) {
+            item = &test_items[cpu][i];
+            work_init(&item->work, work_test_fn, item);
+            item->cpu = cpu;
+            item->ran_on = 0;
+            item->queued_us = timer_now_us();
+            queue_work_on(system_wq, cpu, &item->work);
+            expected++;
+        }
+    }
+
+    start = timer_now_us();
+    while (test_done < expected && timer_now_us() < start + WORK_TEST_TIMEOUT_US) {
+        thread_sleep_us(1000);
+    }
+
+    for (cpu = 0; cpu < NR_CPUS; cpu++) {
+        if (!cpu_data[cpu].online) {
+            continue;
+        }
+        for (i = 0; i < WORK_TEST_ITEMS; i++) {
+            item = &test_items[cpu][i];
+            if (item->ran_on == 0) {
+                error("item %u for cpu %u never ran", i, cpu);
+                return 0;
+            }
+            if (item->ran_on != cpu + 1) {
+                error("item %u for cpu %u ran on cpu %u", i, cpu, item->ran_on - 1);
+                return 0;
+            }
+            wait = item->started_us - item->queued_us;
+            total_wait += wait;
+            if (wait > max_wait) {
+                max_wait = wait;
+            }
+        }
+    }
+
+    if (cancelled_ran) {
+        error("a cancelled item ran");
+        return 0;
+    }
+
+    kprintf("%u items ran, queue to start max %u us, average %u us (includes the sleeping items ahead)\n",
+            expected, max_wait, total_wait / expected);
+    return 1;
+}
@@ -0,0 +1,342 @@
+#include <kernel/mem.h>
+#include <kernel/slab.h>
+#include <common/stdio.h>
+#include "memhost.h"
+
+/**
+ * Invariant checks. mem_check_pages() and mem_check_heap() check the
+ * allocators' own structures and report every range they walk, from
+ * which check_all() builds a map of who owns each page of the arena:
+ *
+ * - every page belongs to exactly one of the reserved start, the deferred
+ *   blocks, a buddy free block, a pool, a magazine, a live block of the
+ *   harness or a slab, so nothing overlaps and nothing leaks
+ * - every allocated heap segment is a live kmalloc() block of the harness
+ *   and every small live block sits in a slab of a size that fits
+ * - each cache's slab lists hold as many slabs as there are pages naming
+ *   that cache, and mem_free_page_count() adds up to the free ranges walked
+ * - zeroed pool pages are still zero and live blocks still hold their tags
+ *
+ * Pages nobody claims are taken to be slabs if their first word points at
+ * one of the caches learned by check_init(), which is where slab.c keeps
+ * the slab descriptor.
+ */
+#define CHECK_REPORT_MAX 10             // Problems printed per check, the rest are only counted
+
+enum {
+    OWNER_NONE,
+    OWNER_RESERVED,                     // The first six match mem_range_t, one up
+    OWNER_DEFERRED,
+    OWNER_BUDDY,
+    OWNER_ZEROED,
+    OWNER_DIRTY,
+    OWNER_MAGAZINE,
+    OWNER_LIVE,
+    OWNER_SLAB,
+};
+
+static const char* const owner_names[] = {
+    "unowned", "reserved", "deferred", "buddy free", "zeroed pool", "dirty pool", "magazine", "allocated", "slab"
+};
+
+#define SLAB_CACHES (4 + 1)             // The kmalloc caches and the cache of caches
+
+static uint8_t page_owner[MEMHOST_MAX_PAGES];
+static uint32_t heap_used[KERNEL_HEAP_SIZE / 16];  // Size of the allocated segment starting at each granule
+static uintptr_t arena_base;
+static uint32_t arena_pages;
+static uintptr_t heap_start;
+static kmem_cache_t* slab_caches[SLAB_CACHES];
+static uint32_t slab_pages[SLAB_CACHES];
+static uint32_t free_pages_walked;
+static uint32_t problems;
+static uint32_t errors_seen;
+
+static void check_fail(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void check_fail(const char* fmt, ...) {
+    va_list args;
+
+    if (++problems > CHECK_REPORT_MAX) {
+        return;
+    }
+    kprintf("check: op %u: ", host_op);
+    va_start(args, fmt);
+    kvprintf(fmt, args);
+    va_end(args);
+    puts("\n");
+}
+
+static inline uint32_t ptr_to_pfn(void* ptr) {
+    return ((uintptr_t)ptr - arena_base) / PAGE_SIZE;
+}
+
+static int slab_cache_index(kmem_cache_t* cache) {
+    int i;
+
+    for (i = 0; i < SLAB_CACHES; i++) {
+        if (slab_caches[i] != NULL && slab_caches[i] == cache) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Learn the slab caches. A kmalloc() of each class size lands in that
+ * class's cache, and the cache descriptors themselves sit in the cache of
+ * caches. The objects go straight back, into this core's magazines.
+ */
+void check_init(void* arena, uint32_t bytes) {
+    slab_t* slab;
+    void* obj;
+    uint32_t i, size;
+
+    arena_base = (uintptr_t)arena;
+    arena_pages = bytes / PAGE_SIZE;
+    errors_seen = host_errors;
+
+    for (i = 0, size = 32; size <= KMALLOC_SLAB_MAX; i++, size *= 2) {
+        obj = kmalloc(size);
+        slab = (slab_t*)((uintptr_t)obj & ~(uintptr_t)(PAGE_SIZE - 1));
+        slab_caches[i] = slab->cache;
+        kfree(obj);
+    }
+    slab = (slab_t*)((uintptr_t)slab_caches[0] & ~(uintptr_t)(PAGE_SIZE - 1));
+    slab_caches[i] = slab->cache;
+}
+
+/* What every single operation must leave behind, returns the number of problems */
+uint32_t check_op(void) {
+    problems = 0;
+    if (host_irq_masked) {
+        check_fail("IRQs were left masked");
+        host_irq_masked = 0;
+    }
+    if (host_locks_held != 0) {
+        check_fail("%u locks were left held", host_locks_held);
+    }
+    if (host_errors != errors_seen) {
+        check_fail("the allocators logged %u errors", host_errors - errors_seen);
+        errors_seen = host_errors;
+    }
+    return problems;
+}
+
+static void mark_pages(void* addr, uint32_t bytes, uint32_t owner) {
+    uint32_t pfn, end;
+
+    pfn = ptr_to_pfn(addr);
+    end = pfn + (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    if ((uintptr_t)addr < arena_base || ((uintptr_t)addr - arena_base) % PAGE_SIZE || end > arena_pages) {
+        check_fail("%s range %p+%u is outside the arena or misaligned", owner_names[owner], addr, bytes);
+        return;
+    }
+
+    for (; pfn < end; pfn++) {
+        if (page_owner[pfn] != OWNER_NONE) {
+            check_fail("page %u is both %s and %s", pfn, owner_names[page_owner[pfn]], owner_names[owner]);
+        } else {
+            page_owner[pfn] = owner;
+        }
+    }
+}
+
+static void walk_range(void* addr, uint32_t bytes, mem_range_t kind, void* arg) {
+    uint32_t granule;
+
+    (void)arg;
+    if (kind == MEM_RANGE_HEAP_FREE || kind == MEM_RANGE_HEAP_USED) {
+        // The first segment walked is the start of the heap
+        if (heap_start == 0) {
+            heap_start = (uintptr_t)addr;
+        }
+        granule = ((uintptr_t)addr - heap_start) / 16;
+        if (kind == MEM_RANGE_HEAP_USED && granule < KERNEL_HEAP_SIZE / 16) {
+            heap_used[granule] = bytes;
+        }
+        return;
+    }
+
+    if (kind == MEM_RANGE_ZEROED && !block_zeroed(addr, bytes)) {
+        check_fail("zeroed pool page %u is dirty", ptr_to_pfn(addr));
+    }
+    if (kind != MEM_RANGE_RESERVED) {
+        free_pages_walked += bytes / PAGE_SIZE;
+    }
+    mark_pages(addr, bytes, kind + 1);
+}
+
+static int heap_block(void* ptr) {
+    return (uintptr_t)ptr >= heap_start && (uintptr_t)ptr < heap_start + KERNEL_HEAP_SIZE;
+}
+
+static void check_live(host_block_t* block) {
+    uint32_t granule, pfn;
+    slab_t* slab;
+
+    if (!block_intact(block)) {
+        check_fail("block %p+%u was overwritten", block->ptr, block_bytes(block));
+    }
+
+    if (block->kind != BLOCK_KMALLOC) {
+        mark_pages(block->ptr, block_bytes(block), OWNER_LIVE);
+        if (page_refcount(block->ptr) != block->refs + 1U) {
+            check_fail("page %u has %u references, %u were taken", ptr_to_pfn(block->ptr),
+                    page_refcount(block->ptr), block->refs + 1U);
+        }
+        return;
+    }
+
+    if (heap_block(block->ptr)) {
+        granule = ((uintptr_t)block->ptr - sizeof(heap_segment_t) - heap_start) / 16;
+        if (heap_used[granule] < block->size + sizeof(heap_segment_t)) {
+            check_fail("kmalloc block %p+%u is not in an allocated heap segment that fits", block->ptr, block->size);
+        }
+        heap_used[granule] = 0;
+        return;
+    }
+
+    // Slab pages are only known once every other page is accounted for
+    pfn = ptr_to_pfn(block->ptr);
+    slab = (slab_t*)((uintptr_t)block->ptr & ~(uintptr_t)(PAGE_SIZE - 1));
+    if (pfn >= arena_pages || page_owner[pfn] != OWNER_SLAB) {
+        check_fail("kmalloc block %p+%u is neither in the heap nor in a slab", block->ptr, block->size);
+    } else if (slab->cache->object_size < block->size ||
+            ((uintptr_t)block->ptr & (PAGE_SIZE - 1)) + block->size > PAGE_SIZE) {
+        check_fail("kmalloc block %p+%u is in a slab of %s", block->ptr, block->size, slab->cache->name);
+    }
+}
+
+uint32_t check_all(host_block_t* blocks, uint32_t count) {
+    uint32_t pfn, i, slabs, granule, free_count;
+    kmem_cache_t* cache;
+    int index;
+
+    problems = check_op();
+    bzero(page_owner, arena_pages);
+    bzero(heap_used, sizeof(heap_used));
+    free_pages_walked = 0;
+
+    // The allocators' own checks log through error(), which check_op() would count again
+    problems += mem_check_pages(walk_range, NULL);
+    problems += mem_check_heap(walk_range, NULL);
+    errors_seen = host_errors;
+
+    for (i = 0; i < count; i++) {
+        if (blocks[i].kind != BLOCK_NONE && blocks[i].kind != BLOCK_KMALLOC) {
+            check_live(&blocks[i]);
+        }
+    }
+
+    // Whatever is still unclaimed has to be a slab
+    for (i = 0; i < SLAB_CACHES; i++) {
+        slab_pages[i] = 0;
+    }
+    for (pfn = 0; pfn < arena_pages; pfn++) {
+        if (page_owner[pfn] != OWNER_NONE) {
+            continue;
+        }
+        index = slab_cache_index(((slab_t*)(arena_base + pfn * PAGE_SIZE))->cache);
+        if (index < 0) {
+            check_fail("page %u is lost, nothing owns it", pfn);
+            continue;
+        }
+        page_owner[pfn] = OWNER_SLAB;
+        slab_pages[index]++;
+    }
+    for (i = 0; i < SLAB_CACHES; i++) {
+        cache = slab_caches[i];
+        slabs = cache->slabs_partial.size + cache->slabs_full.size + cache->slabs_free.size;
+        if (slabs != slab_pages[i]) {
+            check_fail("%s has %u slabs on its lists, %u pages name it", cache->name, slabs, slab_pages[i]);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (blocks[i].kind == BLOCK_KMALLOC) {
+            check_live(&blocks[i]);
+        }
+    }
+    for (granule = 0; granule < KERNEL_HEAP_SIZE / 16; granule++) {
+        if (heap_used[granule] != 0) {
+            check_fail("heap segment %p+%u is allocated but nobody has it", (void*)(heap_start + granule * 16),
+                    heap_used[granule]);
+        }
+    }
+
+    free_count = mem_free_page_count();
+    if (free_count != free_pages_walked) {
+        check_fail("%u pages are counted free, %u were walked", free_count, free_pages_walked);
+    }
+    return problems;
+}
+
+static void walk_heap_stats(void* addr, uint32_t bytes, mem_range_t kind, void* arg) {
+    host_frag_t* frag = arg;
+
+    (void)addr;
+    if (kind == MEM_RANGE_HEAP_USED) {
+        frag->heap_used_segments++;
+    } else if (kind == MEM_RANGE_HEAP_FREE) {
+        frag->heap_free_segments++;
+        frag->heap_free += bytes;
+        if (bytes > frag->heap_largest) {
+            frag->heap_largest = bytes;
+        }
+    } else if (kind == MEM_RANGE_DEFERRED) {
+        frag->deferred_blocks = bytes / (PAGE_SIZE << (MAX_ORDER - 1));
+    }
+}
+
+void frag_stats(host_frag_t* frag) {
+    uint32_t order;
+
+    bzero(frag, sizeof(host_frag_t));
+    for (order = 0; order < MAX_ORDER; order++) {
+        frag->free_blocks[order] = mem_free_blocks(order);
+    }
+    frag->free_pages = mem_free_page_count();
+    mem_check_pages(walk_heap_stats, frag);
+    mem_check_heap(walk_heap_stats, frag);
+}
+
+uint32_t block_bytes(host_block_t* block) {
+    if (block->kind == BLOCK_KMALLOC) {
+        return block->size;
+    }
+    return PAGE_SIZE << (block->kind == BLOCK_PAGES ? block->size : 0);
+}
+
+void block_fill(host_block_t* block) {
+    memset(block->ptr, block->tag, block_bytes(block));
+}
+
+int block_intact(host_block_t* block) {
+    uint8_t* bytes = block->ptr;
+    uint32_t i, len = block_bytes(block);
+
+    for (i = 0; i < len; i++) {
+        if (bytes[i] != block->tag) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int block_zeroed(void* ptr, uint32_t bytes) {
+    uint32_t* words = ptr;
+    uint32_t i;
+
+    for (i = 0; i < bytes / sizeof(uint32_t); i++) {
+        if (words[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Buddy blocks are aligned to their size counting from the start of RAM, which is the arena here */
+int block_aligned(void* ptr, uint32_t order) {
+    return ((uintptr_t)ptr - arena_base) % (PAGE_SIZE << order) == 0;
+}
@@ -0,0 +1,193 @@
+#include <kernel/mem.h>
+#include <common/stdio.h>
+#include "memhost.h"
+
+/**
+ * Randomized allocator fuzzing, along the lines of buddy_stress_test()
+ * but over every entry point: each step picks a random slot and frees
+ * what it holds or fills it from a random allocator, with page
+ * references, idle scrubbing and magazine resizing mixed in, each on a
+ * random core. Every block is filled with its tag and checked before it
+ * is freed, fresh zeroed memory must be zero, and check_op() runs after
+ * every step and check_all() every check_every steps and at the end,
+ * after everything has been freed again.
+ *
+ * The arena is small enough that the allocators run dry at times, a
+ * NULL return is fine as long as it leaves everything consistent. The
+ * seed reproduces a run exactly.
+ */
+#define FUZZ_SLOTS 4096
+#define FUZZ_MAX_ORDER 6                // alloc_pages() orders 0 .. 5
+#define FUZZ_MAX_SHIFT 15               // kmalloc() sizes up to 32 KiB, log-uniformly
+
+typedef struct {
+    uint32_t allocs;
+    uint32_t failed;
+    uint32_t frees;
+    uint32_t refs;
+    uint32_t scrubs;
+    uint32_t resizes;
+    uint32_t checks;
+} fuzz_stats_t;
+
+static host_block_t slots[FUZZ_SLOTS];
+static uint64_t fuzz_state;
+static fuzz_stats_t stats;
+
+static uint32_t fuzz_rand(uint32_t bound) {
+    return host_rand(&fuzz_state) % bound;
+}
+
+/* Fill an empty slot, returns 0 if the new block is wrong */
+static int fuzz_alloc(host_block_t* block) {
+    uint32_t choice, flags = 0;
+    void* ptr;
+
+    choice = fuzz_rand(100);
+    if (choice < 40) {
+        block->kind = BLOCK_KMALLOC;
+        block->size = 1 + fuzz_rand(1U << fuzz_rand(FUZZ_MAX_SHIFT + 1));
+        if (fuzz_rand(200) == 0) {
+            // Larger than the whole heap, must be turned down
+            if (kmalloc(KERNEL_HEAP_SIZE + 1) != NULL) {
+                kprintf("fuzz: kmalloc(%u) succeeded\n", KERNEL_HEAP_SIZE + 1);
+                return 0;
+            }
+        }
+        ptr = kmalloc(block->size);
+    } else if (choice < 75) {
+        block->kind = BLOCK_PAGE;
+        block->size = 0;
+        flags = fuzz_rand(2) ? ALLOC_ZERO : 0;
+        ptr = alloc_page_flags(flags);
+    } else {
+        block->kind = BLOCK_PAGES;
+        block->size = fuzz_rand(FUZZ_MAX_ORDER);
+        flags = ALLOC_ZERO;
+        ptr = alloc_pages(block->size);
+    }
+
+    if (ptr == NULL) {
+        block->kind = BLOCK_NONE;
+        stats.failed++;
+        return 1;
+    }
+    block->ptr = ptr;
+    block->refs = 0;
+    block->tag = 1 + fuzz_rand(255);
+    stats.allocs++;
+
+    if (block->kind == BLOCK_KMALLOC && (uintptr_t)ptr % 16) {
+        kprintf("fuzz: kmalloc(%u) returned %p, which is not 16 byte aligned\n", block->size, ptr);
+        return 0;
+    }
+    if (block->kind == BLOCK_PAGES && !block_aligned(ptr, block->size)) {
+        kprintf("fuzz: order %u block at %p is not aligned to its size\n", block->size, ptr);
+        return 0;
+    }
+    if ((flags & ALLOC_ZERO) && !block_zeroed(ptr, block_bytes(block))) {
+        kprintf("fuzz: %u byte block at %p was not zeroed\n", block_bytes(block), ptr);
+        return 0;
+    }
+    block_fill(block);
+    return 1;
+}
+
+/* Empty a slot, returns 0 if the block was overwritten while it was allocated */
+static int fuzz_free(host_block_t* block) {
+    if (!block_intact(block)) {
+        kprintf("fuzz: %u byte block at %p was overwritten\n", block_bytes(block), block->ptr);
+        return 0;
+    }
+
+    if (block->kind == BLOCK_KMALLOC) {
+        kfree(block->ptr);
+    } else if (block->refs != 0) {
+        // Dropping a shared reference leaves the page allocated
+        page_put(block->ptr);
+        block->refs--;
+        stats.frees++;
+        return 1;
+    } else if (block->kind == BLOCK_PAGES && (block->size != 0 || fuzz_rand(2))) {
+        free_pages(block->ptr, block->size);
+    } else if (fuzz_rand(4) == 0) {
+        page_put(block->ptr);
+    } else {
+        free_page(block->ptr);
+    }
+    block->kind = BLOCK_NONE;
+    stats.frees++;
+    return 1;
+}
+
+static int fuzz_step(void) {
+    host_block_t* block;
+    uint32_t choice;
+
+    host_cpu = fuzz_rand(NR_CPUS);
+    block = &slots[fuzz_rand(FUZZ_SLOTS)];
+    choice = fuzz_rand(100);
+
+    if (choice < 90) {
+        return block->kind == BLOCK_NONE ? fuzz_alloc(block) : fuzz_free(block);
+    } else if (choice < 95) {
+        // Only single pages can be shared
+        if ((block->kind == BLOCK_PAGE || (block->kind == BLOCK_PAGES && block->size == 0)) &&
+                block->refs < 8 && page_get(block->ptr) == 0) {
+            block->refs++;
+            stats.refs++;
+        }
+    } else if (choice < 99) {
+        mem_idle_scrub();
+        stats.scrubs++;
+    } else {
+        mem_set_magazine_depth(fuzz_rand(MAG_DEPTH + 1));
+        stats.resizes++;
+    }
+    return 1;
+}
+
+static int fuzz_failed(uint64_t seed) {
+    kprintf("fuzz: seed 0x%llx FAILED at op %u\n", (unsigned long long)seed, host_op);
+    return 1;
+}
+
+int fuzz_run(uint64_t seed, uint32_t ops, uint32_t check_every) {
+    uint32_t i;
+
+    fuzz_state = seed ? seed : 1;
+    kprintf("fuzz: seed 0x%llx, %u ops, full check every %u ops\n", (unsigned long long)seed, ops,
+            check_every);
+
+    for (host_op = 1; host_op <= ops; host_op++) {
+        if (!fuzz_step() || check_op() != 0) {
+            return fuzz_failed(seed);
+        }
+        if (host_op % check_every == 0) {
+            stats.checks++;
+            if (check_all(slots, FUZZ_SLOTS) != 0) {
+                return fuzz_failed(seed);
+            }
+        }
+    }
+
+    // Everything goes back, on random cores, and then nothing may be left allocated
+    for (i = 0; i < FUZZ_SLOTS; i++) {
+        host_cpu = fuzz_rand(NR_CPUS);
+        while (slots[i].kind != BLOCK_NONE) {
+            if (!fuzz_free(&slots[i])) {
+                return fuzz_failed(seed);
+            }
+        }
+    }
+    stats.checks++;
+    if (check_op() != 0 || check_all(slots, FUZZ_SLOTS) != 0) {
+        return fuzz_failed(seed);
+    }
+
+    kprintf("fuzz: %u allocs (%u failed for lack of memory), %u frees, %u page refs, %u scrubs, "
+            "%u magazine resizes, %u full checks\n", stats.allocs, stats.failed, stats.frees, stats.refs,
+            stats.scrubs, stats.resizes, stats.checks);
+    kprintf("fuzz: passed\n");
+    return 0;
+}
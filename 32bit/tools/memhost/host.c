@@ -0,0 +1,137 @@
+#include <kernel/spinlock.h>
+#include <common/stdio.h>
+#include "memhost.h"
+
+/**
+ * What mem.c and slab.c need from the rest of the kernel: locks, the log
+ * and the console. Nothing runs concurrently on the host, so a lock only
+ * has to notice being taken while it is already held, which on the Pi
+ * would hang the core for good.
+ */
+uint32_t host_irq_masked;
+uint32_t host_cpu;
+uint32_t host_locks_held;
+uint32_t host_errors;
+uint32_t host_log_level = LOG_WARNING;
+uint32_t host_op;
+
+static const char* const log_level_names[] = { "", "error", "warning", "info", "debug" };
+
+void spin_lock_init(spinlock_t* lock, const char* name) {
+    bzero(lock, sizeof(spinlock_t));
+#ifndef NO_LOCKSTAT
+    lock->stats.name = name;
+#else
+    (void)name;
+#endif
+}
+
+void spin_lock(spinlock_t* lock) {
+    if (lock->slock != 0) {
+        host_abort("spin_lock: the lock is already held, the core would spin forever");
+    }
+    lock->slock = 1;
+    host_locks_held++;
+}
+
+int spin_trylock(spinlock_t* lock) {
+    if (lock->slock != 0) {
+        return 0;
+    }
+    spin_lock(lock);
+    return 1;
+}
+
+void spin_unlock(spinlock_t* lock) {
+    if (lock->slock == 0) {
+        host_abort("spin_unlock: the lock is not held");
+    }
+    lock->slock = 0;
+    host_locks_held--;
+}
+
+void mcs_lock_init(mcs_lock_t* lock, const char* name) {
+    bzero(lock, sizeof(mcs_lock_t));
+#ifndef NO_LOCKSTAT
+    lock->stats.name = name;
+#else
+    (void)name;
+#endif
+}
+
+void mcs_lock(mcs_lock_t* lock, mcs_node_t* node) {
+    if (lock->tail != NULL) {
+        host_abort("mcs_lock: the lock is already held, the core would queue behind itself");
+    }
+    node->next = NULL;
+    node->locked = 0;
+    lock->tail = node;
+    host_locks_held++;
+}
+
+void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node) {
+    if (lock->tail != node) {
+        host_abort("mcs_unlock: the lock is not held through this node");
+    }
+    lock->tail = NULL;
+    host_locks_held--;
+}
+
+/* Errors are counted, the harness treats any message at that level as a failure */
+void klog(uint32_t level, const char* fmt, ...) {
+    char buf[KPRINTF_BUF_SIZE];
+    va_list args;
+    int len;
+
+    if (level == LOG_ERROR) {
+        host_errors++;
+    }
+    if (level > host_log_level || level > LOG_DEBUG) {
+        return;
+    }
+
+    va_start(args, fmt);
+    len = kvsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    // Some callers end their message with a newline, one is added here either way
+    if (len > 0 && (uint32_t)len < sizeof(buf) && buf[len - 1] == '\n') {
+        buf[len - 1] = '\0';
+    }
+    kprintf("[%s] %s\n", log_level_names[level], buf);
+}
+
+void uart_write(const char* buf, uint32_t len) {
+    host_write(buf, len);
+}
+
+void puts(const char* str) {
+    uint32_t len = 0;
+
+    while (str[len] != '\0') {
+        len++;
+    }
+    host_write(str, len);
+}
+
+void panic(const char* msg) {
+    host_abort(msg);
+}
+
+/* Plain C versions of the memops.S block routines, same contract */
+void __memcpy_blocks(void* dest, const void* src, size_t bytes) {
+    uint32_t* d = dest;
+    const uint32_t* s = src;
+
+    for (bytes /= sizeof(uint32_t); bytes != 0; bytes--) {
+        *d++ = *s++;
+    }
+}
+
+void __memset_blocks(void* dest, uint32_t pattern, size_t bytes) {
+    uint32_t* d = dest;
+
+    for (bytes /= sizeof(uint32_t); bytes != 0; bytes--) {
+        *d++ = pattern;
+    }
+}
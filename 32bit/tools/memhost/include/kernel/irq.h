@@ -0,0 +1,27 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+
+/**
+ * Host build stand-in for include/kernel/irq.h. There are no interrupts
+ * on the host, irq_save() and irq_restore() only keep track of whether the
+ * simulated core would have IRQs masked, so the harness can check that
+ * every path through the allocators unmasks them again.
+ */
+#define CPSR_IRQ_MASK (1 << 7)
+
+extern uint32_t host_irq_masked;
+
+static inline uint32_t irq_save(void) {
+    uint32_t cpsr = host_irq_masked ? CPSR_IRQ_MASK : 0;
+
+    host_irq_masked = 1;
+    return cpsr;
+}
+
+static inline void irq_restore(uint32_t cpsr) {
+    host_irq_masked = (cpsr & CPSR_IRQ_MASK) != 0;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+/**
+ * Host build stand-in for include/kernel/smp.h. Everything runs on one
+ * host thread, host_cpu says which core it is playing at the moment, so
+ * the per-CPU magazines fill and drain the way they would on the Pi.
+ */
+#ifdef MODEL_1
+    #define NR_CPUS 1
+#else
+    #define NR_CPUS 4
+#endif
+
+extern uint32_t host_cpu;
+
+static inline uint32_t smp_processor_id(void) {
+    return host_cpu;
+}
+
+#endif
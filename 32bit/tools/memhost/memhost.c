@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "memhost.h"
+
+/**
+ * The host build of the memory manager, see memhost.h. Built from the
+ * 32-bit build directory with 'make memhost':
+ *
+ *     ./memhost fuzz [seed [ops [check_every]]]
+ *     ./memhost gen [seed [ops]] > trace.txt
+ *     ./memhost bench trace.txt
+ *     ./memhost check trace.txt [check_every]
+ *
+ * -m MiB before the command sizes the arena, -v prints the allocators'
+ * info messages too. The exit status is 0 when everything held up.
+ */
+#define FUZZ_DEFAULT_OPS 200000
+#define FUZZ_CHECK_EVERY 1000
+#define GEN_DEFAULT_OPS 100000
+#define CHECK_DEFAULT_EVERY 64
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: memhost [-m MiB] [-v] fuzz [seed [ops [check_every]]]\n"
+            "       memhost gen [seed [ops]]\n"
+            "       memhost [-m MiB] [-v] bench <trace>\n"
+            "       memhost [-m MiB] [-v] check <trace> [check_every]\n");
+    exit(2);
+}
+
+void host_write(const char* buf, uint32_t len) {
+    fwrite(buf, 1, len, stdout);
+}
+
+void host_abort(const char* why) {
+    fflush(stdout);
+    fprintf(stderr, "memhost: op %u: %s\n", host_op, why);
+    exit(1);
+}
+
+/* The arena starts out full of junk like RAM does, nothing may count on it being zero */
+static void arena_init(uint32_t mib) {
+    uint32_t bytes = mib << 20;
+    void* arena;
+
+    if (mib == 0 || bytes / PAGE_SIZE > MEMHOST_MAX_PAGES) {
+        fprintf(stderr, "memhost: the arena takes 1 to %u MiB\n", MEMHOST_MAX_PAGES / (1 << 20) * PAGE_SIZE);
+        exit(2);
+    }
+    arena = aligned_alloc(PAGE_SIZE, bytes);
+    if (arena == NULL) {
+        fprintf(stderr, "memhost: can't get a %u MiB arena\n", mib);
+        exit(2);
+    }
+    memset(arena, 0xA5, bytes);
+
+    mem_init_arena(arena, bytes);
+    check_init(arena, bytes);
+}
+
+static unsigned long long arg_number(int argc, char** argv, int i, unsigned long long fallback) {
+    char* end;
+    unsigned long long value;
+
+    if (i >= argc) {
+        return fallback;
+    }
+    value = strtoull(argv[i], &end, 0);
+    if (*argv[i] == '\0' || *end != '\0') {
+        usage();
+    }
+    return value;
+}
+
+int main(int argc, char** argv) {
+    uint32_t mib = 0, ops, every;
+    uint64_t seed;
+    const char* cmd;
+    int i = 1, status;
+
+    // Line buffered, so a crash in the allocators still leaves everything up to it on screen
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (argv[i][1] == 'm' && argv[i][2] == '\0' && i + 1 < argc) {
+            mib = arg_number(argc, argv, ++i, 0);
+        } else if (argv[i][1] == 'v' && argv[i][2] == '\0') {
+            host_log_level = LOG_DEBUG;
+        } else {
+            usage();
+        }
+    }
+    if (i >= argc) {
+        usage();
+    }
+    cmd = argv[i++];
+
+    if (strcmp(cmd, "gen") == 0) {
+        return trace_gen(arg_number(argc, argv, i, time(NULL)), arg_number(argc, argv, i + 1, GEN_DEFAULT_OPS));
+    }
+
+    if (strcmp(cmd, "fuzz") == 0) {
+        seed = arg_number(argc, argv, i, time(NULL));
+        ops = arg_number(argc, argv, i + 1, FUZZ_DEFAULT_OPS);
+        every = arg_number(argc, argv, i + 2, FUZZ_CHECK_EVERY);
+        if (every == 0) {
+            usage();
+        }
+        mib = mib ? mib : MEMHOST_FUZZ_MB;
+        arena_init(mib);
+        status = fuzz_run(seed, ops, every);
+        if (status != 0) {
+            printf("rerun with: memhost -m %u fuzz 0x%llx %u %u\n", mib, (unsigned long long)seed, ops, every);
+        }
+        return status;
+    }
+
+    if (i >= argc || (strcmp(cmd, "bench") != 0 && strcmp(cmd, "check") != 0)) {
+        usage();
+    }
+    every = arg_number(argc, argv, i + 1, CHECK_DEFAULT_EVERY);
+    if (every == 0) {
+        usage();
+    }
+    arena_init(mib ? mib : MEMHOST_DEFAULT_MB);
+    return strcmp(cmd, "bench") == 0 ? trace_bench(argv[i]) : trace_check(argv[i], every);
+}
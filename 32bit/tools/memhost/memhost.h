@@ -0,0 +1,100 @@
+#ifndef MEMHOST_H
+#define MEMHOST_H
+
+#include <kernel/mem.h>
+#include <kernel/smp.h>
+#include <common/log.h>
+#include <stdint.h>
+
+/**
+ * memhost runs the kernel's page allocator, slab caches and kmalloc heap
+ * (mem.c, slab.c and the common library) as an ordinary host program.
+ * An arena from the host's allocator stands in for RAM, the page
+ * descriptors and the kernel heap go at its start like they go after the
+ * kernel image on the Pi, and the pages after them are handed out.
+ *
+ * The IRQ and per-CPU helpers are replaced by the headers in
+ * tools/memhost/include, locks by the stubs in host.c. There is a single
+ * host thread, which plays one of the NR_CPUS cores at a time, so the
+ * per-CPU magazines behave like they do on the Pi but nothing actually
+ * runs at the same time.
+ *
+ * The harness files that need the C library (memhost.c and replay.c)
+ * leave out common/stdio.h, whose puts() clashes with the C library's,
+ * and none of them can include <string.h>, whose bzero() clashes with
+ * common/stdlib.h.
+ */
+#define MEMHOST_MAX_PAGES (1U << 18)    // Arenas up to 1 GiB, the most mem_init() takes on the Pi
+#define MEMHOST_FUZZ_MB 16              // Small enough that the fuzzer runs the allocators dry now and then
+#define MEMHOST_DEFAULT_MB 64
+
+/* A block the harness allocated */
+typedef enum {
+    BLOCK_NONE,
+    BLOCK_PAGES,                        // alloc_pages(), size is the order
+    BLOCK_PAGE,                         // alloc_page_flags()
+    BLOCK_KMALLOC,                      // kmalloc(), size is the requested bytes
+} block_kind_t;
+
+typedef struct {
+    void* ptr;
+    uint32_t size;
+    uint8_t kind;
+    uint8_t tag;                        // Every byte of the block holds this while it is allocated
+    uint16_t refs;                      // page_get() references held on top of the first one
+} host_block_t;
+
+/* Free memory, as buddyinfo and the heap walk see it */
+typedef struct {
+    uint32_t free_blocks[MAX_ORDER];
+    uint32_t free_pages;                // Including the pools, magazines and deferred blocks
+    uint32_t deferred_blocks;           // Max order blocks not handed to the buddy allocator yet
+    uint32_t heap_free;
+    uint32_t heap_largest;
+    uint32_t heap_free_segments;
+    uint32_t heap_used_segments;
+} host_frag_t;
+
+/* host.c */
+extern uint32_t host_irq_masked;
+extern uint32_t host_cpu;
+extern uint32_t host_locks_held;
+extern uint32_t host_errors;
+extern uint32_t host_log_level;
+extern uint32_t host_op;
+
+/* memhost.c */
+void host_write(const char* buf, uint32_t len);
+void host_abort(const char* why) __attribute__((noreturn));
+
+/* check.c */
+void check_init(void* arena, uint32_t bytes);
+uint32_t check_op(void);
+uint32_t check_all(host_block_t* blocks, uint32_t count);
+void frag_stats(host_frag_t* frag);
+uint32_t block_bytes(host_block_t* block);
+void block_fill(host_block_t* block);
+int block_intact(host_block_t* block);
+int block_zeroed(void* ptr, uint32_t bytes);
+int block_aligned(void* ptr, uint32_t order);
+
+/* fuzz.c */
+int fuzz_run(uint64_t seed, uint32_t ops, uint32_t check_every);
+
+/* replay.c */
+int trace_gen(uint64_t seed, uint32_t ops);
+int trace_bench(const char* path);
+int trace_check(const char* path, uint32_t check_every);
+
+/* xorshift64*, state must not be 0 */
+static inline uint64_t host_rand(uint64_t* state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+#endif
@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "memhost.h"
+
+/**
+ * Allocation traces. A trace is a text file with one operation per line,
+ * and '#' starting a comment:
+ *
+ *     p <cpu> <id> <order>     alloc_page() for order 0, alloc_pages() above
+ *     m <cpu> <id> <bytes>     kmalloc()
+ *     f <cpu> <id>             free block id with the call that matches its allocation
+ *
+ * Ids name blocks for the length of their life and may be reused after
+ * they are freed. Cores past NR_CPUS fold onto the ones there are.
+ * tools/trace_decode.py --alloc-trace turns a kernel trace dump into this
+ * format, 'memhost gen' makes up synthetic ones.
+ *
+ * 'bench' replays a trace once with every call timed, and reports the
+ * latency of each kind of call in the style of the in-kernel 'bench'
+ * table, then how fragmented free memory is at the end of the trace.
+ * 'check' replays it with the invariant checks instead of the clock.
+ */
+#define REPLAY_SAMPLE_OPS 1024          // Ops between fragmentation samples in 'bench'
+#define REPLAY_OVERHEAD_READS 1000
+
+typedef struct {
+    char op;
+    uint8_t cpu;
+    uint32_t id;
+    uint32_t arg;
+    uint32_t line;
+} trace_op_t;
+
+typedef struct {
+    trace_op_t* ops;
+    uint32_t count;
+    uint32_t max_id;
+} trace_t;
+
+enum {
+    CALL_ALLOC_PAGE,
+    CALL_ALLOC_PAGES,
+    CALL_KMALLOC_SMALL,
+    CALL_KMALLOC_LARGE,
+    CALL_FREE_PAGE,
+    CALL_FREE_PAGES,
+    CALL_KFREE_SMALL,
+    CALL_KFREE_LARGE,
+    CALL_KINDS,
+};
+
+static const char* const call_names[CALL_KINDS] = {
+    "alloc_page", "alloc_pages", "kmalloc <= 256", "kmalloc > 256",
+    "free_page", "free_pages", "kfree <= 256", "kfree > 256",
+};
+
+/* Read and validate a whole trace, returns 0 on success */
+static int trace_load(const char* path, trace_t* trace) {
+    char line[128], op;
+    unsigned int cpu, id, arg;
+    uint32_t lineno = 0, capacity = 0, live_size = 0, i;
+    uint8_t* live = NULL;
+    trace_op_t* entry;
+    int fields;
+    FILE* file;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    trace->ops = NULL;
+    trace->count = trace->max_id = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lineno++;
+        fields = sscanf(line, " %c %u %u %u", &op, &cpu, &id, &arg);
+        if (fields <= 0 || op == '#') {
+            continue;
+        }
+        if (!((op == 'p' || op == 'm') && fields == 4) && !(op == 'f' && fields >= 3)) {
+            fprintf(stderr, "%s:%u: expected 'p|m <cpu> <id> <arg>' or 'f <cpu> <id>'\n", path, lineno);
+            goto fail;
+        }
+        if (op == 'p' && arg >= MAX_ORDER) {
+            fprintf(stderr, "%s:%u: order %u is above the largest, %u\n", path, lineno, arg, MAX_ORDER - 1);
+            goto fail;
+        }
+
+        // Ids have to alternate between alloc and free, checked here so the replay can't go wrong
+        if (id >= live_size) {
+            live_size = id + 1024;
+            live = realloc(live, live_size);
+            if (live == NULL) {
+                goto oom;
+            }
+            for (i = id; i < live_size; i++) {
+                live[i] = 0;
+            }
+        }
+        if (live[id] == (op == 'f' ? 0 : 1)) {
+            fprintf(stderr, "%s:%u: block %u is %s\n", path, lineno, id,
+                    op == 'f' ? "not allocated" : "already allocated");
+            goto fail;
+        }
+        live[id] = op != 'f';
+
+        if (trace->count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            entry = realloc(trace->ops, capacity * sizeof(trace_op_t));
+            if (entry == NULL) {
+                goto oom;
+            }
+            trace->ops = entry;
+        }
+        entry = &trace->ops[trace->count++];
+        entry->op = op;
+        entry->cpu = cpu % NR_CPUS;
+        entry->id = id;
+        entry->arg = op == 'f' ? 0 : arg;
+        entry->line = lineno;
+        if (id > trace->max_id) {
+            trace->max_id = id;
+        }
+    }
+
+    fclose(file);
+    free(live);
+    return 0;
+
+oom:
+    fprintf(stderr, "%s: out of memory\n", path);
+fail:
+    fclose(file);
+    free(live);
+    free(trace->ops);
+    return -1;
+}
+
+/* Which call an op makes, given what its block was allocated as */
+static int op_call(trace_op_t* op, host_block_t* block) {
+    if (op->op == 'p') {
+        return op->arg == 0 ? CALL_ALLOC_PAGE : CALL_ALLOC_PAGES;
+    } else if (op->op == 'm') {
+        return op->arg <= KMALLOC_SLAB_MAX ? CALL_KMALLOC_SMALL : CALL_KMALLOC_LARGE;
+    } else if (block->kind == BLOCK_KMALLOC) {
+        return block->size <= KMALLOC_SLAB_MAX ? CALL_KFREE_SMALL : CALL_KFREE_LARGE;
+    }
+    return block->kind == BLOCK_PAGE ? CALL_FREE_PAGE : CALL_FREE_PAGES;
+}
+
+/* Carry out one op, returns 0 if an allocation came back NULL */
+static int op_run(trace_op_t* op, host_block_t* block) {
+    host_cpu = op->cpu;
+    switch (op->op) {
+    case 'p':
+        block->kind = op->arg == 0 ? BLOCK_PAGE : BLOCK_PAGES;
+        block->size = op->arg;
+        block->ptr = op->arg == 0 ? alloc_page() : alloc_pages(op->arg);
+        break;
+    case 'm':
+        block->kind = BLOCK_KMALLOC;
+        block->size = op->arg;
+        block->ptr = kmalloc(op->arg);
+        break;
+    default:
+        // The allocation may have failed, then there is nothing to free
+        if (block->kind == BLOCK_KMALLOC) {
+            kfree(block->ptr);
+        } else if (block->kind == BLOCK_PAGE) {
+            free_page(block->ptr);
+        } else if (block->kind == BLOCK_PAGES) {
+            free_pages(block->ptr, block->size);
+        }
+        block->kind = BLOCK_NONE;
+        return 1;
+    }
+
+    if (block->ptr == NULL) {
+        block->kind = BLOCK_NONE;
+        return 0;
+    }
+    return 1;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void print_frag(const char* when, host_frag_t* frag) {
+    uint32_t order, small = 0, largest = 0;
+
+    printf("\nfree memory %s: %u pages, %u max order blocks deferred\n", when, frag->free_pages,
+            frag->deferred_blocks);
+    printf("order ");
+    for (order = 0; order < MAX_ORDER; order++) {
+        printf(" %6u", order);
+    }
+    printf("\nblocks");
+    for (order = 0; order < MAX_ORDER; order++) {
+        printf(" %6u", frag->free_blocks[order]);
+        if (frag->free_blocks[order] != 0) {
+            largest = order;
+        }
+    }
+    if (frag->deferred_blocks != 0) {
+        largest = MAX_ORDER - 1;
+    }
+
+    // Free pages a max order allocation can't use: smaller blocks, pools and magazines
+    small = frag->free_pages - ((frag->free_blocks[MAX_ORDER - 1] + frag->deferred_blocks) << (MAX_ORDER - 1));
+    printf("\nlargest free block: order %u, %u%% of free pages are outside max order blocks\n", largest,
+            frag->free_pages ? (uint32_t)(small * 100ULL / frag->free_pages) : 0);
+    printf("heap: %u segments used, %u bytes free in %u segments, largest %u (%u%% fragmented)\n",
+            frag->heap_used_segments, frag->heap_free, frag->heap_free_segments, frag->heap_largest,
+            frag->heap_free ? 100 - (uint32_t)(frag->heap_largest * 100ULL / frag->heap_free) : 0);
+}
+
+int trace_bench(const char* path) {
+    static uint32_t* samples[CALL_KINDS];
+    uint32_t counts[CALL_KINDS] = { 0 };
+    uint64_t start, end, overhead = ~0ULL, total_ns = 0;
+    uint32_t i, call, n, failed = 0, worst_heap = 0;
+    host_block_t* blocks;
+    host_frag_t frag;
+    trace_t trace;
+    int ok;
+
+    if (trace_load(path, &trace) != 0) {
+        return 1;
+    }
+    blocks = calloc(trace.max_id + 1, sizeof(host_block_t));
+    for (call = 0; call < CALL_KINDS; call++) {
+        samples[call] = malloc(trace.count * sizeof(uint32_t));
+    }
+
+    // What reading the clock twice costs comes off every sample
+    for (i = 0; i < REPLAY_OVERHEAD_READS; i++) {
+        start = now_ns();
+        end = now_ns();
+        if (end - start < overhead) {
+            overhead = end - start;
+        }
+    }
+
+    for (i = 0; i < trace.count; i++) {
+        host_op = i + 1;
+        call = op_call(&trace.ops[i], &blocks[trace.ops[i].id]);
+        if (trace.ops[i].op == 'f' && blocks[trace.ops[i].id].kind == BLOCK_NONE) {
+            continue;
+        }
+
+        start = now_ns();
+        ok = op_run(&trace.ops[i], &blocks[trace.ops[i].id]);
+        end = now_ns();
+
+        failed += ok ? 0 : 1;
+        end -= start;
+        end = end > overhead ? end - overhead : 0;
+        samples[call][counts[call]++] = end;
+        total_ns += end;
+
+        // Worst heap fragmentation seen along the way, sampled off the clock
+        if (i % REPLAY_SAMPLE_OPS == 0) {
+            frag_stats(&frag);
+            if (frag.heap_free && 100 - frag.heap_largest * 100ULL / frag.heap_free > worst_heap) {
+                worst_heap = 100 - frag.heap_largest * 100ULL / frag.heap_free;
+            }
+        }
+    }
+
+    printf("%s: %u ops, %u allocations failed, %llu us in the allocators (%llu ops/s)\n", path, trace.count,
+            failed, (unsigned long long)(total_ns / 1000),
+            total_ns ? (unsigned long long)(trace.count * 1000000000ULL / total_ns) : 0ULL);
+    printf("\n%-16s %8s %8s %8s %8s %8s   (ns, %llu ns of clock reads taken off)\n", "call", "count", "min",
+            "median", "p99", "max", (unsigned long long)overhead);
+    for (call = 0; call < CALL_KINDS; call++) {
+        n = counts[call];
+        if (n == 0) {
+            continue;
+        }
+        qsort(samples[call], n, sizeof(uint32_t), compare_u32);
+        printf("%-16s %8u %8u %8u %8u %8u\n", call_names[call], n, samples[call][0], samples[call][n / 2],
+                samples[call][(uint32_t)(n * 99ULL / 100)], samples[call][n - 1]);
+    }
+
+    frag_stats(&frag);
+    print_frag("at the end of the trace", &frag);
+    printf("worst heap fragmentation seen: %u%%\n", worst_heap);
+
+    for (call = 0; call < CALL_KINDS; call++) {
+        free(samples[call]);
+    }
+    free(blocks);
+    free(trace.ops);
+    return 0;
+}
+
+int trace_check(const char* path, uint32_t check_every) {
+    uint32_t i, problems = 0, checks = 0, failed = 0;
+    host_block_t* blocks;
+    host_block_t* block;
+    trace_t trace;
+
+    if (trace_load(path, &trace) != 0) {
+        return 1;
+    }
+    blocks = calloc(trace.max_id + 1, sizeof(host_block_t));
+
+    for (i = 0; i < trace.count && problems == 0; i++) {
+        host_op = i + 1;
+        block = &blocks[trace.ops[i].id];
+        if (trace.ops[i].op == 'f' && block->kind != BLOCK_NONE && !block_intact(block)) {
+            printf("%s:%u: block %u was overwritten\n", path, trace.ops[i].line, trace.ops[i].id);
+            problems++;
+            break;
+        }
+
+        if (!op_run(&trace.ops[i], block)) {
+            failed++;
+        } else if (block->kind != BLOCK_NONE) {
+            block->tag = 1 + trace.ops[i].id % 255;
+            block->refs = 0;
+            block_fill(block);
+        }
+
+        problems += check_op();
+        if (problems == 0 && (i + 1) % check_every == 0) {
+            problems += check_all(blocks, trace.max_id + 1);
+            checks++;
+        }
+        if (problems != 0) {
+            printf("%s:%u: the checks failed after this op\n", path, trace.ops[i].line);
+        }
+    }
+
+    if (problems == 0) {
+        problems += check_all(blocks, trace.max_id + 1);
+        checks++;
+        if (problems != 0) {
+            printf("%s: the checks failed at the end of the trace\n", path);
+        }
+    }
+    if (problems == 0) {
+        printf("%s: %u ops, %u allocations failed, %u full checks, passed\n", path, trace.count, failed, checks);
+    }
+
+    free(blocks);
+    free(trace.ops);
+    return problems != 0;
+}
+
+/**
+ * Synthetic trace, roughly what the kernel does: more small than large
+ * kmalloc()s, mostly single pages, and a mix of lifetimes. Most blocks go
+ * within a few dozen ops, some live for thousands and a few for good,
+ * which is what scatters holes through the heap and the free areas.
+ */
+#define GEN_MAX_LIVE 2048
+#define GEN_SHORT_LIFE 64
+#define GEN_MEDIUM_LIFE 4096
+
+typedef struct {
+    uint32_t id;
+    uint32_t due;                       // Op at which it gets freed, ~0 for never
+    uint8_t cpu;
+} gen_block_t;
+
+static uint32_t gen_size(uint64_t* state) {
+    uint32_t choice = host_rand(state) % 100;
+
+    if (choice < 60) {
+        return 8 + host_rand(state) % (KMALLOC_SLAB_MAX - 7);
+    } else if (choice < 95) {
+        return KMALLOC_SLAB_MAX + 1 + host_rand(state) % (2048 - KMALLOC_SLAB_MAX);
+    }
+    return 2049 + host_rand(state) % (16384 - 2048);
+}
+
+static uint32_t gen_order(uint64_t* state) {
+    static const uint8_t orders[20] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 2, 3 };
+
+    return orders[host_rand(state) % 20];
+}
+
+int trace_gen(uint64_t seed, uint32_t ops) {
+    static gen_block_t live[GEN_MAX_LIVE];
+    static uint32_t free_ids[GEN_MAX_LIVE];
+    uint32_t i, j, count = 0, free_count = 0, next_id = 0, pick, life;
+    uint64_t state = seed ? seed : 1;
+    gen_block_t* block;
+
+    printf("# memhost trace: gen seed 0x%llx, %u ops\n", (unsigned long long)seed, ops);
+    for (i = 0; i < ops; i++) {
+        // A block that is due goes first, then a random one if there are too many
+        pick = count;
+        for (j = 0; j < count; j++) {
+            if (live[j].due <= i) {
+                pick = j;
+                break;
+            }
+        }
+        if (pick == count && count == GEN_MAX_LIVE) {
+            pick = host_rand(&state) % count;
+        }
+
+        if (pick < count) {
+            printf("f %u %u\n", (unsigned)(host_rand(&state) % NR_CPUS), live[pick].id);
+            free_ids[free_count++] = live[pick].id;
+            live[pick] = live[--count];
+            continue;
+        }
+
+        block = &live[count++];
+        block->id = free_count ? free_ids[--free_count] : next_id++;
+        block->cpu = host_rand(&state) % NR_CPUS;
+        life = host_rand(&state) % 100;
+        if (life < 70) {
+            block->due = i + 1 + host_rand(&state) % GEN_SHORT_LIFE;
+        } else if (life < 95) {
+            block->due = i + 1 + host_rand(&state) % GEN_MEDIUM_LIFE;
+        } else {
+            block->due = ~0U;
+        }
+
+        if (host_rand(&state) % 100 < 55) {
+            printf("m %u %u %u\n", block->cpu, block->id, gen_size(&state));
+        } else {
+            printf("p %u %u %u\n", block->cpu, block->id, gen_order(&state));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,258 @@
+#!/usr/bin/env python3
+"""Turn a SimpleOS trace dump into a timeline.
+
+Reads a console log holding the output of the 'trace_dump' shell command,
+in the format include/kernel/trace.h describes, and prints every record
+in time order across the cores. IRQ exits show how long the handler ran.
+With --chrome the timeline is also written as a Chrome trace event file,
+for chrome://tracing or ui.perfetto.dev. With --alloc-trace the page and
+kmalloc events are written out as an allocation trace that the host build
+of the memory manager replays (see tools/memhost/replay.c).
+
+    make run | tee console.log
+    tools/trace_decode.py console.log
+"""
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+FORMAT_VERSION = 1
+RECORD = struct.Struct("<IHHII")
+
+# trace_event_t, in order
+EVENTS = [
+    "irq_entry",
+    "irq_exit",
+    "switch",
+    "page_alloc",
+    "page_free",
+    "kmalloc",
+    "kfree",
+    "uart_tx",
+    "uart_rx",
+]
+
+# include/kernel/mem.h, kmalloc sizes up to this come from the slab caches
+KMALLOC_SLAB_MAX = 256
+
+# thread_state_t, for the thread a switch takes off the core
+THREAD_STATES = ["running", "sleeping", "blocked", "dead"]
+
+HEX_RECORD = re.compile(r"^[0-9a-f]{%d}$" % (RECORD.size * 2))
+
+
+class Dump:
+    def __init__(self, clock_hz, stopped_at):
+        self.clock_hz = clock_hz
+        self.stopped_at = stopped_at
+        self.irq_names = {}
+        self.cpus = {}          # cpu -> list of (time low word, event, data, arg0, arg1)
+        self.overwritten = {}
+
+
+def parse(lines):
+    """The last complete dump in the log"""
+    dump = None
+    last = None
+    cpu = None
+
+    for line in lines:
+        line = line.strip()
+        words = line.split()
+        if line.startswith("TRACE BEGIN"):
+            if int(words[2]) != FORMAT_VERSION:
+                sys.exit("trace format version %s, this decoder reads %d" % (words[2], FORMAT_VERSION))
+            dump = Dump(int(words[3]), int(words[4], 16))
+            cpu = None
+        elif dump is None:
+            continue
+        elif line.startswith("TRACE IRQ"):
+            dump.irq_names[int(words[2])] = " ".join(words[3:])
+        elif line.startswith("TRACE CPU"):
+            cpu = int(words[2])
+            dump.cpus[cpu] = []
+            dump.overwritten[cpu] = int(words[4])
+        elif line == "TRACE END":
+            last = dump
+            dump = None
+        elif cpu is not None and HEX_RECORD.match(line):
+            dump.cpus[cpu].append(RECORD.unpack(bytes.fromhex(line)))
+        # Anything else is other output that got in between
+
+    if last is None:
+        sys.exit("no complete TRACE BEGIN ... TRACE END block in the input")
+    return last
+
+
+def full_times(dump, records):
+    """64 bit clock values, going backwards from when tracing stopped"""
+    times = [0] * len(records)
+    now = dump.stopped_at
+    low = now & 0xFFFFFFFF
+    for i in range(len(records) - 1, -1, -1):
+        now -= (low - records[i][0]) & 0xFFFFFFFF
+        low = records[i][0]
+        times[i] = now
+    return times
+
+
+def describe(dump, event, data, arg0, arg1):
+    name = EVENTS[event] if event < len(EVENTS) else "event %d" % event
+    if name in ("irq_entry", "irq_exit"):
+        return name, "irq %d %s" % (data, dump.irq_names.get(data, ""))
+    if name == "switch":
+        state = THREAD_STATES[data] if data < len(THREAD_STATES) else str(data)
+        return name, "thread %d (%s) -> thread %d" % (arg0, state, arg1)
+    if name in ("page_alloc", "page_free"):
+        return name, "0x%08x order %d" % (arg0, data)
+    if name == "kmalloc":
+        return name, "0x%08x %d bytes" % (arg0, arg1)
+    if name == "kfree":
+        return name, "0x%08x" % arg0
+    if name == "uart_tx":
+        return name, "%d bytes to the FIFO, %d queued" % (data, arg0)
+    if name == "uart_rx":
+        return name, "%d bytes waiting, %d overruns" % (data, arg0)
+    return name, "data %d, args 0x%08x 0x%08x" % (data, arg0, arg1)
+
+
+def write_alloc_trace(events, out):
+    """The allocations and frees in memhost's trace format, returns how many frees were left out
+
+    The slab caches get their pages from alloc_page_flags() inside the
+    kmalloc() that needs them, with IRQs masked, so single page allocations
+    a small kmalloc follows right away on the same core are slab growth.
+    They are left out, like the frees of those pages, because replaying the
+    kmalloc grows the slab again. Frees of blocks allocated before tracing
+    started are left out too.
+    """
+    live = {}           # address -> id of the blocks allocated so far
+    free_ids = []
+    next_id = 0
+    pending = {}        # cpu -> page allocations that may turn out to be slab growth
+    slab_pages = set()
+    lines = []
+    dropped = 0
+
+    def alloc(cpu, op, addr, arg):
+        nonlocal next_id
+        # Allocated again without a free, the free happened while tracing was off
+        if addr in live:
+            lines.append("f %d %d" % (cpu, live[addr]))
+            free_ids.append(live.pop(addr))
+        if free_ids:
+            live[addr] = free_ids.pop()
+        else:
+            live[addr] = next_id
+            next_id += 1
+        lines.append("%s %d %d %d" % (op, cpu, live[addr], arg))
+
+    for time, cpu, event, data, arg0, arg1 in events:
+        name = EVENTS[event] if event < len(EVENTS) else None
+        if name not in ("page_alloc", "page_free", "kmalloc", "kfree"):
+            continue
+        # alloc_page_flags() records failures too, with a NULL address
+        if name == "page_alloc" and arg0 == 0:
+            continue
+
+        held = pending.pop(cpu, [])
+        if name == "page_alloc" and data == 0:
+            pending[cpu] = held + [arg0]
+            continue
+        if name == "kmalloc" and arg1 <= KMALLOC_SLAB_MAX:
+            slab_pages.update(held)
+        else:
+            for addr in held:
+                alloc(cpu, "p", addr, 0)
+
+        if name == "page_alloc":
+            alloc(cpu, "p", arg0, data)
+        elif name == "kmalloc":
+            alloc(cpu, "m", arg0, arg1)
+        elif arg0 in slab_pages:
+            slab_pages.discard(arg0)
+        elif arg0 in live:
+            lines.append("f %d %d" % (cpu, live[arg0]))
+            free_ids.append(live.pop(arg0))
+        else:
+            dropped += 1
+
+    for cpu, held in pending.items():
+        for addr in held:
+            alloc(cpu, "p", addr, 0)
+
+    out.write("# memhost allocation trace, %d operations\n" % len(lines))
+    out.write("\n".join(lines) + "\n")
+    return dropped
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("log", nargs="?", help="console log, standard input if left out")
+    parser.add_argument("--chrome", metavar="FILE", help="also write a Chrome trace event file")
+    parser.add_argument("--alloc-trace", metavar="FILE", help="also write the allocations out for memhost")
+    args = parser.parse_args()
+
+    if args.log:
+        with open(args.log, errors="replace") as f:
+            dump = parse(f)
+    else:
+        dump = parse(sys.stdin)
+
+    events = []
+    for cpu, records in dump.cpus.items():
+        for time, record in zip(full_times(dump, records), records):
+            events.append((time, cpu) + record[1:])
+    events.sort(key=lambda e: (e[0], e[1]))
+    if not events:
+        print("The dump holds no records")
+        return
+
+    to_us = 1e6 / dump.clock_hz
+    start = events[0][0]
+    irq_stacks = {cpu: [] for cpu in dump.cpus}
+    irq_times = {}
+    chrome = []
+
+    print("%14s  %3s  %-10s  %s" % ("time (us)", "cpu", "event", "details"))
+    for time, cpu, event, data, arg0, arg1 in events:
+        us = (time - start) * to_us
+        name, details = describe(dump, event, data, arg0, arg1)
+
+        if name == "irq_entry":
+            irq_stacks[cpu].append((data, time))
+            chrome.append({"name": details, "ph": "B", "ts": us, "pid": 0, "tid": cpu})
+        elif name == "irq_exit":
+            chrome.append({"name": details, "ph": "E", "ts": us, "pid": 0, "tid": cpu})
+            if irq_stacks[cpu] and irq_stacks[cpu][-1][0] == data:
+                took = (time - irq_stacks[cpu].pop()[1]) * to_us
+                details += " (%.3f us)" % took
+                irq_times.setdefault(data, []).append(took)
+        else:
+            chrome.append({"name": name, "ph": "i", "s": "t", "ts": us, "pid": 0, "tid": cpu,
+                           "args": {"details": details}})
+        print("%14.3f  %3d  %-10s  %s" % (us, cpu, name, details))
+
+    print()
+    print("%d records over %.3f us" % (len(events), (events[-1][0] - start) * to_us), end="")
+    lost = sum(dump.overwritten.values())
+    print(", %d older ones overwritten" % lost if lost else "")
+    for irq, times in sorted(irq_times.items()):
+        print("irq %d %s: %d handled, avg %.3f us, max %.3f us" % (
+            irq, dump.irq_names.get(irq, ""), len(times), sum(times) / len(times), max(times)))
+
+    if args.chrome:
+        with open(args.chrome, "w") as f:
+            json.dump({"traceEvents": chrome, "displayTimeUnit": "ns"}, f)
+    if args.alloc_trace:
+        with open(args.alloc_trace, "w") as f:
+            dropped = write_alloc_trace(events, f)
+        if dropped:
+            print("%d frees of blocks allocated before tracing started left out" % dropped)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,159 @@
+#include "bench.h"
+#include "pmu.h"
+#include "uart.h"
+#include "string.h"
+#include "types.h"
+
+/*
+ * Hot path benchmarks, run at every boot so regressions show in the log.
+ * Each case runs one operation per sample with interrupts masked, with
+ * the PMU counters read around it, and the distribution of each counter
+ * is printed as min, median and 99th percentile. The cost of the counter
+ * reads themselves is measured first and taken off the cycle counts.
+ */
+
+#define BENCH_SAMPLES       200
+#define BENCH_UART_SAMPLES  32      /* Each one prints a line */
+#define BENCH_COPY_BYTES    4096
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+struct bench_case {
+	const char *name;
+	void (*fn)(void);
+	uint32_t samples;
+};
+
+static uint64_t bench_values[1 + PMU_EVENTS][BENCH_SAMPLES];
+static uint8_t bench_src[BENCH_COPY_BYTES] __attribute__((aligned(64)));
+static uint8_t bench_dst[BENCH_COPY_BYTES] __attribute__((aligned(64)));
+
+static void bench_nop(void) {
+}
+
+static void bench_memcpy(void) {
+	memcpy(bench_dst, bench_src, BENCH_COPY_BYTES);
+}
+
+static void bench_memset(void) {
+	memset(bench_dst, 0, BENCH_COPY_BYTES);
+}
+
+static void bench_uart(void) {
+	uart_puts("bench: uart_puts of one 64 byte line, newline included ........\n");
+}
+
+/* Into exception_handler() and straight back out */
+static void bench_svc(void) {
+	asm volatile ("svc #0" ::: "memory");
+}
+
+static const struct bench_case bench_cases[] = {
+	{ "memcpy 4K", bench_memcpy, BENCH_SAMPLES },
+	{ "memset 4K", bench_memset, BENCH_SAMPLES },
+	{ "uart_puts 64B", bench_uart, BENCH_UART_SAMPLES },
+	{ "svc round trip", bench_svc, BENCH_SAMPLES },
+};
+
+static uint64_t bench_results[ARRAY_LEN(bench_cases)][1 + PMU_EVENTS][3];
+
+static void bench_measure(const struct bench_case *bc, uint64_t overhead) {
+	struct pmu_sample before, after;
+	uint64_t cycles;
+	uint32_t i, e;
+
+	/* Once untimed, so the first sample doesn't pay for cold caches alone */
+	bc->fn();
+
+	for (i = 0; i < bc->samples; i++) {
+		asm volatile ("msr daifset, #2" ::: "memory");
+		pmu_read(&before);
+		bc->fn();
+		pmu_read(&after);
+		asm volatile ("msr daifclr, #2" ::: "memory");
+
+		cycles = after.cycles - before.cycles;
+		bench_values[0][i] = cycles > overhead ? cycles - overhead : 0;
+		for (e = 0; e < PMU_EVENTS; e++) {
+			bench_values[1 + e][i] = after.events[e] - before.events[e];
+		}
+	}
+}
+
+static void sort_u64(uint64_t *values, uint32_t count) {
+	uint64_t v;
+	uint32_t i, j;
+
+	for (i = 1; i < count; i++) {
+		v = values[i];
+		for (j = i; j > 0 && values[j - 1] > v; j--) {
+			values[j] = values[j - 1];
+		}
+		values[j] = v;
+	}
+}
+
+/* Right aligned in width columns, uart_putu has no padding of its own */
+static void put_padded(uint64_t val, uint32_t width) {
+	uint64_t v = val;
+	uint32_t digits = 1;
+
+	while (v >= 10) {
+		v /= 10;
+		digits++;
+	}
+	while (digits++ < width) {
+		uart_putc(' ');
+	}
+	uart_putu(val);
+}
+
+static void put_name(const char *name, uint32_t width) {
+	uint32_t len = 0;
+
+	while (name[len] != 0) {
+		len++;
+	}
+	uart_puts(name);
+	while (len++ < width) {
+		uart_putc(' ');
+	}
+}
+
+/* Interrupts are unmasked between samples, so the console keeps draining */
+void pmu_bench(void) {
+	struct bench_case calibrate = { "counter overhead", bench_nop, BENCH_SAMPLES };
+	uint64_t overhead;
+	uint32_t i, m, s, samples;
+
+	bench_measure(&calibrate, 0);
+	sort_u64(bench_values[0], BENCH_SAMPLES);
+	overhead = bench_values[0][0];
+
+	/* Every case before any output, so the UART case's lines don't end up in the table */
+	for (i = 0; i < ARRAY_LEN(bench_cases); i++) {
+		samples = bench_cases[i].samples;
+		bench_measure(&bench_cases[i], overhead);
+		for (m = 0; m < 1 + PMU_EVENTS; m++) {
+			sort_u64(bench_values[m], samples);
+			bench_results[i][m][0] = bench_values[m][0];
+			bench_results[i][m][1] = bench_values[m][samples / 2];
+			bench_results[i][m][2] = bench_values[m][samples * 99 / 100];
+		}
+	}
+
+	uart_puts("\n                    cycles                   dcache misses            branch misses\n");
+	uart_puts("benchmark               min  median     p99      min  median     p99      min  median     p99\n");
+	for (i = 0; i < ARRAY_LEN(bench_cases); i++) {
+		put_name(bench_cases[i].name, 18);
+		for (m = 0; m < 1 + PMU_EVENTS; m++) {
+			for (s = 0; s < 3; s++) {
+				put_padded(bench_results[i][m][s], s == 0 ? 9 : 8);
+			}
+		}
+		uart_puts("\n");
+	}
+	uart_puts("(");
+	uart_putu(overhead);
+	uart_puts(" cycles of counter reads taken off)\n");
+}
@@ -0,0 +1,6 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+void pmu_bench(void);
+
+#endif /* BENCH_H */
@@ -0,0 +1,37 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "types.h"
+
+/* Cortex-A72 data cache line, CTR_EL0.DminLine on the Pi 4 */
+#define CACHE_LINE_BYTES 64
+
+/*
+ * Cache and TLB maintenance by virtual address, to the point of coherency.
+ * Clean before a device reads memory the CPU wrote, invalidate before the
+ * CPU reads memory a device wrote.
+ */
+#define CACHE_RANGE_OP(name, op) \
+static inline void name(const void *start, uint64_t len) { \
+	uint64_t line = (uint64_t)start & ~(uint64_t)(CACHE_LINE_BYTES - 1); \
+	uint64_t end = (uint64_t)start + len; \
+	for (; line < end; line += CACHE_LINE_BYTES) { \
+		asm volatile ("dc " #op ", %0" :: "r" (line) : "memory"); \
+	} \
+	asm volatile ("dsb sy" ::: "memory"); \
+}
+
+CACHE_RANGE_OP(dcache_clean_range, cvac)
+CACHE_RANGE_OP(dcache_invalidate_range, ivac)
+CACHE_RANGE_OP(dcache_clean_invalidate_range, civac)
+
+static inline void icache_invalidate_all(void) {
+	asm volatile ("ic iallu; dsb nsh; isb" ::: "memory");
+}
+
+/* Drop every EL1 TLB entry on all cores in the inner shareable domain */
+static inline void tlb_invalidate_all(void) {
+	asm volatile ("dsb ishst; tlbi vmalle1is; dsb ish; isb" ::: "memory");
+}
+
+#endif /* CACHE_H */
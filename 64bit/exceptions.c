@@ -0,0 +1,89 @@
+#include "uart.h"
+#include "types.h"
+
+/* Laid out by trap_entry in vectors.S */
+struct trap_frame {
+	uint64_t x[31];
+	uint64_t sp;
+	uint64_t elr;
+	uint64_t spsr;
+	uint64_t esr;
+	uint64_t far;
+};
+
+#define ESR_EC(esr)         (((esr) >> 26) & 0x3F)
+#define ESR_EC_SVC64        0x15
+#define ESR_EC_BRK64        0x3C
+
+/* svc #SVC_NULL returns at once, for timing the exception round trip */
+#define SVC_NULL            0
+
+static const char *const exception_kinds[4] = { "synchronous", "IRQ", "FIQ", "SError" };
+static const char *const exception_sources[4] = { "EL1t", "EL1h", "EL0 AArch64", "EL0 AArch32" };
+
+static void put_reg(const char *name, uint64_t val) {
+	uart_puts(name);
+	uart_puts(" 0x");
+	uart_puthex(val);
+}
+
+static void trap_dump(const struct trap_frame *frame) {
+	char name[4];
+	int i;
+
+	for (i = 0; i < 31; i++) {
+		name[0] = 'x';
+		name[1] = i < 10 ? '0' + i : '0' + i / 10;
+		name[2] = i < 10 ? 0 : '0' + i % 10;
+		name[3] = 0;
+		put_reg(name, frame->x[i]);
+		uart_puts(i % 4 == 3 ? "\n" : "  ");
+	}
+	put_reg("  sp", frame->sp);
+	uart_puts("\n");
+	put_reg("ELR", frame->elr);
+	put_reg(", SPSR", frame->spsr);
+	put_reg(", ESR", frame->esr);
+	put_reg(", FAR", frame->far);
+	uart_puts("\n");
+}
+
+/*
+ * Called from trap_entry with the vector index and the saved state. A null
+ * svc returns straight away, a brk in kernel code reports the state and
+ * carries on after the instruction, anything else stops the core.
+ */
+void exception_handler(uint64_t index, struct trap_frame *frame) {
+	uint64_t mpidr;
+
+	asm volatile ("mrs %0, mpidr_el1" : "=r" (mpidr));
+
+	/* ELR already points past an svc */
+	if (index == 4 && ESR_EC(frame->esr) == ESR_EC_SVC64 && (frame->esr & 0xFFFF) == SVC_NULL) {
+		return;
+	}
+
+	if (index == 4 && ESR_EC(frame->esr) == ESR_EC_BRK64) {
+		uart_puts("\nbrk #");
+		uart_putu(frame->esr & 0xFFFF);
+		uart_puts(" on cpu ");
+		uart_putu(mpidr & 3);
+		uart_puts("\n");
+		trap_dump(frame);
+		frame->elr += 4;
+		return;
+	}
+
+	uart_puts("\nUnhandled ");
+	uart_puts(exception_kinds[index & 3]);
+	uart_puts(" exception from ");
+	uart_puts(exception_sources[index >> 2]);
+	uart_puts(" on cpu ");
+	uart_putu(mpidr & 3);
+	uart_puts("\n");
+	trap_dump(frame);
+
+	while (1) {
+		asm volatile ("wfe");
+	}
+}
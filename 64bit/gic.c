@@ -0,0 +1,274 @@
+#include "gic.h"
+#include "smp.h"
+#include "uart.h"
+#include "types.h"
+#include "spinlock.h"
+#include "pmu.h"
+
+/* Distributor registers, the per-interrupt ones are arrays indexed by interrupt ID */
+#define GICD_CTLR           (GICD_BASE + 0x000ULL)
+#define GICD_TYPER          (GICD_BASE + 0x004ULL)
+#define GICD_ISENABLER      (GICD_BASE + 0x100ULL)
+#define GICD_ICENABLER      (GICD_BASE + 0x180ULL)
+#define GICD_ICPENDR        (GICD_BASE + 0x280ULL)
+#define GICD_IPRIORITYR     (GICD_BASE + 0x400ULL)
+#define GICD_ITARGETSR      (GICD_BASE + 0x800ULL)
+#define GICD_ICFGR          (GICD_BASE + 0xC00ULL)
+
+/* CPU interface registers, banked per core */
+#define GICC_CTLR           (GICC_BASE + 0x000ULL)
+#define GICC_PMR            (GICC_BASE + 0x004ULL)
+#define GICC_BPR            (GICC_BASE + 0x008ULL)
+#define GICC_IAR            (GICC_BASE + 0x00CULL)
+#define GICC_EOIR           (GICC_BASE + 0x010ULL)
+
+/* Every interrupt gets the same priority, below the mask so all are signalled */
+#define GIC_PRIORITY        0xA0
+#define GIC_PRIORITY_MASK   0xF0
+
+static inline void mmio_write(uint64_t reg, uint32_t data) {
+	*(volatile uint32_t *)reg = data;
+}
+
+static inline uint32_t mmio_read(uint64_t reg) {
+	return *(volatile uint32_t *)reg;
+}
+
+/*
+ * Per core handling statistics, in cycles. Entry is the time from irq_entry
+ * reading the cycle counter to the handler being called, which covers the
+ * register save, the acknowledge and any interrupts handled before this one.
+ */
+typedef struct irq_stat {
+	uint32_t count;
+	uint64_t entry_cycles;
+	uint64_t handler_cycles;
+	uint64_t max_cycles;
+} irq_stat_t;
+
+typedef struct irq_desc {
+	irq_handler_t handler;
+	void *arg;
+	const char *name;
+#ifndef NO_IRQSTAT
+	irq_stat_t stats[NR_CPUS];
+#endif
+} irq_desc_t;
+
+static irq_desc_t irq_descs[NR_IRQS];
+static spinlock_t irq_lock;
+static uint32_t gic_lines;
+
+/* The banked private interrupt state and the CPU interface, which every core sets up for itself */
+static void gic_cpu_init(void) {
+	uint32_t i;
+
+	mmio_write(GICD_ICENABLER, 0xFFFF0000);
+	mmio_write(GICD_ISENABLER, 0x0000FFFF);
+	for (i = 0; i < 32; i += 4) {
+		mmio_write(GICD_IPRIORITYR + i, GIC_PRIORITY * 0x01010101U);
+	}
+
+	mmio_write(GICC_PMR, GIC_PRIORITY_MASK);
+	mmio_write(GICC_BPR, 0);
+	mmio_write(GICC_CTLR, 1);
+}
+
+/*
+ * Core 0 resets the distributor: every shared interrupt disabled, level
+ * triggered and routed to core 0, then sets up its own CPU interface.
+ */
+void gic_init(void) {
+	uint32_t i;
+
+	spin_lock_init(&irq_lock, "irq");
+
+	mmio_write(GICD_CTLR, 0);
+	gic_lines = ((mmio_read(GICD_TYPER) & 0x1F) + 1) * 32;
+	if (gic_lines > NR_IRQS) {
+		gic_lines = NR_IRQS;
+	}
+
+	for (i = 32; i < gic_lines; i += 32) {
+		mmio_write(GICD_ICENABLER + i / 8, 0xFFFFFFFF);
+		mmio_write(GICD_ICPENDR + i / 8, 0xFFFFFFFF);
+	}
+	for (i = 32; i < gic_lines; i += 16) {
+		mmio_write(GICD_ICFGR + i / 4, 0);
+	}
+	for (i = 32; i < gic_lines; i += 4) {
+		mmio_write(GICD_IPRIORITYR + i, GIC_PRIORITY * 0x01010101U);
+		mmio_write(GICD_ITARGETSR + i, 0x01010101);
+	}
+	mmio_write(GICD_CTLR, 1);
+
+	gic_cpu_init();
+}
+
+void gic_init_secondary(void) {
+	gic_cpu_init();
+}
+
+/* Install the handler for an interrupt, it still has to be enabled */
+int irq_register(uint32_t irq, irq_handler_t handler, void *arg, const char *name) {
+	irq_desc_t *desc;
+	uint64_t flags;
+
+	if (irq >= gic_lines || handler == 0) {
+		return -1;
+	}
+
+	desc = &irq_descs[irq];
+	flags = spin_lock_irqsave(&irq_lock);
+	if (desc->handler != 0) {
+		spin_unlock_irqrestore(&irq_lock, flags);
+		return -1;
+	}
+	desc->arg = arg;
+	desc->name = name;
+	asm volatile ("" ::: "memory");
+	desc->handler = handler;
+	spin_unlock_irqrestore(&irq_lock, flags);
+	return 0;
+}
+
+/* Disables the interrupt first, so the handler isn't called afterwards */
+void irq_unregister(uint32_t irq) {
+	uint64_t flags;
+
+	if (irq >= gic_lines) {
+		return;
+	}
+	irq_disable(irq);
+
+	flags = spin_lock_irqsave(&irq_lock);
+	irq_descs[irq].handler = 0;
+	spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+/* Private interrupts are enabled on the calling core only */
+void irq_enable(uint32_t irq) {
+	mmio_write(GICD_ISENABLER + (irq / 32) * 4, 1U << (irq & 31));
+}
+
+void irq_disable(uint32_t irq) {
+	mmio_write(GICD_ICENABLER + (irq / 32) * 4, 1U << (irq & 31));
+}
+
+/* Route a shared interrupt to another core than core 0 */
+void irq_set_target(uint32_t irq, uint32_t cpu) {
+	uint64_t reg = GICD_ITARGETSR + (irq & ~3U), flags;
+	uint32_t shift = (irq & 3) * 8;
+
+	if (irq < 32 || irq >= gic_lines) {
+		return;
+	}
+
+	flags = spin_lock_irqsave(&irq_lock);
+	mmio_write(reg, (mmio_read(reg) & ~(0xFFU << shift)) | ((1U << cpu) << shift));
+	spin_unlock_irqrestore(&irq_lock, flags);
+}
+
+static void irq_handle(uint32_t irq, uint64_t start) {
+	irq_desc_t *desc = &irq_descs[irq];
+#ifndef NO_IRQSTAT
+	irq_stat_t *stat = &desc->stats[smp_processor_id()];
+	uint64_t entry, cycles;
+#endif
+
+	if (desc->handler == 0) {
+		irq_disable(irq);
+		uart_puts("IRQ ");
+		uart_putu(irq);
+		uart_puts(" has no handler, disabled\n");
+		return;
+	}
+
+#ifndef NO_IRQSTAT
+	entry = pmu_cycles();
+#else
+	(void)start;
+#endif
+	desc->handler(desc->arg);
+#ifndef NO_IRQSTAT
+	cycles = pmu_cycles() - entry;
+	stat->count++;
+	stat->entry_cycles += entry - start;
+	stat->handler_cycles += cycles;
+	if (cycles > stat->max_cycles) {
+		stat->max_cycles = cycles;
+	}
+#endif
+}
+
+/*
+ * Called from irq_entry with interrupts masked, the cycle count at entry
+ * and the saved registers, which handlers find in this_cpu(). Acknowledge
+ * and handle until the CPU interface reports nothing pending, so
+ * interrupts that arrive meanwhile don't cost another exception entry.
+ */
+void irq_dispatch(uint64_t start, struct irq_frame *frame) {
+	uint32_t iar, irq;
+
+	this_cpu()->irq_frame = frame;
+
+	while (1) {
+		iar = mmio_read(GICC_IAR);
+		irq = iar & 0x3FF;
+		if (irq >= IRQ_SPURIOUS) {
+			break;
+		}
+		irq_handle(irq, start);
+		mmio_write(GICC_EOIR, iar);
+	}
+}
+
+void irq_info(void) {
+#ifdef NO_IRQSTAT
+	uart_puts("IRQ statistics are compiled out, rebuild without IRQSTAT=0\n");
+#else
+	irq_desc_t *desc;
+	irq_stat_t total;
+	uint32_t irq, cpu;
+
+	for (irq = 0; irq < gic_lines; irq++) {
+		desc = &irq_descs[irq];
+		if (desc->handler == 0) {
+			continue;
+		}
+
+		total.count = 0;
+		total.entry_cycles = 0;
+		total.handler_cycles = 0;
+		total.max_cycles = 0;
+		uart_puts("irq ");
+		uart_putu(irq);
+		uart_puts(" (");
+		uart_puts(desc->name);
+		uart_puts("):");
+		for (cpu = 0; cpu < NR_CPUS; cpu++) {
+			if (cpu_data[cpu].online) {
+				uart_puts(" ");
+				uart_putu(desc->stats[cpu].count);
+			}
+			total.count += desc->stats[cpu].count;
+			total.entry_cycles += desc->stats[cpu].entry_cycles;
+			total.handler_cycles += desc->stats[cpu].handler_cycles;
+			if (desc->stats[cpu].max_cycles > total.max_cycles) {
+				total.max_cycles = desc->stats[cpu].max_cycles;
+			}
+		}
+
+		if (total.count != 0) {
+			uart_puts(", entry ");
+			uart_putu(total.entry_cycles / total.count);
+			uart_puts(", handler ");
+			uart_putu(total.handler_cycles / total.count);
+			uart_puts(", max ");
+			uart_putu(total.max_cycles);
+			uart_puts(" cycles");
+		}
+		uart_puts("\n");
+	}
+#endif
+}
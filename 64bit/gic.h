@@ -0,0 +1,65 @@
+#ifndef GIC_H
+#define GIC_H
+
+#include "types.h"
+
+/*
+ * GIC-400 interrupt controller of the BCM2711. Interrupt IDs 0-15 are
+ * software generated, 16-31 are each core's private peripherals (the
+ * generic timers) and 32 up are shared peripherals, VideoCore interrupt n
+ * being 96 + n. Shared interrupts are all routed to core 0.
+ *
+ * The CPU interface hands out the highest priority pending interrupt on
+ * an acknowledge read, so dispatch needs no scan of the pending bits.
+ * Build with IRQSTAT=0 to drop the per-interrupt statistics.
+ */
+#define GIC_BASE            0xFF840000ULL
+#define GICD_BASE           (GIC_BASE + 0x1000ULL)
+#define GICC_BASE           (GIC_BASE + 0x2000ULL)
+
+#define NR_IRQS             256
+#define IRQ_SPURIOUS        1020
+
+/* Private peripheral interrupts */
+#define IRQ_CNTPNS          30      /* EL1 physical timer */
+#define IRQ_CNTV            27      /* Virtual timer */
+
+/* Shared peripheral interrupts */
+#define IRQ_PMU(cpu)        (48 + (cpu))    /* Each core's PMU overflow */
+
+/* VideoCore interrupts */
+#define IRQ_VC(n)           (96 + (n))
+#define IRQ_UART0           IRQ_VC(57)
+
+typedef void (*irq_handler_t)(void *arg);
+
+/*
+ * The start of what irq_entry saves of the interrupted code. IRQs stay
+ * masked in the handlers, so ELR_EL1 still holds its pc.
+ */
+struct irq_frame {
+	uint64_t x[19];
+	uint64_t fp;
+	uint64_t lr;
+	uint64_t fpsr;
+};
+
+void gic_init(void);
+void gic_init_secondary(void);
+int irq_register(uint32_t irq, irq_handler_t handler, void *arg, const char *name);
+void irq_unregister(uint32_t irq);
+void irq_enable(uint32_t irq);
+void irq_disable(uint32_t irq);
+void irq_set_target(uint32_t irq, uint32_t cpu);
+void irq_dispatch(uint64_t start, struct irq_frame *frame);
+void irq_info(void);
+
+static inline void enable_interrupts(void) {
+	asm volatile ("msr daifclr, #2" ::: "memory");
+}
+
+static inline void disable_interrupts(void) {
+	asm volatile ("msr daifset, #2" ::: "memory");
+}
+
+#endif /* GIC_H */
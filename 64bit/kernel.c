@@ -1,24 +1,181 @@
 #include "uart.h"
 #include "types.h"
+#include "string.h"
+#include "mmu.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "gic.h"
+#include "bench.h"
+#include "profile.h"
 
-/* Minimal delay for flood visibility and backend flushing */
-static void delay(uint32_t count) {
-	while (count--) asm volatile ("nop");
+#define BENCH_LINE "The quick brown fox jumps over the lazy dog 0123456789\n"
+#define BENCH_LINES 256
+
+static inline uint64_t read_cntpct(void) {
+	uint64_t cnt;
+	asm volatile ("isb; mrs %0, cntpct_el0" : "=r" (cnt));
+	return cnt;
+}
+
+static inline uint64_t read_cntfrq(void) {
+	uint64_t frq;
+	asm volatile ("mrs %0, cntfrq_el0" : "=r" (frq));
+	return frq;
+}
+
+/*
+ * Push a block of text through the console and report the throughput
+ * against the line rate, which is baud / 10 for 8n1 framing.
+ */
+static void uart_bench(void) {
+	uint64_t start, ticks, freq, bytes, rate;
+	int i;
+
+	bytes = BENCH_LINES * (sizeof(BENCH_LINE) - 1 + 1);  /* '\n' goes out as "\r\n" */
+	freq = read_cntfrq();
+
+	uart_flush();
+	start = read_cntpct();
+	for (i = 0; i < BENCH_LINES; i++) {
+		uart_puts(BENCH_LINE);
+	}
+	uart_flush();
+	ticks = read_cntpct() - start;
+
+	rate = ticks ? bytes * freq / ticks : 0;
+	uart_puts("uart bench: ");
+	uart_putu(bytes);
+	uart_puts(" bytes in ");
+	uart_putu(ticks * 1000000 / freq);
+	uart_puts(" us, ");
+	uart_putu(rate);
+	uart_puts(" bytes/s (line rate ");
+	uart_putu(UART_BAUD / 10);
+	uart_puts(" bytes/s at ");
+	uart_putu(UART_BAUD);
+	uart_puts(" baud)\n");
+}
+
+#define CACHE_BENCH_BYTES (16 * 1024)
+#define CACHE_BENCH_REPS 16
+
+static uint8_t cache_bench_src[CACHE_BENCH_BYTES] __attribute__((aligned(64)));
+static uint8_t cache_bench_dst[CACHE_BENCH_BYTES] __attribute__((aligned(64)));
+
+/* Nanoseconds per KiB for memcpy and memset in the current cache state */
+static void cache_bench(const char *label) {
+	uint64_t start, copy_ticks, set_ticks, freq, kib;
+	int i;
+
+	freq = read_cntfrq();
+	kib = CACHE_BENCH_REPS * CACHE_BENCH_BYTES / 1024;
+
+	start = read_cntpct();
+	for (i = 0; i < CACHE_BENCH_REPS; i++) {
+		memcpy(cache_bench_dst, cache_bench_src, CACHE_BENCH_BYTES);
+	}
+	copy_ticks = read_cntpct() - start;
+
+	start = read_cntpct();
+	for (i = 0; i < CACHE_BENCH_REPS; i++) {
+		memset(cache_bench_dst, 0, CACHE_BENCH_BYTES);
+	}
+	set_ticks = read_cntpct() - start;
+
+	uart_puts(label);
+	uart_puts(": memcpy ");
+	uart_putu(copy_ticks * 1000000000 / freq / kib);
+	uart_puts(" ns/KiB, memset ");
+	uart_putu(set_ticks * 1000000000 / freq / kib);
+	uart_puts(" ns/KiB\n");
+}
+
+#define IRQ_BENCH_SHOTS 1000
+#define IRQ_BENCH_INTERVAL_US 100
+
+static volatile uint32_t irq_bench_fired;
+static uint64_t irq_bench_total, irq_bench_max, irq_bench_interval;
+
+/* Physical timer handler: how long after the compare value the handler ran, then rearm */
+static void irq_bench_handler(void *arg) {
+	uint64_t now = read_cntpct(), cval, late;
+
+	(void)arg;
+	asm volatile ("mrs %0, cntp_cval_el0" : "=r" (cval));
+	late = now - cval;
+	irq_bench_total += late;
+	if (late > irq_bench_max) {
+		irq_bench_max = late;
+	}
+
+	if (++irq_bench_fired < IRQ_BENCH_SHOTS) {
+		asm volatile ("msr cntp_cval_el0, %0" :: "r" (now + irq_bench_interval));
+	} else {
+		asm volatile ("msr cntp_ctl_el0, %0" :: "r" (0UL));
+	}
+}
+
+/*
+ * Interrupt latency: fire the physical timer IRQ_BENCH_SHOTS times and
+ * measure from the compare value being reached to the handler running,
+ * which covers the GIC, the exception entry and the dispatch.
+ */
+static void irq_bench(void) {
+	uint64_t freq = read_cntfrq();
+
+	irq_bench_fired = 0;
+	irq_bench_total = 0;
+	irq_bench_max = 0;
+	irq_bench_interval = freq * IRQ_BENCH_INTERVAL_US / 1000000;
+
+	if (irq_register(IRQ_CNTPNS, irq_bench_handler, 0, "cntp") != 0) {
+		uart_puts("irq bench: timer IRQ is taken\n");
+		return;
+	}
+	irq_enable(IRQ_CNTPNS);
+
+	asm volatile ("msr cntp_cval_el0, %0" :: "r" (read_cntpct() + irq_bench_interval));
+	asm volatile ("msr cntp_ctl_el0, %0" :: "r" (1UL));
+	while (irq_bench_fired < IRQ_BENCH_SHOTS) {
+		asm volatile ("wfi");
+	}
+
+	uart_puts("irq bench: ");
+	uart_putu(IRQ_BENCH_SHOTS);
+	uart_puts(" timer interrupts, latency avg ");
+	uart_putu(irq_bench_total * 1000000000 / freq / IRQ_BENCH_SHOTS);
+	uart_puts(" ns, max ");
+	uart_putu(irq_bench_max * 1000000000 / freq);
+	uart_puts(" ns\n");
+	irq_info();
 }
 
 void kernel_main(void) {
+	percpu_init(0);
 	uart_init();
-	/* Flood mode: repeatedly print to force output visibility */
-	while (1) {
-		uart_puts("Hello, World! (flood mode for debug)\r\n");
-		delay(1000000);  /* Adjustable pause – longer for slower scrolling, shorter for faster confirmation */
-	}
+	uart_puts("Hello, World!\n");
+
+	cache_bench("caches off");
+	mmu_init();
+	cache_bench("caches on");
+
+	gic_init();
+	enable_interrupts();
+
+	smp_init();
+	smp_info();
+
+	/* The boot benchmarks double as the profiler's workload */
+	profile_start();
+	uart_bench();
+	irq_bench();
+	pmu_bench();
+	profile_stop();
+	lock_stats_dump();
+	profile_report();
 
-	/* Once output confirmed, revert to normal echo loop by uncommenting below and removing flood:
-	uart_puts("Hello, World!\r\n");
 	while (1) {
-	uart_putc(uart_getc());
-	uart_puts("\r\n");
+		uart_putc(uart_getc());
+		uart_puts("\n");
 	}
-	*/
-}
\ No newline at end of file
+}
@@ -0,0 +1,46 @@
+#include "ksyms.h"
+
+/* Generated by ksyms.sh: addresses in ascending order, and where each name starts in __ksym_names */
+extern const uint32_t __ksym_count;
+extern const uint64_t __ksym_addrs[];
+extern const uint32_t __ksym_name_offsets[];
+extern const char __ksym_names[];
+
+/* From the linker script */
+extern uint8_t __text_start[];
+extern uint8_t __text_end[];
+
+uint32_t ksym_count(void) {
+	return __ksym_count;
+}
+
+int kernel_text(uint64_t addr) {
+	return addr >= (uint64_t)__text_start && addr < (uint64_t)__text_end;
+}
+
+/* The function addr is in, the last symbol at or below it, or KSYM_NONE outside the kernel text */
+uint32_t ksym_find(uint64_t addr) {
+	uint32_t low = 0, high = __ksym_count, mid;
+
+	if (!kernel_text(addr) || high == 0 || addr < __ksym_addrs[0]) {
+		return KSYM_NONE;
+	}
+
+	while (high - low > 1) {
+		mid = (low + high) / 2;
+		if (__ksym_addrs[mid] <= addr) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+const char *ksym_name(uint32_t index) {
+	return &__ksym_names[__ksym_name_offsets[index]];
+}
+
+uint64_t ksym_addr(uint32_t index) {
+	return __ksym_addrs[index];
+}
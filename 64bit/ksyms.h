@@ -0,0 +1,20 @@
+#ifndef KSYMS_H
+#define KSYMS_H
+
+#include "types.h"
+
+/*
+ * Kernel symbol table, for naming code addresses. The makefile links the
+ * kernel once with an empty table, has ksyms.sh list the functions in that
+ * image, and links again with the list, which goes in .rodata behind all
+ * the code so no function moves.
+ */
+#define KSYM_NONE           0xFFFFFFFFU
+
+uint32_t ksym_count(void);
+uint32_t ksym_find(uint64_t addr);
+const char *ksym_name(uint32_t index);
+uint64_t ksym_addr(uint32_t index);
+int kernel_text(uint64_t addr);
+
+#endif /* KSYMS_H */
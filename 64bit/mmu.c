@@ -0,0 +1,91 @@
+#include "mmu.h"
+#include "cache.h"
+#include "types.h"
+#include "spinlock.h"
+
+#define PT_ENTRIES          512
+#define BLOCK_SIZE          (2ULL << 20)
+#define L1_SPAN             (1ULL << 30)
+#define DEVICE_START        0xFC000000ULL
+#define MAP_END             (4ULL << 30)
+
+/* Descriptor bits */
+#define PT_TABLE            3ULL
+#define PT_BLOCK            1ULL
+#define PT_ATTR(idx)        ((uint64_t)(idx) << 2)
+#define PT_INNER_SHARE      (3ULL << 8)
+#define PT_AF               (1ULL << 10)
+#define PT_PXN              (1ULL << 53)
+#define PT_UXN              (1ULL << 54)
+
+/* MAIR_EL1 slots: 0 normal write-back read/write allocate, 1 device nGnRnE */
+#define MAIR_NORMAL         0
+#define MAIR_DEVICE         1
+#define MAIR_VALUE          ((0xFFULL << (8 * MAIR_NORMAL)) | (0x00ULL << (8 * MAIR_DEVICE)))
+
+/* TCR_EL1: 4 GiB of VA (walk starts at level 1), 4 KiB granule, cacheable inner shareable walks, no TTBR1 */
+#define TCR_T0SZ            (64 - 32)
+#define TCR_IRGN0_WBWA      (1ULL << 8)
+#define TCR_ORGN0_WBWA      (1ULL << 10)
+#define TCR_SH0_INNER       (3ULL << 12)
+#define TCR_EPD1            (1ULL << 23)
+#define TCR_IPS_36BIT       (1ULL << 32)
+#define TCR_VALUE           (TCR_T0SZ | TCR_IRGN0_WBWA | TCR_ORGN0_WBWA | TCR_SH0_INNER | TCR_EPD1 | TCR_IPS_36BIT)
+
+#define SCTLR_M             (1 << 0)
+#define SCTLR_C             (1 << 2)
+#define SCTLR_I             (1 << 12)
+
+/* Set once LDAXR/STLXR work, see spinlock.h */
+volatile int exclusives_ok;
+
+static uint64_t l1_table[PT_ENTRIES] __attribute__((aligned(4096)));
+static uint64_t l2_tables[MAP_END / L1_SPAN][PT_ENTRIES] __attribute__((aligned(4096)));
+
+#ifndef NO_MMU
+/* Turn on this core's MMU and caches with the shared tables */
+static void mmu_enable(void) {
+	uint64_t sctlr;
+
+	asm volatile ("msr mair_el1, %0" :: "r" (MAIR_VALUE));
+	asm volatile ("msr tcr_el1, %0" :: "r" (TCR_VALUE));
+	asm volatile ("msr ttbr0_el1, %0" :: "r" ((uint64_t)l1_table));
+	asm volatile ("dsb ish; isb" ::: "memory");
+	tlb_invalidate_all();
+	icache_invalidate_all();
+
+	asm volatile ("mrs %0, sctlr_el1" : "=r" (sctlr));
+	sctlr |= SCTLR_M | SCTLR_C | SCTLR_I;
+	asm volatile ("msr sctlr_el1, %0; isb" :: "r" (sctlr) : "memory");
+}
+#endif
+
+void mmu_init(void) {
+#ifndef NO_MMU
+	uint64_t addr, attrs;
+	uint32_t i;
+
+	for (i = 0; i < MAP_END / L1_SPAN; i++) {
+		l1_table[i] = (uint64_t)l2_tables[i] | PT_TABLE;
+	}
+
+	for (addr = 0; addr < MAP_END; addr += BLOCK_SIZE) {
+		if (addr < DEVICE_START) {
+			attrs = PT_ATTR(MAIR_NORMAL) | PT_INNER_SHARE;
+		} else {
+			attrs = PT_ATTR(MAIR_DEVICE) | PT_PXN | PT_UXN;
+		}
+		l2_tables[addr / L1_SPAN][(addr % L1_SPAN) / BLOCK_SIZE] = addr | attrs | PT_AF | PT_BLOCK;
+	}
+
+	mmu_enable();
+	exclusives_ok = 1;
+#endif
+}
+
+/* Secondary cores reuse the tables the boot core built */
+void mmu_init_secondary(void) {
+#ifndef NO_MMU
+	mmu_enable();
+#endif
+}
@@ -0,0 +1,13 @@
+#ifndef MMU_H
+#define MMU_H
+
+/*
+ * Identity map of the low 4 GiB in 2 MiB blocks: RAM is normal write-back
+ * cacheable memory and the peripheral window from 0xFC000000 (which holds
+ * PBASE and the GIC) is device memory. Build with MMU=0 to leave the MMU
+ * and caches off.
+ */
+void mmu_init(void);
+void mmu_init_secondary(void);
+
+#endif /* MMU_H */
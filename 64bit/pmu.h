@@ -0,0 +1,69 @@
+#ifndef PMU_H
+#define PMU_H
+
+#include "types.h"
+
+/*
+ * PMU counters, started on every core by enter_el1 in boot.S: the 64 bit
+ * cycle counter, and event counters 0 and 1 counting L1 data cache refills
+ * and mispredicted branches.
+ */
+#define PMU_EVENT_DCACHE_MISS   0
+#define PMU_EVENT_BRANCH_MISS   1
+#define PMU_EVENTS              2
+
+struct pmu_sample {
+	uint64_t cycles;
+	uint64_t events[PMU_EVENTS];
+};
+
+static inline uint64_t pmu_cycles(void) {
+	uint64_t cycles;
+	asm volatile ("isb; mrs %0, pmccntr_el0" : "=r" (cycles));
+	return cycles;
+}
+
+/* Event counters first, so their reads aren't in the cycle count */
+static inline void pmu_read(struct pmu_sample *sample) {
+	asm volatile ("isb; mrs %0, pmevcntr0_el0" : "=r" (sample->events[0]));
+	asm volatile ("mrs %0, pmevcntr1_el0" : "=r" (sample->events[1]));
+	sample->cycles = pmu_cycles();
+}
+
+/*
+ * The profiler counts CPU cycles on the next event counter, started
+ * period cycles short of overflowing the 32 bit counter, and takes the
+ * overflow interrupt. The counters are reached directly, not through
+ * PMSELR_EL0, so nothing an interrupted pmu_read() uses changes.
+ */
+#define PMU_EVTYPE_CPU_CYCLES   0x11
+#define PMU_OVERFLOW_COUNTER    PMU_EVENTS
+
+static inline void pmu_overflow_start(uint32_t period) {
+	asm volatile ("msr pmevtyper2_el0, %0" :: "r" ((uint64_t)PMU_EVTYPE_CPU_CYCLES));
+	asm volatile ("msr pmevcntr2_el0, %0" :: "r" ((uint64_t)(uint32_t)-period));
+	asm volatile ("msr pmovsclr_el0, %0" :: "r" (1UL << PMU_OVERFLOW_COUNTER));
+	asm volatile ("msr pmintenset_el1, %0" :: "r" (1UL << PMU_OVERFLOW_COUNTER));
+	asm volatile ("msr pmcntenset_el0, %0" :: "r" (1UL << PMU_OVERFLOW_COUNTER));
+}
+
+/* From the overflow interrupt: start the next period and drop the interrupt, 0 if the counter hadn't overflowed */
+static inline int pmu_overflow_rearm(uint32_t period) {
+	uint64_t overflow;
+
+	asm volatile ("mrs %0, pmovsclr_el0" : "=r" (overflow));
+	if (!(overflow & (1UL << PMU_OVERFLOW_COUNTER))) {
+		return 0;
+	}
+	asm volatile ("msr pmevcntr2_el0, %0" :: "r" ((uint64_t)(uint32_t)-period));
+	asm volatile ("msr pmovsclr_el0, %0" :: "r" (1UL << PMU_OVERFLOW_COUNTER));
+	return 1;
+}
+
+static inline void pmu_overflow_stop(void) {
+	asm volatile ("msr pmcntenclr_el0, %0" :: "r" (1UL << PMU_OVERFLOW_COUNTER));
+	asm volatile ("msr pmintenclr_el1, %0" :: "r" (1UL << PMU_OVERFLOW_COUNTER));
+	asm volatile ("msr pmovsclr_el0, %0" :: "r" (1UL << PMU_OVERFLOW_COUNTER));
+}
+
+#endif /* PMU_H */
@@ -0,0 +1,266 @@
+#include "profile.h"
+#include "ksyms.h"
+#include "pmu.h"
+#include "gic.h"
+#include "smp.h"
+#include "uart.h"
+#include "types.h"
+
+#ifdef PROFILE_TIMER
+#define PROFILE_IRQ(cpu)    IRQ_CNTV
+#else
+#define PROFILE_IRQ(cpu)    IRQ_PMU(cpu)
+#endif
+
+/* Core 0 runs on the stack boot.S sets up below this, the others in cpu_stacks */
+#define BOOT_STACK_TOP      0x10000000ULL
+
+/* Only written by its own core, apart from the reset in profile_start() */
+struct profile_buf {
+	struct profile_sample samples[PROFILE_SAMPLES];
+	volatile uint32_t count;
+	uint32_t dropped;               /* Samples lost to a full buffer */
+	volatile uint32_t running;
+} __attribute__((aligned(64)));
+
+static struct profile_buf profile_bufs[NR_CPUS];
+static uint8_t profile_registered[NR_IRQS];
+static uint32_t profile_self[PROFILE_MAX_SYMBOLS + 1];
+static uint32_t profile_total[PROFILE_MAX_SYMBOLS + 1];
+
+extern uint8_t cpu_stacks[];
+
+static uint64_t stack_top(uint64_t sp) {
+	uint64_t base = (uint64_t)cpu_stacks + smp_processor_id() * CPU_STACK_SIZE;
+
+	if (sp - base < CPU_STACK_SIZE) {
+		return base + CPU_STACK_SIZE;
+	}
+	return sp < BOOT_STACK_TOP ? BOOT_STACK_TOP : sp;
+}
+
+#ifdef PROFILE_TIMER
+static inline void profile_timer_start(void) {
+	uint64_t freq;
+
+	asm volatile ("mrs %0, cntfrq_el0" : "=r" (freq));
+	asm volatile ("msr cntv_tval_el0, %0" :: "r" (freq * PROFILE_PERIOD_US / 1000000));
+	asm volatile ("msr cntv_ctl_el0, %0" :: "r" (1UL));
+}
+#endif
+
+/*
+ * Follow the frame records of the interrupted code: x29 points at the
+ * caller's x29 and the return address, stored together by the prologue.
+ * A leaf function keeps no record, so its caller only shows in lr, which
+ * is taken when it returns into another function than the pc is in and
+ * isn't the first record's return address anyway. Records have to go up
+ * the stack and return into the kernel text, otherwise the walk stops.
+ */
+static void profile_unwind(const struct irq_frame *frame, uint64_t pc, uint64_t *callers) {
+	uint32_t n = 0;
+#ifndef NO_CALLCHAIN
+	uint64_t low = (uint64_t)(frame + 1), high = stack_top(low);
+	uint64_t fp = frame->fp, next, ret;
+	int fp_ok = fp >= low && fp + 16 <= high && !(fp & 7);
+
+	if (kernel_text(frame->lr) && ksym_find(frame->lr - 4) != ksym_find(pc) &&
+	    !(fp_ok && ((uint64_t *)fp)[1] == frame->lr)) {
+		callers[n++] = frame->lr;
+	}
+
+	while (n < PROFILE_DEPTH && fp >= low && fp + 16 <= high && !(fp & 7)) {
+		ret = ((uint64_t *)fp)[1];
+		if (!kernel_text(ret)) {
+			break;
+		}
+		callers[n++] = ret;
+		next = ((uint64_t *)fp)[0];
+		if (next <= fp) {
+			break;
+		}
+		fp = next;
+	}
+#else
+	(void)frame;
+	(void)pc;
+#endif
+
+	while (n < PROFILE_DEPTH) {
+		callers[n++] = 0;
+	}
+}
+
+/* The sample interrupt */
+static void profile_handler(void *arg) {
+	struct profile_buf *buf = &profile_bufs[smp_processor_id()];
+	struct profile_sample *sample;
+	uint64_t pc;
+
+	(void)arg;
+
+#ifdef PROFILE_TIMER
+	if (!buf->running) {
+		asm volatile ("msr cntv_ctl_el0, %0" :: "r" (0UL));
+		return;
+	}
+	profile_timer_start();
+#else
+	if (!buf->running) {
+		pmu_overflow_stop();
+		return;
+	}
+	if (!pmu_overflow_rearm(PROFILE_PERIOD_CYCLES)) {
+		return;
+	}
+#endif
+
+	if (buf->count == PROFILE_SAMPLES) {
+		buf->dropped++;
+		return;
+	}
+	asm volatile ("mrs %0, elr_el1" : "=r" (pc));
+	sample = &buf->samples[buf->count];
+	sample->pc = pc;
+	profile_unwind(this_cpu()->irq_frame, pc, sample->callers);
+	buf->count++;
+}
+
+/* Start sampling the calling core, with an empty buffer */
+int profile_start(void) {
+	uint32_t cpu = smp_processor_id();
+	struct profile_buf *buf = &profile_bufs[cpu];
+
+	if (!profile_registered[PROFILE_IRQ(cpu)]) {
+		if (irq_register(PROFILE_IRQ(cpu), profile_handler, 0, "profile") != 0) {
+			uart_puts("profile: interrupt is taken\n");
+			return -1;
+		}
+		profile_registered[PROFILE_IRQ(cpu)] = 1;
+	}
+
+	buf->count = 0;
+	buf->dropped = 0;
+	buf->running = 1;
+#ifdef PROFILE_TIMER
+	profile_timer_start();
+#else
+	irq_set_target(PROFILE_IRQ(cpu), cpu);
+	pmu_overflow_start(PROFILE_PERIOD_CYCLES);
+#endif
+	irq_enable(PROFILE_IRQ(cpu));
+	return 0;
+}
+
+void profile_stop(void) {
+	struct profile_buf *buf = &profile_bufs[smp_processor_id()];
+
+	disable_interrupts();
+	buf->running = 0;
+#ifdef PROFILE_TIMER
+	asm volatile ("msr cntv_ctl_el0, %0" :: "r" (0UL));
+#else
+	pmu_overflow_stop();
+#endif
+	enable_interrupts();
+}
+
+/* Bucket for a code address, the last one is for addresses without a symbol of their own */
+static uint32_t profile_bucket(uint64_t addr) {
+	uint32_t index = ksym_find(addr);
+
+	return index < PROFILE_MAX_SYMBOLS ? index : PROFILE_MAX_SYMBOLS;
+}
+
+/* Count one sample, each function once however often it is in the chain */
+static void profile_count(const struct profile_sample *sample) {
+	uint32_t buckets[1 + PROFILE_DEPTH];
+	uint32_t i, j, n = 0;
+
+	buckets[n++] = profile_bucket(sample->pc);
+	profile_self[buckets[0]]++;
+	/* A return address is past its call, which may be the last instruction of the caller */
+	for (i = 0; i < PROFILE_DEPTH && sample->callers[i] != 0; i++) {
+		buckets[n++] = profile_bucket(sample->callers[i] - 4);
+	}
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < i && buckets[j] != buckets[i]; j++) {
+		}
+		if (j == i) {
+			profile_total[buckets[i]]++;
+		}
+	}
+}
+
+/* Percentage with one decimal, right aligned in 6 columns */
+static void put_percent(uint32_t count, uint32_t samples) {
+	uint32_t tenths = (uint64_t)count * 1000 / samples;
+
+	uart_puts(tenths < 100 ? "  " : tenths < 1000 ? " " : "");
+	uart_putu(tenths / 10);
+	uart_putc('.');
+	uart_putu(tenths % 10);
+	uart_putc('%');
+}
+
+/*
+ * Print the functions with the most samples, over every core's buffer.
+ * Self is where the samples hit, total also counts the samples taken in
+ * the functions they called, as far as the call chains go.
+ */
+void profile_report(void) {
+	uint32_t cpu, count, i, line, best, samples = 0, dropped = 0;
+
+	for (i = 0; i <= PROFILE_MAX_SYMBOLS; i++) {
+		profile_self[i] = 0;
+		profile_total[i] = 0;
+	}
+
+	uart_puts("profile:");
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		count = profile_bufs[cpu].count;
+		if (count == 0) {
+			continue;
+		}
+		asm volatile ("dmb ish" ::: "memory");
+		for (i = 0; i < count; i++) {
+			profile_count(&profile_bufs[cpu].samples[i]);
+		}
+		uart_puts(" cpu");
+		uart_putu(cpu);
+		uart_puts(" ");
+		uart_putu(count);
+		samples += count;
+		dropped += profile_bufs[cpu].dropped;
+	}
+	uart_puts(" samples, ");
+	uart_putu(dropped);
+	uart_puts(" dropped to full buffers\n");
+	if (samples == 0) {
+		return;
+	}
+
+	uart_puts(" self%  total%  function (samples)\n");
+	/* Selection of the largest remaining self count, the table is short */
+	for (line = 0; line < PROFILE_REPORT_LINES; line++) {
+		best = 0;
+		for (i = 1; i <= PROFILE_MAX_SYMBOLS; i++) {
+			if (profile_self[i] > profile_self[best]) {
+				best = i;
+			}
+		}
+		if (profile_self[best] == 0) {
+			break;
+		}
+		put_percent(profile_self[best], samples);
+		uart_puts("  ");
+		put_percent(profile_total[best], samples);
+		uart_puts("  ");
+		uart_puts(best < PROFILE_MAX_SYMBOLS && best < ksym_count() ? ksym_name(best) : "[no symbol]");
+		uart_puts(" (");
+		uart_putu(profile_self[best]);
+		uart_puts(")\n");
+		profile_self[best] = 0;
+	}
+}
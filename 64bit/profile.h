@@ -0,0 +1,33 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "types.h"
+
+/*
+ * Sampling profiler for the calling core. While it runs the core is
+ * interrupted about once per PROFILE_PERIOD_CYCLES of its cycles by a PMU
+ * counter overflow, and records the interrupted pc and up to
+ * PROFILE_DEPTH return addresses from the frame records. Built with
+ * PROFTIMER=1 it samples off the virtual timer every PROFILE_PERIOD_US
+ * instead, for emulators that don't raise the PMU interrupt.
+ *
+ * The cycle counter stops in wfi, so idle time doesn't show. Call chains
+ * need the frame pointers the build keeps unless CALLCHAIN=0.
+ */
+#define PROFILE_PERIOD_CYCLES   149993  /* About 10 kHz at 1.5 GHz, prime so it doesn't beat with periodic work */
+#define PROFILE_PERIOD_US       97
+#define PROFILE_DEPTH           4
+#define PROFILE_SAMPLES         2048    /* Per core */
+#define PROFILE_MAX_SYMBOLS     1024    /* Functions the report tells apart */
+#define PROFILE_REPORT_LINES    20
+
+struct profile_sample {
+	uint64_t pc;
+	uint64_t callers[PROFILE_DEPTH];    /* Return addresses, innermost first, 0 past the end of the chain */
+};
+
+int profile_start(void);
+void profile_stop(void);
+void profile_report(void);
+
+#endif /* PROFILE_H */
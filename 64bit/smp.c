@@ -0,0 +1,143 @@
+#include "smp.h"
+#include "mmu.h"
+#include "cache.h"
+#include "uart.h"
+#include "types.h"
+#include "spinlock.h"
+#include "gic.h"
+
+/* How long the boot core waits for a released core to report in, in ms */
+#define SECONDARY_BOOT_TIMEOUT_MS 100
+
+cpu_data_t cpu_data[NR_CPUS];
+
+/* Defined in boot.S */
+extern uint8_t cpu_stacks[];
+extern void secondary_start(void);
+
+static inline uint64_t read_mpidr(void) {
+	uint64_t mpidr;
+	asm volatile ("mrs %0, mpidr_el1" : "=r" (mpidr));
+	return mpidr;
+}
+
+static inline uint64_t read_cntpct(void) {
+	uint64_t cnt;
+	asm volatile ("isb; mrs %0, cntpct_el0" : "=r" (cnt));
+	return cnt;
+}
+
+static inline uint64_t read_cntfrq(void) {
+	uint64_t frq;
+	asm volatile ("mrs %0, cntfrq_el0" : "=r" (frq));
+	return frq;
+}
+
+/* Point TPIDR_EL1 at this core's data, before anything calls this_cpu() */
+void percpu_init(uint32_t cpu) {
+	asm volatile ("msr tpidr_el1, %0" :: "r" (&cpu_data[cpu]));
+}
+
+/*
+ * Release a parked core and wait for it to come up. Until it turns its MMU
+ * on the core reads memory uncached, so everything it touches before then
+ * is cleaned out of this core's cache first, and it writes nothing shared
+ * until its cache is coherent with ours.
+ */
+static int smp_boot_cpu(uint32_t cpu) {
+	volatile uint64_t *release = (volatile uint64_t *)(SPIN_TABLE_BASE + cpu * 8);
+	uint64_t start, timeout;
+
+	cpu_data[cpu].cpu = cpu;
+	cpu_data[cpu].online = 0;
+	dcache_clean_invalidate_range(&cpu_data[cpu], sizeof(cpu_data_t));
+	dcache_clean_invalidate_range(cpu_stacks + cpu * CPU_STACK_SIZE, CPU_STACK_SIZE);
+
+	*release = (uint64_t)secondary_start;
+	dcache_clean_range((const void *)release, sizeof(*release));
+	asm volatile ("sev");
+
+	timeout = read_cntfrq() * SECONDARY_BOOT_TIMEOUT_MS / 1000;
+	start = read_cntpct();
+	while (!cpu_data[cpu].online) {
+		if (read_cntpct() - start > timeout) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void smp_init(void) {
+	uint32_t cpu;
+
+	cpu_data[0].mpidr = read_mpidr();
+	cpu_data[0].online_ticks = read_cntpct();
+	cpu_data[0].online = 1;
+
+	/* Without the MMU the locks have no working exclusives, so stay on one core */
+	if (!exclusives_ok) {
+		uart_puts("MMU is off, running on the boot cpu only\n");
+		return;
+	}
+
+	for (cpu = 1; cpu < NR_CPUS; cpu++) {
+		if (smp_boot_cpu(cpu) != 0) {
+			uart_puts("cpu ");
+			uart_putu(cpu);
+			uart_puts(" did not come online\n");
+		}
+	}
+
+	uart_putu(smp_online_cpus());
+	uart_puts(" of ");
+	uart_putu(NR_CPUS);
+	uart_puts(" cpus online\n");
+}
+
+uint32_t smp_online_cpus(void) {
+	uint32_t cpu, count = 0;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		count += cpu_data[cpu].online != 0;
+	}
+	return count;
+}
+
+void smp_info(void) {
+	uint64_t freq = read_cntfrq();
+	uint32_t cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++) {
+		uart_puts("cpu ");
+		uart_putu(cpu);
+		if (!cpu_data[cpu].online) {
+			uart_puts(": offline\n");
+			continue;
+		}
+		uart_puts(": mpidr 0x");
+		uart_puthex(cpu_data[cpu].mpidr);
+		uart_puts(", online at ");
+		uart_putu(cpu_data[cpu].online_ticks * 1000000 / freq);
+		uart_puts(" us\n");
+	}
+}
+
+/* C entry point of cores 1-3, on their own stacks with their own exception vectors */
+void kernel_main_secondary(uint32_t cpu) {
+	cpu_data_t *data;
+
+	percpu_init(cpu);
+	mmu_init_secondary();
+	gic_init_secondary();
+
+	data = this_cpu();
+	data->mpidr = read_mpidr();
+	data->online_ticks = read_cntpct();
+	asm volatile ("dmb ish" ::: "memory");
+	data->online = 1;
+
+	/* Nothing schedules work onto this core yet, so it sleeps with interrupts masked */
+	while (1) {
+		asm volatile ("wfe");
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef SMP_H
+#define SMP_H
+
+/*
+ * The Pi 4 has four Cortex-A72 cores. The firmware parks cores 1-3 in a wfe
+ * loop polling a spin table, one 64 bit release address per core from
+ * 0xD8; storing an entry point there and signalling an event releases the
+ * core at EL2. This header is shared with boot.S.
+ */
+#define NR_CPUS             4
+#define CPU_STACK_SIZE      16384
+
+#ifndef __ASSEMBLER__
+
+#include "types.h"
+
+#define SPIN_TABLE_BASE     0xD8ULL
+
+/* Data private to one core, padded to a cache line so cores don't share lines */
+typedef struct cpu_data {
+	uint32_t cpu;
+	volatile uint32_t online;
+	uint64_t mpidr;
+	uint64_t online_ticks;      /* CNTPCT when the core came up */
+	struct irq_frame *irq_frame;    /* What the IRQ being handled interrupted */
+} __attribute__((aligned(64))) cpu_data_t;
+
+extern cpu_data_t cpu_data[NR_CPUS];
+
+/* TPIDR_EL1 holds the running core's cpu_data */
+static inline cpu_data_t *this_cpu(void) {
+	cpu_data_t *data;
+	asm volatile ("mrs %0, tpidr_el1" : "=r" (data));
+	return data;
+}
+
+static inline uint32_t smp_processor_id(void) {
+	return this_cpu()->cpu;
+}
+
+void percpu_init(uint32_t cpu);
+void smp_init(void);
+uint32_t smp_online_cpus(void);
+void smp_info(void);
+void kernel_main_secondary(uint32_t cpu);
+
+#endif /* __ASSEMBLER__ */
+
+#endif /* SMP_H */
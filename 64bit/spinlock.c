@@ -0,0 +1,270 @@
+#include "spinlock.h"
+#include "uart.h"
+
+#define TICKET_ONE          (1U << 16)
+
+static inline uint64_t read_cntpct(void) {
+	uint64_t cnt;
+	asm volatile ("isb; mrs %0, cntpct_el0" : "=r" (cnt));
+	return cnt;
+}
+
+#ifndef NO_LOCKSTAT
+/* Every named lock, newest first. The lock guarding the list is never registered itself. */
+static lock_stats_t *stats_list;
+static spinlock_t stats_list_lock;
+
+static void lock_stats_register(lock_stats_t *stats, const char *name) {
+	uint64_t flags = spin_lock_irqsave(&stats_list_lock);
+
+	if (stats->name == 0) {
+		stats->next = stats_list;
+		stats_list = stats;
+	}
+	stats->name = name;
+	spin_unlock_irqrestore(&stats_list_lock, flags);
+}
+
+/* Both run with the lock held, so plain updates are safe */
+static inline void lock_acquired(lock_stats_t *stats, int contended, uint32_t spins) {
+	stats->acquisitions++;
+	if (contended) {
+		stats->contended++;
+		stats->spins += spins;
+	}
+	stats->hold_start = read_cntpct();
+}
+
+static inline void lock_released(lock_stats_t *stats) {
+	uint64_t held = read_cntpct() - stats->hold_start;
+
+	if (held > stats->max_hold) {
+		stats->max_hold = held;
+	}
+}
+
+#define LOCK_REGISTER(lock, name)               lock_stats_register(&(lock)->stats, name)
+#define LOCK_ACQUIRED(lock, contended, spins)   lock_acquired(&(lock)->stats, contended, spins)
+#define LOCK_RELEASED(lock)                     lock_released(&(lock)->stats)
+#else
+#define LOCK_REGISTER(lock, name)               do { (void)(lock); (void)(name); } while (0)
+#define LOCK_ACQUIRED(lock, contended, spins)   do { (void)(contended); (void)(spins); } while (0)
+#define LOCK_RELEASED(lock)                     do { } while (0)
+#endif
+
+void spin_lock_init(spinlock_t *lock, const char *name) {
+	LOCK_REGISTER(lock, name);
+}
+
+/* Take the next ticket, returns the lock word as it was before */
+static inline uint32_t ticket_take(spinlock_t *lock) {
+	volatile uint32_t *word = (volatile uint32_t *)lock;
+	uint32_t old, newval, fail;
+	uint64_t flags;
+
+	if (!exclusives_ok) {
+		flags = irq_save();
+		old = *word;
+		*word = old + TICKET_ONE;
+		irq_restore(flags);
+		return old;
+	}
+
+	asm volatile (
+		"	prfm    pstl1strm, %3\n"
+		"1:	ldaxr   %w0, %3\n"
+		"	add     %w1, %w0, %w4\n"
+		"	stxr    %w2, %w1, %3\n"
+		"	cbnz    %w2, 1b"
+		: "=&r" (old), "=&r" (newval), "=&r" (fail), "+Q" (*word)
+		: "r" (TICKET_ONE)
+		: "memory");
+	return old;
+}
+
+void spin_lock(spinlock_t *lock) {
+	uint32_t old, owner, spins = 0;
+	uint16_t ticket;
+
+	old = ticket_take(lock);
+	ticket = old >> 16;
+	owner = old & 0xFFFF;
+
+	/*
+	 * The load-exclusive arms this core's monitor on the owner field, so the
+	 * unlocking store wakes the wfe. sevl makes the first wfe fall through.
+	 */
+	if (owner != ticket) {
+		asm volatile ("sevl");
+		do {
+			asm volatile ("wfe");
+			asm volatile ("ldaxrh %w0, %1" : "=r" (owner) : "Q" (lock->owner) : "memory");
+			spins++;
+		} while (owner != ticket);
+	}
+
+	LOCK_ACQUIRED(lock, (uint16_t)old != ticket, spins);
+}
+
+int spin_trylock(spinlock_t *lock) {
+	volatile uint32_t *word = (volatile uint32_t *)lock;
+	uint32_t tmp, fail;
+	uint64_t flags;
+
+	if (!exclusives_ok) {
+		flags = irq_save();
+		tmp = *word;
+		fail = (tmp >> 16) != (tmp & 0xFFFF);
+		if (!fail) {
+			*word = tmp + TICKET_ONE;
+		}
+		irq_restore(flags);
+	} else {
+		asm volatile (
+			"	ldaxr   %w0, %2\n"
+			"	eor     %w1, %w0, %w0, ror #16\n"
+			"	cbnz    %w1, 1f\n"
+			"	add     %w0, %w0, %w3\n"
+			"	stxr    %w1, %w0, %2\n"
+			"1:"
+			: "=&r" (tmp), "=&r" (fail), "+Q" (*word)
+			: "r" (TICKET_ONE)
+			: "memory");
+	}
+	if (fail) {
+		return 0;
+	}
+
+	LOCK_ACQUIRED(lock, 0, 0);
+	return 1;
+}
+
+void spin_unlock(spinlock_t *lock) {
+	LOCK_RELEASED(lock);
+
+	/* Only the holder writes the owner half, a racing ticket_take() loses its reservation and retries */
+	asm volatile ("stlrh %w1, %0" : "=Q" (lock->owner) : "r" (lock->owner + 1) : "memory");
+}
+
+void mcs_lock_init(mcs_lock_t *lock, const char *name) {
+	LOCK_REGISTER(lock, name);
+}
+
+static inline mcs_node_t *mcs_xchg(mcs_node_t *volatile *ptr, mcs_node_t *val) {
+	mcs_node_t *old;
+	uint32_t fail;
+	uint64_t flags;
+
+	if (!exclusives_ok) {
+		flags = irq_save();
+		old = *ptr;
+		*ptr = val;
+		irq_restore(flags);
+		return old;
+	}
+
+	asm volatile (
+		"1:	ldaxr   %0, %2\n"
+		"	stlxr   %w1, %3, %2\n"
+		"	cbnz    %w1, 1b"
+		: "=&r" (old), "=&r" (fail), "+Q" (*ptr)
+		: "r" (val)
+		: "memory");
+	return old;
+}
+
+/* Store val if *ptr holds expected, returns what *ptr held */
+static inline mcs_node_t *mcs_cmpxchg(mcs_node_t *volatile *ptr, mcs_node_t *expected, mcs_node_t *val) {
+	mcs_node_t *old;
+	uint32_t fail;
+	uint64_t flags;
+
+	if (!exclusives_ok) {
+		flags = irq_save();
+		old = *ptr;
+		if (old == expected) {
+			*ptr = val;
+		}
+		irq_restore(flags);
+		return old;
+	}
+
+	asm volatile (
+		"1:	ldaxr   %0, %2\n"
+		"	cmp     %0, %3\n"
+		"	b.ne    2f\n"
+		"	stlxr   %w1, %4, %2\n"
+		"	cbnz    %w1, 1b\n"
+		"2:"
+		: "=&r" (old), "=&r" (fail), "+Q" (*ptr)
+		: "r" (expected), "r" (val)
+		: "cc", "memory");
+	return old;
+}
+
+void mcs_lock(mcs_lock_t *lock, mcs_node_t *node) {
+	mcs_node_t *prev;
+	uint32_t locked, spins = 0;
+
+	node->next = 0;
+	node->locked = 1;
+
+	/* The release in the exchange publishes the node's initial state with it */
+	prev = mcs_xchg(&lock->tail, node);
+	if (prev != 0) {
+		/* Queue behind the previous tail, it hands the lock over by clearing our flag */
+		asm volatile ("stlr %1, %0" : "=Q" (prev->next) : "r" (node) : "memory");
+		asm volatile ("sevl");
+		do {
+			asm volatile ("wfe");
+			asm volatile ("ldaxr %w0, %1" : "=r" (locked) : "Q" (node->locked) : "memory");
+			spins++;
+		} while (locked);
+	}
+
+	LOCK_ACQUIRED(lock, prev != 0, spins);
+}
+
+void mcs_unlock(mcs_lock_t *lock, mcs_node_t *node) {
+	mcs_node_t *next;
+
+	LOCK_RELEASED(lock);
+
+	next = node->next;
+	if (next == 0) {
+		/* Nobody queued: empty the lock, unless someone swapped themselves in meanwhile */
+		if (mcs_cmpxchg(&lock->tail, node, 0) == node) {
+			return;
+		}
+		/* They have the tail but haven't linked themselves to us yet */
+		while ((next = node->next) == 0) {
+		}
+	}
+
+	asm volatile ("stlr wzr, %0" : "=Q" (next->locked) :: "memory");
+}
+
+void lock_stats_dump(void) {
+#ifndef NO_LOCKSTAT
+	lock_stats_t *stats;
+	uint64_t flags;
+
+	flags = spin_lock_irqsave(&stats_list_lock);
+	for (stats = stats_list; stats != 0; stats = stats->next) {
+		uart_puts("lock ");
+		uart_puts(stats->name);
+		uart_puts(": ");
+		uart_putu(stats->acquisitions);
+		uart_puts(" acquired, ");
+		uart_putu(stats->contended);
+		uart_puts(" contended, ");
+		uart_putu(stats->spins);
+		uart_puts(" spins, max hold ");
+		uart_putu(stats->max_hold);
+		uart_puts(" ticks\n");
+	}
+	spin_unlock_irqrestore(&stats_list_lock, flags);
+#else
+	uart_puts("Lock statistics were compiled out (LOCKSTAT=0)\n");
+#endif
+}
@@ -0,0 +1,101 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include "types.h"
+
+/*
+ * Spinlocks for data shared between cores, built on LDAXR/STLXR.
+ *
+ * spinlock_t is a ticket lock: cores take tickets in arrival order, so it
+ * is fair. mcs_lock_t is an MCS queue lock, where every waiter spins on its
+ * own queue node (usually on its stack) instead of the shared word. Waiters
+ * sleep in wfe: the releasing store clears their exclusive monitor, which
+ * wakes them without an explicit sev.
+ *
+ * Both are unlocked when zeroed. The init functions name a lock and
+ * register its statistics for lock_stats_dump(). Build with LOCKSTAT=0 to
+ * drop the statistics.
+ */
+
+typedef struct lock_stats {
+	const char *name;
+	uint32_t acquisitions;
+	uint32_t contended;         /* Acquisitions that had to wait */
+	uint32_t spins;             /* Times a waiter woke up and found the lock still held */
+	uint64_t max_hold;          /* Longest hold, in CNTPCT ticks */
+	uint64_t hold_start;
+	struct lock_stats *next;
+} lock_stats_t;
+
+typedef struct spinlock {
+	volatile uint16_t owner;
+	volatile uint16_t next;
+#ifndef NO_LOCKSTAT
+	lock_stats_t stats;
+#endif
+} spinlock_t;
+
+typedef struct mcs_node {
+	struct mcs_node *volatile next;
+	volatile uint32_t locked;
+} mcs_node_t;
+
+typedef struct mcs_lock {
+	mcs_node_t *volatile tail;
+#ifndef NO_LOCKSTAT
+	lock_stats_t stats;
+#endif
+} mcs_lock_t;
+
+void spin_lock_init(spinlock_t *lock, const char *name);
+void spin_lock(spinlock_t *lock);
+int spin_trylock(spinlock_t *lock);
+void spin_unlock(spinlock_t *lock);
+
+void mcs_lock_init(mcs_lock_t *lock, const char *name);
+void mcs_lock(mcs_lock_t *lock, mcs_node_t *node);
+void mcs_unlock(mcs_lock_t *lock, mcs_node_t *node);
+
+/* Mask IRQs and return the previous DAIF, for irq_restore() */
+static inline uint64_t irq_save(void) {
+	uint64_t daif;
+	asm volatile ("mrs %0, daif; msr daifset, #2" : "=r" (daif) :: "memory");
+	return daif;
+}
+
+static inline void irq_restore(uint64_t daif) {
+	asm volatile ("msr daif, %0" :: "r" (daif) : "memory");
+}
+
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+	uint64_t flags = irq_save();
+	spin_lock(lock);
+	return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+	spin_unlock(lock);
+	irq_restore(flags);
+}
+
+static inline uint64_t mcs_lock_irqsave(mcs_lock_t *lock, mcs_node_t *node) {
+	uint64_t flags = irq_save();
+	mcs_lock(lock, node);
+	return flags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t *lock, mcs_node_t *node, uint64_t flags) {
+	mcs_unlock(lock, node);
+	irq_restore(flags);
+}
+
+/*
+ * Exclusive accesses need the MMU on, with it off all memory is Device
+ * memory that the exclusive monitors don't cover. Until mmu_init() sets
+ * this only the boot core runs and the locks fall back to plain accesses.
+ */
+extern volatile int exclusives_ok;
+
+void lock_stats_dump(void);
+
+#endif /* SPINLOCK_H */
@@ -0,0 +1,165 @@
+#include "string.h"
+
+#define WORD_MASK (sizeof(uint64_t) - 1)
+#define BLOCK_ALIGN_MASK 15UL
+#define BULK_MIN (2 * MEMOPS_BLOCK)
+
+/*
+ * Copy 8 byte words from a misaligned source to an aligned destination by
+ * reading aligned source words and stitching neighbours together, so no
+ * unaligned access is made (those fault while the MMU is off).
+ */
+static void copy_words_shifted(uint64_t *d, const uint8_t *s, size_t words) {
+	uint64_t offset = (uint64_t)s & WORD_MASK;
+	const uint64_t *ws = (const uint64_t *)(s - offset);
+	uint64_t shift = offset * 8;
+	uint64_t lo = *ws++, hi;
+
+	while (words--) {
+		hi = *ws++;
+		*d++ = (lo >> shift) | (hi << (64 - shift));
+		lo = hi;
+	}
+}
+
+void *memcpy(void *dest, const void *src, size_t bytes) {
+	uint8_t *d = dest;
+	const uint8_t *s = src;
+	size_t chunk;
+
+	if (bytes >= sizeof(uint64_t)) {
+		/* Byte copy until the destination is word aligned */
+		while ((uint64_t)d & WORD_MASK) {
+			*d++ = *s++;
+			bytes--;
+		}
+
+		if (((uint64_t)s & WORD_MASK) == 0) {
+			/* Bring both up to 16 bytes for the NEON blocks if they share that alignment */
+			if (bytes >= BULK_MIN && (((uint64_t)d ^ (uint64_t)s) & BLOCK_ALIGN_MASK) == 0) {
+				if ((uint64_t)d & BLOCK_ALIGN_MASK) {
+					*(uint64_t *)d = *(const uint64_t *)s;
+					d += 8;
+					s += 8;
+					bytes -= 8;
+				}
+				chunk = bytes & ~(size_t)(MEMOPS_BLOCK - 1);
+				__memcpy_blocks(d, s, chunk);
+				d += chunk;
+				s += chunk;
+				bytes -= chunk;
+			}
+
+			while (bytes >= sizeof(uint64_t)) {
+				*(uint64_t *)d = *(const uint64_t *)s;
+				d += 8;
+				s += 8;
+				bytes -= 8;
+			}
+		} else {
+			/* Leave one word so the last stitched read stays inside the source */
+			chunk = bytes / sizeof(uint64_t);
+			if (chunk > 1) {
+				chunk--;
+				copy_words_shifted((uint64_t *)d, s, chunk);
+				d += chunk * 8;
+				s += chunk * 8;
+				bytes -= chunk * 8;
+			}
+		}
+	}
+
+	while (bytes--) {
+		*d++ = *s++;
+	}
+	return dest;
+}
+
+void *memmove(void *dest, const void *src, size_t bytes) {
+	uint8_t *d = dest;
+	const uint8_t *s = src;
+
+	/* A forward copy is only unsafe when dest starts inside src */
+	if (d <= s || d >= s + bytes) {
+		return memcpy(dest, src, bytes);
+	}
+
+	d += bytes;
+	s += bytes;
+	if ((((uint64_t)d ^ (uint64_t)s) & WORD_MASK) == 0) {
+		while (bytes && ((uint64_t)d & WORD_MASK)) {
+			*--d = *--s;
+			bytes--;
+		}
+		while (bytes >= sizeof(uint64_t)) {
+			d -= 8;
+			s -= 8;
+			*(uint64_t *)d = *(const uint64_t *)s;
+			bytes -= 8;
+		}
+	}
+	while (bytes--) {
+		*--d = *--s;
+	}
+	return dest;
+}
+
+void *memset(void *dest, int c, size_t bytes) {
+	uint8_t *d = dest;
+	uint64_t pattern = (uint8_t)c * 0x0101010101010101UL;
+	size_t chunk;
+
+	if (bytes >= sizeof(uint64_t)) {
+		while ((uint64_t)d & WORD_MASK) {
+			*d++ = (uint8_t)c;
+			bytes--;
+		}
+
+		if (bytes >= BULK_MIN) {
+			if ((uint64_t)d & BLOCK_ALIGN_MASK) {
+				*(uint64_t *)d = pattern;
+				d += 8;
+				bytes -= 8;
+			}
+			chunk = bytes & ~(size_t)(MEMOPS_BLOCK - 1);
+			__memset_blocks(d, c, chunk);
+			d += chunk;
+			bytes -= chunk;
+		}
+
+		while (bytes >= sizeof(uint64_t)) {
+			*(uint64_t *)d = pattern;
+			d += 8;
+			bytes -= 8;
+		}
+	}
+
+	while (bytes--) {
+		*d++ = (uint8_t)c;
+	}
+	return dest;
+}
+
+int strcmp(const char *s1, const char *s2) {
+	const uint8_t *p1 = (const uint8_t *)s1;
+	const uint8_t *p2 = (const uint8_t *)s2;
+	const uint64_t *w1, *w2;
+
+	/* Compare 8 bytes at a time while neither word holds the terminator */
+	if ((((uint64_t)p1 | (uint64_t)p2) & WORD_MASK) == 0) {
+		w1 = (const uint64_t *)p1;
+		w2 = (const uint64_t *)p2;
+		while (*w1 == *w2 && ((*w1 - 0x0101010101010101UL) & ~*w1 & 0x8080808080808080UL) == 0) {
+			w1++;
+			w2++;
+		}
+		p1 = (const uint8_t *)w1;
+		p2 = (const uint8_t *)w2;
+	}
+
+	while (*p1 && *p1 == *p2) {
+		p1++;
+		p2++;
+	}
+	return (*p1 > *p2) ? 1 : (*p1 < *p2) ? -1 : 0;
+}
@@ -0,0 +1,24 @@
+#ifndef STRING_H
+#define STRING_H
+
+#include "types.h"
+
+typedef unsigned long size_t;
+
+/*
+ * Memory routines. Word sized (8 byte) loops handle small and misaligned
+ * buffers, and the bulk of 16 byte aligned buffers goes through the NEON
+ * block routines in memops.S, MEMOPS_BLOCK bytes per iteration.
+ */
+#define MEMOPS_BLOCK 64
+
+void *memcpy(void *dest, const void *src, size_t bytes);
+void *memmove(void *dest, const void *src, size_t bytes);
+void *memset(void *dest, int c, size_t bytes);
+int strcmp(const char *s1, const char *s2);
+
+/* From memops.S: bytes must be a non-zero multiple of MEMOPS_BLOCK, pointers 16 byte aligned */
+void __memcpy_blocks(void *dest, const void *src, size_t bytes);
+void __memset_blocks(void *dest, int c, size_t bytes);
+
+#endif /* STRING_H */
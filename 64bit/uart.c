@@ -1,5 +1,6 @@
 #include "uart.h"
 #include "types.h"
+#include "spinlock.h"
 
 /* Peripheral base for Raspberry Pi 4 & 5 */
 #define PBASE               0xFE000000ULL
@@ -25,12 +26,43 @@ static inline uint32_t mmio_read(uint64_t reg) {
 	return *(volatile uint32_t *)reg;
 }
 
-/* Busy-wait delay - tuned for visibility in QEMU during debug flooding */
+#define UART_FR_BUSY        (1 << 3)
+#define UART_FR_RXFE        (1 << 4)
+#define UART_FR_TXFF        (1 << 5)
+#define UART_FR_TXFE        (1 << 7)
+
+/* Serializes output between cores so strings come out whole */
+static spinlock_t uart_lock;
+
+/* Busy-wait delay */
 static void delay(uint32_t count) {
 	while (count--) asm volatile ("nop");
 }
 
+/*
+ * Program the divisor for baud from a clock of the given rate. The divisor
+ * is clock / (16 * baud) in 16.6 fixed point, rounded to nearest.
+ * Returns -1 if the rate is out of range for this clock.
+ */
+int uart_set_baud(uint32_t clock, uint32_t baud) {
+	uint32_t div64;
+
+	if (baud == 0 || baud > clock / 16) {
+		return -1;
+	}
+
+	div64 = (uint32_t)(((uint64_t)clock * 4 + baud / 2) / baud);
+	if ((div64 >> 6) == 0 || (div64 >> 6) > 0xFFFF) {
+		return -1;
+	}
+
+	mmio_write(UART_IBRD, div64 >> 6);
+	mmio_write(UART_FBRD, div64 & 0x3F);
+	return 0;
+}
+
 void uart_init(void) {
+	spin_lock_init(&uart_lock, "uart");
 	mmio_write(UART_CR, 0);  /* Disable UART */
 
 	#ifdef REAL_HARDWARE
@@ -46,29 +78,105 @@ void uart_init(void) {
 		mmio_write(GPPUPPDN0, r);
 	#endif
 
-	mmio_write(UART_IBRD, 26);
-	mmio_write(UART_FBRD, 3);
-	mmio_write(UART_LCR_H, 0x70);  /* 8n1, FIFO enable */
+	uart_set_baud(UART_CLOCK, UART_BAUD);
+	mmio_write(UART_LCR_H, 0x70);  /* 8n1, FIFO enable; also latches the divisor */
 	mmio_write(UART_ICR, 0x7FF);   /* Clear interrupts */
 	delay(20000);  /* Stabilisation */
 	mmio_write(UART_CR, 0x301);   /* Enable UART, TX, RX */
 }
 
 void uart_putc(unsigned char c) {
-	mmio_write(UART_DR, c);  /* Direct write - optimal for QEMU raspi4b PL011 emulation */
+	uint64_t flags = spin_lock_irqsave(&uart_lock);
+
+	while (mmio_read(UART_FR) & UART_FR_TXFF) {}
+	mmio_write(UART_DR, c);
+	spin_unlock_irqrestore(&uart_lock, flags);
 }
 
 unsigned char uart_getc(void) {
-	while (mmio_read(UART_FR) & (1 << 4)) {}  /* RXFE */
+	while (mmio_read(UART_FR) & UART_FR_RXFE) {}
 	return (unsigned char)mmio_read(UART_DR);
 }
 
+/*
+ * Free TX FIFO slots we can rely on without reading the flags again. An
+ * empty FIFO takes a full burst, otherwise all we know is that one more
+ * byte fits. Spins while the FIFO is full.
+ */
+static uint32_t uart_tx_room(void) {
+	uint32_t fr;
+
+	do {
+		fr = mmio_read(UART_FR);
+	} while (fr & UART_FR_TXFF);
+
+	return (fr & UART_FR_TXFE) ? UART_FIFO_DEPTH : 1;
+}
+
+/* Send len bytes as is, one flag register read per FIFO burst */
+void uart_write(const char *buf, uint32_t len) {
+	uint64_t flags = spin_lock_irqsave(&uart_lock);
+	uint32_t room;
+
+	while (len) {
+		room = uart_tx_room();
+		if (room > len) {
+			room = len;
+		}
+		len -= room;
+		while (room--) {
+			mmio_write(UART_DR, (unsigned char)*buf++);
+		}
+	}
+	spin_unlock_irqrestore(&uart_lock, flags);
+}
+
+/* Send a string, expanding '\n' to "\r\n" */
 void uart_puts(const char *str) {
+	uint64_t flags = spin_lock_irqsave(&uart_lock);
+	uint32_t room = 0;
+
 	while (*str) {
+		if (room == 0) {
+			room = uart_tx_room();
+		}
 		if (*str == '\n') {
-			uart_putc('\r');
+			mmio_write(UART_DR, '\r');
+			if (--room == 0) {
+				room = uart_tx_room();
+			}
 		}
-		uart_putc(*str++);   /* Fixed: dereference before post-increment */
-		delay(100);          /* Small per-char delay for reliable flushing in flood/debug mode */
+		mmio_write(UART_DR, (unsigned char)*str++);
+		room--;
 	}
-}
\ No newline at end of file
+	spin_unlock_irqrestore(&uart_lock, flags);
+}
+
+void uart_putu(uint64_t val) {
+	char buf[21];
+	int i = sizeof(buf) - 1;
+
+	buf[i] = '\0';
+	do {
+		buf[--i] = '0' + val % 10;
+		val /= 10;
+	} while (val);
+	uart_puts(&buf[i]);
+}
+
+void uart_puthex(uint64_t val) {
+	char buf[17];
+	int i = sizeof(buf) - 1;
+
+	buf[i] = '\0';
+	do {
+		buf[--i] = "0123456789abcdef"[val & 0xF];
+		val >>= 4;
+	} while (val);
+	uart_puts(&buf[i]);
+}
+
+/* Wait until everything written so far has left the shift register */
+void uart_flush(void) {
+	while ((mmio_read(UART_FR) & (UART_FR_TXFE | UART_FR_BUSY)) != UART_FR_TXFE) {}
+}
@@ -1,9 +1,31 @@
 #ifndef UART_H
 #define UART_H
 
+#include "types.h"
+
+/*
+ * PL011 reference clock and console baud rate, both can be overridden from
+ * the makefile. The Pi 4 firmware runs the UART clock at 48 MHz, which
+ * allows up to 3 Mbaud.
+ */
+#ifndef UART_CLOCK
+#define UART_CLOCK 48000000
+#endif
+
+#ifndef UART_BAUD
+#define UART_BAUD 921600
+#endif
+
+#define UART_FIFO_DEPTH 16
+
 void uart_init(void);
+int uart_set_baud(uint32_t clock, uint32_t baud);
 void uart_putc(unsigned char c);
 unsigned char uart_getc(void);
 void uart_puts(const char *str);
+void uart_write(const char *buf, uint32_t len);
+void uart_putu(uint64_t val);
+void uart_puthex(uint64_t val);
+void uart_flush(void);
 
-#endif /* UART_H */
\ No newline at end of file
+#endif /* UART_H */